@@ -0,0 +1,1450 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// In-tree AES-256-CBC and AES-128-GCM. Add this file to DRIVERS next
+// to mbedtls.c or openssl.c, which will then only provide HMAC and
+// HKDF.
+//
+// There are three implementations, the best one is selected at runtime
+// using the features from cpu.c:
+// - AES-NI + PCLMULQDQ on x86-64
+// - ARMv8 Crypto Extensions (AES + PMULL) on AArch64
+// - Portable constant-time fallback, the AES part is the 32-bit
+//   bitsliced implementation from BearSSL (aes_ct, MIT licensed,
+//   Thomas Pornin) and GHASH is done bit by bit with masks.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "omemo.h"
+#include "driver.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define AES_X86 1
+#include <immintrin.h>
+#define TARGET_X86 __attribute__((target("aes,pclmul,ssse3")))
+#endif
+
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define AES_ARM 1
+#include <arm_neon.h>
+#ifdef __clang__
+#define TARGET_ARM __attribute__((target("crypto")))
+#else
+#define TARGET_ARM __attribute__((target("+crypto")))
+#endif
+#endif
+
+struct AesKey {
+  int rounds;
+  // Standard round keys for the hardware implementations, bitsliced
+  // round keys for the constant-time implementation.
+  union {
+    uint8_t rk[15][16];
+    uint32_t q[120];
+  };
+};
+
+// What GcmBlocks does with the blocks.
+enum {
+  GCM_HASHIN = 1,  // GHASH over s
+  GCM_CTR = 2,     // CTR from s to d
+  GCM_HASHOUT = 4, // GHASH over d
+};
+
+struct AesImpl {
+  const char *name;
+  uint32_t (*subword)(uint32_t w);
+  void (*setkey)(struct AesKey *key, const uint32_t *w, bool dec);
+  void (*cbcenc)(const struct AesKey *key, size_t nblocks,
+                 uint8_t iv[static 16], const uint8_t *s, uint8_t *d);
+  void (*cbcdec)(const struct AesKey *key, size_t nblocks,
+                 uint8_t iv[static 16], const uint8_t *s, uint8_t *d);
+  // GCM counter mode, increments the last 32 bits of ctr big endian.
+  void (*ctr)(const struct AesKey *key, size_t nblocks,
+              uint8_t ctr[static 16], const uint8_t *s, uint8_t *d);
+  void (*ghash)(uint8_t y[static 16], const uint8_t h[static 16],
+                const uint8_t *p, size_t nblocks);
+  // Optional, the ops of GcmBlocks in one pass with the powers of H
+  // that gcminit wrote to htab.
+  void (*gcminit)(uint8_t htab[8][16], const uint8_t h[static 16]);
+  void (*gcm)(const struct AesKey *key, const uint8_t htab[8][16],
+              uint8_t ctr[static 16], uint8_t y[static 16],
+              const uint8_t *s, uint8_t *d, size_t nblocks, int ops);
+};
+
+static inline uint32_t Load32Le(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static inline void Store32Le(uint8_t *p, uint32_t v) {
+  p[0] = v, p[1] = v >> 8, p[2] = v >> 16, p[3] = v >> 24;
+}
+
+static inline uint32_t Load32Be(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+         (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline void Store32Be(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+
+static inline uint64_t Load64Be(const uint8_t *p) {
+  return (uint64_t)Load32Be(p) << 32 | Load32Be(p + 4);
+}
+
+static inline void Store64Be(uint8_t *p, uint64_t v) {
+  Store32Be(p, v >> 32);
+  Store32Be(p + 4, v);
+}
+
+static inline void Inc32(uint8_t ctr[static 16]) {
+  Store32Be(ctr + 12, Load32Be(ctr + 12) + 1);
+}
+
+static inline void Xor16(uint8_t *d, const uint8_t *a, const uint8_t *b) {
+  for (int i = 0; i < 16; i++)
+    d[i] = a[i] ^ b[i];
+}
+
+/**
+ * Standard AES key expansion into little endian words, the S-box is
+ * provided by the implementation so that it is never a table lookup.
+ */
+static int ExpandKey(uint32_t w[60], const uint8_t *k, int nk,
+                     uint32_t (*subword)(uint32_t)) {
+  static const uint8_t rcon[] = {0x01, 0x02, 0x04, 0x08, 0x10,
+                                 0x20, 0x40, 0x80, 0x1b, 0x36};
+  int rounds = nk + 6;
+  for (int i = 0; i < nk; i++)
+    w[i] = Load32Le(k + 4 * i);
+  for (int i = nk; i < 4 * (rounds + 1); i++) {
+    uint32_t t = w[i - 1];
+    if (i % nk == 0)
+      t = subword((t >> 8) | (t << 24)) ^ rcon[i / nk - 1];
+    else if (nk > 6 && i % nk == 4)
+      t = subword(t);
+    w[i] = w[i - nk] ^ t;
+  }
+  return rounds;
+}
+
+/*************************** CONSTANT-TIME ***************************/
+
+static void BitsliceSbox(uint32_t *q) {
+  uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+  uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+  uint32_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+  uint32_t y20, y21;
+  uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+  uint32_t z10, z11, z12, z13, z14, z15, z16, z17;
+  uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+  uint32_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+  uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+  uint32_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+  uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+  uint32_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+  uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+  uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+  x0 = q[7];
+  x1 = q[6];
+  x2 = q[5];
+  x3 = q[4];
+  x4 = q[3];
+  x5 = q[2];
+  x6 = q[1];
+  x7 = q[0];
+
+  // Top linear transformation.
+  y14 = x3 ^ x5;
+  y13 = x0 ^ x6;
+  y9 = x0 ^ x3;
+  y8 = x0 ^ x5;
+  t0 = x1 ^ x2;
+  y1 = t0 ^ x7;
+  y4 = y1 ^ x3;
+  y12 = y13 ^ y14;
+  y2 = y1 ^ x0;
+  y5 = y1 ^ x6;
+  y3 = y5 ^ y8;
+  t1 = x4 ^ y12;
+  y15 = t1 ^ x5;
+  y20 = t1 ^ x1;
+  y6 = y15 ^ x7;
+  y10 = y15 ^ t0;
+  y11 = y20 ^ y9;
+  y7 = x7 ^ y11;
+  y17 = y10 ^ y11;
+  y19 = y10 ^ y8;
+  y16 = t0 ^ y11;
+  y21 = y13 ^ y16;
+  y18 = x0 ^ y16;
+
+  // Non-linear section.
+  t2 = y12 & y15;
+  t3 = y3 & y6;
+  t4 = t3 ^ t2;
+  t5 = y4 & x7;
+  t6 = t5 ^ t2;
+  t7 = y13 & y16;
+  t8 = y5 & y1;
+  t9 = t8 ^ t7;
+  t10 = y2 & y7;
+  t11 = t10 ^ t7;
+  t12 = y9 & y11;
+  t13 = y14 & y17;
+  t14 = t13 ^ t12;
+  t15 = y8 & y10;
+  t16 = t15 ^ t12;
+  t17 = t4 ^ t14;
+  t18 = t6 ^ t16;
+  t19 = t9 ^ t14;
+  t20 = t11 ^ t16;
+  t21 = t17 ^ y20;
+  t22 = t18 ^ y19;
+  t23 = t19 ^ y21;
+  t24 = t20 ^ y18;
+
+  t25 = t21 ^ t22;
+  t26 = t21 & t23;
+  t27 = t24 ^ t26;
+  t28 = t25 & t27;
+  t29 = t28 ^ t22;
+  t30 = t23 ^ t24;
+  t31 = t22 ^ t26;
+  t32 = t31 & t30;
+  t33 = t32 ^ t24;
+  t34 = t23 ^ t33;
+  t35 = t27 ^ t33;
+  t36 = t24 & t35;
+  t37 = t36 ^ t34;
+  t38 = t27 ^ t36;
+  t39 = t29 & t38;
+  t40 = t25 ^ t39;
+
+  t41 = t40 ^ t37;
+  t42 = t29 ^ t33;
+  t43 = t29 ^ t40;
+  t44 = t33 ^ t37;
+  t45 = t42 ^ t41;
+  z0 = t44 & y15;
+  z1 = t37 & y6;
+  z2 = t33 & x7;
+  z3 = t43 & y16;
+  z4 = t40 & y1;
+  z5 = t29 & y7;
+  z6 = t42 & y11;
+  z7 = t45 & y17;
+  z8 = t41 & y10;
+  z9 = t44 & y12;
+  z10 = t37 & y3;
+  z11 = t33 & y4;
+  z12 = t43 & y13;
+  z13 = t40 & y5;
+  z14 = t29 & y2;
+  z15 = t42 & y9;
+  z16 = t45 & y14;
+  z17 = t41 & y8;
+
+  // Bottom linear transformation.
+  t46 = z15 ^ z16;
+  t47 = z10 ^ z11;
+  t48 = z5 ^ z13;
+  t49 = z9 ^ z10;
+  t50 = z2 ^ z12;
+  t51 = z2 ^ z5;
+  t52 = z7 ^ z8;
+  t53 = z0 ^ z3;
+  t54 = z6 ^ z7;
+  t55 = z16 ^ z17;
+  t56 = z12 ^ t48;
+  t57 = t50 ^ t53;
+  t58 = z4 ^ t46;
+  t59 = z3 ^ t54;
+  t60 = t46 ^ t57;
+  t61 = z14 ^ t57;
+  t62 = t52 ^ t58;
+  t63 = t49 ^ t58;
+  t64 = z4 ^ t59;
+  t65 = t61 ^ t62;
+  t66 = z1 ^ t63;
+  s0 = t59 ^ t63;
+  s6 = t56 ^ ~t62;
+  s7 = t48 ^ ~t60;
+  t67 = t64 ^ t65;
+  s3 = t53 ^ t66;
+  s4 = t51 ^ t66;
+  s5 = t47 ^ t65;
+  s1 = t64 ^ ~s3;
+  s2 = t55 ^ ~t67;
+
+  q[7] = s0;
+  q[6] = s1;
+  q[5] = s2;
+  q[4] = s3;
+  q[3] = s4;
+  q[2] = s5;
+  q[1] = s6;
+  q[0] = s7;
+}
+
+// B(x) from iS(x) = B(S(B(x ^ 0x63)) ^ 0x63), where B is the inverse of
+// the affine transform in the S-box.
+static void BitsliceInvAffine(uint32_t *q) {
+  uint32_t q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3], q4 = q[4],
+           q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+  q[7] = q1 ^ q4 ^ q6;
+  q[6] = q0 ^ q3 ^ q5;
+  q[5] = q7 ^ q2 ^ q4;
+  q[4] = q6 ^ q1 ^ q3;
+  q[3] = q5 ^ q0 ^ q2;
+  q[2] = q4 ^ q7 ^ q1;
+  q[1] = q3 ^ q6 ^ q0;
+  q[0] = q2 ^ q5 ^ q7;
+}
+
+static void BitsliceInvSbox(uint32_t *q) {
+  BitsliceInvAffine(q);
+  BitsliceSbox(q);
+  BitsliceInvAffine(q);
+}
+
+#define SWAPN(cl, ch, s, x, y)                                         \
+  do {                                                                 \
+    uint32_t a_ = (x), b_ = (y);                                       \
+    (x) = (a_ & (uint32_t)(cl)) | ((b_ & (uint32_t)(cl)) << (s));      \
+    (y) = ((a_ & (uint32_t)(ch)) >> (s)) | (b_ & (uint32_t)(ch));      \
+  } while (0)
+
+#define SWAP2(x, y) SWAPN(0x55555555, 0xaaaaaaaa, 1, x, y)
+#define SWAP4(x, y) SWAPN(0x33333333, 0xcccccccc, 2, x, y)
+#define SWAP8(x, y) SWAPN(0x0f0f0f0f, 0xf0f0f0f0, 4, x, y)
+
+static void Ortho(uint32_t *q) {
+  SWAP2(q[0], q[1]);
+  SWAP2(q[2], q[3]);
+  SWAP2(q[4], q[5]);
+  SWAP2(q[6], q[7]);
+
+  SWAP4(q[0], q[2]);
+  SWAP4(q[1], q[3]);
+  SWAP4(q[4], q[6]);
+  SWAP4(q[5], q[7]);
+
+  SWAP8(q[0], q[4]);
+  SWAP8(q[1], q[5]);
+  SWAP8(q[2], q[6]);
+  SWAP8(q[3], q[7]);
+}
+
+static inline void AddRoundKey(uint32_t *q, const uint32_t *sk) {
+  for (int i = 0; i < 8; i++)
+    q[i] ^= sk[i];
+}
+
+static inline void ShiftRows(uint32_t *q) {
+  for (int i = 0; i < 8; i++) {
+    uint32_t x = q[i];
+    q[i] = (x & 0x000000ff) | ((x & 0x0000fc00) >> 2) |
+           ((x & 0x00000300) << 6) | ((x & 0x00f00000) >> 4) |
+           ((x & 0x000f0000) << 4) | ((x & 0xc0000000) >> 6) |
+           ((x & 0x3f000000) << 2);
+  }
+}
+
+static inline void InvShiftRows(uint32_t *q) {
+  for (int i = 0; i < 8; i++) {
+    uint32_t x = q[i];
+    q[i] = (x & 0x000000ff) | ((x & 0x00003f00) << 2) |
+           ((x & 0x0000c000) >> 6) | ((x & 0x000f0000) << 4) |
+           ((x & 0x00f00000) >> 4) | ((x & 0x03000000) << 6) |
+           ((x & 0xfc000000) >> 2);
+  }
+}
+
+static inline uint32_t Rotr16(uint32_t x) { return (x << 16) | (x >> 16); }
+
+static inline void MixColumns(uint32_t *q) {
+  uint32_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3], q4 = q[4],
+           q5 = q[5], q6 = q[6], q7 = q[7];
+  uint32_t r0 = (q0 >> 8) | (q0 << 24), r1 = (q1 >> 8) | (q1 << 24),
+           r2 = (q2 >> 8) | (q2 << 24), r3 = (q3 >> 8) | (q3 << 24),
+           r4 = (q4 >> 8) | (q4 << 24), r5 = (q5 >> 8) | (q5 << 24),
+           r6 = (q6 >> 8) | (q6 << 24), r7 = (q7 >> 8) | (q7 << 24);
+  q[0] = q7 ^ r7 ^ r0 ^ Rotr16(q0 ^ r0);
+  q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ Rotr16(q1 ^ r1);
+  q[2] = q1 ^ r1 ^ r2 ^ Rotr16(q2 ^ r2);
+  q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ Rotr16(q3 ^ r3);
+  q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ Rotr16(q4 ^ r4);
+  q[5] = q4 ^ r4 ^ r5 ^ Rotr16(q5 ^ r5);
+  q[6] = q5 ^ r5 ^ r6 ^ Rotr16(q6 ^ r6);
+  q[7] = q6 ^ r6 ^ r7 ^ Rotr16(q7 ^ r7);
+}
+
+static inline void InvMixColumns(uint32_t *q) {
+  uint32_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3], q4 = q[4],
+           q5 = q[5], q6 = q[6], q7 = q[7];
+  uint32_t r0 = (q0 >> 8) | (q0 << 24), r1 = (q1 >> 8) | (q1 << 24),
+           r2 = (q2 >> 8) | (q2 << 24), r3 = (q3 >> 8) | (q3 << 24),
+           r4 = (q4 >> 8) | (q4 << 24), r5 = (q5 >> 8) | (q5 << 24),
+           r6 = (q6 >> 8) | (q6 << 24), r7 = (q7 >> 8) | (q7 << 24);
+  q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^ Rotr16(q0 ^ q5 ^ q6 ^ r0 ^ r5);
+  q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7 ^
+         Rotr16(q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+  q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7 ^
+         Rotr16(q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+  q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5 ^
+         Rotr16(q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+  q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7 ^
+         Rotr16(q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+  q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7 ^
+         Rotr16(q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+  q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7 ^
+         Rotr16(q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+  q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7 ^ Rotr16(q4 ^ q5 ^ q7 ^ r4 ^ r7);
+}
+
+static void BitsliceEncrypt(const struct AesKey *key, uint32_t *q) {
+  AddRoundKey(q, key->q);
+  for (int u = 1; u < key->rounds; u++) {
+    BitsliceSbox(q);
+    ShiftRows(q);
+    MixColumns(q);
+    AddRoundKey(q, key->q + (u << 3));
+  }
+  BitsliceSbox(q);
+  ShiftRows(q);
+  AddRoundKey(q, key->q + (key->rounds << 3));
+}
+
+static void BitsliceDecrypt(const struct AesKey *key, uint32_t *q) {
+  AddRoundKey(q, key->q + (key->rounds << 3));
+  for (int u = key->rounds - 1; u > 0; u--) {
+    InvShiftRows(q);
+    BitsliceInvSbox(q);
+    AddRoundKey(q, key->q + (u << 3));
+    InvMixColumns(q);
+  }
+  InvShiftRows(q);
+  BitsliceInvSbox(q);
+  AddRoundKey(q, key->q);
+}
+
+static uint32_t CtSubWord(uint32_t x) {
+  uint32_t q[8];
+  for (int i = 0; i < 8; i++)
+    q[i] = x;
+  Ortho(q);
+  BitsliceSbox(q);
+  Ortho(q);
+  return q[0];
+}
+
+static void CtSetKey(struct AesKey *key, const uint32_t *w, bool dec) {
+  (void)dec;
+  for (int i = 0; i < 4 * (key->rounds + 1); i += 4) {
+    uint32_t *q = key->q + (i << 1);
+    for (int j = 0; j < 4; j++)
+      q[2 * j] = q[2 * j + 1] = w[i + j];
+    Ortho(q);
+  }
+}
+
+// Up to two blocks are processed at once, a in the even words and b in
+// the odd words.
+static void CtLoad(uint32_t q[8], const uint8_t *a, const uint8_t *b) {
+  for (int i = 0; i < 4; i++) {
+    q[2 * i] = Load32Le(a + 4 * i);
+    q[2 * i + 1] = b ? Load32Le(b + 4 * i) : 0;
+  }
+  Ortho(q);
+}
+
+static void CtStore(uint32_t q[8], uint8_t *a, uint8_t *b) {
+  Ortho(q);
+  for (int i = 0; i < 4; i++) {
+    Store32Le(a + 4 * i, q[2 * i]);
+    if (b)
+      Store32Le(b + 4 * i, q[2 * i + 1]);
+  }
+}
+
+static void CtCbcEnc(const struct AesKey *key, size_t nblocks,
+                     uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  uint32_t q[8];
+  uint8_t buf[16];
+  for (size_t i = 0; i < nblocks; i++, s += 16, d += 16) {
+    Xor16(buf, iv, s);
+    CtLoad(q, buf, NULL);
+    BitsliceEncrypt(key, q);
+    CtStore(q, iv, NULL);
+    memcpy(d, iv, 16);
+  }
+}
+
+static void CtCbcDec(const struct AesKey *key, size_t nblocks,
+                     uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  uint32_t q[8];
+  uint8_t c[32], p[32];
+  while (nblocks) {
+    size_t n = nblocks >= 2 ? 2 : 1;
+    memcpy(c, s, 16 * n);
+    CtLoad(q, c, n == 2 ? c + 16 : NULL);
+    BitsliceDecrypt(key, q);
+    CtStore(q, p, n == 2 ? p + 16 : NULL);
+    Xor16(d, p, iv);
+    if (n == 2)
+      Xor16(d + 16, p + 16, c);
+    memcpy(iv, c + 16 * (n - 1), 16);
+    s += 16 * n, d += 16 * n, nblocks -= n;
+  }
+}
+
+static void CtCtr(const struct AesKey *key, size_t nblocks,
+                  uint8_t ctr[static 16], const uint8_t *s, uint8_t *d) {
+  uint32_t q[8];
+  uint8_t ks[32];
+  while (nblocks) {
+    size_t n = nblocks >= 2 ? 2 : 1;
+    memcpy(ks, ctr, 16);
+    Inc32(ctr);
+    memcpy(ks + 16, ctr, 16);
+    if (n == 2)
+      Inc32(ctr);
+    CtLoad(q, ks, ks + 16);
+    BitsliceEncrypt(key, q);
+    CtStore(q, ks, ks + 16);
+    for (size_t i = 0; i < 16 * n; i++)
+      d[i] = s[i] ^ ks[i];
+    s += 16 * n, d += 16 * n, nblocks -= n;
+  }
+}
+
+// Multiplication in GF(2^128) as in NIST SP 800-38D, the bits of x are
+// processed one by one but only masks depend on them.
+static void GfMul(uint64_t x[2], const uint64_t h[2]) {
+  uint64_t z0 = 0, z1 = 0, v0 = h[0], v1 = h[1];
+  for (int i = 0; i < 128; i++) {
+    uint64_t m = -((x[i >> 6] >> (63 - (i & 63))) & 1);
+    z0 ^= v0 & m;
+    z1 ^= v1 & m;
+    m = -(v1 & 1);
+    v1 = (v1 >> 1) | (v0 << 63);
+    v0 = (v0 >> 1) ^ (0xe100000000000000ull & m);
+  }
+  x[0] = z0, x[1] = z1;
+}
+
+static void CtGhash(uint8_t y[static 16], const uint8_t h[static 16],
+                    const uint8_t *p, size_t nblocks) {
+  uint64_t hh[2] = {Load64Be(h), Load64Be(h + 8)};
+  uint64_t x[2] = {Load64Be(y), Load64Be(y + 8)};
+  for (size_t i = 0; i < nblocks; i++, p += 16) {
+    x[0] ^= Load64Be(p);
+    x[1] ^= Load64Be(p + 8);
+    GfMul(x, hh);
+  }
+  Store64Be(y, x[0]);
+  Store64Be(y + 8, x[1]);
+}
+
+static const struct AesImpl ctimpl = {
+    "ct", CtSubWord, CtSetKey, CtCbcEnc, CtCbcDec, CtCtr, CtGhash,
+    NULL, NULL,
+};
+
+/****************************** AES-NI *******************************/
+
+#ifdef AES_X86
+
+TARGET_X86 static uint32_t NiSubWord(uint32_t w) {
+  __m128i x = _mm_set1_epi32((int)w);
+  return (uint32_t)_mm_cvtsi128_si32(_mm_aeskeygenassist_si128(x, 0));
+}
+
+TARGET_X86 static void NiSetKey(struct AesKey *key, const uint32_t *w,
+                                bool dec) {
+  for (int i = 0; i < 4 * (key->rounds + 1); i++)
+    Store32Le(key->rk[i / 4] + 4 * (i % 4), w[i]);
+  if (!dec)
+    return;
+  // Equivalent inverse cipher, round keys in reverse order.
+  uint8_t rk[15][16];
+  memcpy(rk, key->rk, sizeof(rk));
+  memcpy(key->rk[0], rk[key->rounds], 16);
+  for (int i = 1; i < key->rounds; i++)
+    _mm_storeu_si128((__m128i *)key->rk[i],
+                     _mm_aesimc_si128(_mm_loadu_si128(
+                         (const __m128i *)rk[key->rounds - i])));
+  memcpy(key->rk[key->rounds], rk[0], 16);
+  memset(rk, 0, sizeof(rk));
+}
+
+#define NiLoadKeys(rk, key)                                            \
+  for (int i_ = 0; i_ <= (key)->rounds; i_++)                          \
+    rk[i_] = _mm_loadu_si128((const __m128i *)(key)->rk[i_])
+
+TARGET_X86 static inline __m128i NiEnc(const __m128i *rk, int rounds,
+                                       __m128i b) {
+  b = _mm_xor_si128(b, rk[0]);
+  for (int i = 1; i < rounds; i++)
+    b = _mm_aesenc_si128(b, rk[i]);
+  return _mm_aesenclast_si128(b, rk[rounds]);
+}
+
+TARGET_X86 static void NiCbcEnc(const struct AesKey *key, size_t nblocks,
+                                uint8_t iv[static 16], const uint8_t *s,
+                                uint8_t *d) {
+  __m128i rk[15];
+  NiLoadKeys(rk, key);
+  __m128i b = _mm_loadu_si128((const __m128i *)iv);
+  for (size_t i = 0; i < nblocks; i++, s += 16, d += 16) {
+    b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)s));
+    b = NiEnc(rk, key->rounds, b);
+    _mm_storeu_si128((__m128i *)d, b);
+  }
+  _mm_storeu_si128((__m128i *)iv, b);
+}
+
+// The blocks of the modes that can run several at a time are kept in
+// registers, which needs the loops over them unrolled.
+#ifdef __clang__
+#define UNROLL8 _Pragma("unroll 8")
+#else
+#define UNROLL8 _Pragma("GCC unroll 8")
+#endif
+
+// Unlike encryption the blocks are independent, the eight in flight
+// cover the latency of AESDEC.
+TARGET_X86 static inline __attribute__((always_inline)) void
+NiCbcDecBlocks(const __m128i *rk, int r, __m128i *prev, const uint8_t *s,
+               uint8_t *d, int n) {
+  __m128i c[8], b[8] = {0};
+  UNROLL8
+  for (int j = 0; j < n; j++) {
+    c[j] = _mm_loadu_si128((const __m128i *)(s + 16 * j));
+    b[j] = _mm_xor_si128(c[j], rk[0]);
+  }
+  for (int i = 1; i < r; i++) {
+    UNROLL8
+    for (int j = 0; j < n; j++)
+      b[j] = _mm_aesdec_si128(b[j], rk[i]);
+  }
+  UNROLL8
+  for (int j = 0; j < n; j++) {
+    b[j] = _mm_xor_si128(_mm_aesdeclast_si128(b[j], rk[r]), *prev);
+    *prev = c[j];
+    _mm_storeu_si128((__m128i *)(d + 16 * j), b[j]);
+  }
+}
+
+TARGET_X86 static void NiCbcDec(const struct AesKey *key, size_t nblocks,
+                                uint8_t iv[static 16], const uint8_t *s,
+                                uint8_t *d) {
+  __m128i rk[15];
+  NiLoadKeys(rk, key);
+  __m128i prev = _mm_loadu_si128((const __m128i *)iv);
+  for (; nblocks >= 8; s += 128, d += 128, nblocks -= 8)
+    NiCbcDecBlocks(rk, key->rounds, &prev, s, d, 8);
+  if (nblocks)
+    NiCbcDecBlocks(rk, key->rounds, &prev, s, d, nblocks);
+  _mm_storeu_si128((__m128i *)iv, prev);
+}
+
+// ctr is byte reversed, so inc32 is an addition to its first word.
+TARGET_X86 static inline __attribute__((always_inline)) void
+NiCtrStart(__m128i b[8], const __m128i *rk, __m128i *ctr, int n) {
+  const __m128i bswap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  UNROLL8
+  for (int j = 0; j < n; j++) {
+    b[j] = _mm_xor_si128(_mm_shuffle_epi8(*ctr, bswap), rk[0]);
+    *ctr = _mm_add_epi32(*ctr, _mm_set_epi32(0, 0, 0, 1));
+  }
+}
+
+// The rounds from i of n blocks and the XOR with s into d.
+TARGET_X86 static inline __attribute__((always_inline)) void
+NiCtrFinish(__m128i b[8], const __m128i *rk, int i, int r,
+            const uint8_t *s, uint8_t *d, int n) {
+  for (; i < r; i++) {
+    UNROLL8
+    for (int j = 0; j < n; j++)
+      b[j] = _mm_aesenc_si128(b[j], rk[i]);
+  }
+  UNROLL8
+  for (int j = 0; j < n; j++) {
+    b[j] = _mm_aesenclast_si128(b[j], rk[r]);
+    b[j] = _mm_xor_si128(b[j],
+                         _mm_loadu_si128((const __m128i *)(s + 16 * j)));
+    _mm_storeu_si128((__m128i *)(d + 16 * j), b[j]);
+  }
+}
+
+TARGET_X86 static void NiCtr(const struct AesKey *key, size_t nblocks,
+                             uint8_t ctr[static 16], const uint8_t *s,
+                             uint8_t *d) {
+  const __m128i bswap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i rk[15], b[8] = {0};
+  NiLoadKeys(rk, key);
+  int r = key->rounds;
+  __m128i cr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)ctr), bswap);
+  for (; nblocks >= 8; s += 128, d += 128, nblocks -= 8) {
+    NiCtrStart(b, rk, &cr, 8);
+    NiCtrFinish(b, rk, 1, r, s, d, 8);
+  }
+  if (nblocks) {
+    NiCtrStart(b, rk, &cr, nblocks);
+    NiCtrFinish(b, rk, 1, r, s, d, nblocks);
+  }
+  _mm_storeu_si128((__m128i *)ctr, _mm_shuffle_epi8(cr, bswap));
+}
+
+// Carry-less multiplication of bit-reflected operands followed by the
+// reduction, as in Intel's "Carry-Less Multiplication Instruction and
+// its Usage for Computing the GCM Mode" white paper. The reduction is
+// linear, so the products of several blocks can be summed in p and
+// reduced once.
+TARGET_X86 static inline void NiClmul(__m128i p[3], __m128i a, __m128i b) {
+  p[0] = _mm_xor_si128(p[0], _mm_clmulepi64_si128(a, b, 0x00));
+  p[1] = _mm_xor_si128(p[1], _mm_clmulepi64_si128(a, b, 0x10));
+  p[1] = _mm_xor_si128(p[1], _mm_clmulepi64_si128(a, b, 0x01));
+  p[2] = _mm_xor_si128(p[2], _mm_clmulepi64_si128(a, b, 0x11));
+}
+
+TARGET_X86 static __m128i NiReduce(const __m128i p[3]) {
+  __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+  t5 = _mm_slli_si128(p[1], 8);
+  t4 = _mm_srli_si128(p[1], 8);
+  t3 = _mm_xor_si128(p[0], t5);
+  t6 = _mm_xor_si128(p[2], t4);
+  // Shift the 256-bit product left by one.
+  t7 = _mm_srli_epi32(t3, 31);
+  t8 = _mm_srli_epi32(t6, 31);
+  t3 = _mm_slli_epi32(t3, 1);
+  t6 = _mm_slli_epi32(t6, 1);
+  t9 = _mm_srli_si128(t7, 12);
+  t8 = _mm_slli_si128(t8, 4);
+  t7 = _mm_slli_si128(t7, 4);
+  t3 = _mm_or_si128(t3, t7);
+  t6 = _mm_or_si128(t6, t8);
+  t6 = _mm_or_si128(t6, t9);
+  // Reduce modulo x^128 + x^7 + x^2 + x + 1.
+  t7 = _mm_slli_epi32(t3, 31);
+  t8 = _mm_slli_epi32(t3, 30);
+  t9 = _mm_slli_epi32(t3, 25);
+  t7 = _mm_xor_si128(t7, t8);
+  t7 = _mm_xor_si128(t7, t9);
+  t8 = _mm_srli_si128(t7, 4);
+  t7 = _mm_slli_si128(t7, 12);
+  t3 = _mm_xor_si128(t3, t7);
+  t2 = _mm_srli_epi32(t3, 1);
+  t4 = _mm_srli_epi32(t3, 2);
+  t5 = _mm_srli_epi32(t3, 7);
+  t2 = _mm_xor_si128(t2, t4);
+  t2 = _mm_xor_si128(t2, t5);
+  t2 = _mm_xor_si128(t2, t8);
+  t3 = _mm_xor_si128(t3, t2);
+  return _mm_xor_si128(t6, t3);
+}
+
+TARGET_X86 static __m128i NiGfMul(__m128i a, __m128i b) {
+  __m128i p[3] = {_mm_setzero_si128(), _mm_setzero_si128(),
+                  _mm_setzero_si128()};
+  NiClmul(p, a, b);
+  return NiReduce(p);
+}
+
+TARGET_X86 static void NiGhash(uint8_t y[static 16],
+                               const uint8_t h[static 16],
+                               const uint8_t *p, size_t nblocks) {
+  const __m128i bswap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i hh = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)h), bswap);
+  __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)y), bswap);
+  for (size_t i = 0; i < nblocks; i++, p += 16) {
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+    x = NiGfMul(_mm_xor_si128(x, b), hh);
+  }
+  _mm_storeu_si128((__m128i *)y, _mm_shuffle_epi8(x, bswap));
+}
+
+// htab[i] is H^(i+1) in the byte order of NiGfMul.
+TARGET_X86 static void NiGcmInit(uint8_t htab[8][16],
+                                 const uint8_t h[static 16]) {
+  const __m128i bswap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i hh = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)h), bswap);
+  __m128i x = hh;
+  for (int i = 0; i < 8; i++) {
+    _mm_storeu_si128((__m128i *)htab[i], x);
+    x = NiGfMul(x, hh);
+  }
+}
+
+// Hashes the m blocks of c, with y in x, while the AES rounds of n
+// counters run, then leaves the ciphertext of the counters in c when
+// hashing it. The GHASH of m blocks is
+//  (Y + C_0) * H^m + C_1 * H^(m-1) + ... + C_(m-1) * H
+// with a single reduction, its multiplications don't depend on the
+// rounds so they are issued in between.
+TARGET_X86 static inline __attribute__((always_inline)) __m128i
+NiGcmStep(const __m128i *rk, int r, const uint8_t htab[8][16], __m128i x,
+          __m128i c[8], int m, __m128i *ctr, const uint8_t *s,
+          uint8_t *d, int n, bool hashout) {
+  const __m128i bswap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i b[8] = {0}, p[3] = {_mm_setzero_si128(), _mm_setzero_si128(),
+                        _mm_setzero_si128()};
+  if (m)
+    c[0] = _mm_xor_si128(c[0], x);
+  NiCtrStart(b, rk, ctr, n);
+  UNROLL8
+  for (int i = 1; i <= 8; i++) {
+    UNROLL8
+    for (int j = 0; j < n; j++)
+      b[j] = _mm_aesenc_si128(b[j], rk[i]);
+    if (i <= m)
+      NiClmul(p, c[i - 1],
+              _mm_loadu_si128((const __m128i *)htab[m - i]));
+  }
+  NiCtrFinish(b, rk, 9, r, s, d, n);
+  if (hashout) {
+    UNROLL8
+    for (int j = 0; j < n; j++)
+      c[j] = _mm_shuffle_epi8(b[j], bswap);
+  }
+  return m ? NiReduce(p) : x;
+}
+
+// Eight blocks at a time. With GCM_HASHOUT the blocks hashed in a step
+// are the ciphertext of the previous one.
+TARGET_X86 static void NiGcm(const struct AesKey *key,
+                             const uint8_t htab[8][16],
+                             uint8_t ctr[static 16], uint8_t y[static 16],
+                             const uint8_t *s, uint8_t *d, size_t nblocks,
+                             int ops) {
+  const __m128i bswap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i rk[15], c[8], cr, x;
+  bool hashout = ops & GCM_HASHOUT;
+  int r = key->rounds, m = 0;
+  NiLoadKeys(rk, key);
+  cr = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)ctr), bswap);
+  x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)y), bswap);
+  while (nblocks) {
+    int n = nblocks >= 8 ? 8 : nblocks;
+    if (ops & GCM_HASHIN) {
+      m = n;
+      for (int j = 0; j < n; j++)
+        c[j] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)(s + 16 * j)), bswap);
+    }
+    int k = ops & GCM_CTR ? n : 0;
+    // The full steps with constant sizes keep c and b in registers.
+    if (m == 8 && k == 8)
+      x = NiGcmStep(rk, r, htab, x, c, 8, &cr, s, d, 8, hashout);
+    else if (m == 8 && !k)
+      x = NiGcmStep(rk, r, htab, x, c, 8, &cr, s, d, 0, false);
+    else
+      x = NiGcmStep(rk, r, htab, x, c, m, &cr, s, d, k, hashout);
+    m = hashout ? n : 0;
+    s += 16 * n, d += 16 * n, nblocks -= n;
+  }
+  if (m)
+    x = NiGcmStep(rk, r, htab, x, c, m, &cr, s, d, 0, false);
+  _mm_storeu_si128((__m128i *)ctr, _mm_shuffle_epi8(cr, bswap));
+  _mm_storeu_si128((__m128i *)y, _mm_shuffle_epi8(x, bswap));
+}
+
+static const struct AesImpl niimpl = {
+    "aesni", NiSubWord, NiSetKey, NiCbcEnc, NiCbcDec, NiCtr, NiGhash,
+    NiGcmInit, NiGcm,
+};
+
+#endif
+
+/**************************** ARMv8 CRYPTO ****************************/
+
+#ifdef AES_ARM
+
+TARGET_ARM static uint32_t ArmSubWord(uint32_t w) {
+  // All columns are the same, so ShiftRows does nothing.
+  uint8x16_t x = vreinterpretq_u8_u32(vdupq_n_u32(w));
+  x = vaeseq_u8(x, vdupq_n_u8(0));
+  return vgetq_lane_u32(vreinterpretq_u32_u8(x), 0);
+}
+
+TARGET_ARM static void ArmSetKey(struct AesKey *key, const uint32_t *w,
+                                 bool dec) {
+  for (int i = 0; i < 4 * (key->rounds + 1); i++)
+    Store32Le(key->rk[i / 4] + 4 * (i % 4), w[i]);
+  if (!dec)
+    return;
+  uint8_t rk[15][16];
+  memcpy(rk, key->rk, sizeof(rk));
+  memcpy(key->rk[0], rk[key->rounds], 16);
+  for (int i = 1; i < key->rounds; i++)
+    vst1q_u8(key->rk[i], vaesimcq_u8(vld1q_u8(rk[key->rounds - i])));
+  memcpy(key->rk[key->rounds], rk[0], 16);
+  memset(rk, 0, sizeof(rk));
+}
+
+#define ArmLoadKeys(rk, key)                                           \
+  for (int i_ = 0; i_ <= (key)->rounds; i_++)                          \
+    rk[i_] = vld1q_u8((key)->rk[i_])
+
+TARGET_ARM static inline uint8x16_t ArmEnc(const uint8x16_t *rk,
+                                           int rounds, uint8x16_t b) {
+  for (int i = 0; i < rounds - 1; i++)
+    b = vaesmcq_u8(vaeseq_u8(b, rk[i]));
+  return veorq_u8(vaeseq_u8(b, rk[rounds - 1]), rk[rounds]);
+}
+
+TARGET_ARM static void ArmCbcEnc(const struct AesKey *key, size_t nblocks,
+                                 uint8_t iv[static 16], const uint8_t *s,
+                                 uint8_t *d) {
+  uint8x16_t rk[15];
+  ArmLoadKeys(rk, key);
+  uint8x16_t b = vld1q_u8(iv);
+  for (size_t i = 0; i < nblocks; i++, s += 16, d += 16) {
+    b = ArmEnc(rk, key->rounds, veorq_u8(b, vld1q_u8(s)));
+    vst1q_u8(d, b);
+  }
+  vst1q_u8(iv, b);
+}
+
+TARGET_ARM static void ArmCbcDec(const struct AesKey *key, size_t nblocks,
+                                 uint8_t iv[static 16], const uint8_t *s,
+                                 uint8_t *d) {
+  uint8x16_t rk[15], c[4], b[4];
+  ArmLoadKeys(rk, key);
+  int r = key->rounds;
+  uint8x16_t prev = vld1q_u8(iv);
+  while (nblocks) {
+    int n = nblocks >= 4 ? 4 : nblocks;
+    for (int j = 0; j < n; j++)
+      b[j] = c[j] = vld1q_u8(s + 16 * j);
+    for (int i = 0; i < r - 1; i++)
+      for (int j = 0; j < n; j++)
+        b[j] = vaesimcq_u8(vaesdq_u8(b[j], rk[i]));
+    for (int j = 0; j < n; j++) {
+      b[j] = veorq_u8(vaesdq_u8(b[j], rk[r - 1]), rk[r]);
+      vst1q_u8(d + 16 * j, veorq_u8(b[j], prev));
+      prev = c[j];
+    }
+    s += 16 * n, d += 16 * n, nblocks -= n;
+  }
+  vst1q_u8(iv, prev);
+}
+
+TARGET_ARM static void ArmCtr(const struct AesKey *key, size_t nblocks,
+                              uint8_t ctr[static 16], const uint8_t *s,
+                              uint8_t *d) {
+  uint8x16_t rk[15], b[4];
+  ArmLoadKeys(rk, key);
+  int r = key->rounds;
+  while (nblocks) {
+    int n = nblocks >= 4 ? 4 : nblocks;
+    for (int j = 0; j < n; j++) {
+      b[j] = vld1q_u8(ctr);
+      Inc32(ctr);
+    }
+    for (int i = 0; i < r - 1; i++)
+      for (int j = 0; j < n; j++)
+        b[j] = vaesmcq_u8(vaeseq_u8(b[j], rk[i]));
+    for (int j = 0; j < n; j++) {
+      b[j] = veorq_u8(vaeseq_u8(b[j], rk[r - 1]), rk[r]);
+      vst1q_u8(d + 16 * j, veorq_u8(b[j], vld1q_u8(s + 16 * j)));
+    }
+    s += 16 * n, d += 16 * n, nblocks -= n;
+  }
+}
+
+#define ArmClmul(a, ai, b, bi)                                         \
+  vreinterpretq_u8_p128(                                               \
+      vmull_p64(vgetq_lane_p64(vreinterpretq_p64_u8(a), ai),           \
+                vgetq_lane_p64(vreinterpretq_p64_u8(b), bi)))
+
+// Byte shifts of the whole register, like _mm_slli_si128/_mm_srli_si128
+#define ArmShl(x, n) vextq_u8(vdupq_n_u8(0), x, 16 - (n))
+#define ArmShr(x, n) vextq_u8(x, vdupq_n_u8(0), n)
+
+// Same algorithm as NiGfMul.
+TARGET_ARM static uint8x16_t ArmGfMul(uint8x16_t a, uint8x16_t b) {
+  uint32x4_t t2, t3, t4, t5, t6, t7, t8, t9;
+  uint8x16_t lo = ArmClmul(a, 0, b, 0);
+  uint8x16_t mid = veorq_u8(ArmClmul(a, 0, b, 1), ArmClmul(a, 1, b, 0));
+  uint8x16_t hi = ArmClmul(a, 1, b, 1);
+  t3 = vreinterpretq_u32_u8(veorq_u8(lo, ArmShl(mid, 8)));
+  t6 = vreinterpretq_u32_u8(veorq_u8(hi, ArmShr(mid, 8)));
+  t7 = vshrq_n_u32(t3, 31);
+  t8 = vshrq_n_u32(t6, 31);
+  t3 = vshlq_n_u32(t3, 1);
+  t6 = vshlq_n_u32(t6, 1);
+  t9 = vreinterpretq_u32_u8(ArmShr(vreinterpretq_u8_u32(t7), 12));
+  t8 = vreinterpretq_u32_u8(ArmShl(vreinterpretq_u8_u32(t8), 4));
+  t7 = vreinterpretq_u32_u8(ArmShl(vreinterpretq_u8_u32(t7), 4));
+  t3 = vorrq_u32(t3, t7);
+  t6 = vorrq_u32(vorrq_u32(t6, t8), t9);
+  t7 = veorq_u32(veorq_u32(vshlq_n_u32(t3, 31), vshlq_n_u32(t3, 30)),
+                 vshlq_n_u32(t3, 25));
+  t8 = vreinterpretq_u32_u8(ArmShr(vreinterpretq_u8_u32(t7), 4));
+  t7 = vreinterpretq_u32_u8(ArmShl(vreinterpretq_u8_u32(t7), 12));
+  t3 = veorq_u32(t3, t7);
+  t2 = veorq_u32(veorq_u32(vshrq_n_u32(t3, 1), vshrq_n_u32(t3, 2)),
+                 vshrq_n_u32(t3, 7));
+  t2 = veorq_u32(t2, t8);
+  t3 = veorq_u32(t3, t2);
+  return vreinterpretq_u8_u32(veorq_u32(t6, t3));
+}
+
+static inline uint8x16_t ArmBswap(uint8x16_t x) {
+  x = vrev64q_u8(x);
+  return vextq_u8(x, x, 8);
+}
+
+TARGET_ARM static void ArmGhash(uint8_t y[static 16],
+                                const uint8_t h[static 16],
+                                const uint8_t *p, size_t nblocks) {
+  uint8x16_t hh = ArmBswap(vld1q_u8(h));
+  uint8x16_t x = ArmBswap(vld1q_u8(y));
+  for (size_t i = 0; i < nblocks; i++, p += 16)
+    x = ArmGfMul(veorq_u8(x, ArmBswap(vld1q_u8(p))), hh);
+  vst1q_u8(y, ArmBswap(x));
+}
+
+static const struct AesImpl armimpl = {
+    "armv8", ArmSubWord, ArmSetKey, ArmCbcEnc, ArmCbcDec, ArmCtr, ArmGhash,
+    NULL, NULL,
+};
+
+#endif
+
+/*********************************************************************/
+
+static const struct AesImpl *GetImpl(void) {
+  uint32_t features = omemoDriverGetCpuFeatures();
+  (void)features;
+#ifdef AES_X86
+  if (features & OMEMO_CPU_AESNI)
+    return &niimpl;
+#endif
+#ifdef AES_ARM
+  if (features & OMEMO_CPU_ARMCRYPTO)
+    return &armimpl;
+#endif
+  return &ctimpl;
+}
+
+const char *omemoDriverAesImpl(void) {
+  return GetImpl()->name;
+}
+
+enum { MODE_NONE, MODE_CBCENC, MODE_CBCDEC, MODE_GCM };
+
+struct omemoDriverAes {
+  const struct AesImpl *impl;
+  int mode;
+  uint8_t k[32];
+  struct AesKey key;
+  uint8_t h[16];
+  // Powers of H for impl->gcm.
+  uint8_t htab[8][16];
+  // Streaming GCM, ks is the key stream and c the ciphertext of the
+  // current partial block.
+  struct {
+    uint8_t ctr[16], ej0[16], y[16], ks[16], c[16];
+    uint64_t n;
+    bool enc;
+  } gcm;
+};
+
+static void SetKey(struct omemoDriverAes *aes, int mode, const uint8_t *k,
+                   int nk) {
+  const struct AesImpl *impl = GetImpl();
+  if (aes->impl == impl && aes->mode == mode &&
+      !omemoDriverCompare(aes->k, k, 4 * nk))
+    return;
+  uint32_t w[60];
+  aes->impl = impl;
+  aes->mode = mode;
+  memcpy(aes->k, k, 4 * nk);
+  aes->key.rounds = ExpandKey(w, k, nk, aes->impl->subword);
+  aes->impl->setkey(&aes->key, w, mode == MODE_CBCDEC);
+  memset(w, 0, sizeof(w));
+  if (mode == MODE_GCM) {
+    uint8_t zero[16] = {0};
+    memset(aes->h, 0, 16);
+    aes->impl->ctr(&aes->key, 1, zero, aes->h, aes->h);
+    if (aes->impl->gcminit)
+      aes->impl->gcminit(aes->htab, aes->h);
+  }
+}
+
+struct omemoDriverAes *omemoDriverAesCreate(void) {
+  return calloc(1, sizeof(struct omemoDriverAes));
+}
+
+void omemoDriverAesDestroy(struct omemoDriverAes *aes) {
+  if (aes) {
+    memset(aes, 0, sizeof(*aes));
+    free(aes);
+  }
+}
+
+int omemoDriverAesSetKey(struct omemoDriverAes *aes, const omemoKey k, bool enc) {
+  SetKey(aes, enc ? MODE_CBCENC : MODE_CBCDEC, k, 8);
+  return 0;
+}
+
+int omemoDriverAesCbc(struct omemoDriverAes *aes, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  if (n % 16)
+    return OMEMO_ECRYPTO;
+  if (aes->mode == MODE_CBCENC)
+    aes->impl->cbcenc(&aes->key, n / 16, iv, s, d);
+  else if (aes->mode == MODE_CBCDEC)
+    aes->impl->cbcdec(&aes->key, n / 16, iv, s, d);
+  else
+    return OMEMO_ECRYPTO;
+  return 0;
+}
+
+int omemoDriverAesSetGcmKey(struct omemoDriverAes *aes, const uint8_t k[static 16]) {
+  SetKey(aes, MODE_GCM, k, 4);
+  return 0;
+}
+
+// Does ops on the nblocks whole blocks of s and d. With GCM_CTR, ctr
+// is advanced past the blocks. With a GHASH op, y is continued with the
+// blocks.
+static void GcmBlocks(const struct omemoDriverAes *aes,
+                      uint8_t ctr[static 16], uint8_t y[static 16],
+                      const uint8_t *s, uint8_t *d, size_t nblocks,
+                      int ops) {
+  if (aes->impl->gcm) {
+    aes->impl->gcm(&aes->key, aes->htab, ctr, y, s, d, nblocks, ops);
+    return;
+  }
+  if (ops & GCM_HASHIN)
+    aes->impl->ghash(y, aes->h, s, nblocks);
+  if (ops & GCM_CTR)
+    aes->impl->ctr(&aes->key, nblocks, ctr, s, d);
+  if (ops & GCM_HASHOUT)
+    aes->impl->ghash(y, aes->h, d, nblocks);
+}
+
+// Continues GHASH with the last partial block of r bytes and the
+// length block for a message of n bytes.
+static void GcmHashTail(const struct omemoDriverAes *aes, uint8_t y[static 16],
+                        const uint8_t *c, size_t r, size_t n) {
+  uint8_t last[16] = {0};
+  if (r) {
+    memcpy(last, c, r);
+    aes->impl->ghash(y, aes->h, last, 1);
+  }
+  memset(last, 0, 8);
+  Store64Be(last + 8, (uint64_t)n * 8);
+  aes->impl->ghash(y, aes->h, last, 1);
+}
+
+// Sets ctr to J0, returns the encrypted J0 in ej0 and leaves ctr at
+// inc32(J0).
+static void GcmStart(const struct omemoDriverAes *aes,
+                     uint8_t ctr[static 16], uint8_t ej0[static 16],
+                     const uint8_t iv[static 12]) {
+  memcpy(ctr, iv, 12);
+  Store32Be(ctr + 12, 1);
+  memset(ej0, 0, 16);
+  aes->impl->ctr(&aes->key, 1, ctr, ej0, ej0);
+}
+
+// CTR with a partial last block.
+static void GcmCtr(const struct omemoDriverAes *aes, uint8_t ctr[static 16],
+                   const uint8_t *s, uint8_t *d, size_t n) {
+  uint8_t last[16];
+  aes->impl->ctr(&aes->key, n / 16, ctr, s, d);
+  if (n % 16) {
+    memcpy(last, s + n - n % 16, n % 16);
+    aes->impl->ctr(&aes->key, 1, ctr, last, last);
+    memcpy(d + n - n % 16, last, n % 16);
+  }
+}
+
+// Large payloads can be split over threads. Each part of the whole
+// blocks gets its own counter and a GHASH Y_i started from zero, which
+// are combined as Y = Y * H^m_i + Y_i where m_i is the number of blocks
+// in part i. The result is the same as with one thread.
+#define GCMMAXTHREADS 16
+
+struct GcmPart {
+  const struct omemoDriverAes *aes;
+  uint8_t ctr[16], y[16];
+  const uint8_t *s;
+  uint8_t *d;
+  size_t nblocks;
+  int ops;
+};
+
+static int gcmthreads = 1;
+static size_t gcmthreshold = SIZE_MAX;
+
+void omemoDriverSetGcmThreads(int n, size_t threshold) {
+  __atomic_store_n(&gcmthreads,
+                   n < 1 ? 1 : n > GCMMAXTHREADS ? GCMMAXTHREADS : n,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&gcmthreshold, threshold, __ATOMIC_RELAXED);
+}
+
+// Returns the number of threads for n bytes, 1 if they are not used.
+static int GcmThreads(size_t n) {
+  int k = __atomic_load_n(&gcmthreads, __ATOMIC_RELAXED);
+  if (k > 1 && n >= __atomic_load_n(&gcmthreshold, __ATOMIC_RELAXED) &&
+      n / 16 >= (size_t)k)
+    return k;
+  return 1;
+}
+
+static void *RunGcmPart(void *arg) {
+  struct GcmPart *p = arg;
+  GcmBlocks(p->aes, p->ctr, p->y, p->s, p->d, p->nblocks, p->ops);
+  return NULL;
+}
+
+// x = x * y in GF(2^128)
+static void GcmMul(const struct omemoDriverAes *aes, uint8_t x[static 16],
+                   const uint8_t y[static 16]) {
+  static const uint8_t zero[16];
+  uint8_t t[16];
+  memcpy(t, y, 16);
+  aes->impl->ghash(x, t, zero, 1);
+}
+
+// r = H^e
+static void GcmPowH(const struct omemoDriverAes *aes, uint8_t r[static 16],
+                    size_t e) {
+  uint8_t b[16];
+  memset(r, 0, 16);
+  r[0] = 0x80;
+  memcpy(b, aes->h, 16);
+  for (; e; e >>= 1) {
+    if (e & 1)
+      GcmMul(aes, r, b);
+    GcmMul(aes, b, b);
+  }
+}
+
+// Does ops on the nblocks whole blocks of s and d with k threads. With GCM_CTR, ctr is advanced past the blocks. With a GHASH
+// op, y is set to the GHASH of the blocks.
+static void GcmParallel(const struct omemoDriverAes *aes, uint8_t ctr[static 16],
+                        uint8_t y[static 16], const uint8_t *s, uint8_t *d,
+                        size_t nblocks, int ops, int k) {
+  struct GcmPart parts[GCMMAXTHREADS];
+  pthread_t threads[GCMMAXTHREADS];
+  bool started[GCMMAXTHREADS] = {0};
+  uint8_t hm[16];
+  size_t off = 0;
+  int i = 0;
+  do {
+    struct GcmPart *p = parts + i;
+    p->aes = aes;
+    p->s = s + 16 * off;
+    p->d = d + 16 * off;
+    p->nblocks = i == k - 1 ? nblocks - off : nblocks / k;
+    p->ops = ops;
+    memset(p->y, 0, 16);
+    memcpy(p->ctr, ctr, 16);
+    Store32Be(p->ctr + 12, Load32Be(ctr + 12) + (uint32_t)off);
+    off += p->nblocks;
+    if (i)
+      started[i] = !pthread_create(threads + i, NULL, RunGcmPart, p);
+  } while (++i < k);
+  RunGcmPart(parts);
+  memset(y, 0, 16);
+  for (i = 0; i < k; i++) {
+    // Run it here if the thread could not be created.
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else if (i)
+      RunGcmPart(parts + i);
+    if (ops & (GCM_HASHIN | GCM_HASHOUT)) {
+      GcmPowH(aes, hm, parts[i].nblocks);
+      GcmMul(aes, y, hm);
+      Xor16(y, y, parts[i].y);
+    }
+  }
+  if (ops & GCM_CTR)
+    Store32Be(ctr + 12, Load32Be(ctr + 12) + (uint32_t)nblocks);
+}
+
+int omemoDriverAesGcmEncrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s) {
+  uint8_t ctr[16], ej0[16], y[16];
+  if (aes->mode != MODE_GCM)
+    return OMEMO_ECRYPTO;
+  GcmStart(aes, ctr, ej0, iv);
+  size_t m = n - n % 16;
+  int k = GcmThreads(n);
+  if (k > 1) {
+    GcmParallel(aes, ctr, y, s, d, n / 16, GCM_CTR | GCM_HASHOUT, k);
+  } else {
+    memset(y, 0, 16);
+    GcmBlocks(aes, ctr, y, s, d, n / 16, GCM_CTR | GCM_HASHOUT);
+  }
+  GcmCtr(aes, ctr, s + m, d + m, n % 16);
+  GcmHashTail(aes, y, d + m, n % 16, n);
+  Xor16(tag, y, ej0);
+  return 0;
+}
+
+int omemoDriverAesGcmDecrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s) {
+  uint8_t ctr[16], ej0[16], y[16];
+  if (aes->mode != MODE_GCM || tagn < 4 || tagn > 16)
+    return OMEMO_ECRYPTO;
+  GcmStart(aes, ctr, ej0, iv);
+  int k = GcmThreads(n);
+  size_t m = n - n % 16;
+  // The tag is checked before anything is written to d, which also
+  // makes in-place decryption safe.
+  if (k > 1) {
+    GcmParallel(aes, ctr, y, s, d, n / 16, GCM_HASHIN, k);
+  } else {
+    memset(y, 0, 16);
+    GcmBlocks(aes, ctr, y, s, d, n / 16, GCM_HASHIN);
+  }
+  GcmHashTail(aes, y, s + m, n % 16, n);
+  Xor16(y, y, ej0);
+  if (omemoDriverCompare(y, tag, tagn))
+    return OMEMO_ECRYPTO;
+  if (k > 1) {
+    GcmParallel(aes, ctr, y, s, d, n / 16, GCM_CTR, k);
+    GcmCtr(aes, ctr, s + m, d + m, n % 16);
+  } else {
+    GcmCtr(aes, ctr, s, d, n);
+  }
+  return 0;
+}
+
+int omemoDriverAesGcmStart(struct omemoDriverAes *aes, const uint8_t iv[static 12], bool enc) {
+  if (aes->mode != MODE_GCM)
+    return OMEMO_ECRYPTO;
+  GcmStart(aes, aes->gcm.ctr, aes->gcm.ej0, iv);
+  memset(aes->gcm.y, 0, 16);
+  aes->gcm.n = 0;
+  aes->gcm.enc = enc;
+  return 0;
+}
+
+// Handles bytes of a partial block, returns how many were used.
+static size_t GcmPartial(struct omemoDriverAes *aes, uint8_t *d, size_t n,
+                         const uint8_t *s) {
+  size_t off = aes->gcm.n % 16, i;
+  for (i = 0; i < n && off + i < 16; i++) {
+    uint8_t c = s[i], p = c ^ aes->gcm.ks[off + i];
+    aes->gcm.c[off + i] = aes->gcm.enc ? p : c;
+    d[i] = p;
+  }
+  aes->gcm.n += i;
+  if (off + i == 16)
+    aes->impl->ghash(aes->gcm.y, aes->h, aes->gcm.c, 1);
+  return i;
+}
+
+int omemoDriverAesGcmUpdate(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t *s) {
+  if (aes->mode != MODE_GCM)
+    return OMEMO_ECRYPTO;
+  size_t i = 0;
+  if (aes->gcm.n % 16)
+    i = GcmPartial(aes, d, n, s);
+  size_t m = (n - i) / 16;
+  if (m) {
+    GcmBlocks(aes, aes->gcm.ctr, aes->gcm.y, s + i, d + i, m,
+              GCM_CTR | (aes->gcm.enc ? GCM_HASHOUT : GCM_HASHIN));
+    aes->gcm.n += 16 * m;
+    i += 16 * m;
+  }
+  if (i < n) {
+    memset(aes->gcm.ks, 0, 16);
+    aes->impl->ctr(&aes->key, 1, aes->gcm.ctr, aes->gcm.ks, aes->gcm.ks);
+    GcmPartial(aes, d + i, n - i, s + i);
+  }
+  return 0;
+}
+
+int omemoDriverAesGcmFinish(struct omemoDriverAes *aes, uint8_t *tag, size_t tagn) {
+  uint8_t last[16] = {0}, y[16];
+  if (aes->mode != MODE_GCM || tagn < 4 || tagn > 16)
+    return OMEMO_ECRYPTO;
+  size_t off = aes->gcm.n % 16;
+  if (off) {
+    memcpy(last, aes->gcm.c, off);
+    aes->impl->ghash(aes->gcm.y, aes->h, last, 1);
+    memset(last, 0, 16);
+  }
+  Store64Be(last + 8, aes->gcm.n * 8);
+  aes->impl->ghash(aes->gcm.y, aes->h, last, 1);
+  Xor16(y, aes->gcm.y, aes->gcm.ej0);
+  bool enc = aes->gcm.enc;
+  memset(&aes->gcm, 0, sizeof(aes->gcm));
+  if (!enc)
+    return omemoDriverCompare(y, tag, tagn) ? OMEMO_ECRYPTO : 0;
+  memcpy(tag, y, tagn);
+  return 0;
+}
+
+// The one-shot functions expand the key in a context on the stack and
+// wipe it before they return, so no key outlives the call. Keep an
+// omemoDriverAes to reuse the key schedule.
+
+int omemoDriverAesEncrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  struct omemoDriverAes aes = {0};
+  omemoDriverAesSetKey(&aes, k, true);
+  int r = omemoDriverAesCbc(&aes, n, iv, s, d);
+  memset(&aes, 0, sizeof(aes));
+  return r;
+}
+
+int omemoDriverAesDecrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  struct omemoDriverAes aes = {0};
+  omemoDriverAesSetKey(&aes, k, false);
+  int r = omemoDriverAesCbc(&aes, n, iv, s, d);
+  memset(&aes, 0, sizeof(aes));
+  return r;
+}
+
+int omemoDriverGcmEncrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s) {
+  struct omemoDriverAes aes = {0};
+  omemoDriverAesSetGcmKey(&aes, key);
+  int r = omemoDriverAesGcmEncrypt(&aes, d, n, iv, tag, s);
+  memset(&aes, 0, sizeof(aes));
+  return r;
+}
+
+int omemoDriverGcmDecrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s) {
+  struct omemoDriverAes aes = {0};
+  omemoDriverAesSetGcmKey(&aes, key);
+  int r = omemoDriverAesGcmDecrypt(&aes, d, n, iv, tag, tagn, s);
+  memset(&aes, 0, sizeof(aes));
+  return r;
+}
@@ -1205,7 +1205,18 @@ void f25519_neg(uint8_t *r, const uint8_t *a)
 	}
 }
 
-void f25519_mul__distinct(uint8_t *r, const uint8_t *a, const uint8_t *b)
+/* With OMEMO_C25519_LIMBS multiplication is done on ten 25.5-bit limbs
+ * instead of bytes, which is much faster on 32-bit and 64-bit CPUs. The
+ * byte version is kept as f25519_mul_bytes so the two can be compared.
+ */
+#ifdef OMEMO_C25519_LIMBS
+void f25519_mul_bytes(uint8_t *r, const uint8_t *a, const uint8_t *b);
+#define F25519_MUL_BYTES f25519_mul_bytes
+#else
+#define F25519_MUL_BYTES f25519_mul__distinct
+#endif
+
+void F25519_MUL_BYTES(uint8_t *r, const uint8_t *a, const uint8_t *b)
 {
 	uint32_t c = 0;
 	int i;
@@ -1234,6 +1245,104 @@ void f25519_mul__distinct(uint8_t *r, const uint8_t *a, const uint8_t *b)
 	}
 }
 
+#ifdef OMEMO_C25519_LIMBS
+/* Limb i holds bits [ceil(25.5 i), ceil(25.5 (i + 1))) */
+#define FE10_BITS(i) (26 - ((i) & 1))
+#define FE10_MASK(i) ((UINT32_C(1) << FE10_BITS(i)) - 1)
+
+static const uint8_t fe10_offset[10] = {
+	0, 26, 51, 77, 102, 128, 153, 179, 204, 230
+};
+
+static void fe10_unpack(uint32_t *h, const uint8_t *s)
+{
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		const int o = fe10_offset[i];
+		uint64_t v = 0;
+		int j;
+
+		for (j = 0; j < 5 && (o >> 3) + j < F25519_SIZE; j++)
+			v |= ((uint64_t)s[(o >> 3) + j]) << (8 * j);
+
+		h[i] = (v >> (o & 7)) & FE10_MASK(i);
+	}
+
+	/* Values may be up to 2p, fold bit 255 back in */
+	h[0] += (s[31] >> 7) * 19;
+}
+
+static void fe10_pack(uint8_t *s, const uint32_t *h)
+{
+	uint64_t c = 0;
+	int bits = 0;
+	int i = 0;
+	int k;
+
+	/* Limbs may exceed their width slightly, so add rather than or */
+	for (k = 0; k < F25519_SIZE; k++) {
+		while (i < 10 && bits < 8) {
+			c += ((uint64_t)h[i]) << bits;
+			bits += FE10_BITS(i);
+			i++;
+		}
+
+		s[k] = c;
+		c >>= 8;
+		bits -= 8;
+	}
+}
+
+void f25519_mul__distinct(uint8_t *r, const uint8_t *a, const uint8_t *b)
+{
+	uint32_t f[10];
+	uint32_t g[10];
+	uint64_t t[10] = {0};
+	uint64_t c;
+	int i;
+
+	fe10_unpack(f, a);
+	fe10_unpack(g, b);
+
+	/* Products of two odd limbs land half a bit too low and are
+	 * doubled, anything at or above 2^255 wraps around times 19.
+	 */
+	for (i = 0; i < 10; i++) {
+		int j;
+
+		for (j = 0; j < 10; j++) {
+			const uint64_t p =
+				(((uint64_t)f[i]) * g[j]) << (i & j & 1);
+
+			if (i + j < 10)
+				t[i + j] += p;
+			else
+				t[i + j - 10] += p * 19;
+		}
+	}
+
+	for (i = 0; i < 10; i++) {
+		c = t[i] >> FE10_BITS(i);
+		t[i] &= FE10_MASK(i);
+
+		if (i < 9)
+			t[i + 1] += c;
+		else
+			t[0] += c * 19;
+	}
+
+	c = t[0] >> FE10_BITS(0);
+	t[0] &= FE10_MASK(0);
+	t[1] += c;
+
+	for (i = 0; i < 10; i++)
+		f[i] = t[i];
+
+	fe10_pack(r, f);
+}
+#endif
+
 void f25519_mul(uint8_t *r, const uint8_t *a, const uint8_t *b)
 {
 	uint8_t tmp[F25519_SIZE];
@@ -1941,8 +2050,104 @@ void omemoDriverEdSignMod(omemoCurveSignature signature, omemoKey pub, omemoKey
 	memcpy(signature + 32, s, 32);
 }
 
+/* Batch verification checks the random linear combination
+ *
+ *     [8]([sum z_i S_i]B - sum [z_i]R_i - sum [z_i h_i]A_i) = 0
+ *
+ * with 128-bit z_i derived from seed. The R_i and A_i are multiplied
+ * bit by bit with one shared chain of doublings, which needs no tables
+ * and so keeps RAM use low. -DOMEMO_SMALLSTACK makes the batches
+ * smaller still.
+ */
+#ifdef OMEMO_SMALLSTACK
+#define BATCHMAX 2
+#else
+#define BATCHMAX 8
+#endif
+
+static bool ed_verify_batch(size_t n, omemoCurveSignature *sigs,
+			    omemoKey *pubs, uint8_t **msgs, size_t *msgns,
+			    const uint8_t *seed, size_t first)
+{
+	struct ed25519_pt pt[2 * BATCHMAX];
+	uint8_t e[2 * BATCHMAX][FPRIME_SIZE];
+	struct ed25519_pt p;
+	struct ed25519_pt q;
+	struct sha512_state st;
+	uint8_t block[SHA512_BLOCK_SIZE];
+	uint8_t s[FPRIME_SIZE];
+	uint8_t h[FPRIME_SIZE];
+	uint8_t t[FPRIME_SIZE];
+	size_t i;
+	size_t j;
+	int k;
+
+	fprime_load(s, 0);
+
+	for (i = 0; i < n; i++) {
+		uint64_t c = first + i;
+
+		if (!upp(&pt[2 * i], sigs[i]) || !upp(&pt[2 * i + 1], pubs[i]))
+			return false;
+
+		/* z = SHA-512(seed || i) truncated to 128 bits */
+		memcpy(block, seed, 32);
+		for (k = 0; k < 8; k++)
+			block[32 + k] = c >> (8 * k);
+		sha512_init(&st);
+		sha512_final(&st, block, 40);
+		memset(e[2 * i], 0, FPRIME_SIZE);
+		sha512_get(&st, e[2 * i], 0, 16);
+
+		hash_message(h, sigs[i], pubs[i], msgs[i], msgns[i]);
+		fprime_mul(e[2 * i + 1], e[2 * i], h, ed25519_order);
+
+		memcpy(t, sigs[i] + 32, FPRIME_SIZE);
+		fprime_normalize(t, ed25519_order);
+		fprime_mul(h, e[2 * i], t, ed25519_order);
+		fprime_add(s, h, ed25519_order);
+	}
+
+	ed25519_copy(&q, &ed25519_neutral);
+
+	for (k = 252; k >= 0; k--) {
+		ed25519_double(&q, &q);
+
+		for (j = 0; j < 2 * n; j++)
+			if ((e[j][k >> 3] >> (k & 7)) & 1)
+				ed25519_add(&q, &q, &pt[j]);
+	}
+
+	/* p = sB - q, which must be of small order */
+	ed25519_smult(&p, &ed25519_base, s);
+	f25519_neg(q.x, q.x);
+	f25519_neg(q.t, q.t);
+	ed25519_add(&p, &p, &q);
+
+	for (k = 0; k < 3; k++)
+		ed25519_double(&p, &p);
+
+	pp(t, &p);
+	return f25519_eq(t, f25519_one);
+}
+
+bool omemoDriverEdVerifyBatch(size_t n, omemoCurveSignature *sigs, omemoKey *pubs, uint8_t **msgs, size_t *msgns, const uint8_t seed[static 32]) {
+  for (size_t i = 0; i < n; i += BATCHMAX) {
+    size_t m = n - i < BATCHMAX ? n - i : BATCHMAX;
+    if (!ed_verify_batch(m, sigs + i, pubs + i, msgs + i, msgns + i, seed, i))
+      return false;
+  }
+  return true;
+}
+
+/* Cofactored like the batch, so both accept the same signatures. Only
+ * when edsign_verify fails is the equation checked with [8], as a batch
+ * of one where any fixed z_1 other than 0 does.
+ */
 bool omemoDriverEdVerify(omemoCurveSignature sig, omemoKey pub, uint8_t *msg, size_t msgn) {
-  return !!edsign_verify(sig, pub, msg, msgn);
+  static const uint8_t seed[32];
+  return edsign_verify(sig, pub, msg, msgn) ||
+         ed_verify_batch(1, (omemoCurveSignature *)sig, (omemoKey *)pub, &msg, &msgn, seed, 0);
 }
 
 void omemoDriverEdSeedToPubPrv(omemoKey pub, omemoKey prv, omemoKey seed) {
@@ -1959,6 +2164,77 @@ void omemoDriverCvPrvToEdPub(omemoKey pub, omemoKey prv) {
 
 void omemoDriverCvPubToEdPub(omemoKey ed, omemoKey cv) {
   morph25519_mx2ey(ed, cv);
+  f25519_normalize(ed);
+}
+
+#define CONVERTMAX 32
+
+/* out = num / den for n elements with one inversion (Montgomery's
+ * trick): acc holds the prefix products of den and the inverses are
+ * peeled off from the back. As with f25519_inv, den = 0 gives 0.
+ */
+static void divide_batch(omemoKey *out, uint8_t (*num)[F25519_SIZE],
+			 uint8_t (*den)[F25519_SIZE], size_t n)
+{
+	uint8_t acc[CONVERTMAX][F25519_SIZE];
+	uint8_t inv[F25519_SIZE];
+	uint8_t t[F25519_SIZE];
+	uint8_t zero[CONVERTMAX];
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		f25519_copy(t, den[i]);
+		f25519_normalize(t);
+		zero[i] = f25519_eq(t, f25519_zero);
+		if (zero[i])
+			f25519_copy(den[i], f25519_one);
+
+		if (i)
+			f25519_mul__distinct(acc[i], acc[i - 1], den[i]);
+		else
+			f25519_copy(acc[0], den[0]);
+	}
+
+	f25519_inv__distinct(inv, acc[n - 1]);
+
+	for (i = n - 1; i > 0; i--) {
+		f25519_mul__distinct(t, inv, acc[i - 1]);
+		f25519_mul__distinct(acc[i - 1], inv, den[i]);
+		f25519_copy(inv, acc[i - 1]);
+		f25519_copy(den[i], t);
+	}
+	f25519_copy(den[0], inv);
+
+	for (i = 0; i < n; i++) {
+		if (zero[i])
+			f25519_copy(den[i], f25519_zero);
+		f25519_mul__distinct(out[i], num[i], den[i]);
+		f25519_normalize(out[i]);
+	}
+}
+
+void omemoDriverEdPubToCvPubBatch(size_t n, omemoKey *cv, omemoKey *ed) {
+  uint8_t num[CONVERTMAX][F25519_SIZE], den[CONVERTMAX][F25519_SIZE];
+  for (size_t i = 0; i < n; i += CONVERTMAX) {
+    size_t m = n - i < CONVERTMAX ? n - i : CONVERTMAX;
+    for (size_t j = 0; j < m; j++) {
+      f25519_sub(den[j], f25519_one, ed[i + j]);
+      f25519_add(num[j], f25519_one, ed[i + j]);
+    }
+    divide_batch(cv + i, num, den, m);
+  }
+}
+
+void omemoDriverCvPubToEdPubBatch(size_t n, omemoKey *ed, omemoKey *cv) {
+  uint8_t num[CONVERTMAX][F25519_SIZE], den[CONVERTMAX][F25519_SIZE];
+  for (size_t i = 0; i < n; i += CONVERTMAX) {
+    size_t m = n - i < CONVERTMAX ? n - i : CONVERTMAX;
+    for (size_t j = 0; j < m; j++) {
+      f25519_add(den[j], cv[i + j], f25519_one);
+      f25519_sub(num[j], cv[i + j], f25519_one);
+    }
+    divide_batch(ed + i, num, den, m);
+  }
 }
 
 void omemoDriverCvPrvToPub(omemoKey pub, omemoKey prv) {
@@ -1969,3 +2245,11 @@ int omemoDriverX25519(omemoKey out, omemoKey prv, omemoKey pub) {
   c25519_smult(out, pub, prv);
   return !f25519_eq(out, f25519_zero) ? 0 : OMEMO_ECORRUPT;
 }
+
+const char *omemoDriverCurveImpl(void) {
+#ifdef OMEMO_C25519_LIMBS
+  return "c25519-limbs";
+#else
+  return "c25519";
+#endif
+}
@@ -0,0 +1,1042 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// See core.h.
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "omemo.h"
+#include "core.h"
+#include "driver.h"
+
+// First byte of OMEMO 0.3 messages, the protocol version 3 twice.
+#define VERSIONBYTE ((3 << 4) | 3)
+
+void omemoCoreSerializeKey(const struct omemoCoreProtocol *pr,
+                           uint8_t *d, const omemoKey pub) {
+  if (pr->serlen > 32)
+    d[0] = 5;
+  memcpy(d + pr->serlen - 32, pub, 32);
+}
+
+/***************************** PROTOBUF ******************************/
+
+/**
+ * Parse Protobuf varint.
+ *
+ * Only supports uint32, higher bits are skipped so it will neither
+ * overflow nor clamp to UINT32_MAX.
+ *
+ * @param s points to the location of the varint in the protobuf data
+ * @param e points to the end of the protobuf data
+ * @param v (out) points to the location where the parsed varint will be
+ * written
+ * @returns pointer to first byte after the varint or NULL if parsing is
+ * not finished before reaching e
+ */
+static const uint8_t *ParseVarInt(const uint8_t *s, const uint8_t *e,
+                                  uint32_t *v) {
+  int i = 0;
+  *v = 0;
+  do {
+    if (s >= e)
+      return NULL;
+    *v |= (*s & 0x7f) << i;
+    i += 7;
+  } while (*s++ & 0x80);
+  return s;
+}
+
+/**
+ * Parse data in Protobuf format.
+ *
+ * For each field encountered it does the following:
+ * - Make sure the field number can be stored in `fields` and that the
+ *   type corresponds with the one specified in the associated field.
+ * - Mark the field number as found which later will be used to check
+ *   whether all required fields are found.
+ * - Parse the value.
+ * - If there already is a non-zero value specified in the field, it is
+ *   used to check whether the parsed value is the same.
+ * `nfields` should have the value of the highest possible field number
+ * + 1. `nfields` must be less than or equal to 32 because the found
+ * fields are tracked in a 32-bit mask.
+ *
+ * @param s is protobuf data
+ * @param n is the length of said data
+ * @param nfields is the amount of fields in the `fields` array
+ * @returns false if successful, true if error
+ */
+bool omemoCoreParseProtobuf(const uint8_t *s, size_t n,
+                            struct ProtobufField *fields, int nfields) {
+  int type, id;
+  uint32_t v;
+  const uint8_t *e = s + n;
+  uint32_t found = 0;
+  assert(nfields <= 32);
+  while (s < e) {
+    if (!(s = ParseVarInt(s, e, &v)))
+      return true;
+    type = v & 7;
+    id = v >> 3;
+    if (id >= nfields || type != (fields[id].type & 7))
+      return true;
+    found |= 1u << id;
+    if (!(s = ParseVarInt(s, e, &v)))
+      return true;
+    // If field is fixed size, enforce it
+    if (fields[id].v && v != fields[id].v)
+      return true;
+    fields[id].v = v;
+    if (type == PB_LEN) {
+      fields[id].p = s;
+      s += fields[id].v;
+    }
+  }
+  if (s > e)
+    return true;
+  for (int i = 0; i < nfields; i++) {
+    if ((fields[i].type & PB_REQUIRED) && !(found & (1u << i)))
+      return true;
+  }
+  return false;
+}
+
+bool omemoCoreParseRepeatingField(const uint8_t *s, const uint8_t *e,
+                                  struct ProtobufField *field,
+                                  int fieldid) {
+  int type, id;
+  uint32_t v;
+  assert(fieldid < 32);
+  while (s < e) {
+    if (!(s = ParseVarInt(s, e, &v)))
+      return true;
+    type = v & 7;
+    id = v >> 3;
+    if (id >= 32 || (id == fieldid && type != (field->type & 7)))
+      return true;
+    if (!(s = ParseVarInt(s, e, &v)))
+      return true;
+    if (id == fieldid)
+      field->v = v;
+    if (type == PB_LEN) {
+      if (id == fieldid)
+        field->p = s;
+      s += v;
+    }
+    if (id == fieldid)
+      break;
+  }
+  return s > e;
+}
+
+// Field numbers from 16 take a two-byte tag.
+static uint8_t *FormatTag(uint8_t d[static 2], int type, int id) {
+  assert(id < 32);
+  *d++ = ((id << 3) & 0x7f) | type | (id >= 16) << 7;
+  if (id >= 16)
+    *d++ = id >> 4;
+  return d;
+}
+
+uint8_t *omemoCoreFormatVarInt(uint8_t d[static 6], int type, int id,
+                               uint32_t v) {
+  d = FormatTag(d, type, id);
+  do {
+    *d = v & 0x7f;
+    v >>= 7;
+    *d++ |= (!!v << 7);
+  } while (v);
+  return d;
+}
+
+uint8_t *omemoCoreFormatKey(uint8_t d[static 34], int id,
+                            const omemoKey k) {
+  d = FormatTag(d, PB_LEN, id);
+  *d++ = 32;
+  memcpy(d, k, 32);
+  return d + 32;
+}
+
+static uint8_t *FormatSerializedKey(const struct omemoCoreProtocol *pr,
+                                    uint8_t *d, int id,
+                                    const omemoKey k) {
+  d = FormatTag(d, PB_LEN, id);
+  *d++ = pr->serlen;
+  omemoCoreSerializeKey(pr, d, k);
+  return d + pr->serlen;
+}
+
+/**************************** KEY MESSAGES ***************************/
+
+// Size of the message formatted by omemoCoreFormatMessage.
+size_t omemoCoreGetMessageSize(const struct omemoCoreProtocol *pr,
+                               uint32_t n, uint32_t pn, size_t encn) {
+  return (pr->v2 ? 4 : 1) + pr->macsize + 2 + pr->serlen + 1 +
+         GetVarIntSize(n) + 1 + GetVarIntSize(pn) + 1 +
+         GetVarIntSize(encn) + encn;
+}
+
+// Size of what omemoCoreFormatPreKeyMessage writes.
+size_t omemoCoreGetPreKeyHeaderSize(const struct omemoCoreProtocol *pr,
+                                    uint32_t pk_id, uint32_t spk_id,
+                                    size_t msgsz) {
+  return (pr->v2 ? 0 : 3) + 1 + GetVarIntSize(pk_id) + 1 +
+         GetVarIntSize(spk_id) + 2 * (2 + pr->serlen) + 1 +
+         GetVarIntSize(msgsz);
+}
+
+// Format Protobuf PreKeyWhisperMessage without message (it should be
+// appended right after this call).
+// This is OMEMOKeyExchange in schema
+size_t omemoCoreFormatPreKeyMessage(const struct omemoCoreProtocol *pr,
+                                    uint8_t *d, uint32_t pk_id,
+                                    uint32_t spk_id, const omemoKey ik,
+                                    const omemoKey ek, uint32_t msgsz) {
+  uint8_t *p = d;
+  if (!pr->v2) {
+    *p++ = VERSIONBYTE;
+    p = omemoCoreFormatVarInt(p, PB_UINT32, 5, 0); // registration id
+  }
+  p = omemoCoreFormatVarInt(p, PB_UINT32, pr->keyex_pk_id, pk_id);
+  p = omemoCoreFormatVarInt(p, PB_UINT32, pr->keyex_spk_id, spk_id);
+  p = FormatSerializedKey(pr, p, pr->keyex_ik, ik);
+  p = FormatSerializedKey(pr, p, pr->keyex_ek, ek);
+  // For OMEMO 2 msgsz can be > 127, the size above reserves 3 bytes
+  assert(pr->v2 || msgsz < 128);
+  p = omemoCoreFormatVarInt(p, PB_LEN, pr->keyex_message, msgsz);
+  return p - d;
+}
+
+// Format Protobuf WhisperMessage without ciphertext.
+//  HEADER(dh_pair, pn, n)
+size_t omemoCoreFormatMessageHeader(const struct omemoCoreProtocol *pr,
+                                    uint8_t *d, uint32_t n, uint32_t pn,
+                                    const omemoKey dhs, size_t keyn) {
+  uint8_t *p = d;
+  if (!pr->v2) {
+    *p++ = VERSIONBYTE;
+    p = FormatSerializedKey(pr, p, pr->msg_dh_pub, dhs);
+  }
+  p = omemoCoreFormatVarInt(p, PB_UINT32, pr->msg_n, n);
+  p = omemoCoreFormatVarInt(p, PB_UINT32, pr->msg_pn, pn);
+  if (pr->v2)
+    p = FormatSerializedKey(pr, p, pr->msg_dh_pub, dhs);
+  p = omemoCoreFormatVarInt(p, PB_LEN, pr->msg_ciphertext, keyn);
+  return p - d;
+}
+
+// Formats everything of the key message except the ciphertext and the
+// MAC, for which m gets the offsets (but not n, pn and dh).
+size_t omemoCoreFormatMessage(const struct omemoCoreProtocol *pr,
+                              struct omemoCoreMessage *m, uint8_t *d,
+                              uint32_t n, uint32_t pn, const omemoKey dhs,
+                              size_t encn) {
+  size_t msgn = omemoCoreGetMessageSize(pr, n, pn, encn), h = 0;
+  if (pr->v2) {
+    d[h++] = (1 << 3) | PB_LEN;
+    d[h++] = pr->macsize;
+    h += pr->macsize;
+    d[h++] = (2 << 3) | PB_LEN;
+    // Hmac'd message will always be smaller than 128
+    d[h] = msgn - h - 1;
+    h++;
+  }
+  m->macced = h;
+  h += omemoCoreFormatMessageHeader(pr, d + h, n, pn, dhs, encn);
+  m->ciphertext = h;
+  m->ciphertextn = encn;
+  m->mac = pr->v2 ? 2 : h + encn;
+  m->maccedn = pr->v2 ? msgn - m->macced : h + encn;
+  return msgn;
+}
+
+// Finds the parts of a key message, the sizes of the ciphertext and the
+// key are not checked.
+int omemoCoreParseMessage(const struct omemoCoreProtocol *pr,
+                          struct omemoCoreMessage *m, const uint8_t *msg,
+                          size_t msgn) {
+  const uint8_t *inner;
+  size_t innern;
+  if (pr->v2) {
+    struct ProtobufField fields1[3] = {
+        [1] = {PB_REQUIRED | PB_LEN, pr->macsize}, // mac
+        [2] = {PB_REQUIRED | PB_LEN},              // message
+    };
+    if (omemoCoreParseProtobuf(msg, msgn, fields1, 3))
+      return OMEMO_EPROTOBUF;
+    m->mac = fields1[1].p - msg;
+    inner = fields1[2].p;
+    innern = fields1[2].v;
+    m->macced = inner - msg;
+    m->maccedn = innern;
+  } else {
+    if (msgn < 1 + pr->macsize || msg[0] != VERSIONBYTE)
+      return OMEMO_ECORRUPT;
+    inner = msg + 1;
+    innern = msgn - 1 - pr->macsize;
+    m->mac = msgn - pr->macsize;
+    m->macced = 0;
+    m->maccedn = msgn - pr->macsize;
+  }
+  struct ProtobufField fields[5] = {0};
+  fields[pr->msg_n].type = PB_REQUIRED | PB_UINT32;
+  fields[pr->msg_pn].type = PB_REQUIRED | PB_UINT32;
+  fields[pr->msg_dh_pub].type = PB_REQUIRED | PB_LEN;
+  fields[pr->msg_dh_pub].v = pr->serlen;
+  fields[pr->msg_ciphertext].type = PB_REQUIRED | PB_LEN;
+  if (omemoCoreParseProtobuf(inner, innern, fields, 5))
+    return OMEMO_EPROTOBUF;
+  m->n = fields[pr->msg_n].v;
+  m->pn = fields[pr->msg_pn].v;
+  m->dh = omemoCoreGetRawKey(pr, fields[pr->msg_dh_pub].p) - msg;
+  m->ciphertext = fields[pr->msg_ciphertext].p - msg;
+  m->ciphertextn = fields[pr->msg_ciphertext].v;
+  return 0;
+}
+
+// Finds the parts of a prekey message.
+int omemoCoreParseKeyExchange(const struct omemoCoreProtocol *pr,
+                              struct omemoCoreKeyExchange *kx,
+                              const uint8_t *msg, size_t msgn) {
+  struct ProtobufField fields[7] = {0};
+  int nfields = 6;
+  if (!pr->v2) {
+    if (msgn == 0 || msg[0] != VERSIONBYTE)
+      return OMEMO_ECORRUPT;
+    msg++, msgn--;
+    // PreKeyWhisperMessage also has the registration id and the highest
+    // field number is 6.
+    fields[5].type = PB_UINT32;
+    nfields = 7;
+  }
+  fields[pr->keyex_pk_id].type = PB_REQUIRED | PB_UINT32;
+  fields[pr->keyex_spk_id].type = PB_REQUIRED | PB_UINT32;
+  fields[pr->keyex_ik].type = PB_REQUIRED | PB_LEN;
+  fields[pr->keyex_ik].v = pr->serlen;
+  fields[pr->keyex_ek].type = PB_REQUIRED | PB_LEN;
+  fields[pr->keyex_ek].v = pr->serlen;
+  fields[pr->keyex_message].type = PB_REQUIRED | PB_LEN;
+  if (omemoCoreParseProtobuf(msg, msgn, fields, nfields))
+    return OMEMO_EPROTOBUF;
+  // The offsets are into the message as it was passed.
+  size_t o = !pr->v2;
+  kx->pk_id = fields[pr->keyex_pk_id].v;
+  kx->spk_id = fields[pr->keyex_spk_id].v;
+  kx->ik = omemoCoreGetRawKey(pr, fields[pr->keyex_ik].p) - msg + o;
+  kx->ek = omemoCoreGetRawKey(pr, fields[pr->keyex_ek].p) - msg + o;
+  kx->message = fields[pr->keyex_message].p - msg + o;
+  kx->messagen = fields[pr->keyex_message].v;
+  return 0;
+}
+
+/****************************** RUNTIME ******************************/
+
+CORE struct omemoCoreRuntime omemoCoreRuntimes[2];
+CORE __thread struct omemoCoreThread omemoCoreThreads[2];
+
+static const uint8_t ZeroKey[32];
+
+// The one-shot primitives below use the driver objects of the context
+// when there is one, the drivers may allocate in their one-shots.
+
+static int ContextHmac(const struct omemoCoreThread *th, const omemoKey k,
+                       const uint8_t *in, size_t n,
+                       uint8_t out[static 32]) {
+  int r;
+  if (!th->hmac)
+    return omemoDriverHmac(k, in, n, out);
+  if ((r = omemoDriverHmacStart(th->hmac, k)) ||
+      (r = omemoDriverHmacUpdate(th->hmac, in, n)))
+    return r;
+  return omemoDriverHmacFinish(th->hmac, out);
+}
+
+// HKDF-SHA-256 from RFC 5869, the salt is always a key here.
+static int ContextHkdf(const struct omemoCoreThread *th,
+                       const uint8_t *salt, size_t saltn,
+                       const uint8_t *key, size_t keyn,
+                       const uint8_t *info, size_t infon, uint8_t *out,
+                       size_t outn) {
+  if (!th->hmac || saltn != 32 || outn > 255 * 32)
+    return omemoDriverHkdf(salt, saltn, key, keyn, info, infon, out,
+                           outn);
+  struct omemoDriverHmac *h = th->hmac;
+  omemoKey prk;
+  uint8_t t[32], i = 0;
+  int r = 0;
+  if ((r = omemoDriverHmacStart(h, salt)) ||
+      (r = omemoDriverHmacUpdate(h, key, keyn)) ||
+      (r = omemoDriverHmacFinish(h, prk)))
+    goto out;
+  for (size_t j = 0; j < outn; j += 32) {
+    i++;
+    if ((r = omemoDriverHmacStart(h, prk)) ||
+        (i > 1 && (r = omemoDriverHmacUpdate(h, t, 32))) ||
+        (r = omemoDriverHmacUpdate(h, info, infon)) ||
+        (r = omemoDriverHmacUpdate(h, &i, 1)) ||
+        (r = omemoDriverHmacFinish(h, t)))
+      goto out;
+    memcpy(out + j, t, outn - j < 32 ? outn - j : 32);
+  }
+out:
+  memset(prk, 0, 32);
+  memset(t, 0, 32);
+  return r;
+}
+
+static int ContextAesCbc(const struct omemoCoreThread *th, omemoKey k,
+                         bool enc, size_t n, uint8_t iv[static 16],
+                         const uint8_t *s, uint8_t *d) {
+  int r;
+  if (!th->aes)
+    return enc ? omemoDriverAesEncrypt(k, n, iv, s, d)
+               : omemoDriverAesDecrypt(k, n, iv, s, d);
+  if ((r = omemoDriverAesSetKey(th->aes, k, enc)))
+    return r;
+  return omemoDriverAesCbc(th->aes, n, iv, s, d);
+}
+
+static int ContextAesCbcHmac(const struct omemoCoreThread *th,
+                             const omemoKey k, const omemoKey mk,
+                             bool enc, size_t n, uint8_t iv[static 16],
+                             const uint8_t *s, uint8_t *d,
+                             uint8_t mac[static 32]) {
+  if (!th->aes)
+    return omemoDriverAesCbcHmac(k, mk, enc, n, iv, s, d, mac);
+  struct omemoDriverAes *aes = th->aes;
+  struct omemoDriverHmac *h = th->hmac;
+  int r;
+  if (n % 16)
+    return OMEMO_ECRYPTO;
+  if ((r = omemoDriverAesSetKey(aes, k, enc)) ||
+      (r = omemoDriverHmacStart(h, mk)))
+    return r;
+  for (size_t i = 0, m; i < n; i += m) {
+    m = n - i < OMEMODRIVER_CHUNKSIZE ? n - i : OMEMODRIVER_CHUNKSIZE;
+    if (enc) {
+      if ((r = omemoDriverAesCbc(aes, m, iv, s + i, d + i)) ||
+          (r = omemoDriverHmacUpdate(h, d + i, m)))
+        return r;
+    } else {
+      if ((r = omemoDriverHmacUpdate(h, s + i, m)) ||
+          (r = omemoDriverAesCbc(aes, m, iv, s + i, d + i)))
+        return r;
+    }
+  }
+  return omemoDriverHmacFinish(h, mac);
+}
+
+static int ContextGcmEncrypt(const struct omemoCoreThread *th, uint8_t *d,
+                             const uint8_t key[static 16], size_t n,
+                             const uint8_t iv[static 12],
+                             uint8_t tag[static 16], const uint8_t *s) {
+  int r;
+  if (!th->aes)
+    return omemoDriverGcmEncrypt(d, key, n, iv, tag, s);
+  if ((r = omemoDriverAesSetGcmKey(th->aes, key)))
+    return r;
+  return omemoDriverAesGcmEncrypt(th->aes, d, n, iv, tag, s);
+}
+
+static int ContextGcmDecrypt(const struct omemoCoreThread *th, uint8_t *d,
+                             const uint8_t key[static 16], size_t n,
+                             const uint8_t iv[static 12],
+                             const uint8_t *tag, size_t tagn,
+                             const uint8_t *s) {
+  int r;
+  if (!th->aes)
+    return omemoDriverGcmDecrypt(d, key, n, iv, tag, tagn, s);
+  if ((r = omemoDriverAesSetGcmKey(th->aes, key)))
+    return r;
+  return omemoDriverAesGcmDecrypt(th->aes, d, n, iv, tag, tagn, s);
+}
+
+#define TRACE(pr, op, call)                                            \
+  ({                                                                   \
+    omemoCoreTraceBegin(pr, op);                                       \
+    __typeof__(call) _tr_ = call;                                      \
+    omemoCoreTraceEnd(pr, op);                                         \
+    _tr_;                                                              \
+  })
+
+#define TRACEV(pr, op, call)                                           \
+  (omemoCoreTraceBegin(pr, op), call, omemoCoreTraceEnd(pr, op))
+
+int omemoCoreHmac(const struct omemoCoreProtocol *pr, const omemoKey k,
+                  const uint8_t *in, size_t n, uint8_t out[static 32]) {
+  return TRACE(pr, OMEMO_TRACE_HMAC,
+               ContextHmac(omemoCoreGetThread(pr), k, in, n, out));
+}
+
+int omemoCoreHkdf(const struct omemoCoreProtocol *pr,
+                  const uint8_t *salt, size_t saltn, const uint8_t *key,
+                  size_t keyn, const uint8_t *info, size_t infon,
+                  uint8_t *out, size_t outn) {
+  return TRACE(pr, OMEMO_TRACE_HKDF,
+               ContextHkdf(omemoCoreGetThread(pr), salt, saltn, key, keyn,
+                           info, infon, out, outn));
+}
+
+int omemoCoreAesEncrypt(const struct omemoCoreProtocol *pr, omemoKey k,
+                        size_t n, uint8_t iv[static 16],
+                        const uint8_t *s, uint8_t *d) {
+  return TRACE(pr, OMEMO_TRACE_AESENCRYPT,
+               ContextAesCbc(omemoCoreGetThread(pr), k, true, n, iv, s, d));
+}
+
+int omemoCoreAesDecrypt(const struct omemoCoreProtocol *pr, omemoKey k,
+                        size_t n, uint8_t iv[static 16],
+                        const uint8_t *s, uint8_t *d) {
+  return TRACE(pr, OMEMO_TRACE_AESDECRYPT,
+               ContextAesCbc(omemoCoreGetThread(pr), k, false, n, iv, s,
+                             d));
+}
+
+int omemoCoreAesCbcHmac(const struct omemoCoreProtocol *pr,
+                        const omemoKey k, const omemoKey mk, bool enc,
+                        size_t n, uint8_t iv[static 16], const uint8_t *s,
+                        uint8_t *d, uint8_t mac[static 32]) {
+  return TRACE(pr, OMEMO_TRACE_AESCBCHMAC,
+               ContextAesCbcHmac(omemoCoreGetThread(pr), k, mk, enc, n, iv,
+                                 s, d, mac));
+}
+
+int omemoCoreGcmEncrypt(const struct omemoCoreProtocol *pr, uint8_t *d,
+                        const uint8_t key[static 16], size_t n,
+                        const uint8_t iv[static 12],
+                        uint8_t tag[static 16], const uint8_t *s) {
+  return TRACE(pr, OMEMO_TRACE_GCMENCRYPT,
+               ContextGcmEncrypt(omemoCoreGetThread(pr), d, key, n, iv, tag,
+                                 s));
+}
+
+int omemoCoreGcmDecrypt(const struct omemoCoreProtocol *pr, uint8_t *d,
+                        const uint8_t key[static 16], size_t n,
+                        const uint8_t iv[static 12], const uint8_t *tag,
+                        size_t tagn, const uint8_t *s) {
+  return TRACE(pr, OMEMO_TRACE_GCMDECRYPT,
+               ContextGcmDecrypt(omemoCoreGetThread(pr), d, key, n, iv, tag,
+                                 tagn, s));
+}
+
+/******************************* KDFS ********************************/
+
+// d may be the same pointer as ck
+//  ck, mk = KDF_CK(ck)
+int omemoCoreKdfCk(const struct omemoCoreProtocol *pr, omemoKey d,
+                   omemoKey mk, const omemoKey ck) {
+  uint8_t data[1] = {1};
+  int r;
+  omemoCoreStat(pr, hmac);
+  if ((r = omemoCoreHmac(pr, ck, data, 1, mk)))
+    return r;
+  data[0] = 2;
+  omemoCoreStat(pr, hmac);
+  return omemoCoreHmac(pr, ck, data, 1, d);
+}
+
+// RK, ck = KDF_RK(RK, dh), masterkey may be scratch.
+int omemoCoreKdfRk(const struct omemoCoreProtocol *pr, omemoKey rk,
+                   omemoKey ck, const omemoKey dh,
+                   uint8_t masterkey[static 64]) {
+  int r;
+  omemoCoreStat(pr, hkdf);
+  if ((r = omemoCoreHkdf(pr, rk, 32, dh, 32,
+                         (const uint8_t *)pr->info_rootchain,
+                         strlen(pr->info_rootchain), masterkey, 64)))
+    return r;
+  memcpy(rk, masterkey, 32);
+  memcpy(ck, masterkey + 32, 32);
+  return 0;
+}
+
+// SK = KDF(DH1 || DH2 || DH3 || DH4) of X3DH, secret starts with the 32
+// bytes of 0xff.
+int omemoCoreKdfSharedSecret(const struct omemoCoreProtocol *pr,
+                             omemoKey sk,
+                             const uint8_t secret[static 32 * 5]) {
+  uint8_t tmpkey[32];
+  int r;
+  omemoCoreStat(pr, hkdf);
+  if (!(r = omemoCoreHkdf(pr, ZeroKey, 32, secret, 32 * 5,
+                          (const uint8_t *)pr->info_keyexchange,
+                          strlen(pr->info_keyexchange), tmpkey, 32)))
+    memcpy(sk, tmpkey, 32);
+  memset(tmpkey, 0, 32);
+  return r;
+}
+
+// The cipher key, MAC key and IV of struct omemoInternalDerivedKeys from
+// a message or payload key, info is one of the infos of pr.
+int omemoCoreDeriveKeys(const struct omemoCoreProtocol *pr,
+                        uint8_t out[static 80], const omemoKey secret,
+                        const char *info) {
+  omemoCoreStat(pr, hkdf);
+  return omemoCoreHkdf(pr, ZeroKey, 32, secret, 32, (const uint8_t *)info,
+                       strlen(info), out, 80);
+}
+
+//  AD = Encode(IKA) || Encode(IKB)
+// The MAC of a key message is over AD and msg, truncated to
+// pr->macsize bytes. macinput must fit both.
+int omemoCoreGetMac(const struct omemoCoreProtocol *pr, uint8_t *d,
+                    const omemoKey ika, const omemoKey ikb,
+                    const omemoKey mk, const uint8_t *msg, size_t msgn,
+                    uint8_t *macinput) {
+  uint8_t mac[32];
+  int r;
+  omemoCoreSerializeKey(pr, macinput, ika);
+  omemoCoreSerializeKey(pr, macinput + pr->serlen, ikb);
+  memcpy(macinput + 2 * pr->serlen, msg, msgn);
+  omemoCoreStat(pr, hmac);
+  if ((r = omemoCoreHmac(pr, mk, macinput, 2 * pr->serlen + msgn, mac)))
+    return r;
+  memcpy(d, mac, pr->macsize);
+  return 0;
+}
+
+/****************************** RATCHET ******************************/
+
+#define TRY(expr)                                                      \
+  do {                                                                 \
+    int _r_;                                                           \
+    if ((_r_ = expr))                                                  \
+      return _r_;                                                      \
+  } while (0)
+
+#define GetPad(n) (16 - ((n) % 16))
+
+/**
+ * @returns OMEMO_ECORRUPT if the generated shared secret is not secure
+ */
+int omemoCoreX25519(const struct omemoCoreProtocol *pr, omemoKey shared,
+                    const omemoKey prv, const omemoKey pub) {
+  omemoKey tmp, tmp2;
+  memcpy(tmp, prv, 32);
+  memcpy(tmp2, pub, 32);
+  omemoCoreStat(pr, x25519);
+  return TRACE(pr, OMEMO_TRACE_X25519,
+               omemoDriverX25519(shared, tmp, tmp2));
+}
+
+int omemoCoreGenerateKeyPair(const struct omemoCoreProtocol *pr,
+                             omemoCoreKeyPair *kp) {
+  TRY(TRACE(pr, OMEMO_TRACE_RANDOM, pr->random(kp->prv, 32)));
+  kp->prv[0] &= 0xf8;
+  kp->prv[31] &= 0x7f;
+  kp->prv[31] |= 0x40;
+  TRACEV(pr, OMEMO_TRACE_CVPRVTOPUB,
+         omemoDriverCvPrvToPub(kp->pub, kp->prv));
+  return 0;
+}
+
+// RK, ck = KDF_RK(RK, DH(DHs, DHr))
+int omemoCoreDeriveRootKey(const struct omemoCoreProtocol *pr,
+                           omemoCoreState *state, omemoKey ck,
+                           const struct omemoCoreScratch *sc) {
+  TRY(omemoCoreX25519(pr, sc->dh, state->dhs.prv, state->dhr));
+  return omemoCoreKdfRk(pr, state->rk, ck, sc->dh, sc->masterkey);
+}
+
+static int GetMac(const struct omemoCoreProtocol *pr, uint8_t *d,
+                  const omemoKey ika, const omemoKey ikb,
+                  const omemoKey mk, const uint8_t *msg, size_t msgn,
+                  const struct omemoCoreScratch *sc) {
+  // This could theoretically happen while decrypting when the protobuf
+  // is needlessly large.
+  if (msgn > pr->maxfullmsg + 4u)
+    return OMEMO_ECORRUPT;
+  // omemoScratch adds 4 in case some client has a large registration id
+  return omemoCoreGetMac(pr, d, ika, ikb, mk, msg, msgn, sc->macinput);
+}
+
+size_t omemoCoreGetKeyMessageSize(const struct omemoCoreProtocol *pr,
+                                  const omemoCoreSession *session,
+                                  size_t keyn) {
+  size_t msgn = omemoCoreGetMessageSize(pr, session->state.ns,
+                                        session->state.pn,
+                                        keyn + GetPad(keyn));
+  if (session->init != SESSION_INIT)
+    return msgn;
+  return omemoCoreGetPreKeyHeaderSize(pr, session->usedpk_id,
+                                      session->usedspk_id, msgn) +
+         msgn;
+}
+
+// CKs, mk = KDF_CK(CKs)
+// header = HEADER(DHs, PN, Ns)
+// return header, ENCRYPT(mk, plaintext, CONCAT(AD, header))
+// The sizes are known in advance, so the message is formatted right
+// after the prekey header, if any, and nothing has to be moved. Only
+// CKs and Ns change, they are updated once the message is complete.
+static int EncryptKeyImpl(const struct omemoCoreProtocol *pr,
+                          const omemoCoreSession *session, omemoKey cks,
+                          uint8_t *d, size_t *dn, bool *isprekey,
+                          const uint8_t *key, size_t keyn,
+                          const struct omemoCoreScratch *sc) {
+  if (!session->init)
+    return OMEMO_ESTATE;
+  size_t encn = keyn + GetPad(keyn);
+  size_t msgn = omemoCoreGetMessageSize(pr, session->state.ns,
+                                        session->state.pn, encn);
+  size_t headern = 0;
+  if (session->init == SESSION_INIT)
+    headern = omemoCoreGetPreKeyHeaderSize(pr, session->usedpk_id,
+                                           session->usedspk_id, msgn);
+  if (headern + msgn > *dn || encn > pr->maxpayload)
+    return OMEMO_EPARAM;
+  TRY(omemoCoreKdfCk(pr, cks, sc->mk, session->state.cks));
+  TRY(omemoCoreDeriveKeys(pr, (uint8_t *)sc->kdfout, sc->mk,
+                          pr->info_messagekeys));
+  uint8_t *p = d + headern;
+  struct omemoCoreMessage m;
+  size_t fmtn =
+      omemoCoreFormatMessage(pr, &m, p, session->state.ns,
+                             session->state.pn, session->state.dhs.pub,
+                             encn);
+  assert(fmtn == msgn);
+  (void)fmtn;
+  memcpy(sc->payload, key, keyn);
+  memset(sc->payload + keyn, encn - keyn, encn - keyn);
+  omemoCoreStat(pr, aes);
+  TRY(omemoCoreAesEncrypt(pr, sc->kdfout->cipher, encn, sc->kdfout->iv,
+                          sc->payload, p + m.ciphertext));
+  TRY(GetMac(pr, p + m.mac, session->identity, session->remoteidentity,
+             sc->kdfout->mac, p + m.macced, m.maccedn, sc));
+  if (headern) {
+    fmtn = omemoCoreFormatPreKeyMessage(
+        pr, d, session->usedpk_id, session->usedspk_id,
+        session->identity, session->usedek, msgn);
+    assert(fmtn == headern);
+  }
+  *dn = headern + msgn;
+  *isprekey = !!headern;
+  return 0;
+}
+
+int omemoCoreEncryptKey(const struct omemoCoreProtocol *pr,
+                        omemoCoreSession *session, uint8_t *d,
+                        size_t *dn, bool *isprekey, const uint8_t *key,
+                        size_t keyn, const struct omemoCoreScratch *sc) {
+  omemoKey cks;
+  int r = EncryptKeyImpl(pr, session, cks, d, dn, isprekey, key, keyn, sc);
+  if (!r) {
+    memcpy(session->state.cks, cks, 32);
+    session->state.ns++;
+  }
+  memset(cks, 0, 32);
+  return r;
+}
+
+//  PN = Ns
+//  Ns = 0
+//  Nr = 0
+//  DHr = dh
+//  RK, CKr = KDF_RK(RK, DH(DHs, DHr))
+//  DHs = GENERATE_DH()
+//  RK, CKs = KDF_RK(RK, DH(DHs, DHr))
+static int DHRatchet(const struct omemoCoreProtocol *pr,
+                     omemoCoreState *state, const omemoKey dh,
+                     const struct omemoCoreScratch *sc) {
+  omemoCoreStat(pr, ratchetsteps);
+  state->pn = state->ns;
+  state->ns = 0;
+  state->nr = 0;
+  memcpy(state->dhr, dh, 32);
+  TRY(omemoCoreDeriveRootKey(pr, state, state->ckr, sc));
+  TRY(omemoCoreGenerateKeyPair(pr, &state->dhs));
+  TRY(omemoCoreDeriveRootKey(pr, state, state->cks, sc));
+  return 0;
+}
+
+static inline uint32_t GetAmountSkipped(int64_t nr, int64_t n) {
+  return n > nr ? n - nr : 0;
+}
+
+static int SkipMessageKeys(const struct omemoCoreProtocol *pr,
+                           omemoCoreSession *session,
+                           omemoCoreState *state, uint32_t n,
+                           uint64_t fullamount) {
+  omemoCoreMessageKey k;
+  while (state->nr < n) {
+    TRY(omemoCoreKdfCk(pr, state->ckr, k.mk, state->ckr));
+    memcpy(k.dh, state->dhr, 32);
+    k.nr = state->nr;
+    TRY(TRACE(pr, OMEMO_TRACE_STOREMESSAGEKEY,
+              pr->storemessagekey(session, &k, fullamount--)));
+    omemoCoreStat(pr, skippedstored);
+    state->nr++;
+  }
+  return 0;
+}
+
+// Decrypts msg with the ratchet state, which is a scratch copy that the
+// caller commits to the session on success. session is only passed to
+// the message key callbacks. ika is the remote and ikb our identity key.
+int omemoCoreDecryptKey(const struct omemoCoreProtocol *pr,
+                        omemoCoreSession *session, omemoCoreState *state,
+                        const omemoKey ika, const omemoKey ikb,
+                        uint8_t *key, size_t *keyn, const uint8_t *msg,
+                        size_t msgn, const struct omemoCoreScratch *sc) {
+  struct omemoCoreMessage m;
+  TRY(omemoCoreParseMessage(pr, &m, msg, msgn));
+  size_t encn = m.ciphertextn;
+  if (encn < 16 || encn % 16 || encn > pr->maxpayload)
+    return OMEMO_ECORRUPT;
+
+  uint32_t headern = m.n;
+  uint32_t headerpn = m.pn;
+  const uint8_t *headerdh = msg + m.dh;
+
+  bool shouldstep = !!memcmp(state->dhr, headerdh, 32);
+
+  // We first check for maxskip, if that does not pass we should not
+  // process the message. If it does pass, we know the total capacity of
+  // the array is large enough because c >= maxskip. Then we check if
+  // the new keys fit in the remaining space. If that is not the case we
+  // return and let the user either remove the old message keys or
+  // ignore the message.
+
+  omemoCoreMessageKey mkey = {0};
+  memcpy(mkey.dh, headerdh, 32);
+  mkey.nr = headern;
+  int r;
+  if (!(r = TRACE(pr, OMEMO_TRACE_LOADMESSAGEKEY,
+                  pr->loadmessagekey(session, &mkey)))) {
+    omemoCoreStat(pr, skippedloaded);
+    memcpy(sc->mk, mkey.mk, 32);
+    memset(&mkey, 0, sizeof(mkey));
+  } else if (r < 0) {
+    return r;
+  } else {
+    if (!shouldstep && headern < state->nr)
+      return OMEMO_EKEYGONE;
+    uint64_t nskips =
+        shouldstep
+            ? GetAmountSkipped(state->nr, headerpn) + headern
+            : GetAmountSkipped(state->nr, headern);
+    if (shouldstep) {
+      TRY(SkipMessageKeys(pr, session, state, headerpn, nskips));
+      nskips -= headern;
+      TRY(DHRatchet(pr, state, headerdh, sc));
+    }
+    TRY(SkipMessageKeys(pr, session, state, headern, nskips));
+    TRY(omemoCoreKdfCk(pr, state->ckr, sc->mk, state->ckr));
+    state->nr++;
+  }
+  TRY(omemoCoreDeriveKeys(pr, (uint8_t *)sc->kdfout, sc->mk,
+                          pr->info_messagekeys));
+  uint8_t mac[16];
+  TRY(GetMac(pr, mac, ika, ikb, sc->kdfout->mac, msg + m.macced,
+             m.maccedn, sc));
+  if (omemoDriverCompare(mac, msg + m.mac, pr->macsize))
+    return OMEMO_ECORRUPT;
+  omemoCoreStat(pr, aes);
+  TRY(omemoCoreAesDecrypt(pr, sc->kdfout->cipher, encn, sc->kdfout->iv,
+                          msg + m.ciphertext, sc->payload));
+  uint8_t pad = sc->payload[encn - 1];
+  if (pad > 16 || pad > encn || encn - pad > *keyn)
+    return OMEMO_ECORRUPT;
+  memcpy(key, sc->payload, encn - pad);
+  *keyn = encn - pad;
+  return 0;
+}
+
+#undef GetPad
+#undef TRACEV
+#undef TRACE
+
+/*************************** SERIALIZATION ***************************/
+
+size_t omemoCoreGetSerializedStoreSize(const omemoCoreStore *store) {
+  size_t sum = 34 * 7 + (2 + 64) * 2 + 1 * 4 +
+               GetVarIntSize(store->init) +
+               GetVarIntSize(store->cursignedprekey.id) +
+               GetVarIntSize(store->prevsignedprekey.id) +
+               GetVarIntSize(store->pkcounter);
+  for (int i = 0; i < OMEMO_NUMPREKEYS; i++)
+    sum += 2 + 1 + GetVarIntSize(store->prekeys[i].id) + 2 * 34;
+  return sum;
+}
+
+void omemoCoreSerializeStore(uint8_t *p, const omemoCoreStore *store) {
+  uint8_t *d = p;
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 1, store->init);
+  d = omemoCoreFormatKey(d, 2, store->identity.prv);
+  d = omemoCoreFormatKey(d, 3, store->identity.pub);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 4, store->cursignedprekey.id);
+  d = omemoCoreFormatKey(d, 5, store->cursignedprekey.kp.prv);
+  d = omemoCoreFormatKey(d, 6, store->cursignedprekey.kp.pub);
+  d = omemoCoreFormatVarInt(d, PB_LEN, 7, 64);
+  d = (memcpy(d, store->cursignedprekey.sig, 64), d + 64);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 8, store->prevsignedprekey.id);
+  d = omemoCoreFormatKey(d, 9, store->prevsignedprekey.kp.prv);
+  d = omemoCoreFormatKey(d, 10, store->prevsignedprekey.kp.pub);
+  d = omemoCoreFormatVarInt(d, PB_LEN, 11, 64);
+  d = (memcpy(d, store->prevsignedprekey.sig, 64), d + 64);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 12, store->pkcounter);
+  for (int i = 0; i < OMEMO_NUMPREKEYS; i++) {
+    const struct omemoPreKey *pk = store->prekeys + i;
+    d = omemoCoreFormatVarInt(d, PB_LEN, 13,
+                              1 + GetVarIntSize(pk->id) + 2 * 34);
+    d = omemoCoreFormatVarInt(d, PB_UINT32, 1, pk->id);
+    d = omemoCoreFormatKey(d, 2, pk->kp.prv);
+    d = omemoCoreFormatKey(d, 3, pk->kp.pub);
+  }
+  d = omemoCoreFormatKey(d, 14, store->identityalt);
+  assert(d - p == omemoCoreGetSerializedStoreSize(store));
+}
+
+// identityalt is left zero when p does not have it, stores serialized
+// by older versions don't.
+int omemoCoreDeserializeStore(const uint8_t *p, size_t n,
+                              omemoCoreStore *store) {
+  struct ProtobufField fields[] = {
+      [1] = {PB_REQUIRED | PB_UINT32},
+      [2] = {PB_REQUIRED | PB_LEN, 32},
+      [3] = {PB_REQUIRED | PB_LEN, 32},
+      [4] = {PB_REQUIRED | PB_UINT32},
+      [5] = {PB_REQUIRED | PB_LEN, 32},
+      [6] = {PB_REQUIRED | PB_LEN, 32},
+      [7] = {PB_REQUIRED | PB_LEN, 64},
+      [8] = {PB_REQUIRED | PB_UINT32},
+      [9] = {PB_REQUIRED | PB_LEN, 32},
+      [10] = {PB_REQUIRED | PB_LEN, 32},
+      [11] = {PB_REQUIRED | PB_LEN, 64},
+      [12] = {PB_REQUIRED | PB_UINT32},
+      [13] = {/*PB_REQUIRED |*/ PB_LEN},
+      [14] = {PB_LEN, 32},
+  };
+  if (omemoCoreParseProtobuf(p, n, fields, 15))
+    return OMEMO_EPROTOBUF;
+  store->init = fields[1].v;
+  memcpy(store->identity.prv, fields[2].p, 32);
+  memcpy(store->identity.pub, fields[3].p, 32);
+  store->cursignedprekey.id = fields[4].v;
+  memcpy(store->cursignedprekey.kp.prv, fields[5].p, 32);
+  memcpy(store->cursignedprekey.kp.pub, fields[6].p, 32);
+  memcpy(store->cursignedprekey.sig, fields[7].p, 64);
+  store->prevsignedprekey.id = fields[8].v;
+  memcpy(store->prevsignedprekey.kp.prv, fields[9].p, 32);
+  memcpy(store->prevsignedprekey.kp.pub, fields[10].p, 32);
+  memcpy(store->prevsignedprekey.sig, fields[11].p, 64);
+  store->pkcounter = fields[12].v;
+  memcpy(store->identityalt, fields[14].p ? fields[14].p : ZeroKey, 32);
+  const uint8_t *e = p + n;
+  int i = 0;
+  while (i < OMEMO_NUMPREKEYS &&
+         !omemoCoreParseRepeatingField(p, e, &fields[13], 13) &&
+         fields[13].p) {
+    struct ProtobufField innerfields[] = {
+        [1] = {PB_REQUIRED | PB_UINT32},
+        [2] = {PB_REQUIRED | PB_LEN, 32},
+        [3] = {PB_REQUIRED | PB_LEN, 32},
+    };
+    if (omemoCoreParseProtobuf(fields[13].p, fields[13].v, innerfields,
+                               4))
+      return OMEMO_EPROTOBUF;
+    store->prekeys[i].id = innerfields[1].v;
+    memcpy(store->prekeys[i].kp.prv, innerfields[2].p, 32);
+    memcpy(store->prekeys[i].kp.pub, innerfields[3].p, 32);
+    i++;
+    p = fields[13].p + fields[13].v;
+    fields[13].v = 0, fields[13].p = NULL;
+  }
+  return 0;
+}
+
+size_t omemoCoreGetSerializedSessionSize(const omemoCoreSession *session) {
+  return 34 * 9 // Key
+         + 1 * 6 + GetVarIntSize(session->state.ns) +
+         GetVarIntSize(session->state.nr) +
+         GetVarIntSize(session->state.pn) +
+         GetVarIntSize(session->usedpk_id) +
+         GetVarIntSize(session->usedspk_id) +
+         GetVarIntSize(session->init) +
+         (memcmp(session->remoteidentityalt, ZeroKey, 32) ? 35 : 0);
+}
+
+void omemoCoreSerializeSession(uint8_t *p,
+                               const omemoCoreSession *session) {
+  uint8_t *d = p;
+  d = omemoCoreFormatKey(d, 1, session->remoteidentity);
+  d = omemoCoreFormatKey(d, 2, session->state.dhs.prv);
+  d = omemoCoreFormatKey(d, 3, session->state.dhs.pub);
+  d = omemoCoreFormatKey(d, 4, session->state.dhr);
+  d = omemoCoreFormatKey(d, 5, session->state.rk);
+  d = omemoCoreFormatKey(d, 6, session->state.cks);
+  d = omemoCoreFormatKey(d, 7, session->state.ckr);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 8, session->state.ns);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 9, session->state.nr);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 10, session->state.pn);
+  // TODO: don't have to include used* after first ratchet
+  d = omemoCoreFormatKey(d, 11, session->usedek);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 12, session->usedpk_id);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 13, session->usedspk_id);
+  d = omemoCoreFormatVarInt(d, PB_UINT32, 14, session->init);
+  d = omemoCoreFormatKey(d, 15, session->identity);
+  if (memcmp(session->remoteidentityalt, ZeroKey, 32))
+    d = omemoCoreFormatKey(d, 16, session->remoteidentityalt);
+  assert(d - p == omemoCoreGetSerializedSessionSize(session));
+}
+
+int omemoCoreDeserializeSession(const uint8_t *p, size_t n,
+                                omemoCoreSession *session) {
+  struct ProtobufField fields[] = {
+      [1] = {PB_REQUIRED | PB_LEN, 32},
+      [2] = {PB_REQUIRED | PB_LEN, 32},
+      [3] = {PB_REQUIRED | PB_LEN, 32},
+      [4] = {PB_REQUIRED | PB_LEN, 32},
+      [5] = {PB_REQUIRED | PB_LEN, 32},
+      [6] = {PB_REQUIRED | PB_LEN, 32},
+      [7] = {PB_REQUIRED | PB_LEN, 32},
+      [8] = {PB_REQUIRED | PB_UINT32},
+      [9] = {PB_REQUIRED | PB_UINT32},
+      [10] = {PB_REQUIRED | PB_UINT32},
+      [11] = {PB_REQUIRED | PB_LEN, 32},
+      [12] = {PB_REQUIRED | PB_UINT32},
+      [13] = {PB_REQUIRED | PB_UINT32},
+      [14] = {PB_REQUIRED | PB_UINT32},
+      [15] = {PB_REQUIRED | PB_LEN, 32},
+      [16] = {PB_LEN, 32},
+  };
+  if (omemoCoreParseProtobuf(p, n, fields, 17))
+    return OMEMO_EPROTOBUF;
+  memcpy(session->remoteidentity, fields[1].p, 32);
+  memcpy(session->state.dhs.prv, fields[2].p, 32);
+  memcpy(session->state.dhs.pub, fields[3].p, 32);
+  memcpy(session->state.dhr, fields[4].p, 32);
+  memcpy(session->state.rk, fields[5].p, 32);
+  memcpy(session->state.cks, fields[6].p, 32);
+  memcpy(session->state.ckr, fields[7].p, 32);
+  session->state.ns = fields[8].v;
+  session->state.nr = fields[9].v;
+  session->state.pn = fields[10].v;
+  memcpy(session->usedek, fields[11].p, 32);
+  session->usedpk_id = fields[12].v;
+  session->usedspk_id = fields[13].v;
+  session->init = fields[14].v;
+  memcpy(session->identity, fields[15].p, 32);
+  memcpy(session->remoteidentityalt,
+         fields[16].p ? fields[16].p : ZeroKey, 32);
+  return 0;
+}
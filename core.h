@@ -0,0 +1,323 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// The code that is the same for OMEMO 0.3 and OMEMO 2 apart from the
+// constants in struct omemoCoreProtocol: the wire format, the Double
+// Ratchet, the serialization of stores and sessions and the state the
+// API calls keep between calls. Both versions call the one copy in
+// o/core.o, which reads the constants at runtime. With
+// -DOMEMO_INLINECORE omemo.c includes core.c instead, so a single-file
+// build gets its own copy with the constants folded in, see INLINECORE
+// in the Makefile.
+
+#ifndef OMEMO_CORE_H_
+#define OMEMO_CORE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "omemo.h"
+
+#ifdef CORESTATIC
+#define CORE    static
+#define COREVAR static
+#else
+// Shared by omemo0.o and omemo2.o, but not exported from the library.
+#define CORE    __attribute__((visibility("hidden")))
+#define COREVAR extern CORE
+#endif
+
+// The structs of omemo.h under names that the generated files keep.
+// The layout is the same in both versions, the wrappers pass their own
+// structs as these.
+typedef struct omemoKeyPair omemoCoreKeyPair;
+typedef struct omemoMessageKey omemoCoreMessageKey;
+typedef struct omemoState omemoCoreState;
+typedef struct omemoStore omemoCoreStore;
+typedef struct omemoSession omemoCoreSession;
+typedef struct omemoInternalDerivedKeys omemoCoreDerivedKeys;
+
+enum {
+  SESSION_UNINIT = 0,
+  SESSION_INIT,
+  SESSION_READY,
+  SESSION_HEARTBEAT,
+};
+
+// Protobuf: https://protobuf.dev/programming-guides/encoding/
+
+// Only supports uint32 and len prefixed.
+struct ProtobufField {
+  int type;         // PB_*
+  uint32_t v;       // destination varint or LEN
+  const uint8_t *p; // LEN element data pointer or NULL
+};
+
+#define PB_REQUIRED (1 << 3)
+#define PB_UINT32   0
+#define PB_LEN      2
+
+// What differs between the versions in the key messages.
+struct omemoCoreProtocol {
+  // OMEMO 2 wraps the message and its MAC in OMEMOAuthenticatedMessage,
+  // 0.3 starts the messages with a version byte and appends the MAC.
+  bool v2;
+  // Size of a serialized public key and of the truncated MAC.
+  uint8_t serlen, macsize;
+  // Field numbers of (Whisper)Message and of the prekey message
+  // (PreKeyWhisperMessage or OMEMOKeyExchange).
+  uint8_t msg_n, msg_pn, msg_dh_pub, msg_ciphertext;
+  uint8_t keyex_pk_id, keyex_spk_id, keyex_ik, keyex_ek, keyex_message;
+  // The HKDF infos, OMEMO 0.3 has no info_payload.
+  const char *info_keyexchange, *info_rootchain, *info_messagekeys,
+      *info_payload;
+  // OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE and
+  // OMEMO_INTERNAL_FULLMSG_MAXSIZE of the version.
+  uint8_t maxpayload;
+  uint16_t maxfullmsg;
+  // Whether the version counts the primitives in omemoStats.
+  bool stats;
+  // omemoRandom, omemoLoadMessageKey and omemoStoreMessageKey of the
+  // version.
+  int (*random)(void *p, size_t n);
+  int (*loadmessagekey)(omemoCoreSession *s, omemoCoreMessageKey *k);
+  int (*storemessagekey)(omemoCoreSession *s,
+                         const omemoCoreMessageKey *k, uint64_t n);
+  // Calls a hook of omemoSetTraceHooks with the session type of the
+  // version.
+  void (*trace)(void (*hook)(void), int op, void *session);
+};
+
+// What the API calls of a version keep between calls. The pointers
+// are to the types of the version.
+struct omemoCoreRuntime {
+  void (*tracebegin)(void), (*traceend)(void);
+  void *sigcache;
+  struct omemoStats stats;
+};
+
+// The same for the API calls on one thread.
+struct omemoCoreThread {
+  // Set with omemoSetContext, aes and hmac are copied from it.
+  void *context;
+  struct omemoDriverAes *aes;
+  struct omemoDriverHmac *hmac;
+  // Session of the API call, for the trace hooks.
+  void *session;
+};
+
+// Temporaries of the ratchet, they point into the omemoScratch of the
+// version or onto the stack of its wrapper.
+struct omemoCoreScratch {
+  uint8_t *macinput, *payload, *mk, *dh, *masterkey;
+  omemoCoreDerivedKeys *kdfout;
+};
+
+// Indexed by omemoCoreProtocol.v2.
+COREVAR struct omemoCoreRuntime omemoCoreRuntimes[2];
+COREVAR __thread struct omemoCoreThread omemoCoreThreads[2];
+
+// Offsets of the parts of a key message without prekey header.
+struct omemoCoreMessage {
+  uint32_t n, pn;
+  size_t dh;                  // raw ratchet public key
+  size_t ciphertext, ciphertextn;
+  size_t mac;                 // truncated MAC
+  size_t macced, maccedn;     // what the MAC is calculated over
+};
+
+// Offsets of the parts of a prekey message.
+struct omemoCoreKeyExchange {
+  uint32_t pk_id, spk_id;
+  size_t ik, ek;              // raw public keys
+  size_t message, messagen;   // the key message it carries
+};
+
+/**
+ * Get the size of a properly formatted varint in bytes.
+ */
+static inline int GetVarIntSize(uint32_t v) {
+  return 1 + (v > 0x7f) + (v > 0x3fff) + (v > 0x1fffff) +
+         (v > 0xfffffff);
+}
+
+static inline struct omemoCoreRuntime *
+omemoCoreGetRuntime(const struct omemoCoreProtocol *pr) {
+  return omemoCoreRuntimes + pr->v2;
+}
+
+static inline struct omemoCoreThread *
+omemoCoreGetThread(const struct omemoCoreProtocol *pr) {
+  return omemoCoreThreads + pr->v2;
+}
+
+static inline void omemoCoreTraceBegin(const struct omemoCoreProtocol *pr,
+                                       int op) {
+  struct omemoCoreRuntime *rt = omemoCoreGetRuntime(pr);
+  if (rt->tracebegin)
+    pr->trace(rt->tracebegin, op, omemoCoreGetThread(pr)->session);
+}
+
+static inline void omemoCoreTraceEnd(const struct omemoCoreProtocol *pr,
+                                     int op) {
+  struct omemoCoreRuntime *rt = omemoCoreGetRuntime(pr);
+  if (rt->traceend)
+    pr->trace(rt->traceend, op, omemoCoreGetThread(pr)->session);
+}
+
+#define omemoCoreStat(pr, name)                                        \
+  ((pr)->stats ? (void)__atomic_fetch_add(                             \
+                     &omemoCoreGetRuntime(pr)->stats.name, 1,          \
+                     __ATOMIC_RELAXED)                                 \
+               : (void)0)
+
+static inline const uint8_t *
+omemoCoreGetRawKey(const struct omemoCoreProtocol *pr, const uint8_t *k) {
+  return k + pr->serlen - 32;
+}
+
+CORE void omemoCoreSerializeKey(const struct omemoCoreProtocol *pr,
+                                uint8_t *d, const omemoKey pub);
+CORE bool omemoCoreParseProtobuf(const uint8_t *s, size_t n,
+                                 struct ProtobufField *fields,
+                                 int nfields);
+CORE bool omemoCoreParseRepeatingField(const uint8_t *s,
+                                       const uint8_t *e,
+                                       struct ProtobufField *field,
+                                       int fieldid);
+CORE uint8_t *omemoCoreFormatVarInt(uint8_t d[static 6], int type, int id,
+                                    uint32_t v);
+CORE uint8_t *omemoCoreFormatKey(uint8_t d[static 34], int id,
+                                 const omemoKey k);
+CORE size_t omemoCoreGetMessageSize(const struct omemoCoreProtocol *pr,
+                                    uint32_t n, uint32_t pn,
+                                    size_t encn);
+CORE size_t
+omemoCoreGetPreKeyHeaderSize(const struct omemoCoreProtocol *pr,
+                             uint32_t pk_id, uint32_t spk_id,
+                             size_t msgsz);
+CORE size_t omemoCoreFormatPreKeyMessage(
+    const struct omemoCoreProtocol *pr, uint8_t *d, uint32_t pk_id,
+    uint32_t spk_id, const omemoKey ik, const omemoKey ek,
+    uint32_t msgsz);
+CORE size_t
+omemoCoreFormatMessageHeader(const struct omemoCoreProtocol *pr,
+                             uint8_t *d, uint32_t n, uint32_t pn,
+                             const omemoKey dhs, size_t keyn);
+CORE size_t omemoCoreFormatMessage(const struct omemoCoreProtocol *pr,
+                                   struct omemoCoreMessage *m, uint8_t *d,
+                                   uint32_t n, uint32_t pn,
+                                   const omemoKey dhs, size_t encn);
+CORE int omemoCoreParseMessage(const struct omemoCoreProtocol *pr,
+                               struct omemoCoreMessage *m,
+                               const uint8_t *msg, size_t msgn);
+CORE int omemoCoreParseKeyExchange(const struct omemoCoreProtocol *pr,
+                                   struct omemoCoreKeyExchange *kx,
+                                   const uint8_t *msg, size_t msgn);
+
+// The primitives through the trace hooks and the driver objects of the
+// context of this thread, if any.
+
+CORE int omemoCoreHmac(const struct omemoCoreProtocol *pr,
+                       const omemoKey k, const uint8_t *in, size_t n,
+                       uint8_t out[static 32]);
+CORE int omemoCoreHkdf(const struct omemoCoreProtocol *pr,
+                       const uint8_t *salt, size_t saltn,
+                       const uint8_t *key, size_t keyn,
+                       const uint8_t *info, size_t infon, uint8_t *out,
+                       size_t outn);
+CORE int omemoCoreAesEncrypt(const struct omemoCoreProtocol *pr,
+                             omemoKey k, size_t n, uint8_t iv[static 16],
+                             const uint8_t *s, uint8_t *d);
+CORE int omemoCoreAesDecrypt(const struct omemoCoreProtocol *pr,
+                             omemoKey k, size_t n, uint8_t iv[static 16],
+                             const uint8_t *s, uint8_t *d);
+CORE int omemoCoreAesCbcHmac(const struct omemoCoreProtocol *pr,
+                             const omemoKey k, const omemoKey mk,
+                             bool enc, size_t n, uint8_t iv[static 16],
+                             const uint8_t *s, uint8_t *d,
+                             uint8_t mac[static 32]);
+CORE int omemoCoreGcmEncrypt(const struct omemoCoreProtocol *pr,
+                             uint8_t *d, const uint8_t key[static 16],
+                             size_t n, const uint8_t iv[static 12],
+                             uint8_t tag[static 16], const uint8_t *s);
+CORE int omemoCoreGcmDecrypt(const struct omemoCoreProtocol *pr,
+                             uint8_t *d, const uint8_t key[static 16],
+                             size_t n, const uint8_t iv[static 12],
+                             const uint8_t *tag, size_t tagn,
+                             const uint8_t *s);
+
+// The KDFs of X3DH and the Double Ratchet.
+
+CORE int omemoCoreKdfCk(const struct omemoCoreProtocol *pr, omemoKey d,
+                        omemoKey mk, const omemoKey ck);
+CORE int omemoCoreKdfRk(const struct omemoCoreProtocol *pr, omemoKey rk,
+                        omemoKey ck, const omemoKey dh,
+                        uint8_t masterkey[static 64]);
+CORE int omemoCoreKdfSharedSecret(const struct omemoCoreProtocol *pr,
+                                  omemoKey sk,
+                                  const uint8_t secret[static 32 * 5]);
+CORE int omemoCoreDeriveKeys(const struct omemoCoreProtocol *pr,
+                             uint8_t out[static 80], const omemoKey secret,
+                             const char *info);
+CORE int omemoCoreGetMac(const struct omemoCoreProtocol *pr, uint8_t *d,
+                         const omemoKey ika, const omemoKey ikb,
+                         const omemoKey mk, const uint8_t *msg,
+                         size_t msgn, uint8_t *macinput);
+
+// The Double Ratchet.
+
+CORE int omemoCoreX25519(const struct omemoCoreProtocol *pr,
+                         omemoKey shared, const omemoKey prv,
+                         const omemoKey pub);
+CORE int omemoCoreGenerateKeyPair(const struct omemoCoreProtocol *pr,
+                                  omemoCoreKeyPair *kp);
+CORE int omemoCoreDeriveRootKey(const struct omemoCoreProtocol *pr,
+                                omemoCoreState *state, omemoKey ck,
+                                const struct omemoCoreScratch *sc);
+CORE size_t
+omemoCoreGetKeyMessageSize(const struct omemoCoreProtocol *pr,
+                           const omemoCoreSession *session, size_t keyn);
+CORE int omemoCoreEncryptKey(const struct omemoCoreProtocol *pr,
+                             omemoCoreSession *session, uint8_t *d,
+                             size_t *dn, bool *isprekey,
+                             const uint8_t *key, size_t keyn,
+                             const struct omemoCoreScratch *sc);
+CORE int omemoCoreDecryptKey(const struct omemoCoreProtocol *pr,
+                             omemoCoreSession *session,
+                             omemoCoreState *state, const omemoKey ika,
+                             const omemoKey ikb, uint8_t *key,
+                             size_t *keyn, const uint8_t *msg,
+                             size_t msgn,
+                             const struct omemoCoreScratch *sc);
+
+// Serialization of stores and sessions, the same in both versions.
+
+CORE size_t omemoCoreGetSerializedStoreSize(const omemoCoreStore *store);
+CORE void omemoCoreSerializeStore(uint8_t *p, const omemoCoreStore *store);
+CORE int omemoCoreDeserializeStore(const uint8_t *p, size_t n,
+                                   omemoCoreStore *store);
+CORE size_t
+omemoCoreGetSerializedSessionSize(const omemoCoreSession *session);
+CORE void omemoCoreSerializeSession(uint8_t *p,
+                                    const omemoCoreSession *session);
+CORE int omemoCoreDeserializeSession(const uint8_t *p, size_t n,
+                                     omemoCoreSession *session);
+
+#endif
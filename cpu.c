@@ -0,0 +1,92 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// CPU feature detection shared by all drivers, always linked. Drivers
+// that have multiple implementations of a primitive pick one based on
+// omemoDriverGetCpuFeatures() when they are called.
+
+#include <stdint.h>
+
+#include "omemo.h"
+#include "driver.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+
+static uint32_t Detect(void) {
+  unsigned a, b, c, d, r = 0;
+  if (!__get_cpuid(1, &a, &b, &c, &d))
+    return 0;
+  // AES-NI is only used together with PCLMULQDQ and SSSE3.
+  if ((c & bit_AES) && (c & bit_PCLMUL) && (c & bit_SSSE3))
+    r |= OMEMO_CPU_AESNI;
+  if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+    return r;
+  if ((b & bit_BMI2) && (b & bit_ADX))
+    r |= OMEMO_CPU_BMI2ADX;
+  return r;
+}
+
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+
+static uint32_t Detect(void) {
+  unsigned long hwcap = getauxval(AT_HWCAP);
+  uint32_t r = 0;
+  if ((hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL))
+    r |= OMEMO_CPU_ARMCRYPTO;
+  return r;
+}
+
+#elif defined(__aarch64__)
+
+static uint32_t Detect(void) {
+  uint32_t r = 0;
+#if defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO)
+  r |= OMEMO_CPU_ARMCRYPTO;
+#endif
+  return r;
+}
+
+#else
+
+static uint32_t Detect(void) {
+  return 0;
+}
+
+#endif
+
+// features is 0 until the first call, DETECTED marks it as done so a
+// CPU without any of the features is not detected every time. Threads
+// may detect at the same time, the accesses are atomic so that is fine.
+#define DETECTED (UINT32_C(1) << 31)
+
+static uint32_t features, mask = ~UINT32_C(0);
+
+uint32_t omemoDriverGetCpuFeatures(void) {
+  uint32_t f = __atomic_load_n(&features, __ATOMIC_RELAXED);
+  if (!f) {
+    f = Detect() | DETECTED;
+    __atomic_store_n(&features, f, __ATOMIC_RELAXED);
+  }
+  return f & __atomic_load_n(&mask, __ATOMIC_RELAXED) & ~DETECTED;
+}
+
+void omemoDriverSetCpuFeatures(uint32_t m) {
+  __atomic_store_n(&mask, m, __ATOMIC_RELAXED);
+}
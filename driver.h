@@ -21,20 +21,79 @@
 
 #include "omemo.h"
 
+uint32_t omemoDriverGetCpuFeatures(void);
+void omemoDriverSetCpuFeatures(uint32_t mask);
+
+// Name of the implementation in use, provided by the driver for that
+// kind of primitive.
+const char *omemoDriverCurveImpl(void);
+const char *omemoDriverAesImpl(void);
+const char *omemoDriverHashImpl(void);
+
 int omemoDriverHmac(const omemoKey k, const uint8_t *in, size_t ilen, uint8_t out[static 32]);
+// For the AES functions d may be equal to s (but not otherwise overlap).
 int omemoDriverAesEncrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d);
 int omemoDriverAesDecrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d);
 int omemoDriverHkdf(const uint8_t *salt, size_t saltn, const uint8_t *key, size_t keyn, const uint8_t *info, size_t infon, uint8_t *out, size_t outn);
 int omemoDriverGcmEncrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s);
 int omemoDriverGcmDecrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s);
+// Use n threads for GCM of at least threshold bytes, if supported.
+void omemoDriverSetGcmThreads(int n, size_t threshold);
 int omemoDriverCompare(const void *a, const void *b, size_t n);
 
+// Reusable AES context, the key schedule is kept until the key changes.
+// Use omemoDriverAesSetKey for AES-256-CBC and omemoDriverAesSetGcmKey
+// for AES-128-GCM. CBC updates iv so calls can be chained.
+struct omemoDriverAes;
+struct omemoDriverAes *omemoDriverAesCreate(void);
+void omemoDriverAesDestroy(struct omemoDriverAes *aes);
+int omemoDriverAesSetKey(struct omemoDriverAes *aes, const omemoKey k, bool enc);
+int omemoDriverAesCbc(struct omemoDriverAes *aes, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d);
+int omemoDriverAesSetGcmKey(struct omemoDriverAes *aes, const uint8_t k[static 16]);
+int omemoDriverAesGcmEncrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s);
+int omemoDriverAesGcmDecrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s);
+
+// Streaming GCM with the key of omemoDriverAesSetGcmKey. Update can be
+// called any number of times with any n, and writes n bytes to d. When
+// decrypting, Finish returns OMEMO_ECRYPTO if the tag does not match,
+// otherwise it writes the tag.
+int omemoDriverAesGcmStart(struct omemoDriverAes *aes, const uint8_t iv[static 12], bool enc);
+int omemoDriverAesGcmUpdate(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t *s);
+int omemoDriverAesGcmFinish(struct omemoDriverAes *aes, uint8_t *tag, size_t tagn);
+
+// Incremental HMAC-SHA256, the context can be started again after
+// omemoDriverHmacFinish.
+struct omemoDriverHmac;
+struct omemoDriverHmac *omemoDriverHmacCreate(void);
+void omemoDriverHmacDestroy(struct omemoDriverHmac *hmac);
+int omemoDriverHmacStart(struct omemoDriverHmac *hmac, const omemoKey k);
+int omemoDriverHmacUpdate(struct omemoDriverHmac *hmac, const uint8_t *in, size_t n);
+int omemoDriverHmacFinish(struct omemoDriverHmac *hmac, uint8_t out[static 32]);
+
+// AES-256-CBC with key k and HMAC-SHA256 with key mk over the ciphertext
+// in a single pass over the data. n must be a multiple of 16.
+//
+// Such passes go through the data in pieces of OMEMODRIVER_CHUNKSIZE,
+// which stay in L1 between the AES and the HMAC of a piece.
+#define OMEMODRIVER_CHUNKSIZE 4096
+int omemoDriverAesCbcHmac(const omemoKey k, const omemoKey mk, bool enc, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d, uint8_t mac[static 32]);
+
 void omemoDriverEdSignMod(omemoCurveSignature sig, omemoKey pub, omemoKey prv, uint8_t *msg, size_t msgn);
+// Signatures are checked with the cofactored equation
+// [8](SB - R - hA) = 0, the same in single and batch verification.
 bool omemoDriverEdVerify(omemoCurveSignature sig, omemoKey pub, uint8_t *msg, size_t msgn);
+// Verify n signatures at once with a random linear combination seeded by
+// seed. Returns true only if all are valid, otherwise at least one is
+// invalid and they must be checked with omemoDriverEdVerify.
+bool omemoDriverEdVerifyBatch(size_t n, omemoCurveSignature *sigs, omemoKey *pubs, uint8_t **msgs, size_t *msgns, const uint8_t seed[static 32]);
 void omemoDriverEdSeedToPubPrv(omemoKey pub, omemoKey prv, omemoKey seed);
 void omemoDriverEdPubToCvPub(omemoKey cv, omemoKey ed);
 void omemoDriverCvPrvToEdPub(omemoKey pub, omemoKey prv);
 void omemoDriverCvPubToEdPub(omemoKey ed, omemoKey cv);
+// Same as the two conversions above for n keys, sharing one field
+// inversion. The output may be the input array.
+void omemoDriverEdPubToCvPubBatch(size_t n, omemoKey *cv, omemoKey *ed);
+void omemoDriverCvPubToEdPubBatch(size_t n, omemoKey *ed, omemoKey *cv);
 void omemoDriverCvPrvToPub(omemoKey pub, omemoKey prv);
 int  omemoDriverX25519(omemoKey out, omemoKey prv, omemoKey pub);
 
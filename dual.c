@@ -0,0 +1,126 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "dual.h"
+#include "driver.h"
+
+// The plaintext is read in pieces of OMEMODRIVER_CHUNKSIZE, which are
+// still in L1 when the second version encrypts them.
+
+// The layout of d is payload0, payload2 and then the key messages.
+
+size_t omemoDualGetSize(const struct omemoDualRecipient *rcpts,
+                        size_t nrcpts, size_t n) {
+  size_t size = n + n + omemo2GetMessagePadSize(n);
+  for (size_t i = 0; i < nrcpts; i++) {
+    if (rcpts[i].session0)
+      size += omemo0GetKeyMessageSize(rcpts[i].session0, OMEMO0_KEYSIZE);
+    else if (rcpts[i].session2)
+      size += omemo2GetKeyMessageSize(rcpts[i].session2, OMEMO2_KEYSIZE);
+  }
+  return size;
+}
+
+// Both streams are freed when this returns.
+static int EncryptPayloads(struct omemoDualMessage *msg, uint8_t *d,
+                           const uint8_t *s, size_t n,
+                           uint8_t key0[OMEMO0_KEYSIZE],
+                           uint8_t key2[OMEMO2_KEYSIZE]) {
+  struct omemo0PayloadStream st0;
+  struct omemo2PayloadStream st2;
+  uint8_t *p0 = d, *p2 = d + n;
+  size_t outn, p2n = 0;
+  int r;
+  if ((r = omemo0EncryptMessageInit(&st0, msg->iv0)))
+    return r;
+  if ((r = omemo2EncryptMessageInit(&st2))) {
+    omemo0FreeMessageStream(&st0);
+    return r;
+  }
+  for (size_t i = 0; i < n; i += OMEMODRIVER_CHUNKSIZE) {
+    size_t m = n - i < OMEMODRIVER_CHUNKSIZE ? n - i : OMEMODRIVER_CHUNKSIZE;
+    if ((r = omemo0EncryptMessageUpdate(&st0, p0 + i, &outn, s + i, m)) ||
+        (r = omemo2EncryptMessageUpdate(&st2, p2 + p2n, &outn, s + i, m)))
+      goto fail;
+    p2n += outn;
+  }
+  if ((r = omemo0EncryptMessageFinal(&st0, p0 + n, &outn, key0)) ||
+      (r = omemo2EncryptMessageFinal(&st2, p2 + p2n, &outn, key2)))
+    goto fail;
+  msg->payload0 = p0;
+  msg->payload0n = n;
+  msg->payload2 = p2;
+  msg->payload2n = p2n + outn;
+  return 0;
+fail:
+  // The stream that failed is freed already, that is harmless to repeat.
+  omemo0FreeMessageStream(&st0);
+  omemo2FreeMessageStream(&st2);
+  return r;
+}
+
+// The key messages go after the payloads in d.
+static void EncryptKeys(const struct omemoDualMessage *msg,
+                        struct omemoDualRecipient *rcpts, size_t nrcpts,
+                        uint8_t *d, size_t dn,
+                        const uint8_t key0[OMEMO0_KEYSIZE],
+                        const uint8_t key2[OMEMO2_KEYSIZE]) {
+  size_t off = msg->payload0n + msg->payload2n;
+  // All OMEMO 0.3 sessions first, then all OMEMO 2 sessions, so each
+  // loop stays within one library.
+  for (int v = 0; v < 2; v++) {
+    for (size_t i = 0; i < nrcpts; i++) {
+      struct omemoDualRecipient *rc = rcpts + i;
+      size_t m = dn - off;
+      if (v == 0 && rc->session0)
+        rc->r = omemo0EncryptKeyTo(rc->session0, d + off, &m,
+                                   &rc->isprekey, key0, OMEMO0_KEYSIZE);
+      else if (v == 1 && rc->session2)
+        rc->r = omemo2EncryptKeyTo(rc->session2, d + off, &m,
+                                   &rc->isprekey, key2, OMEMO2_KEYSIZE);
+      else
+        continue;
+      rc->msg = rc->r ? NULL : d + off;
+      rc->msgn = rc->r ? 0 : m;
+      off += rc->msgn;
+    }
+  }
+}
+
+int omemoDualEncrypt(struct omemoDualMessage *msg,
+                     struct omemoDualRecipient *rcpts, size_t nrcpts,
+                     uint8_t *d, size_t dn, const uint8_t *s, size_t n) {
+  if (!msg || (!rcpts && nrcpts) || !d || (!s && n))
+    return OMEMO0_EPARAM;
+  for (size_t i = 0; i < nrcpts; i++) {
+    if (!rcpts[i].session0 == !rcpts[i].session2)
+      return OMEMO0_EPARAM;
+  }
+  if (dn < omemoDualGetSize(rcpts, nrcpts, n))
+    return OMEMO0_EPARAM;
+  uint8_t key0[OMEMO0_KEYSIZE], key2[OMEMO2_KEYSIZE];
+  int r;
+  if (!(r = EncryptPayloads(msg, d, s, n, key0, key2)))
+    EncryptKeys(msg, rcpts, nrcpts, d, dn, key0, key2);
+  // Also when the payloads failed, key0 may be written by then.
+  memset(key0, 0, sizeof(key0));
+  memset(key2, 0, sizeof(key2));
+  return r;
+}
@@ -0,0 +1,87 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Sending one message to OMEMO 0.3 and OMEMO 2 devices at once, on top
+// of omemo0.h and omemo2.h. Errors are the OMEMO0_E* codes, which are
+// the same as the OMEMO2_E* codes.
+
+#ifndef OMEMODUAL_H_
+#define OMEMODUAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "omemo0.h"
+#include "omemo2.h"
+
+#ifndef OMEMODUAL_EXPORT
+#define OMEMODUAL_EXPORT
+#endif
+
+struct omemoDualRecipient {
+  // Exactly one of them is set.
+  struct omemo0Session *session0;
+  struct omemo2Session *session2;
+  // Set by omemoDualEncrypt, msg points into the shared buffer and is
+  // NULL when r is not 0.
+  const uint8_t *msg;
+  size_t msgn;
+  bool isprekey;
+  int r;
+};
+
+struct omemoDualMessage {
+  // <payload> for eu.siacs.conversations.axolotl, payload0n is the size
+  // of the plaintext.
+  const uint8_t *payload0;
+  size_t payload0n;
+  uint8_t iv0[12];
+  // <payload> for urn:xmpp:omemo:2, padded.
+  const uint8_t *payload2;
+  size_t payload2n;
+};
+
+/**
+ * @returns the size of the buffer omemoDualEncrypt needs for a message
+ * of n bytes to the recipients
+ */
+OMEMODUAL_EXPORT size_t
+omemoDualGetSize(const struct omemoDualRecipient *rcpts, size_t nrcpts,
+                 size_t n);
+
+/**
+ * Encrypt the message s of n bytes for OMEMO 0.3 and OMEMO 2 in one pass
+ * and the keys for all recipients.
+ *
+ * Both payloads and all key messages are written to d, which must be
+ * omemoDualGetSize() bytes. The plaintext is read once, in pieces that
+ * are encrypted for both versions while they are in cache. The
+ * recipients are done per version, a failure of one does not stop the
+ * others and is only recorded in its r.
+ *
+ * @param msg (out) points into d
+ * @returns 0 or OMEMO0_E*, for the payloads and parameters
+ */
+OMEMODUAL_EXPORT int omemoDualEncrypt(struct omemoDualMessage *msg,
+                                      struct omemoDualRecipient *rcpts,
+                                      size_t nrcpts, uint8_t *d,
+                                      size_t dn, const uint8_t *s,
+                                      size_t n);
+
+#endif
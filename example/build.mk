@@ -2,7 +2,7 @@ XMPPSRCS:=example/xmpp.c example/yxml.c
 IMSRCS:=example/im.c
 
 # Always use hacl + mbedtls
-o/im: $(IMSRCS) $(XMPPSRCS) omemo.c hacl.c mbedtls.c | o/store.inc test/cacert.inc
+o/im: $(IMSRCS) $(XMPPSRCS) omemo.c core.c hacl.c mbedtls.c cpu.c | o/store.inc test/cacert.inc
 	$(CC) -o $@ $^ $(CFLAGS) -Iexample -DIM_NATIVE -lmbedtls -lmbedcrypto -lmbedx509 -lsqlite3
 
 define IM_INPUT
@@ -382,7 +382,7 @@ static bool GetRemoteId(struct xmppParser *parser) {
 static void ParseEncryptedMessage(struct xmppParser *parser, const struct xmppXmlSlice *from) {
   struct xmppXmlSlice keyslc = {0}, ivslc = {0}, payloadslc = {0};
   bool isprekey = false;
-  uint8_t *key = NULL, *iv = NULL, *payload = NULL, *decryptedpayload = NULL;
+  uint8_t *key = NULL, *iv = NULL, *payload = NULL;
   size_t keysz, ivsz, payloadsz;
   while (xmppParseElement(parser)) {
     if (!strcmp(parser->x.elem, "header")) {
@@ -427,22 +427,19 @@ static void ParseEncryptedMessage(struct xmppParser *parser, const struct xmppXm
     DecodeBase64(&iv, &ivsz, &ivslc);
     DecodeBase64(&payload, &payloadsz, &payloadslc);
     if (ivsz != 12) goto free;
-    decryptedpayload = Malloc(payloadsz+1);
-    decryptedpayload[payloadsz] = 0;
-    r = omemoDecryptMessage(decryptedpayload, decryptedkey, sizeof(decryptedkey), iv, payload, payloadsz);
+    r = omemoDecryptMessage(payload, decryptedkey, sizeof(decryptedkey), iv, payload, payloadsz);
     if (r < 0) {
       LogWarn("Message decryption error: %d", r);
       goto free;
     }
     PrintSlice(from, "[unknown]");
-    printf("🔒> %s\n", decryptedpayload);
+    printf("🔒> %.*s\n", (int)payloadsz, payload);
     fflush(stdout);
   }
 free:
   free(key);
   free(iv);
   free(payload);
-  free(decryptedpayload);
 }
 
 /**
@@ -712,12 +709,12 @@ static bool IterateClient() {
   return true;
 }
 
-static void SendNormalOmemo(const char *msg) {
+// msg is encrypted in place.
+static void SendNormalOmemo(char *msg) {
   size_t msgn = strlen(msg);
-  char *payload = Malloc(msgn);
   uint8_t iv[12];
   uint8_t encryptionkey[OMEMO_KEYSIZE];
-  int r = omemoEncryptMessage(payload, encryptionkey, iv, msg, msgn);
+  int r = omemoEncryptMessage(msg, encryptionkey, iv, msg, msgn);
   if (r < 0) {
     LogWarn("Message encryption error: %d", r);
     return;
@@ -741,12 +738,12 @@ static void SendNormalOmemo(const char *msg) {
 "<request xmlns='urn:xmpp:receipts'/><markable xmlns='urn:xmpp:chat-markers:0'/>"
       "<store xmlns='urn:xmpp:hints'/></message>",
       remotejid.localp, remotejid.domainp, RandomInt(), deviceid, encrypted.isprekey, remoteid, encrypted.n, encrypted.p, sizeof(iv), iv, msgn,
-      payload);
+      msg);
 }
 
 static void HandleCommand() {
   static char jid[3074];
-  const char *cmd = GetLine();
+  char *cmd = GetLine();
   if (!strncmp("/login ", cmd, 7)) {
     if (!xmppIsInitialized(&client)) {
       strcpy(jid, cmd+7);
@@ -550,10 +550,10 @@ static char *Itoa(char *d, char *e, int i) {
   int n = 0;
   if (i < 0)
     mult = -1;
-  while (i && n < sizeof(buf)) {
+  do {
     buf[n++] = '0' + (i % 10) * mult;
     i /= 10;
-  }
+  } while (i && n < sizeof(buf));
   if (mult == -1 && n < sizeof(buf))
     buf[n++] = '-';
   while (n-- && d < e) {
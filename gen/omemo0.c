@@ -20,6 +20,10 @@
 #include <sys/random.h>
 #endif
 
+#ifdef OMEMO0_STATS
+#include <time.h>
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -29,22 +33,70 @@
 #include "omemo0.h"
 #include "driver.h"
 
+#ifdef OMEMO0_INLINECORE
+#define CORESTATIC
+#include "core.c"
+#else
+#include "core.h"
+#endif
+
+// Calls a hook of omemo0SetTraceHooks for the core.
+static void Trace(void (*hook)(void), int op, void *session) {
+  ((omemo0TraceCallback)hook)(op, session);
+}
+
+// The callbacks of the user for the core, it adds the hooks.
+static int CoreLoadMessageKey(omemoCoreSession *s,
+                              omemoCoreMessageKey *k) {
+  return omemo0LoadMessageKey((struct omemo0Session *)s,
+                             (struct omemo0MessageKey *)k);
+}
+
+static int CoreStoreMessageKey(omemoCoreSession *s,
+                               const omemoCoreMessageKey *k, uint64_t n) {
+  return omemo0StoreMessageKey((struct omemo0Session *)s,
+                              (const struct omemo0MessageKey *)k, n);
+}
+
+_Static_assert(sizeof(struct omemo0Store) == sizeof(omemoCoreStore),
+               "store layout differs from the core");
+_Static_assert(sizeof(struct omemo0Session) == sizeof(omemoCoreSession),
+               "session layout differs from the core");
 
+#ifdef OMEMO0_STATS
+#define COUNTSTATS true
+#else
+#define COUNTSTATS false
+#endif
 
-#define HkdfInfoKeyExchange "WhisperText"
-#define HkdfInfoRootChain   "WhisperRatchet"
-#define HkdfInfoMessageKeys "WhisperMessageKeys"
 
-#define PbMsg_n          2
-#define PbMsg_pn         3
-#define PbMsg_dh_pub     1
-#define PbMsg_ciphertext 4
 
-#define PbKeyEx_pk_id   1
-#define PbKeyEx_spk_id  6
-#define PbKeyEx_ik      3
-#define PbKeyEx_ek      2
-#define PbKeyEx_message 4
+#define MACSIZE 8
+
+static const struct omemoCoreProtocol Protocol = {
+    .v2 = false,
+    .serlen = sizeof(omemo0SerializedKey),
+    .macsize = MACSIZE,
+    .msg_n = 2,
+    .msg_pn = 3,
+    .msg_dh_pub = 1,
+    .msg_ciphertext = 4,
+    .keyex_pk_id = 1,
+    .keyex_spk_id = 6,
+    .keyex_ik = 3,
+    .keyex_ek = 2,
+    .keyex_message = 4,
+    .info_keyexchange = "WhisperText",
+    .info_rootchain = "WhisperRatchet",
+    .info_messagekeys = "WhisperMessageKeys",
+    .maxpayload = OMEMO0_INTERNAL_PAYLOAD_MAXPADDEDSIZE,
+    .maxfullmsg = OMEMO0_INTERNAL_FULLMSG_MAXSIZE,
+    .stats = COUNTSTATS,
+    .trace = Trace,
+    .random = omemo0Random,
+    .loadmessagekey = CoreLoadMessageKey,
+    .storemessagekey = CoreStoreMessageKey,
+};
 
 
 #define TRY(expr)                                                      \
@@ -60,15 +112,10 @@
     assert(_r_);                                                       \
   } while (0)
 
-enum {
-  SESSION_UNINIT = 0,
-  SESSION_INIT,
-  SESSION_READY,
-  SESSION_HEARTBEAT,
-};
-
 #define SerLen sizeof(omemo0SerializedKey)
 
+static const uint8_t Zero32[32];
+
 static omemo0LoadMessageKeyCallback  g_lmkcb;
 static omemo0StoreMessageKeyCallback g_smkcb;
 static omemo0RandomCallback          g_rndcb;
@@ -104,216 +151,297 @@ void omemo0SetCallbacks(omemo0LoadMessageKeyCallback lmk,
   g_rndcb = rnd;
 }
 
-void omemo0SerializeKey(omemo0SerializedKey k,
-                                    const omemo0Key pub) {
+// The state between the API calls is in the core, see
+// omemoCoreRuntime.
 
-  k[0] = 5;
-  memcpy(k + 1, pub, SerLen - 1);
+static inline struct omemoCoreRuntime *Runtime(void) {
+  return omemoCoreGetRuntime(&Protocol);
 }
 
-static inline const uint8_t *GetRawKey(const omemo0SerializedKey k) {
+static inline struct omemoCoreThread *Thread(void) {
+  return omemoCoreGetThread(&Protocol);
+}
 
-  return k + 1;
+// Context of the API calls on this thread, see omemo0SetContext.
+static inline struct omemo0Context *GetContext(void) {
+  return Thread()->context;
 }
 
-/***************************** PROTOBUF ******************************/
+int omemo0SetupContext(struct omemo0Context *ctx) {
+  if (!ctx)
+    return OMEMO0_EPARAM;
+  memset(ctx, 0, sizeof(struct omemo0Context));
+  if (!(ctx->aes = omemoDriverAesCreate()) ||
+      !(ctx->hmac = omemoDriverHmacCreate())) {
+    omemo0FreeContext(ctx);
+    return OMEMO0_ECRYPTO;
+  }
+  return 0;
+}
+
+void omemo0FreeContext(struct omemo0Context *ctx) {
+  if (ctx) {
+    if (GetContext() == ctx)
+      omemo0SetContext(NULL);
+    omemoDriverAesDestroy(ctx->aes);
+    omemoDriverHmacDestroy(ctx->hmac);
+    memset(ctx, 0, sizeof(struct omemo0Context));
+  }
+}
 
-// Protobuf: https://protobuf.dev/programming-guides/encoding/
+void omemo0SetContext(struct omemo0Context *ctx) {
+  struct omemoCoreThread *t = Thread();
+  t->context = ctx;
+  t->aes = ctx ? ctx->aes : NULL;
+  t->hmac = ctx ? ctx->hmac : NULL;
+}
+
+void omemo0SetTraceHooks(omemo0TraceCallback begin, omemo0TraceCallback end) {
+  Runtime()->tracebegin = (void (*)(void))begin;
+  Runtime()->traceend = (void (*)(void))end;
+}
+
+static void EndTraceSession(void **prev) {
+  Thread()->session = *prev;
+}
 
-// Only supports uint32 and len prefixed.
-struct ProtobufField {
-  int type;         // PB_*
-  uint32_t v;       // destination varint or LEN
-  const uint8_t *p; // LEN element data pointer or NULL
+// Reports session to the hooks until the function returns.
+#define TRACESESSION(session)                                          \
+  void *_ts_ __attribute__((cleanup(EndTraceSession))) =               \
+      Thread()->session;                                               \
+  Thread()->session = session
+
+#define TRACE(op, call)                                                \
+  ({                                                                   \
+    omemoCoreTraceBegin(&Protocol, op);                                \
+    __typeof__(call) _tr_ = call;                                      \
+    omemoCoreTraceEnd(&Protocol, op);                                  \
+    _tr_;                                                              \
+  })
+
+#define TRACEV(op, call)                                               \
+  (omemoCoreTraceBegin(&Protocol, op), call,                           \
+   omemoCoreTraceEnd(&Protocol, op))
+
+// Every call below goes through the hooks, a macro is not expanded
+// again inside its own expansion. The one-shot primitives go through
+// the core, which also uses the context.
+#define omemo0LoadMessageKey(...)                                       \
+  TRACE(OMEMO0_TRACE_LOADMESSAGEKEY, omemo0LoadMessageKey(__VA_ARGS__))
+#define omemo0StoreMessageKey(...)                                      \
+  TRACE(OMEMO0_TRACE_STOREMESSAGEKEY, omemo0StoreMessageKey(__VA_ARGS__))
+#define omemo0Random(...) TRACE(OMEMO0_TRACE_RANDOM, omemo0Random(__VA_ARGS__))
+#define omemoDriverX25519(...)                                         \
+  TRACE(OMEMO0_TRACE_X25519, omemoDriverX25519(__VA_ARGS__))
+#define omemoDriverCvPrvToPub(...)                                     \
+  TRACEV(OMEMO0_TRACE_CVPRVTOPUB, omemoDriverCvPrvToPub(__VA_ARGS__))
+#define omemoDriverCvPrvToEdPub(...)                                   \
+  TRACEV(OMEMO0_TRACE_CVPRVTOEDPUB, omemoDriverCvPrvToEdPub(__VA_ARGS__))
+#define omemoDriverCvPubToEdPub(...)                                   \
+  TRACEV(OMEMO0_TRACE_CVPUBTOEDPUB, omemoDriverCvPubToEdPub(__VA_ARGS__))
+#define omemoDriverEdPubToCvPub(...)                                   \
+  TRACEV(OMEMO0_TRACE_EDPUBTOCVPUB, omemoDriverEdPubToCvPub(__VA_ARGS__))
+#define omemoDriverCvPubToEdPubBatch(...)                              \
+  TRACEV(OMEMO0_TRACE_CVPUBTOEDPUBBATCH,                                \
+         omemoDriverCvPubToEdPubBatch(__VA_ARGS__))
+#define omemoDriverEdPubToCvPubBatch(...)                              \
+  TRACEV(OMEMO0_TRACE_EDPUBTOCVPUBBATCH,                                \
+         omemoDriverEdPubToCvPubBatch(__VA_ARGS__))
+#define omemoDriverEdSeedToPubPrv(...)                                 \
+  TRACEV(OMEMO0_TRACE_EDSEEDTOPUBPRV, omemoDriverEdSeedToPubPrv(__VA_ARGS__))
+#define omemoDriverEdSignMod(...)                                      \
+  TRACEV(OMEMO0_TRACE_EDSIGN, omemoDriverEdSignMod(__VA_ARGS__))
+#define omemoDriverEdVerify(...)                                       \
+  TRACE(OMEMO0_TRACE_EDVERIFY, omemoDriverEdVerify(__VA_ARGS__))
+#define omemoDriverEdVerifyBatch(...)                                  \
+  TRACE(OMEMO0_TRACE_EDVERIFYBATCH, omemoDriverEdVerifyBatch(__VA_ARGS__))
+#define omemoDriverHmac(...) omemoCoreHmac(&Protocol, __VA_ARGS__)
+#define omemoDriverHkdf(...) omemoCoreHkdf(&Protocol, __VA_ARGS__)
+#define omemoDriverAesEncrypt(...)                                     \
+  omemoCoreAesEncrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesDecrypt(...)                                     \
+  omemoCoreAesDecrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesCbcHmac(...)                                     \
+  omemoCoreAesCbcHmac(&Protocol, __VA_ARGS__)
+#define omemoDriverGcmEncrypt(...)                                     \
+  omemoCoreGcmEncrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverGcmDecrypt(...)                                     \
+  omemoCoreGcmDecrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesSetKey(...)                                      \
+  TRACE(OMEMO0_TRACE_AESSETKEY, omemoDriverAesSetKey(__VA_ARGS__))
+#define omemoDriverAesSetGcmKey(...)                                   \
+  TRACE(OMEMO0_TRACE_AESSETKEY, omemoDriverAesSetGcmKey(__VA_ARGS__))
+#define omemoDriverAesCbc(...)                                         \
+  TRACE(OMEMO0_TRACE_AESCBC, omemoDriverAesCbc(__VA_ARGS__))
+#define omemoDriverAesGcmStart(...)                                    \
+  TRACE(OMEMO0_TRACE_AESGCMSTART, omemoDriverAesGcmStart(__VA_ARGS__))
+#define omemoDriverAesGcmUpdate(...)                                   \
+  TRACE(OMEMO0_TRACE_AESGCMUPDATE, omemoDriverAesGcmUpdate(__VA_ARGS__))
+#define omemoDriverAesGcmFinish(...)                                   \
+  TRACE(OMEMO0_TRACE_AESGCMFINISH, omemoDriverAesGcmFinish(__VA_ARGS__))
+#define omemoDriverHmacStart(...)                                      \
+  TRACE(OMEMO0_TRACE_HMACSTART, omemoDriverHmacStart(__VA_ARGS__))
+#define omemoDriverHmacUpdate(...)                                     \
+  TRACE(OMEMO0_TRACE_HMACUPDATE, omemoDriverHmacUpdate(__VA_ARGS__))
+#define omemoDriverHmacFinish(...)                                     \
+  TRACE(OMEMO0_TRACE_HMACFINISH, omemoDriverHmacFinish(__VA_ARGS__))
+
+uint32_t omemo0GetCpuFeatures(void) {
+  return omemoDriverGetCpuFeatures();
+}
+
+void omemo0SetCpuFeatures(uint32_t mask) {
+  omemoDriverSetCpuFeatures(mask);
+}
+
+void omemo0SetGcmThreads(int n, size_t threshold) {
+  omemoDriverSetGcmThreads(n, threshold);
+}
+
+#define STAT(name) omemoCoreStat(&Protocol, name)
+
+#ifdef OMEMO0_STATS
+
+static uint64_t StatNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct StatTimer {
+  int api;
+  uint64_t start;
 };
 
-#define PB_REQUIRED (1 << 3)
-#define PB_UINT32   0
-#define PB_LEN      2
+static void StopStatTimer(struct StatTimer *t) {
+  uint64_t ns = StatNow() - t->start;
+  int i = ns ? 63 - __builtin_clzll(ns) : 0;
+  if (i >= OMEMO0_STAT_NUMBUCKETS)
+    i = OMEMO0_STAT_NUMBUCKETS - 1;
+  __atomic_fetch_add(&Runtime()->stats.latency[t->api][i], 1,
+                     __ATOMIC_RELAXED);
+}
 
-/**
- * Parse Protobuf varint.
- *
- * Only supports uint32, higher bits are skipped so it will neither
- * overflow nor clamp to UINT32_MAX.
- *
- * @param s points to the location of the varint in the protobuf data
- * @param e points to the end of the protobuf data
- * @param v (out) points to the location where the parsed varint will be
- * written
- * @returns pointer to first byte after the varint or NULL if parsing is
- * not finished before reaching e
- */
-static const uint8_t *ParseVarInt(const uint8_t *s, const uint8_t *e,
-                                  uint32_t *v) {
-  int i = 0;
-  *v = 0;
-  do {
-    if (s >= e)
-      return NULL;
-    *v |= (*s & 0x7f) << i;
-    i += 7;
-  } while (*s++ & 0x80);
-  return s;
+// Adds the time until the function returns to the histogram of api.
+#define STATTIME(api)                                                  \
+  struct StatTimer _st_ __attribute__((cleanup(StopStatTimer))) = {   \
+      api, StatNow()}
+
+int omemo0GetStats(struct omemo0Stats *stats, bool reset) {
+  if (!stats)
+    return OMEMO0_EPARAM;
+  uint64_t *s = (uint64_t *)&Runtime()->stats, *d = (uint64_t *)stats;
+  for (size_t i = 0; i < sizeof(struct omemo0Stats) / sizeof(uint64_t); i++)
+    d[i] = reset ? __atomic_exchange_n(s + i, 0, __ATOMIC_RELAXED)
+                 : __atomic_load_n(s + i, __ATOMIC_RELAXED);
+  return 0;
 }
 
-/**
- * Parse data in Protobuf format.
- *
- * For each field encountered it does the following:
- * - Make sure the field number can be stored in `fields` and that the
- *   type corresponds with the one specified in the associated field.
- * - Mark the field number as found which later will be used to check
- *   whether all required fields are found.
- * - Parse the value.
- * - If there already is a non-zero value specified in the field, it is
- *   used to check whether the parsed value is the same.
- * `nfields` should have the value of the highest possible field number
- * + 1. `nfields` must be less than or equal to 16 because we only
- * support a single byte field number, the number is stored like this in
- * the byte: 0nnnnttt where n is the field number and t is the type.
- *
- * @param s is protobuf data
- * @param n is the length of said data
- * @param nfields is the amount of fields in the `fields` array
- * @returns false if successful, true if error
- */
-static bool ParseProtobuf(const uint8_t *s, size_t n,
-                          struct ProtobufField *fields, int nfields) {
-  int type, id;
-  uint32_t v;
-  const uint8_t *e = s + n;
-  uint32_t found = 0;
-  ASSERT(nfields <= 16);
-  while (s < e) {
-    // This is actually a varint, but we only support id < 16 and return
-    // an error otherwise, so we don't have to account for multiple-byte
-    // tags.
-    type = *s & 7;
-    id = *s >> 3;
-    s++;
-    if (id >= nfields || type != (fields[id].type & 7))
-      return true;
-    found |= 1 << id;
-    if (!(s = ParseVarInt(s, e, &v)))
-      return true;
-    // If field is fixed size, enforce it
-    if (fields[id].v && v != fields[id].v)
-      return true;
-    fields[id].v = v;
-    if (type == PB_LEN) {
-      fields[id].p = s;
-      s += fields[id].v;
-    }
-  }
-  if (s > e)
-    return true;
-  for (int i = 0; i < nfields; i++) {
-    if ((fields[i].type & PB_REQUIRED) && !(found & (1 << i)))
-      return true;
-  }
-  return false;
+#else
+
+#define STATTIME(api) (void)0
+
+int omemo0GetStats(struct omemo0Stats *stats, bool reset) {
+  if (!stats)
+    return OMEMO0_EPARAM;
+  memset(stats, 0, sizeof(struct omemo0Stats));
+  return OMEMO0_ESTATE;
 }
 
-static bool ParseRepeatingField(const uint8_t *s, const uint8_t *e,
-                                struct ProtobufField *field,
-                                int fieldid) {
-  int type, id;
-  uint32_t v;
-  ASSERT(fieldid <= 16);
-  while (s < e) {
-    type = *s & 7;
-    id = *s >> 3;
-    s++;
-    if (id >= 16 || (id == fieldid && type != (field->type & 7)))
-      return true;
-    if (!(s = ParseVarInt(s, e, &v)))
-      return true;
-    if (id == fieldid)
-      field->v = v;
-    if (type == PB_LEN) {
-      if (id == fieldid)
-        field->p = s;
-      s += v;
-    }
-    if (id == fieldid)
-      break;
+#endif
+
+struct Scratch {
+  void *p;
+  size_t n;
+};
+
+// The barrier keeps the compiler from dropping the stores to a buffer
+// that is about to go out of scope.
+static void WipeScratch(struct Scratch *s) {
+  memset(s->p, 0, s->n);
+  __asm__ volatile("" : : "r"(s->p) : "memory");
+}
+
+#define SCRATCHSIZE(name) sizeof(((struct omemo0Scratch *)0)->name)
+
+#ifdef OMEMO0_SMALLSTACK
+
+// Declares the temporary name as a pointer into the context of this
+// thread, it must be the first element of an array field. It is wiped
+// when the function returns.
+#define SCRATCH(name)                                                  \
+  if (!GetContext())                                                   \
+    return OMEMO0_ESTATE;                                               \
+  __typeof__(*GetContext()->scratch.name) *name =                      \
+      GetContext()->scratch.name;                                      \
+  struct Scratch name##_w_ __attribute__((cleanup(WipeScratch))) = {  \
+      name, SCRATCHSIZE(name)}
+
+#else
+
+// Same as above, but on the stack when this thread has no context.
+#define SCRATCH(name)                                                  \
+  __typeof__(((struct omemo0Scratch *)0)->name) name##_;               \
+  __typeof__(*name##_) *name =                                        \
+      GetContext() ? GetContext()->scratch.name : name##_;            \
+  struct Scratch name##_w_ __attribute__((cleanup(WipeScratch))) = {  \
+      name, SCRATCHSIZE(name)}
+
+#endif
+
+const char *omemo0GetDriverImpl(int kind) {
+  switch (kind) {
+  case OMEMO0_DRIVER_CURVE: return omemoDriverCurveImpl();
+  case OMEMO0_DRIVER_AES:   return omemoDriverAesImpl();
+  case OMEMO0_DRIVER_HASH:  return omemoDriverHashImpl();
   }
-  return s > e;
+  return NULL;
 }
 
-/**
- * Get the size of a properly formatted varint in bytes.
- */
-static inline int GetVarIntSize(uint32_t v) {
-  return 1 + (v > 0x7f) + (v > 0x3fff) + (v > 0x1fffff) +
-         (v > 0xfffffff);
-}
-
-static uint8_t *FormatVarInt(uint8_t d[static 6], int type, int id,
-                             uint32_t v) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | type;
-  do {
-    *d = v & 0x7f;
-    v >>= 7;
-    *d++ |= (!!v << 7);
-  } while (v);
-  return d;
-}
-
-static uint8_t *FormatSerializedKey(uint8_t d[static 35], int id,
-                                    const omemo0Key k) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | PB_LEN;
-  *d++ = 33;
-  omemo0SerializeKey(d, k);
-  return d + 33;
-}
-
-static uint8_t *FormatKey(uint8_t d[static 34], int id,
-                          const omemo0Key k) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | PB_LEN;
-  *d++ = 32;
-  memcpy(d, k, 32);
-  return d + 32;
-}
-
-// Format Protobuf PreKeyWhisperMessage without message (it should be
-// appended right after this call).
-// This is OMEMOKeyExchange in schema
+void omemo0SerializeKey(omemo0SerializedKey k,
+                                    const omemo0Key pub) {
+  omemoCoreSerializeKey(&Protocol, k, pub);
+}
+
+static inline const uint8_t *GetRawKey(const omemo0SerializedKey k) {
+  return omemoCoreGetRawKey(&Protocol, k);
+}
+
+/***************************** PROTOBUF ******************************/
+
+// The wire format is in core.c, these pass it the constants of this
+// version.
+
+#define ParseProtobuf       omemoCoreParseProtobuf
+#define ParseRepeatingField omemoCoreParseRepeatingField
+#define FormatVarInt        omemoCoreFormatVarInt
+#define FormatKey           omemoCoreFormatKey
+
 static size_t FormatPreKeyMessage(
     uint8_t d[static OMEMO0_INTERNAL_PREKEYHEADER_MAXSIZE],
     uint32_t pk_id, uint32_t spk_id, const omemo0Key ik,
     const omemo0Key ek, uint32_t msgsz) {
-  uint8_t *p = d;
-
-  *p++ = (3 << 4) | 3;
-  p = FormatVarInt(p, PB_UINT32, 5, 0); // registration id
-  p = FormatVarInt(p, PB_UINT32, 1, pk_id);
-  p = FormatVarInt(p, PB_UINT32, 6, spk_id);
-  p = FormatSerializedKey(p, 3, ik);
-  p = FormatSerializedKey(p, 2, ek);
-  ASSERT(msgsz < 128);
-  p = FormatVarInt(p, PB_LEN, 4, msgsz);
-  return p - d;
+  return omemoCoreFormatPreKeyMessage(&Protocol, d, pk_id, spk_id, ik,
+                                      ek, msgsz);
 }
 
-// Format Protobuf WhisperMessage without ciphertext.
-//  HEADER(dh_pair, pn, n)
 static size_t
 FormatMessageHeader(uint8_t d[static OMEMO0_INTERNAL_HEADER_MAXSIZE],
                     uint32_t n, uint32_t pn, const omemo0Key dhs,
                     size_t keyn) {
-  uint8_t *p = d;
+  return omemoCoreFormatMessageHeader(&Protocol, d, n, pn, dhs, keyn);
+}
 
-  *p++ = (3 << 4) | 3;
-  p = FormatSerializedKey(p, 1, dhs);
-  p = FormatVarInt(p, PB_UINT32, 2, n);
-  p = FormatVarInt(p, PB_UINT32, 3, pn);
-  p = FormatVarInt(p, PB_LEN, 4, keyn);
-  return p - d;
+// Size of the message formatted by EncryptKeyImpl, without the prekey
+// header.
+static size_t GetMessageSize(uint32_t n, uint32_t pn, size_t encn) {
+  return omemoCoreGetMessageSize(&Protocol, n, pn, encn);
+}
+
+// Size of what FormatPreKeyMessage writes.
+static size_t GetPreKeyHeaderSize(uint32_t pk_id, uint32_t spk_id,
+                                  size_t msgsz) {
+  return omemoCoreGetPreKeyHeaderSize(&Protocol, pk_id, spk_id, msgsz);
 }
 
 /*************************** CRYPTOGRAPHY ****************************/
@@ -323,10 +451,7 @@ FormatMessageHeader(uint8_t d[static OMEMO0_INTERNAL_HEADER_MAXSIZE],
  */
 static int DoX25519(omemo0Key shared, const omemo0Key prv,
                     const omemo0Key pub) {
-  omemo0Key tmp, tmp2;
-  memcpy(tmp, prv, 32);
-  memcpy(tmp2, pub, 32);
-  return omemoDriverX25519(shared, tmp, tmp2);
+  return omemoCoreX25519(&Protocol, shared, prv, pub);
 }
 
 // For OMEMO 0.3, we use the sign_modified as is required.
@@ -344,67 +469,182 @@ static int DoX25519(omemo0Key shared, const omemo0Key prv,
 // Essentially the only deviations from regular EdDSA is the
 // addition of a randomized nonce to msg and the usage of the hash1(X)
 // variation on SHA-512.
+// ed is the Ed25519 public key of ik, see GetIdentityEd.
 static int CalculateCurveSignature(omemo0CurveSignature sig,
                                    const struct omemo0KeyPair *ik,
+                                   const omemo0Key ed,
                                    const uint8_t rnd[static 64],
                                    const uint8_t *msg, size_t msgn) {
   ASSERT(msgn <= SerLen);
   uint8_t msgbuf[SerLen + 64];
   memcpy(msgbuf, msg, msgn);
   memcpy(msgbuf + msgn, rnd, 64);
-  omemo0Key ikprv, ikpub;
+  omemo0Key ikprv, edpub;
   memcpy(ikprv, ik->prv, 32);
-  memcpy(ikpub, ik->pub, 32);
-
-  omemo0Key ed;
-  omemoDriverCvPrvToEdPub(ed, ikprv);
-  int sign = ed[31] & 0x80;
-  omemoDriverEdSignMod(sig, ed, ikprv, msgbuf, msgn);
+  memcpy(edpub, ed, 32);
+  omemoDriverEdSignMod(sig, edpub, ikprv, msgbuf, msgn);
   sig[63] &= 0x7f;
-  sig[63] |= sign;
+  sig[63] |= ed[31] & 0x80;
   return 0;
 }
 
+// Our identity key as Ed25519 public key, for OMEMO 0.3 it is cached in
+// store->identityalt.
+static void GetIdentityEd(omemo0Key ed, const struct omemo0Store *store) {
+
+  if (memcmp(store->identityalt, Zero32, 32)) {
+    memcpy(ed, store->identityalt, 32);
+  } else {
+    omemo0Key prv;
+    memcpy(prv, store->identity.prv, 32);
+    omemoDriverCvPrvToEdPub(ed, prv);
+  }
+}
+
+static void DeriveIdentityAlt(struct omemo0Store *store) {
+  omemo0Key k;
+  memcpy(k, store->identity.pub, 32);
+
+  memset(store->identityalt, 0, 32);
+  GetIdentityEd(k, store);
+  memcpy(store->identityalt, k, 32);
+}
+
+// Remote identity key ik in the other curve form (without sign bit),
+// taken from session->remoteidentityalt when it was cached for ik.
+static void GetRemoteIdentityAlt(omemo0Key alt,
+                                 const struct omemo0Session *session,
+                                 const omemo0Key ik) {
+  if (session && !memcmp(session->remoteidentity, ik, 32) &&
+      memcmp(session->remoteidentityalt, Zero32, 32)) {
+    memcpy(alt, session->remoteidentityalt, 32);
+    return;
+  }
+  omemo0Key k;
+  memcpy(k, ik, 32);
+
+  omemoDriverCvPubToEdPub(alt, k);
+  alt[31] &= 0x7f;
+}
+
+// GetRemoteIdentityAlt for n keys without the session cache, sharing
+// the field inversion.
+static void GetRemoteIdentityAlts(omemo0Key *alt, const uint8_t *const *ik,
+                                  size_t n) {
+
+  for (size_t i = 0; i < n; i++)
+    memcpy(alt[i], ik[i], 32);
+  omemoDriverCvPubToEdPubBatch(n, alt, alt);
+  for (size_t i = 0; i < n; i++)
+    alt[i][31] &= 0x7f;
+}
+
+// alt is the result of GetRemoteIdentityAlt or NULL when unknown.
+static void SetRemoteIdentity(struct omemo0Session *session,
+                              const omemo0Key ik, const omemo0Key alt) {
+  if (alt)
+    memcpy(session->remoteidentityalt, alt, 32);
+  else if (memcmp(session->remoteidentity, ik, 32))
+    memset(session->remoteidentityalt, 0, 32);
+  memcpy(session->remoteidentity, ik, 32);
+}
+
+// Converts the signature and public key to what omemoDriverEdVerify
+// expects. alt is pub from GetRemoteIdentityAlt or NULL.
+static void PrepareSignature(omemo0CurveSignature sig2, omemo0Key ed,
+                             const omemo0CurveSignature sig,
+                             const omemo0Key pub, const uint8_t *alt) {
+  memcpy(sig2, sig, 64);
+
+  if (alt)
+    memcpy(ed, alt, 32);
+  else
+    GetRemoteIdentityAlt(ed, NULL, pub);
+  ed[31] &= 0x7f;
+  ed[31] |= sig[63] & 0x80;
+  sig2[63] &= 0x7f;
+}
+
 //  Sig(PK, M)
 static bool VerifySignature(const omemo0CurveSignature sig,
-                            const omemo0Key pub, const uint8_t *msg,
-                            size_t msgn) {
+                            const omemo0Key pub, const uint8_t *alt,
+                            const uint8_t *msg, size_t msgn) {
   ASSERT(msgn <= SerLen);
   uint8_t msgbuf[SerLen];
   memcpy(msgbuf, msg, msgn);
-  omemo0Key pubcpy;
-  memcpy(pubcpy, pub, 32);
-  omemo0CurveSignature sig2;
-  memcpy(sig2, sig, 64);
-
   omemo0Key ed;
-  omemoDriverCvPubToEdPub(ed, pubcpy);
-  ed[31] &= 0x7f;
-  ed[31] |= sig[63] & 0x80;
-  sig2[63] &= 0x7f;
+  omemo0CurveSignature sig2;
+  PrepareSignature(sig2, ed, sig, pub, alt);
   return omemoDriverEdVerify(sig2, ed, msgbuf, msgn);
 }
 
+int omemo0SetupSignatureCache(struct omemo0SignatureCache *cache) {
+  if (!cache)
+    return OMEMO0_EPARAM;
+  memset(cache, 0, sizeof(struct omemo0SignatureCache));
+  return omemo0Random(cache->salt, 32);
+}
+
+void omemo0SetSignatureCache(struct omemo0SignatureCache *cache) {
+  Runtime()->sigcache = cache;
+}
+
+static inline struct omemo0SignatureCache *GetSignatureCache(void) {
+  return Runtime()->sigcache;
+}
+
+// Cache entry for a bundle's signed prekey signature, returns false when
+// there is no cache.
+static bool HashBundle(uint8_t h[static 16], const omemo0CurveSignature spks,
+                       const omemo0SerializedKey spk,
+                       const omemo0SerializedKey ik) {
+  struct omemo0SignatureCache *c = GetSignatureCache();
+  uint8_t buf[SerLen * 2 + 64], mac[32];
+  if (!c)
+    return false;
+  memcpy(buf, ik, SerLen);
+  memcpy(buf + SerLen, spk, SerLen);
+  memcpy(buf + SerLen * 2, spks, 64);
+  STAT(hmac);
+  if (omemoDriverHmac(c->salt, buf, sizeof(buf), mac))
+    return false;
+  memcpy(h, mac, 16);
+  return true;
+}
+
+static bool IsBundleCached(const uint8_t h[static 16]) {
+  for (int i = 0; i < OMEMO0_SIGCACHE_SIZE; i++) {
+    if (!memcmp(GetSignatureCache()->entries[i], h, 16))
+      return true;
+  }
+  return false;
+}
+
+static void CacheBundle(const uint8_t h[static 16]) {
+  struct omemo0SignatureCache *c = GetSignatureCache();
+  uint32_t i = c->next % OMEMO0_SIGCACHE_SIZE;
+  memcpy(c->entries[i], h, 16);
+  c->next = (i + 1) % OMEMO0_SIGCACHE_SIZE;
+}
+
 static int GenerateKeyPair(struct omemo0KeyPair *kp) {
-  TRY(omemo0Random(kp->prv, sizeof(kp->prv)));
-  kp->prv[0] &= 0xf8;
-  kp->prv[31] &= 0x7f;
-  kp->prv[31] |= 0x40;
-  omemoDriverCvPrvToPub(kp->pub, kp->prv);
-  return 0;
+  return omemoCoreGenerateKeyPair(&Protocol, (omemoCoreKeyPair *)kp);
 }
 
 
 static int GenerateSignedPreKey(struct omemo0SignedPreKey *spk,
                                 uint32_t id,
-                                const struct omemo0KeyPair *idkp) {
+                                const struct omemo0Store *store) {
   omemo0SerializedKey ser;
+  omemo0Key ed;
   spk->id = id;
   TRY(GenerateKeyPair(&spk->kp));
   omemo0SerializeKey(ser, spk->kp.pub);
   uint8_t rnd[64];
   TRY(omemo0Random(rnd, 64));
-  return CalculateCurveSignature(spk->sig, idkp, rnd, ser, SerLen);
+  GetIdentityEd(ed, store);
+  return CalculateCurveSignature(spk->sig, &store->identity, ed, rnd, ser,
+                                 SerLen);
 }
 
 /****************************** STORE ********************************/
@@ -415,6 +655,7 @@ static inline uint32_t IncrementWrapSkipZero(uint32_t n) {
 }
 
 int omemo0RefillPreKeys(struct omemo0Store *store) {
+  STATTIME(OMEMO0_STAT_REFILLPREKEYS);
   if (!store)
     return OMEMO0_EPARAM;
   int i;
@@ -437,14 +678,15 @@ static int omemo0SetupStoreImpl(struct omemo0Store *store) {
   memset(store, 0, sizeof(struct omemo0Store));
 
   TRY(GenerateKeyPair(&store->identity));
-  TRY(GenerateSignedPreKey(&store->cursignedprekey, 1,
-                           &store->identity));
+  DeriveIdentityAlt(store);
+  TRY(GenerateSignedPreKey(&store->cursignedprekey, 1, store));
   TRY(omemo0RefillPreKeys(store));
   store->init = true;
   return 0;
 }
 
 int omemo0SetupStore(struct omemo0Store *store) {
+  STATTIME(OMEMO0_STAT_SETUPSTORE);
   if (!store)
     return OMEMO0_EPARAM;
   int r;
@@ -455,136 +697,81 @@ int omemo0SetupStore(struct omemo0Store *store) {
 
 /*********************************************************************/
 
-#define ADSIZE (2 * SerLen)
-
-#define MACSIZE 8
-
-//  AD = Encode(IKA) || Encode(IKB)
-static void GetAd(uint8_t ad[static ADSIZE], const omemo0Key ika,
-                  const omemo0Key ikb) {
-  omemo0SerializeKey(ad, ika);
-  omemo0SerializeKey(ad + SerLen, ikb);
-}
-
-static int GetMac(uint8_t d[static MACSIZE], const omemo0Key ika,
-                  const omemo0Key ikb, const omemo0Key mk,
-                  const uint8_t *msg, size_t msgn) {
-  // This could theoretically happen while decrypting when the protobuf
-  // is needlessly large.
-  if (msgn > OMEMO0_INTERNAL_FULLMSG_MAXSIZE + 4)
-    return OMEMO0_ECORRUPT;
-  // Adding 4 in case some client has a large registration id
-  uint8_t macinput[ADSIZE + OMEMO0_INTERNAL_FULLMSG_MAXSIZE + 4],
-      mac[32];
-  GetAd(macinput, ika, ikb);
-  memcpy(macinput + ADSIZE, msg, msgn);
-  TRY(omemoDriverHmac(mk, macinput, ADSIZE + msgn, mac));
-  memcpy(d, mac, MACSIZE);
-  return 0;
-}
-
-#define GetPad(n) (16 - ((n) % 16))
-
-static int Encrypt(uint8_t out[OMEMO0_INTERNAL_PAYLOAD_MAXPADDEDSIZE],
-                   const uint8_t *in, size_t n, omemo0Key key,
-                   uint8_t iv[static 16]) {
-  uint8_t tmp[OMEMO0_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
-  int pad = GetPad(n);
-  memcpy(tmp, in, n);
-  memset(tmp + n, pad, pad);
-  TRY(omemoDriverAesEncrypt(key, n+pad, iv, tmp, out));
-  return n + pad;
-}
-
-static const uint8_t Zero32[32];
-
-#define DeriveKey(salt, secret, info, out)                             \
-  omemoDriverHkdf(salt,    \
-                sizeof(salt), secret, sizeof(secret), info,            \
-                sizeof(info) - 1, (uint8_t *)out, sizeof(out))
-
-struct __attribute__((__packed__)) DeriveChainKeyOutput {
-  omemo0Key cipher, mac;
-  uint8_t iv[16];
-};
+// Fills *out from the 32 byte secret with the HKDF info of Protocol,
+// out may point into the scratch.
+#define DeriveKey(secret, info, out)                                   \
+  omemoCoreDeriveKeys(&Protocol, (uint8_t *)(out), secret,             \
+                      Protocol.info)
 
 // d may be the same pointer as ck
 //  ck, mk = KDF_CK(ck)
 static int GetBaseMaterials(omemo0Key d, omemo0Key mk,
                              const omemo0Key ck) {
-  uint8_t data[1] = {1};
-  TRY(omemoDriverHmac(ck, data, 1, mk));
-  data[0] = 2;
-  TRY(omemoDriverHmac(ck, data, 1, d));
-  return 0;
-}
-
-// CKs, mk = KDF_CK(CKs)
-// header = HEADER(DHs, PN, Ns)
-// Ns += 1
-// return header, ENCRYPT(mk, plaintext, CONCAT(AD, header))
-static int EncryptKeyImpl(struct omemo0Session *session,
-                          struct omemo0KeyMessage *msg,
-                          const uint8_t *key, size_t keyn) {
-  if (!session->init)
-    return OMEMO0_ESTATE;
-  omemo0Key mk;
-  TRY(GetBaseMaterials(session->state.cks, mk, session->state.cks));
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, mk, HkdfInfoMessageKeys, kdfout));
-  msg->n = 0;
-  msg->n += FormatMessageHeader(
-      msg->p + msg->n, session->state.ns, session->state.pn,
-      session->state.dhs.pub, keyn + GetPad(keyn));
-  msg->n +=
-      Encrypt(msg->p + msg->n, key, keyn, kdfout->cipher, kdfout->iv);
-
-  TRY(GetMac(msg->p + msg->n, session->identity,
-             session->remoteidentity, kdfout->mac, msg->p, msg->n));
-  msg->n += 8;
-  session->state.ns++;
-  if (session->init == SESSION_INIT) {
-    msg->isprekey = true;
-    // [message 00...] -> [00... message] -> [header 00... message] ->
-    // [header message]
-    memmove(msg->p + OMEMO0_INTERNAL_PREKEYHEADER_MAXSIZE, msg->p,
-            msg->n);
-    int headersz = FormatPreKeyMessage(
-        msg->p, session->usedpk_id, session->usedspk_id,
-        session->identity, session->usedek, msg->n);
-    memmove(msg->p + headersz,
-            msg->p + OMEMO0_INTERNAL_PREKEYHEADER_MAXSIZE, msg->n);
-    msg->n += headersz;
-  }
-  return 0;
+  return omemoCoreKdfCk(&Protocol, d, mk, ck);
 }
 
 int omemo0EncryptKey(struct omemo0Session *session,
                                  struct omemo0KeyMessage *msg,
                                  const uint8_t *key, size_t keyn) {
+  STATTIME(OMEMO0_STAT_ENCRYPTKEY);
+  TRACESESSION(session);
   if (!session || !msg || keyn > OMEMO0_KEYSIZE)
     return OMEMO0_EPARAM;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
   int r;
-  // Fields outside of session->state are not modified in
-  // EncryptKeyImpl() but we'll back them up to save a future headache.
-  struct omemo0Session backup;
-  memcpy(&backup, session, sizeof(struct omemo0Session));
-  memset(msg, 0, sizeof(struct omemo0KeyMessage));
-  if ((r = EncryptKeyImpl(session, msg, key, keyn))) {
-    memcpy(session, &backup, sizeof(struct omemo0Session));
+  msg->n = sizeof(msg->p);
+  if ((r = omemoCoreEncryptKey(&Protocol, (omemoCoreSession *)session,
+                               msg->p, &msg->n, &msg->isprekey, key, keyn,
+                               &sc)))
     memset(msg, 0, sizeof(struct omemo0KeyMessage));
-  }
   return r;
 }
 
+int omemo0EncryptKeyTo(struct omemo0Session *session, uint8_t *d,
+                      size_t *dn, bool *isprekey, const uint8_t *key,
+                      size_t keyn) {
+  STATTIME(OMEMO0_STAT_ENCRYPTKEY);
+  TRACESESSION(session);
+  if (!session || !d || !dn || !isprekey || keyn > OMEMO0_KEYSIZE)
+    return OMEMO0_EPARAM;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
+  return omemoCoreEncryptKey(&Protocol, (omemoCoreSession *)session, d, dn,
+                             isprekey, key, keyn, &sc);
+}
+
+size_t omemo0GetKeyMessageSize(const struct omemo0Session *session,
+                              size_t keyn) {
+  if (!session)
+    return 0;
+  return omemoCoreGetKeyMessageSize(&Protocol,
+                                    (const omemoCoreSession *)session, keyn);
+}
+
 // RK, ck = KDF_RK(RK, DH(DHs, DHr))
 static int DeriveRootKey(struct omemo0State *state, omemo0Key ck) {
-  uint8_t secret[32], masterkey[64];
-  TRY(DoX25519(secret, state->dhs.prv, state->dhr));
-  TRY(DeriveKey(state->rk, secret, HkdfInfoRootChain, masterkey));
-  memcpy(state->rk, masterkey, 32);
-  memcpy(ck, masterkey + 32, 32);
-  return 0;
+  SCRATCH(dh);
+  SCRATCH(masterkey);
+  struct omemoCoreScratch sc = {.dh = dh, .masterkey = masterkey};
+  return omemoCoreDeriveRootKey(&Protocol, (omemoCoreState *)state, ck,
+                                &sc);
 }
 
 // DH1 = DH(IKA, SPKB)
@@ -596,7 +783,7 @@ static int GetSharedSecret(omemo0Key sk, bool isbob, const omemo0Key ika,
                            const omemo0Key ska, const omemo0Key eka,
                            const omemo0Key ikb, const omemo0Key spkb,
                            const omemo0Key opkb) {
-  uint8_t secret[32 * 5] = {0}, tmpkey[32];
+  SCRATCH(secret);
   memset(secret, 0xff, 32);
   // When we are bob, we must swap the first two.
   TRY(DoX25519(secret + 32, isbob ? ska : ika, isbob ? ikb : spkb));
@@ -604,9 +791,7 @@ static int GetSharedSecret(omemo0Key sk, bool isbob, const omemo0Key ika,
   TRY(DoX25519(secret + 96, ska, spkb));
   // OMEMO mandates that the bundle MUST contain a prekey.
   TRY(DoX25519(secret + 128, eka, opkb));
-  TRY(DeriveKey(Zero32, secret, HkdfInfoKeyExchange, tmpkey));
-  memcpy(sk, tmpkey, 32);
-  return 0;
+  return omemoCoreKdfSharedSecret(&Protocol, sk, secret);
 }
 
 //  state.DHs = GENERATE_DH()
@@ -627,21 +812,95 @@ static int RatchetInitAlice(struct omemo0State *state, const omemo0Key sk,
   return DeriveRootKey(state, state->cks);
 }
 
-int omemo0InitiateSession(struct omemo0Session *session,
-                                      const struct omemo0Store *store,
-                                      const omemo0CurveSignature spks,
-                                      const omemo0SerializedKey spk,
-                                      const omemo0SerializedKey ik,
-                                      const omemo0SerializedKey pk,
-                                      uint32_t spk_id, uint32_t pk_id) {
-  if (!session || !store)
+#define VERIFYBATCH OMEMO0_INTERNAL_VERIFYBATCH
+
+int omemo0VerifyBundles(const struct omemo0Bundle *bundles, bool *ok,
+                       size_t n) {
+  STATTIME(OMEMO0_STAT_VERIFYBUNDLES);
+  if (!bundles || !ok)
     return OMEMO0_EPARAM;
-  if (!VerifySignature(spks, GetRawKey(ik), spk, SerLen)) {
-    return OMEMO0_ECORRUPT;
+  SCRATCH(sigs);
+  SCRATCH(pubs);
+  SCRATCH(alts);
+  SCRATCH(iks);
+  SCRATCH(msgs);
+  SCRATCH(msgp);
+  SCRATCH(msgn);
+  SCRATCH(idx);
+  SCRATCH(hashes);
+  SCRATCH(cache);
+  uint8_t seed[32];
+  int r = 0;
+  for (size_t i = 0; i < n;) {
+    size_t m = 0;
+    for (; i < n && m < VERIFYBATCH; i++) {
+      const struct omemo0Bundle *b = bundles + i;
+      cache[m] = HashBundle(hashes[m], b->spks, b->spk, b->ik);
+      if (cache[m] && IsBundleCached(hashes[m])) {
+        ok[i] = true;
+        continue;
+      }
+      iks[m] = GetRawKey(b->ik);
+      memcpy(msgs[m], b->spk, SerLen);
+      msgp[m] = msgs[m];
+      msgn[m] = SerLen;
+      idx[m++] = i;
+    }
+    if (!m)
+      break;
+    GetRemoteIdentityAlts(alts, iks, m);
+    for (size_t j = 0; j < m; j++)
+      PrepareSignature(sigs[j], pubs[j], bundles[idx[j]].spks, iks[j],
+                       alts[j]);
+    TRY(omemo0Random(seed, 32));
+    bool all = omemoDriverEdVerifyBatch(m, sigs, pubs, msgp, msgn, seed);
+    // Find out which ones are bad.
+    for (size_t j = 0; j < m; j++) {
+      ok[idx[j]] =
+          all || omemoDriverEdVerify(sigs[j], pubs[j], msgp[j], SerLen);
+      if (!ok[idx[j]])
+        r = OMEMO0_ECORRUPT;
+      else if (cache[j])
+        CacheBundle(hashes[j]);
+    }
+  }
+  return r;
+}
+
+int omemo0ImportRemoteIdentities(struct omemo0Session **sessions,
+                                const omemo0SerializedKey *iks, size_t n) {
+  if (!sessions || !iks)
+    return OMEMO0_EPARAM;
+  for (size_t i = 0; i < n; i++) {
+    if (!sessions[i])
+      return OMEMO0_EPARAM;
+    if (sessions[i]->init != SESSION_UNINIT &&
+        memcmp(sessions[i]->remoteidentity, GetRawKey(iks[i]), 32))
+      return OMEMO0_ESTATE;
+  }
+  SCRATCH(alts);
+  const uint8_t *raw[VERIFYBATCH];
+  for (size_t i = 0; i < n; i += VERIFYBATCH) {
+    size_t m = n - i < VERIFYBATCH ? n - i : VERIFYBATCH;
+    for (size_t j = 0; j < m; j++)
+      raw[j] = GetRawKey(iks[i + j]);
+    GetRemoteIdentityAlts(alts, raw, m);
+    for (size_t j = 0; j < m; j++)
+      SetRemoteIdentity(sessions[i + j], raw[j], alts[j]);
   }
+  return 0;
+}
+
+static int InitiateSessionImpl(struct omemo0Session *session,
+                               const struct omemo0Store *store,
+                               const omemo0SerializedKey spk,
+                               const omemo0SerializedKey ik,
+                               const omemo0SerializedKey pk,
+                               uint32_t spk_id, uint32_t pk_id) {
   struct omemo0KeyPair eka;
   TRY(GenerateKeyPair(&eka));
-  omemo0Key sk;
+  omemo0Key sk, alt;
+  GetRemoteIdentityAlt(alt, session, GetRawKey(ik));
 
   TRY(GetSharedSecret(sk, false, store->identity.prv, eka.prv, eka.prv,
                       GetRawKey(ik), GetRawKey(spk), GetRawKey(pk)));
@@ -652,13 +911,50 @@ int omemo0InitiateSession(struct omemo0Session *session,
   }
   memcpy(session->usedek, eka.pub, 32);
   memcpy(session->identity, store->identity.pub, 32);
-  memcpy(session->remoteidentity, GetRawKey(ik), 32);
+  SetRemoteIdentity(session, GetRawKey(ik), alt);
   session->usedpk_id = pk_id;
   session->usedspk_id = spk_id;
   session->init = SESSION_INIT;
   return 0;
 }
 
+int omemo0InitiateSession(struct omemo0Session *session,
+                                      const struct omemo0Store *store,
+                                      const omemo0CurveSignature spks,
+                                      const omemo0SerializedKey spk,
+                                      const omemo0SerializedKey ik,
+                                      const omemo0SerializedKey pk,
+                                      uint32_t spk_id, uint32_t pk_id) {
+  STATTIME(OMEMO0_STAT_INITIATESESSION);
+  TRACESESSION(session);
+  if (!session || !store)
+    return OMEMO0_EPARAM;
+  uint8_t h[16];
+  bool cache = HashBundle(h, spks, spk, ik);
+  if (!cache || !IsBundleCached(h)) {
+    omemo0Key alt;
+    GetRemoteIdentityAlt(alt, session, GetRawKey(ik));
+    if (!VerifySignature(spks, GetRawKey(ik), alt, spk, SerLen))
+      return OMEMO0_ECORRUPT;
+    if (cache)
+      CacheBundle(h);
+  }
+  return InitiateSessionImpl(session, store, spk, ik, pk, spk_id, pk_id);
+}
+
+int omemo0InitiateVerifiedSession(struct omemo0Session *session,
+                                 const struct omemo0Store *store,
+                                 const omemo0SerializedKey spk,
+                                 const omemo0SerializedKey ik,
+                                 const omemo0SerializedKey pk,
+                                 uint32_t spk_id, uint32_t pk_id) {
+  STATTIME(OMEMO0_STAT_INITIATESESSION);
+  TRACESESSION(session);
+  if (!session || !store)
+    return OMEMO0_EPARAM;
+  return InitiateSessionImpl(session, store, spk, ik, pk, spk_id, pk_id);
+}
+
 static const struct omemo0PreKey *FindPreKey(const struct omemo0Store *store,
                                       uint32_t pk_id) {
   for (int i = 0; i < OMEMO0_NUMPREKEYS; i++) {
@@ -680,12 +976,12 @@ FindSignedPreKey(const struct omemo0Store *store, uint32_t spk_id) {
 }
 
 int omemo0RotateSignedPreKey(struct omemo0Store *store) {
+  STATTIME(OMEMO0_STAT_ROTATESIGNEDPREKEY);
   if (!store)
     return OMEMO0_EPARAM;
   struct omemo0SignedPreKey spk;
   int r = GenerateSignedPreKey(
-      &spk, IncrementWrapSkipZero(store->cursignedprekey.id),
-      &store->identity);
+      &spk, IncrementWrapSkipZero(store->cursignedprekey.id), store);
   if (!r) {
     memcpy(&store->prevsignedprekey, &store->cursignedprekey,
            sizeof(struct omemo0SignedPreKey));
@@ -694,183 +990,85 @@ int omemo0RotateSignedPreKey(struct omemo0Store *store) {
   return r;
 }
 
-//  PN = Ns
-//  Ns = 0
-//  Nr = 0
-//  DHr = dh
-//  RK, CKr = KDF_RK(RK, DH(DHs, DHr))
-//  DHs = GENERATE_DH()
-//  RK, CKs = KDF_RK(RK, DH(DHs, DHr))
-static int DHRatchet(struct omemo0State *state, const omemo0Key dh) {
-  state->pn = state->ns;
-  state->ns = 0;
-  state->nr = 0;
-  memcpy(state->dhr, dh, 32);
-  TRY(DeriveRootKey(state, state->ckr));
-  TRY(GenerateKeyPair(&state->dhs));
-  TRY(DeriveRootKey(state, state->cks));
-  return 0;
-}
-
 static void RatchetInitBob(struct omemo0State *state, const omemo0Key sk,
                            const struct omemo0KeyPair *ekb) {
   memcpy(&state->dhs, ekb, sizeof(struct omemo0KeyPair));
   memcpy(state->rk, sk, 32);
 }
 
-#define CLAMP0(v) ((v) > 0 ? (v) : 0)
-
-static inline uint32_t GetAmountSkipped(int64_t nr, int64_t n) {
-  return CLAMP0(n - nr);
-}
-
-static int SkipMessageKeys(struct omemo0Session *session, uint32_t n,
-                           uint64_t fullamount) {
-  struct omemo0MessageKey k;
-  while (session->state.nr < n) {
-    TRY(GetBaseMaterials(session->state.ckr, k.mk, session->state.ckr));
-    memcpy(k.dh, session->state.dhr, 32);
-    k.nr = session->state.nr;
-    TRY(omemo0StoreMessageKey(session, &k, fullamount--));
-    session->state.nr++;
-  }
-  return 0;
-}
-
-static int DecryptKeyImpl(struct omemo0Session *session,
-                          uint8_t *key, size_t *keyn,
-                          const uint8_t *msg, size_t msgn) {
-
-  if (msgn < 9 || msg[0] != ((3 << 4) | 3))
-    return OMEMO0_ECORRUPT;
-  struct ProtobufField fields[5] = {
-      [PbMsg_dh_pub] = {PB_REQUIRED | PB_LEN, SerLen},
-      [PbMsg_n] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_pn] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_ciphertext] = {PB_REQUIRED | PB_LEN},
-  };
-  if (ParseProtobuf(msg + 1, msgn - 9, fields, 5))
-    return OMEMO0_EPROTOBUF;
-  const uint8_t *realmac = msg + msgn - 8;
-
-  uint32_t encn = fields[PbMsg_ciphertext].v;
-  if (encn < 16 || encn % 16 ||
-      encn > OMEMO0_INTERNAL_PAYLOAD_MAXPADDEDSIZE)
-    return OMEMO0_ECORRUPT;
-
-  uint32_t headern = fields[PbMsg_n].v;
-  uint32_t headerpn = fields[PbMsg_pn].v;
-  const uint8_t *headerdh = GetRawKey(fields[PbMsg_dh_pub].p);
-
-  bool shouldstep = !!memcmp(session->state.dhr, headerdh, 32);
-
-  // We first check for maxskip, if that does not pass we should not
-  // process the message. If it does pass, we know the total capacity of
-  // the array is large enough because c >= maxskip. Then we check if
-  // the new keys fit in the remaining space. If that is not the case we
-  // return and let the user either remove the old message keys or
-  // ignore the message.
-
-  omemo0Key mk;
-  struct omemo0MessageKey mkey = {0};
-  memcpy(mkey.dh, headerdh, 32);
-  mkey.nr = headern;
-  int r;
-  if (!(r = omemo0LoadMessageKey(session, &mkey))) {
-    memcpy(mk, mkey.mk, 32);
-  } else if (r < 0) {
-    return r;
-  } else {
-    if (!shouldstep && headern < session->state.nr)
-      return OMEMO0_EKEYGONE;
-    uint64_t nskips =
-        shouldstep
-            ? GetAmountSkipped(session->state.nr, headerpn) + headern
-            : GetAmountSkipped(session->state.nr, headern);
-    if (shouldstep) {
-      TRY(SkipMessageKeys(session, headerpn, nskips));
-      nskips -= headern;
-      TRY(DHRatchet(&session->state, headerdh));
-    }
-    TRY(SkipMessageKeys(session, headern, nskips));
-    TRY(GetBaseMaterials(session->state.ckr, mk, session->state.ckr));
-    session->state.nr++;
-  }
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, mk, HkdfInfoMessageKeys, kdfout));
-  uint8_t mac[MACSIZE];
-
-  TRY(GetMac(mac, session->remoteidentity, session->identity,
-             kdfout->mac, msg, msgn - 8));
-  if (omemoDriverCompare(mac, realmac, MACSIZE))
-    return OMEMO0_ECORRUPT;
-  uint8_t tmp[OMEMO0_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
-  TRY(omemoDriverAesDecrypt(kdfout->cipher, encn, kdfout->iv,
-         fields[PbMsg_ciphertext].p, tmp));
-  uint8_t pad = tmp[encn - 1];
-  if (pad > 16 || pad > encn || encn - pad > *keyn)
-    return OMEMO0_ECORRUPT;
-  memcpy(key, tmp, encn - pad);
-  *keyn = encn - pad;
-  session->init = SESSION_READY;
-  return 0;
-}
-
+// Nothing in session is changed until the message is decrypted, then
+// state is copied to it together with the other changes.
 static int DecryptGenericKeyImpl(struct omemo0Session *session,
                                  const struct omemo0Store *store,
+                                 struct omemo0State *state,
                                  uint8_t *key, size_t *keyn,
                                  bool isprekey, const uint8_t *msg,
                                  size_t msgn) {
   const struct omemo0PreKey *pk = NULL;
+  // Remote identity key of a new session and the alt form if known.
+  omemo0Key ik[2];
+  const uint8_t *remote = session->remoteidentity, *remotealt = NULL;
+  uint32_t pkid = 0;
   if (isprekey) {
     // Can't receive prekey when we sent a prekey...
     if (session->init == SESSION_INIT)
       return OMEMO0_ESTATE;
-
-    if (msgn == 0 || msg[0] != ((3 << 4) | 3))
-      return OMEMO0_ECORRUPT;
-    // PreKeyWhisperMessage
-    struct ProtobufField fields[7] = {
-        [5] = {PB_UINT32},                             // registrationid
-        [PbKeyEx_pk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_spk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_ek] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_ik] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_message] = {PB_REQUIRED | PB_LEN},
-    };
-    if (ParseProtobuf(msg + 1, msgn - 1, fields, 7))
-      return OMEMO0_EPROTOBUF;
+    struct omemoCoreKeyExchange kx;
+    TRY(omemoCoreParseKeyExchange(&Protocol, &kx, msg, msgn));
     if (session->init == SESSION_UNINIT) {
-      pk = FindPreKey(store, fields[PbKeyEx_pk_id].v);
+      pk = FindPreKey(store, kx.pk_id);
       const struct omemo0SignedPreKey *spk =
-          FindSignedPreKey(store, fields[PbKeyEx_spk_id].v);
+          FindSignedPreKey(store, kx.spk_id);
       if (!pk || !spk)
         return OMEMO0_ECORRUPT;
-      session->usedpk_id = fields[PbKeyEx_pk_id].v;
+      pkid = kx.pk_id;
       omemo0Key sk;
-      memcpy(session->identity, store->identity.pub, 32);
-      memcpy(session->remoteidentity, GetRawKey(fields[PbKeyEx_ik].p),
-             32);
+      memcpy(ik[0], msg + kx.ik, 32);
 
       TRY(GetSharedSecret(sk, true, store->identity.prv, spk->kp.prv,
-                          pk->kp.prv, GetRawKey(fields[PbKeyEx_ik].p),
-                          GetRawKey(fields[PbKeyEx_ek].p),
-                          GetRawKey(fields[PbKeyEx_ek].p)));
-      RatchetInitBob(&session->state, sk, &spk->kp);
+                          pk->kp.prv, ik[0], msg + kx.ek, msg + kx.ek));
+      RatchetInitBob(state, sk, &spk->kp);
+      remote = ik[0];
     }
-    msg = fields[PbKeyEx_message].p;
-    msgn = fields[PbKeyEx_message].v;
+    msgn = kx.messagen;
+    msg += kx.message;
+  } else if (session->init == SESSION_UNINIT) {
+    return OMEMO0_ESTATE;
+  }
+  if (remote != ik[0] &&
+      memcmp(session->identity, store->identity.pub, 32))
+    return OMEMO0_ESTORE;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(dh);
+  SCRATCH(masterkey);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .dh = dh,
+      .masterkey = masterkey,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
+  TRY(omemoCoreDecryptKey(&Protocol, (omemoCoreSession *)session,
+                          (omemoCoreState *)state, remote,
+                          store->identity.pub, key, keyn, msg, msgn, &sc));
+  if (remote == ik[0]) {
+    memcpy(session->identity, store->identity.pub, 32);
+    SetRemoteIdentity(session, remote, remotealt);
+    session->usedpk_id = pkid;
+    STAT(prekeysused);
   } else if (session->init == SESSION_INIT) {
     // We don't need these anymore
     session->usedpk_id = 0;
     session->usedspk_id = 0;
     memset(session->usedek, 0, 32);
-  } else if (session->init == SESSION_UNINIT) {
-    return OMEMO0_ESTATE;
   }
-  if (memcmp(session->identity, store->identity.pub, 32))
-    return OMEMO0_ESTORE;
-  return DecryptKeyImpl(session, key, keyn, msg, msgn);
+  memcpy(&session->state, state, sizeof(struct omemo0State));
+  session->init = SESSION_READY;
+  return 0;
 }
 
 int omemo0DecryptKey(struct omemo0Session *session,
@@ -878,24 +1076,22 @@ int omemo0DecryptKey(struct omemo0Session *session,
                                  uint8_t *key, size_t *keyn,
                                  bool isprekey, const uint8_t *msg,
                                  size_t msgn) {
+  STATTIME(OMEMO0_STAT_DECRYPTKEY);
+  TRACESESSION(session);
   if (!session || !store || !key || !keyn || !store->init || !msg)
     return OMEMO0_EPARAM;
-  // We only have to backup session->state functionality wise, but to
-  // ensure session stays the same before and after an error we backup
-  // everything.
-  struct omemo0Session backup;
-  memcpy(&backup, session, sizeof(struct omemo0Session));
-  int r;
-  if ((r = DecryptGenericKeyImpl(session, store, key, keyn, isprekey,
-                                 msg, msgn))) {
-    memcpy(session, &backup, sizeof(struct omemo0Session));
-  }
-  return r;
+  // The ratchet is advanced in a copy of the state, so session stays the
+  // same when there is an error.
+  SCRATCH(state);
+  memcpy(state, &session->state, sizeof(struct omemo0State));
+  return DecryptGenericKeyImpl(session, store, state, key, keyn,
+                               isprekey, msg, msgn);
 }
 
 int omemo0Heartbeat(struct omemo0Session *session,
                                 const struct omemo0Store *store,
                                 struct omemo0KeyMessage *msg) {
+  TRACESESSION(session);
   if (!session || !store || !msg) return OMEMO0_EPARAM;
   if (session->state.nr >= 53) {
     if (session->init == SESSION_READY) {
@@ -916,11 +1112,13 @@ int omemo0Heartbeat(struct omemo0Session *session,
 int omemo0DecryptMessage(uint8_t *d, const uint8_t *key,
                                      size_t keyn, const uint8_t iv[12],
                                      const uint8_t *s, size_t n) {
+  STATTIME(OMEMO0_STAT_DECRYPTMESSAGE);
   if (!d || !key || !iv || !s)
     return OMEMO0_EPARAM;
   int r = 0;
   if (keyn < 32)
     return OMEMO0_ECORRUPT;
+  STAT(aes);
   TRY(omemoDriverGcmDecrypt(d, key, n, iv, key+16, keyn-16, s));
   return r ? OMEMO0_ECRYPTO : 0;
 }
@@ -929,109 +1127,125 @@ int omemo0DecryptMessage(uint8_t *d, const uint8_t *key,
 int omemo0EncryptMessage(uint8_t *d, uint8_t key[32],
                                      uint8_t iv[12], const uint8_t *s,
                                      size_t n) {
+  STATTIME(OMEMO0_STAT_ENCRYPTMESSAGE);
   if (!d || !key || !iv || !s)
     return OMEMO0_EPARAM;
   int r = 0;
   if ((r = omemo0Random(key, 16)) || (r = omemo0Random(iv, 12)))
     return r;
+  STAT(aes);
   return omemoDriverGcmEncrypt(d, key, n, iv, key + 16, s);
 }
 
+void omemo0FreeMessageStream(struct omemo0PayloadStream *st) {
+  if (st) {
+    omemoDriverAesDestroy(st->aes);
+    omemoDriverHmacDestroy(st->hmac);
+    memset(st, 0, sizeof(*st));
+  }
+}
+
+// Frees the stream when r is an error.
+static int CheckStream(struct omemo0PayloadStream *st, int r) {
+  if (r)
+    omemo0FreeMessageStream(st);
+  return r;
+}
+
+
+static int StartStream(struct omemo0PayloadStream *st, const uint8_t *iv,
+                       bool enc) {
+  if (!(st->aes = omemoDriverAesCreate()))
+    return OMEMO0_ECRYPTO;
+  TRY(omemoDriverAesSetGcmKey(st->aes, st->key));
+  return omemoDriverAesGcmStart(st->aes, iv, enc);
+}
+
+int omemo0EncryptMessageInit(struct omemo0PayloadStream *st,
+                            uint8_t iv[12]) {
+  if (!st || !iv)
+    return OMEMO0_EPARAM;
+  memset(st, 0, sizeof(*st));
+  int r;
+  if ((r = omemo0Random(st->key, 16)) || (r = omemo0Random(iv, 12)))
+    return r;
+  return CheckStream(st, StartStream(st, iv, true));
+}
+
+int omemo0EncryptMessageUpdate(struct omemo0PayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  if (!st || !d || !outn || (!s && n))
+    return OMEMO0_EPARAM;
+  *outn = n;
+  STAT(aes);
+  return CheckStream(st, omemoDriverAesGcmUpdate(st->aes, d, n, s));
+}
+
+int omemo0EncryptMessageFinal(struct omemo0PayloadStream *st, uint8_t *d,
+                             size_t *outn, uint8_t key[32]) {
+  if (!st || !outn || !key)
+    return OMEMO0_EPARAM;
+  *outn = 0;
+  int r = omemoDriverAesGcmFinish(st->aes, st->key + 16, 16);
+  if (!r)
+    memcpy(key, st->key, 32);
+  omemo0FreeMessageStream(st);
+  return r;
+}
+
+int omemo0DecryptMessageInit(struct omemo0PayloadStream *st,
+                            const uint8_t *key, size_t keyn,
+                            const uint8_t iv[12]) {
+  if (!st || !key || !iv)
+    return OMEMO0_EPARAM;
+  if (keyn < 32 || keyn > sizeof(st->key))
+    return OMEMO0_ECORRUPT;
+  memset(st, 0, sizeof(*st));
+  memcpy(st->key, key, keyn);
+  st->keyn = keyn;
+  return CheckStream(st, StartStream(st, iv, false));
+}
+
+int omemo0DecryptMessageUpdate(struct omemo0PayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  return omemo0EncryptMessageUpdate(st, d, outn, s, n);
+}
+
+int omemo0DecryptMessageFinal(struct omemo0PayloadStream *st, uint8_t *d,
+                             size_t *outn) {
+  if (!st || !outn)
+    return OMEMO0_EPARAM;
+  *outn = 0;
+  int r = omemoDriverAesGcmFinish(st->aes, st->key + 16, st->keyn - 16);
+  omemo0FreeMessageStream(st);
+  return r;
+}
+
 /************************** SERIALIZATION ****************************/
 
+// The format is the same in both versions, see core.c.
+
 size_t omemo0GetSerializedStoreSize(const struct omemo0Store *store) {
   if (!store)
     return 0;
-  size_t sum = 34 * 6 + (2 + 64) * 2 + 1 * 4 +
-               GetVarIntSize(store->init) +
-               GetVarIntSize(store->cursignedprekey.id) +
-               GetVarIntSize(store->prevsignedprekey.id) +
-               GetVarIntSize(store->pkcounter);
-  for (int i = 0; i < OMEMO0_NUMPREKEYS; i++)
-    sum += 2 + 1 + GetVarIntSize(store->prekeys[i].id) + 2 * 34;
-  return sum;
+  return omemoCoreGetSerializedStoreSize((const omemoCoreStore *)store);
 }
 
 void omemo0SerializeStore(uint8_t *p,
                                       const struct omemo0Store *store) {
   if (!p || !store)
     return;
-  uint8_t *d = p;
-  d = FormatVarInt(d, PB_UINT32, 1, store->init);
-  d = FormatKey(d, 2, store->identity.prv);
-  d = FormatKey(d, 3, store->identity.pub);
-  d = FormatVarInt(d, PB_UINT32, 4, store->cursignedprekey.id);
-  d = FormatKey(d, 5, store->cursignedprekey.kp.prv);
-  d = FormatKey(d, 6, store->cursignedprekey.kp.pub);
-  d = FormatVarInt(d, PB_LEN, 7, 64);
-  d = (memcpy(d, store->cursignedprekey.sig, 64), d + 64);
-  d = FormatVarInt(d, PB_UINT32, 8, store->prevsignedprekey.id);
-  d = FormatKey(d, 9, store->prevsignedprekey.kp.prv);
-  d = FormatKey(d, 10, store->prevsignedprekey.kp.pub);
-  d = FormatVarInt(d, PB_LEN, 11, 64);
-  d = (memcpy(d, store->prevsignedprekey.sig, 64), d + 64);
-  d = FormatVarInt(d, PB_UINT32, 12, store->pkcounter);
-  for (int i = 0; i < OMEMO0_NUMPREKEYS; i++) {
-    const struct omemo0PreKey *pk = store->prekeys + i;
-    d = FormatVarInt(d, PB_LEN, 13, 1 + GetVarIntSize(pk->id) + 2 * 34);
-    d = FormatVarInt(d, PB_UINT32, 1, pk->id);
-    d = FormatKey(d, 2, pk->kp.prv);
-    d = FormatKey(d, 3, pk->kp.pub);
-  }
-  ASSERT(d - p == omemo0GetSerializedStoreSize(store));
+  omemoCoreSerializeStore(p, (const omemoCoreStore *)store);
 }
 
 int omemo0DeserializeStore(const uint8_t *p, size_t n,
                                        struct omemo0Store *store) {
   if (!p || !store)
     return OMEMO0_EPARAM;
-  struct ProtobufField fields[] = {
-      [1] = {PB_REQUIRED | PB_UINT32},
-      [2] = {PB_REQUIRED | PB_LEN, 32},
-      [3] = {PB_REQUIRED | PB_LEN, 32},
-      [4] = {PB_REQUIRED | PB_UINT32},
-      [5] = {PB_REQUIRED | PB_LEN, 32},
-      [6] = {PB_REQUIRED | PB_LEN, 32},
-      [7] = {PB_REQUIRED | PB_LEN, 64},
-      [8] = {PB_REQUIRED | PB_UINT32},
-      [9] = {PB_REQUIRED | PB_LEN, 32},
-      [10] = {PB_REQUIRED | PB_LEN, 32},
-      [11] = {PB_REQUIRED | PB_LEN, 64},
-      [12] = {PB_REQUIRED | PB_UINT32},
-      [13] = {/*PB_REQUIRED |*/ PB_LEN},
-  };
-  if (ParseProtobuf(p, n, fields, 14))
-    return OMEMO0_EPROTOBUF;
-  store->init = fields[1].v;
-  memcpy(store->identity.prv, fields[2].p, 32);
-  memcpy(store->identity.pub, fields[3].p, 32);
-  store->cursignedprekey.id = fields[4].v;
-  memcpy(store->cursignedprekey.kp.prv, fields[5].p, 32);
-  memcpy(store->cursignedprekey.kp.pub, fields[6].p, 32);
-  memcpy(store->cursignedprekey.sig, fields[7].p, 64);
-  store->prevsignedprekey.id = fields[8].v;
-  memcpy(store->prevsignedprekey.kp.prv, fields[9].p, 32);
-  memcpy(store->prevsignedprekey.kp.pub, fields[10].p, 32);
-  memcpy(store->prevsignedprekey.sig, fields[11].p, 64);
-  store->pkcounter = fields[12].v;
-  const uint8_t *e = p + n;
-  int i = 0;
-  while (i < OMEMO0_NUMPREKEYS &&
-         !ParseRepeatingField(p, e, &fields[13], 13) && fields[13].p) {
-    struct ProtobufField innerfields[] = {
-        [1] = {PB_REQUIRED | PB_UINT32},
-        [2] = {PB_REQUIRED | PB_LEN, 32},
-        [3] = {PB_REQUIRED | PB_LEN, 32},
-    };
-    if (ParseProtobuf(fields[13].p, fields[13].v, innerfields, 4))
-      return OMEMO0_EPROTOBUF;
-    store->prekeys[i].id = innerfields[1].v;
-    memcpy(store->prekeys[i].kp.prv, innerfields[2].p, 32);
-    memcpy(store->prekeys[i].kp.pub, innerfields[3].p, 32);
-    i++;
-    p = fields[13].p + fields[13].v;
-    fields[13].v = 0, fields[13].p = NULL;
-  }
+  TRY(omemoCoreDeserializeStore(p, n, (omemoCoreStore *)store));
+  // Stores serialized by older versions don't have it.
+  if (!memcmp(store->identityalt, Zero32, 32))
+    DeriveIdentityAlt(store);
   return 0;
 }
 
@@ -1039,76 +1253,20 @@ size_t
 omemo0GetSerializedSessionSize(const struct omemo0Session *session) {
   if (!session)
     return 0;
-  return 34 * 9 // Key
-         + 1 * 6 + GetVarIntSize(session->state.ns) +
-         GetVarIntSize(session->state.nr) +
-         GetVarIntSize(session->state.pn) +
-         GetVarIntSize(session->usedpk_id) +
-         GetVarIntSize(session->usedspk_id) +
-         GetVarIntSize(session->init);
+  return omemoCoreGetSerializedSessionSize(
+      (const omemoCoreSession *)session);
 }
 
 void
 omemo0SerializeSession(uint8_t *p, const struct omemo0Session *session) {
   if (!p || !session)
     return;
-  uint8_t *d = p;
-  d = FormatKey(d, 1, session->remoteidentity);
-  d = FormatKey(d, 2, session->state.dhs.prv);
-  d = FormatKey(d, 3, session->state.dhs.pub);
-  d = FormatKey(d, 4, session->state.dhr);
-  d = FormatKey(d, 5, session->state.rk);
-  d = FormatKey(d, 6, session->state.cks);
-  d = FormatKey(d, 7, session->state.ckr);
-  d = FormatVarInt(d, PB_UINT32, 8, session->state.ns);
-  d = FormatVarInt(d, PB_UINT32, 9, session->state.nr);
-  d = FormatVarInt(d, PB_UINT32, 10, session->state.pn);
-  // TODO: don't have to include used* after first ratchet
-  d = FormatKey(d, 11, session->usedek);
-  d = FormatVarInt(d, PB_UINT32, 12, session->usedpk_id);
-  d = FormatVarInt(d, PB_UINT32, 13, session->usedspk_id);
-  d = FormatVarInt(d, PB_UINT32, 14, session->init);
-  d = FormatKey(d, 15, session->identity);
-  ASSERT(d - p == omemo0GetSerializedSessionSize(session));
+  omemoCoreSerializeSession(p, (const omemoCoreSession *)session);
 }
 
 int omemo0DeserializeSession(const uint8_t *p, size_t n,
                                          struct omemo0Session *session) {
   if (!p || !session)
     return OMEMO0_EPARAM;
-  struct ProtobufField fields[] = {
-      [1] = {PB_REQUIRED | PB_LEN, 32},
-      [2] = {PB_REQUIRED | PB_LEN, 32},
-      [3] = {PB_REQUIRED | PB_LEN, 32},
-      [4] = {PB_REQUIRED | PB_LEN, 32},
-      [5] = {PB_REQUIRED | PB_LEN, 32},
-      [6] = {PB_REQUIRED | PB_LEN, 32},
-      [7] = {PB_REQUIRED | PB_LEN, 32},
-      [8] = {PB_REQUIRED | PB_UINT32},
-      [9] = {PB_REQUIRED | PB_UINT32},
-      [10] = {PB_REQUIRED | PB_UINT32},
-      [11] = {PB_REQUIRED | PB_LEN, 32},
-      [12] = {PB_REQUIRED | PB_UINT32},
-      [13] = {PB_REQUIRED | PB_UINT32},
-      [14] = {PB_REQUIRED | PB_UINT32},
-      [15] = {PB_REQUIRED | PB_LEN, 32},
-  };
-  if (ParseProtobuf(p, n, fields, 16))
-    return OMEMO0_EPROTOBUF;
-  memcpy(session->remoteidentity, fields[1].p, 32);
-  memcpy(session->state.dhs.prv, fields[2].p, 32);
-  memcpy(session->state.dhs.pub, fields[3].p, 32);
-  memcpy(session->state.dhr, fields[4].p, 32);
-  memcpy(session->state.rk, fields[5].p, 32);
-  memcpy(session->state.cks, fields[6].p, 32);
-  memcpy(session->state.ckr, fields[7].p, 32);
-  session->state.ns = fields[8].v;
-  session->state.nr = fields[9].v;
-  session->state.pn = fields[10].v;
-  memcpy(session->usedek, fields[11].p, 32);
-  session->usedpk_id = fields[12].v;
-  session->usedspk_id = fields[13].v;
-  session->init = fields[14].v;
-  memcpy(session->identity, fields[15].p, 32);
-  return 0;
+  return omemoCoreDeserializeSession(p, n, (omemoCoreSession *)session);
 }
@@ -28,6 +28,8 @@
 #endif
 
 #define OMEMO0_NUMPREKEYS 100
+#define OMEMO0_SIGCACHE_SIZE 64
+#define OMEMO0_INTERNAL_VERIFYBATCH 16
 
 #define OMEMO0_EPROTOBUF (-1)
 #define OMEMO0_ECRYPTO   (-2)
@@ -39,6 +41,59 @@
 #define OMEMO0_EUSER     (-8)
 #define OMEMO0_ERANDOM   (-9)
 
+#define OMEMO0_CPU_BMI2ADX   (1 << 0)
+#define OMEMO0_CPU_AESNI     (1 << 1)
+#define OMEMO0_CPU_ARMCRYPTO (1 << 2)
+
+#define OMEMO0_DRIVER_CURVE 0
+#define OMEMO0_DRIVER_AES   1
+#define OMEMO0_DRIVER_HASH  2
+
+// Public functions that have a latency histogram in omemo0Stats.
+#define OMEMO0_STAT_SETUPSTORE         0
+#define OMEMO0_STAT_REFILLPREKEYS      1
+#define OMEMO0_STAT_ROTATESIGNEDPREKEY 2
+#define OMEMO0_STAT_VERIFYBUNDLES      3
+#define OMEMO0_STAT_INITIATESESSION    4
+#define OMEMO0_STAT_ENCRYPTKEY         5
+#define OMEMO0_STAT_DECRYPTKEY         6
+#define OMEMO0_STAT_ENCRYPTMESSAGE     7
+#define OMEMO0_STAT_DECRYPTMESSAGE     8
+#define OMEMO0_STAT_NUMAPIS            9
+#define OMEMO0_STAT_NUMBUCKETS         40
+
+// Operations passed to the trace hooks, the driver primitives and the
+// user callbacks.
+#define OMEMO0_TRACE_X25519            0
+#define OMEMO0_TRACE_CVPRVTOPUB        1
+#define OMEMO0_TRACE_CVPRVTOEDPUB      2
+#define OMEMO0_TRACE_CVPUBTOEDPUB      3
+#define OMEMO0_TRACE_EDPUBTOCVPUB      4
+#define OMEMO0_TRACE_CVPUBTOEDPUBBATCH 5
+#define OMEMO0_TRACE_EDPUBTOCVPUBBATCH 6
+#define OMEMO0_TRACE_EDSEEDTOPUBPRV    7
+#define OMEMO0_TRACE_EDSIGN            8
+#define OMEMO0_TRACE_EDVERIFY          9
+#define OMEMO0_TRACE_EDVERIFYBATCH     10
+#define OMEMO0_TRACE_HMAC              11
+#define OMEMO0_TRACE_HKDF              12
+#define OMEMO0_TRACE_AESENCRYPT        13
+#define OMEMO0_TRACE_AESDECRYPT        14
+#define OMEMO0_TRACE_AESCBCHMAC        15
+#define OMEMO0_TRACE_GCMENCRYPT        16
+#define OMEMO0_TRACE_GCMDECRYPT        17
+#define OMEMO0_TRACE_AESSETKEY         18
+#define OMEMO0_TRACE_AESCBC            19
+#define OMEMO0_TRACE_AESGCMSTART       20
+#define OMEMO0_TRACE_AESGCMUPDATE      21
+#define OMEMO0_TRACE_AESGCMFINISH      22
+#define OMEMO0_TRACE_HMACSTART         23
+#define OMEMO0_TRACE_HMACUPDATE        24
+#define OMEMO0_TRACE_HMACFINISH        25
+#define OMEMO0_TRACE_LOADMESSAGEKEY    26
+#define OMEMO0_TRACE_STOREMESSAGEKEY   27
+#define OMEMO0_TRACE_RANDOM            28
+
 
 
 #define OMEMO0_KEYSIZE                        32
@@ -56,6 +111,17 @@ typedef uint8_t omemo0Key[32];
 typedef uint8_t omemo0SerializedKey[1 + 32];
 typedef uint8_t omemo0CurveSignature[64];
 
+// Counters since the start of the program or the last reset, see
+// omemo0GetStats.
+struct omemo0Stats {
+  uint64_t x25519, hmac, hkdf, aes;
+  uint64_t skippedstored, skippedloaded;
+  uint64_t ratchetsteps, prekeysused;
+  // latency[api][i] counts the calls to api that took less than 2^(i+1)
+  // ns and at least 2^i ns, the last bucket also counts slower ones.
+  uint64_t latency[OMEMO0_STAT_NUMAPIS][OMEMO0_STAT_NUMBUCKETS];
+};
+
 struct omemo0KeyPair {
   omemo0Key prv;
   omemo0Key pub;
@@ -85,9 +151,12 @@ struct omemo0State {
   uint32_t ns, nr, pn;
 };
 
+// Maximum size of an encrypted key message.
+#define OMEMO0_KEYMESSAGE_MAXSIZE                                       \
+  (OMEMO0_INTERNAL_PREKEYHEADER_MAXSIZE + OMEMO0_INTERNAL_ENCRYPTED_MAXSIZE)
+
 struct omemo0KeyMessage {
-  uint8_t p[OMEMO0_INTERNAL_PREKEYHEADER_MAXSIZE +
-            OMEMO0_INTERNAL_ENCRYPTED_MAXSIZE];
+  uint8_t p[OMEMO0_KEYMESSAGE_MAXSIZE];
   size_t n;
   bool isprekey;
 };
@@ -95,15 +164,82 @@ struct omemo0KeyMessage {
 struct omemo0Store {
   bool init;
   struct omemo0KeyPair identity;
+  // identity.pub as Ed25519 key for OMEMO 0.3 and as X25519 key for
+  // OMEMO 2, derived once so signing and X3DH don't convert it again.
+  omemo0Key identityalt;
   struct omemo0SignedPreKey cursignedprekey, prevsignedprekey;
   struct omemo0PreKey prekeys[OMEMO0_NUMPREKEYS];
   uint32_t pkcounter;
 };
 
+// Signed prekey part of a bundle, see omemo0VerifyBundles.
+struct omemo0Bundle {
+  omemo0CurveSignature spks;
+  omemo0SerializedKey spk, ik;
+};
+
+// Hashes of recently verified bundle signatures, see
+// omemo0SetSignatureCache.
+struct omemo0SignatureCache {
+  omemo0Key salt;
+  uint8_t entries[OMEMO0_SIGCACHE_SIZE][16];
+  uint32_t next;
+};
+
+// Cipher key, MAC key and IV derived from a message key.
+struct omemo0InternalDerivedKeys {
+  omemo0Key cipher, mac;
+  uint8_t iv[16];
+};
+
+// The temporaries of the API calls, see omemo0Context.
+struct omemo0Scratch {
+  uint8_t macinput[2 * sizeof(omemo0SerializedKey) +
+                   OMEMO0_INTERNAL_FULLMSG_MAXSIZE + 4];
+  uint8_t payload[OMEMO0_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
+  uint8_t secret[32 * 5];
+  uint8_t dh[32], masterkey[64];
+  omemo0Key mk;
+  struct omemo0InternalDerivedKeys kdfout[1];
+  struct omemo0State state[1];
+  omemo0CurveSignature sigs[OMEMO0_INTERNAL_VERIFYBATCH];
+  omemo0Key pubs[OMEMO0_INTERNAL_VERIFYBATCH];
+  omemo0Key alts[OMEMO0_INTERNAL_VERIFYBATCH];
+  const uint8_t *iks[OMEMO0_INTERNAL_VERIFYBATCH];
+  uint8_t msgs[OMEMO0_INTERNAL_VERIFYBATCH][sizeof(omemo0SerializedKey)];
+  uint8_t *msgp[OMEMO0_INTERNAL_VERIFYBATCH];
+  size_t msgn[OMEMO0_INTERNAL_VERIFYBATCH], idx[OMEMO0_INTERNAL_VERIFYBATCH];
+  uint8_t hashes[OMEMO0_INTERNAL_VERIFYBATCH][16];
+  bool cache[OMEMO0_INTERNAL_VERIFYBATCH];
+};
+
+struct omemoDriverAes;
+struct omemoDriverHmac;
+
+// Memory the API calls of a thread work in, see omemo0SetContext.
+struct omemo0Context {
+  struct omemo0Scratch scratch;
+  struct omemoDriverAes *aes;
+  struct omemoDriverHmac *hmac;
+};
+
+// State of a streamed payload, see omemo0EncryptMessageInit.
+struct omemo0PayloadStream {
+  struct omemoDriverAes *aes;
+  struct omemoDriverHmac *hmac;
+  uint8_t key[48];
+  size_t keyn;
+  uint8_t iv[16], buf[16];
+  size_t bufn;
+};
+
 struct omemo0Session {
   int init;
   omemo0Key identity;
   omemo0Key remoteidentity;
+  // Optional cached remoteidentity in the other curve form, zero when
+  // unknown.
+  omemo0Key remoteidentityalt;
   struct omemo0State state;
   omemo0Key usedek;
   uint32_t usedpk_id, usedspk_id;
@@ -119,6 +255,10 @@ typedef int (*omemo0StoreMessageKeyCallback)(
 
 typedef int (*omemo0RandomCallback)(void *p, size_t n);
 
+// op is one of OMEMO0_TRACE_*, session is the session of the API call
+// that caused it or NULL.
+typedef void (*omemo0TraceCallback)(int op, struct omemo0Session *session);
+
 int omemo0LoadMessageKey(struct omemo0Session *s,
                         struct omemo0MessageKey *sk);
 
@@ -136,6 +276,102 @@ OMEMO0_EXPORT void omemo0SetCallbacks(omemo0LoadMessageKeyCallback,
                                     omemo0StoreMessageKeyCallback,
                                     omemo0RandomCallback);
 
+/**
+ * Set global hooks that are called right before and after every driver
+ * primitive and every call to the callbacks above. Pass NULL to remove
+ * them, which leaves only a branch per call. Like omemo0SetCallbacks
+ * they should be set before other threads use the library, the hooks
+ * themselves may be called from any thread.
+ */
+OMEMO0_EXPORT void omemo0SetTraceHooks(omemo0TraceCallback begin,
+                                     omemo0TraceCallback end);
+
+/**
+ * Initialize an empty signature cache with a random salt.
+ *
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int
+omemo0SetupSignatureCache(struct omemo0SignatureCache *cache);
+
+/**
+ * Remember verified signed prekey signatures in cache, so that
+ * omemo0InitiateSession and omemo0VerifyBundles don't verify the same
+ * bundle twice. Calling omemo0VerifyBundles warms the cache. The cache
+ * contains no pointers, so it can be saved to disk and loaded again as
+ * is. Pass NULL to stop using it. Like omemo0SetCallbacks this is global,
+ * so the cache must not be used from multiple threads at once.
+ */
+OMEMO0_EXPORT void
+omemo0SetSignatureCache(struct omemo0SignatureCache *cache);
+
+/**
+ * Create the driver objects of ctx. This is the only allocation, the
+ * API calls made with ctx set reuse them and keep all their
+ * temporaries in ctx->scratch, so nothing is allocated or left on the
+ * stack while encrypting or decrypting.
+ *
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0SetupContext(struct omemo0Context *ctx);
+
+/**
+ * Destroy the driver objects of ctx and wipe it, which also clears the
+ * leftover key material of all calls made with it.
+ */
+OMEMO0_EXPORT void omemo0FreeContext(struct omemo0Context *ctx);
+
+/**
+ * Use ctx for the API calls made by this thread, NULL goes back to the
+ * stack and the one-shot driver functions. Every thread needs its own
+ * context and the callbacks must not call into the library. When the
+ * library is compiled with -DOMEMO0_SMALLSTACK the calls fail with
+ * OMEMO0_ESTATE until a context is set. GCM payloads are not split over
+ * the threads of omemo0SetGcmThreads while a context is set.
+ */
+OMEMO0_EXPORT void omemo0SetContext(struct omemo0Context *ctx);
+
+/**
+ * @returns OMEMO0_CPU_* features that are detected on this CPU and not
+ * disabled with omemo0SetCpuFeatures()
+ */
+OMEMO0_EXPORT uint32_t omemo0GetCpuFeatures(void);
+
+/**
+ * Only allow the drivers to use the OMEMO0_CPU_* features in mask, 0
+ * forces the portable implementations. This is shared between OMEMO
+ * versions and should not be called while other threads are using the
+ * library.
+ */
+OMEMO0_EXPORT void omemo0SetCpuFeatures(uint32_t mask);
+
+/**
+ * Split AES-GCM of payloads of at least threshold bytes over n threads,
+ * the output is the same as with one thread (the default). Only the
+ * in-tree AES driver (aes.c) does this, other drivers ignore it. Like
+ * omemo0SetCpuFeatures it should not be called while other threads are
+ * using the library.
+ */
+OMEMO0_EXPORT void omemo0SetGcmThreads(int n, size_t threshold);
+
+/**
+ * @param kind is one of OMEMO0_DRIVER_*
+ * @returns name of the implementation currently used for kind, or NULL
+ */
+OMEMO0_EXPORT const char *omemo0GetDriverImpl(int kind);
+
+/**
+ * Copy the operation counters and latency histograms to stats and
+ * optionally reset them. They are only collected when the library is
+ * compiled with -DOMEMO0_STATS, the counters are atomic but a snapshot
+ * taken while other threads use the library may be slightly
+ * inconsistent. InitiateVerifiedSession is counted as InitiateSession
+ * and EncryptKeyTo as EncryptKey.
+ *
+ * @returns 0 or OMEMO0_ESTATE if statistics are compiled out
+ */
+OMEMO0_EXPORT int omemo0GetStats(struct omemo0Stats *stats, bool reset);
+
 /**
  * Serialize a raw public key into the OMEMO public key format.
  */
@@ -216,6 +452,44 @@ OMEMO0_EXPORT int omemo0InitiateSession(struct omemo0Session *session,
                                       const omemo0SerializedKey pk,
                                       uint32_t spk_id, uint32_t pk_id);
 
+/**
+ * Verify the signed prekey signatures of n bundles at once, which is
+ * faster than letting omemo0InitiateSession verify them one by one.
+ * Sessions can then be started with omemo0InitiateVerifiedSession for the
+ * bundles where ok[i] is true.
+ *
+ * @param ok receives for each bundle whether its signature is valid
+ * @returns 0, OMEMO0_ECORRUPT if any signature is invalid or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0VerifyBundles(const struct omemo0Bundle *bundles,
+                                    bool *ok, size_t n);
+
+/**
+ * Set the remote identity key of n sessions at once, iks[i] for
+ * sessions[i]. The converted forms of the keys that are cached in the
+ * sessions are computed together, which is faster than letting
+ * omemo0InitiateSession or omemo0DecryptKey do it for each device. Use it
+ * when importing the devices of a roster. Sessions that are already
+ * initialized must have the same remote identity.
+ *
+ * @returns 0, OMEMO0_ESTATE when an identity doesn't match or OMEMO0_E*
+ */
+OMEMO0_EXPORT int
+omemo0ImportRemoteIdentities(struct omemo0Session **sessions,
+                            const omemo0SerializedKey *iks, size_t n);
+
+/**
+ * Same as omemo0InitiateSession, but without verifying the signature of
+ * the signed prekey. Only use for bundles that passed
+ * omemo0VerifyBundles.
+ *
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0InitiateVerifiedSession(
+    struct omemo0Session *session, const struct omemo0Store *store,
+    const omemo0SerializedKey spk, const omemo0SerializedKey ik,
+    const omemo0SerializedKey pk, uint32_t spk_id, uint32_t pk_id);
+
 /**
  * Encrypt message encryption key payload for a specific recipient.
  *
@@ -224,6 +498,30 @@ OMEMO0_EXPORT int omemo0InitiateSession(struct omemo0Session *session,
 OMEMO0_EXPORT int omemo0EncryptKey(struct omemo0Session *session,
                                  struct omemo0KeyMessage *msg,
                                  const uint8_t *key, size_t keyn);
+
+/**
+ * Same as omemo0EncryptKey, but the message is written directly to d,
+ * e.g. a buffer shared by the messages for all recipients.
+ *
+ * @param dn is the size of d and is set to the size of the message,
+ * which is omemo0GetKeyMessageSize() and at most
+ * OMEMO0_KEYMESSAGE_MAXSIZE
+ * @param isprekey is set like omemo0KeyMessage.isprekey
+ * @returns 0 or OMEMO0_E*, OMEMO0_EPARAM if d is too small
+ */
+OMEMO0_EXPORT int omemo0EncryptKeyTo(struct omemo0Session *session,
+                                   uint8_t *d, size_t *dn,
+                                   bool *isprekey, const uint8_t *key,
+                                   size_t keyn);
+
+/**
+ * @returns the size of the message the next omemo0EncryptKey or
+ * omemo0EncryptKeyTo call writes for a key of keyn bytes, 0 when session
+ * is NULL
+ */
+OMEMO0_EXPORT size_t
+omemo0GetKeyMessageSize(const struct omemo0Session *session, size_t keyn);
+
 /**
  * Decrypt message encryption key payload for a specific recipient.
  *
@@ -262,6 +560,9 @@ OMEMO0_EXPORT int omemo0Heartbeat(struct omemo0Session *session,
 /**
  * Encrypt message which will be stored in the <payload> element.
  *
+ * The ciphertext is as large as the plaintext. d may be s to encrypt in
+ * place.
+ *
  * @param key (out) will contain the encryption key
  * @param n is the size of the buffer in d and s
  *
@@ -275,6 +576,9 @@ OMEMO0_EXPORT int omemo0EncryptMessage(uint8_t *d, uint8_t key[32],
 /**
  * Decrypt message taken from the <payload> element.
  *
+ * d may be s to decrypt in place. If the tag does not match, d should
+ * be discarded as it might be partly written.
+ *
  * @param key is the decrypted key of the omemo0KeyMessage
  * @param keyn is the size of key, some clients might make the tag
  * larger than 16 bytes
@@ -286,4 +590,92 @@ OMEMO0_EXPORT int omemo0DecryptMessage(uint8_t *d, const uint8_t *key,
                                      size_t keyn, const uint8_t iv[12],
                                      const uint8_t *s, size_t n);
 
+
+/**
+ * Start encrypting a payload in pieces, for when it does not fit in
+ * memory at once. Call omemo0EncryptMessageUpdate for each piece and
+ * finish with omemo0EncryptMessageFinal. The result is the same as
+ * omemo0EncryptMessage over the concatenated pieces.
+ *
+ * If any of the streaming functions fails, the stream is freed.
+ * omemo0FreeMessageStream must be called only when a stream is abandoned
+ * before Final.
+ *
+ * @param iv (out) will contain the IV
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0EncryptMessageInit(struct omemo0PayloadStream *st,
+                                         uint8_t iv[12]);
+
+/**
+ * Encrypt the next n bytes of the payload.
+ *
+ * For OMEMO 0.3 n bytes are written to d and d may be s. For OMEMO 2
+ * the output is whole blocks, d must have room for n + 15 bytes and
+ * must not overlap s.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0EncryptMessageUpdate(struct omemo0PayloadStream *st,
+                                           uint8_t *d, size_t *outn,
+                                           const uint8_t *s, size_t n);
+
+/**
+ * Finish the payload and free the stream. For OMEMO 2 the last 16 bytes
+ * are written to d, for OMEMO 0.3 nothing.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @param key (out) will contain the encryption key, like with
+ * omemo0EncryptMessage
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0EncryptMessageFinal(struct omemo0PayloadStream *st,
+                                          uint8_t *d, size_t *outn,
+                                          uint8_t key[OMEMO0_KEYSIZE]);
+
+
+/**
+ * Start decrypting a payload in pieces, see omemo0EncryptMessageInit.
+ *
+ * The payload is only authenticated by omemo0DecryptMessageFinal, the
+ * output of omemo0DecryptMessageUpdate must not be used before it
+ * succeeds.
+ *
+ * @param key is the decrypted key of the omemo0KeyMessage
+ * @param keyn is the size of key
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0DecryptMessageInit(struct omemo0PayloadStream *st,
+                                         const uint8_t *key, size_t keyn,
+                                         const uint8_t iv[12]);
+
+/**
+ * Decrypt the next n bytes of the payload, with the same buffer rules
+ * as omemo0EncryptMessageUpdate. For OMEMO 2 the last block is held back
+ * until omemo0DecryptMessageFinal.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO0_E*
+ */
+OMEMO0_EXPORT int omemo0DecryptMessageUpdate(struct omemo0PayloadStream *st,
+                                           uint8_t *d, size_t *outn,
+                                           const uint8_t *s, size_t n);
+
+/**
+ * Check the payload and free the stream. For OMEMO 2 the rest of the
+ * plaintext, at most 15 bytes, is written to d, for OMEMO 0.3 nothing.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO0_E*, in which case the whole output must be
+ * discarded
+ */
+OMEMO0_EXPORT int omemo0DecryptMessageFinal(struct omemo0PayloadStream *st,
+                                          uint8_t *d, size_t *outn);
+
+/**
+ * Free a stream that is not finished.
+ */
+OMEMO0_EXPORT void omemo0FreeMessageStream(struct omemo0PayloadStream *st);
+
 #endif
@@ -20,6 +20,10 @@
 #include <sys/random.h>
 #endif
 
+#ifdef OMEMO2_STATS
+#include <time.h>
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -29,22 +33,70 @@
 #include "omemo2.h"
 #include "driver.h"
 
+#ifdef OMEMO2_INLINECORE
+#define CORESTATIC
+#include "core.c"
+#else
+#include "core.h"
+#endif
 
-#define HkdfInfoKeyExchange "OMEMO X3DH"
-#define HkdfInfoRootChain   "OMEMO Root Chain"
-#define HkdfInfoMessageKeys "OMEMO Message Key Material"
-#define HkdfInfoPayload     "OMEMO Payload"
+// Calls a hook of omemo2SetTraceHooks for the core.
+static void Trace(void (*hook)(void), int op, void *session) {
+  ((omemo2TraceCallback)hook)(op, session);
+}
 
-#define PbMsg_n          1
-#define PbMsg_pn         2
-#define PbMsg_dh_pub     3
-#define PbMsg_ciphertext 4
+// The callbacks of the user for the core, it adds the hooks.
+static int CoreLoadMessageKey(omemoCoreSession *s,
+                              omemoCoreMessageKey *k) {
+  return omemo2LoadMessageKey((struct omemo2Session *)s,
+                             (struct omemo2MessageKey *)k);
+}
 
-#define PbKeyEx_pk_id   1
-#define PbKeyEx_spk_id  2
-#define PbKeyEx_ik      3
-#define PbKeyEx_ek      4
-#define PbKeyEx_message 5
+static int CoreStoreMessageKey(omemoCoreSession *s,
+                               const omemoCoreMessageKey *k, uint64_t n) {
+  return omemo2StoreMessageKey((struct omemo2Session *)s,
+                              (const struct omemo2MessageKey *)k, n);
+}
+
+_Static_assert(sizeof(struct omemo2Store) == sizeof(omemoCoreStore),
+               "store layout differs from the core");
+_Static_assert(sizeof(struct omemo2Session) == sizeof(omemoCoreSession),
+               "session layout differs from the core");
+
+#ifdef OMEMO2_STATS
+#define COUNTSTATS true
+#else
+#define COUNTSTATS false
+#endif
+
+
+#define MACSIZE 16
+
+static const struct omemoCoreProtocol Protocol = {
+    .v2 = true,
+    .serlen = sizeof(omemo2SerializedKey),
+    .macsize = MACSIZE,
+    .msg_n = 1,
+    .msg_pn = 2,
+    .msg_dh_pub = 3,
+    .msg_ciphertext = 4,
+    .keyex_pk_id = 1,
+    .keyex_spk_id = 2,
+    .keyex_ik = 3,
+    .keyex_ek = 4,
+    .keyex_message = 5,
+    .info_keyexchange = "OMEMO X3DH",
+    .info_rootchain = "OMEMO Root Chain",
+    .info_messagekeys = "OMEMO Message Key Material",
+    .info_payload = "OMEMO Payload",
+    .maxpayload = OMEMO2_INTERNAL_PAYLOAD_MAXPADDEDSIZE,
+    .maxfullmsg = OMEMO2_INTERNAL_FULLMSG_MAXSIZE,
+    .stats = COUNTSTATS,
+    .trace = Trace,
+    .random = omemo2Random,
+    .loadmessagekey = CoreLoadMessageKey,
+    .storemessagekey = CoreStoreMessageKey,
+};
 
 
 #define TRY(expr)                                                      \
@@ -60,15 +112,10 @@
     assert(_r_);                                                       \
   } while (0)
 
-enum {
-  SESSION_UNINIT = 0,
-  SESSION_INIT,
-  SESSION_READY,
-  SESSION_HEARTBEAT,
-};
-
 #define SerLen sizeof(omemo2SerializedKey)
 
+static const uint8_t Zero32[32];
+
 static omemo2LoadMessageKeyCallback  g_lmkcb;
 static omemo2StoreMessageKeyCallback g_smkcb;
 static omemo2RandomCallback          g_rndcb;
@@ -104,200 +151,294 @@ void omemo2SetCallbacks(omemo2LoadMessageKeyCallback lmk,
   g_rndcb = rnd;
 }
 
-void omemo2SerializeKey(omemo2SerializedKey k,
-                                    const omemo2Key pub) {
-  memcpy(k, pub, SerLen);
+// The state between the API calls is in the core, see
+// omemoCoreRuntime.
+
+static inline struct omemoCoreRuntime *Runtime(void) {
+  return omemoCoreGetRuntime(&Protocol);
 }
 
-static inline const uint8_t *GetRawKey(const omemo2SerializedKey k) {
-  return k;
+static inline struct omemoCoreThread *Thread(void) {
+  return omemoCoreGetThread(&Protocol);
 }
 
-/***************************** PROTOBUF ******************************/
+// Context of the API calls on this thread, see omemo2SetContext.
+static inline struct omemo2Context *GetContext(void) {
+  return Thread()->context;
+}
+
+int omemo2SetupContext(struct omemo2Context *ctx) {
+  if (!ctx)
+    return OMEMO2_EPARAM;
+  memset(ctx, 0, sizeof(struct omemo2Context));
+  if (!(ctx->aes = omemoDriverAesCreate()) ||
+      !(ctx->hmac = omemoDriverHmacCreate())) {
+    omemo2FreeContext(ctx);
+    return OMEMO2_ECRYPTO;
+  }
+  return 0;
+}
+
+void omemo2FreeContext(struct omemo2Context *ctx) {
+  if (ctx) {
+    if (GetContext() == ctx)
+      omemo2SetContext(NULL);
+    omemoDriverAesDestroy(ctx->aes);
+    omemoDriverHmacDestroy(ctx->hmac);
+    memset(ctx, 0, sizeof(struct omemo2Context));
+  }
+}
+
+void omemo2SetContext(struct omemo2Context *ctx) {
+  struct omemoCoreThread *t = Thread();
+  t->context = ctx;
+  t->aes = ctx ? ctx->aes : NULL;
+  t->hmac = ctx ? ctx->hmac : NULL;
+}
+
+void omemo2SetTraceHooks(omemo2TraceCallback begin, omemo2TraceCallback end) {
+  Runtime()->tracebegin = (void (*)(void))begin;
+  Runtime()->traceend = (void (*)(void))end;
+}
+
+static void EndTraceSession(void **prev) {
+  Thread()->session = *prev;
+}
+
+// Reports session to the hooks until the function returns.
+#define TRACESESSION(session)                                          \
+  void *_ts_ __attribute__((cleanup(EndTraceSession))) =               \
+      Thread()->session;                                               \
+  Thread()->session = session
+
+#define TRACE(op, call)                                                \
+  ({                                                                   \
+    omemoCoreTraceBegin(&Protocol, op);                                \
+    __typeof__(call) _tr_ = call;                                      \
+    omemoCoreTraceEnd(&Protocol, op);                                  \
+    _tr_;                                                              \
+  })
+
+#define TRACEV(op, call)                                               \
+  (omemoCoreTraceBegin(&Protocol, op), call,                           \
+   omemoCoreTraceEnd(&Protocol, op))
+
+// Every call below goes through the hooks, a macro is not expanded
+// again inside its own expansion. The one-shot primitives go through
+// the core, which also uses the context.
+#define omemo2LoadMessageKey(...)                                       \
+  TRACE(OMEMO2_TRACE_LOADMESSAGEKEY, omemo2LoadMessageKey(__VA_ARGS__))
+#define omemo2StoreMessageKey(...)                                      \
+  TRACE(OMEMO2_TRACE_STOREMESSAGEKEY, omemo2StoreMessageKey(__VA_ARGS__))
+#define omemo2Random(...) TRACE(OMEMO2_TRACE_RANDOM, omemo2Random(__VA_ARGS__))
+#define omemoDriverX25519(...)                                         \
+  TRACE(OMEMO2_TRACE_X25519, omemoDriverX25519(__VA_ARGS__))
+#define omemoDriverCvPrvToPub(...)                                     \
+  TRACEV(OMEMO2_TRACE_CVPRVTOPUB, omemoDriverCvPrvToPub(__VA_ARGS__))
+#define omemoDriverCvPrvToEdPub(...)                                   \
+  TRACEV(OMEMO2_TRACE_CVPRVTOEDPUB, omemoDriverCvPrvToEdPub(__VA_ARGS__))
+#define omemoDriverCvPubToEdPub(...)                                   \
+  TRACEV(OMEMO2_TRACE_CVPUBTOEDPUB, omemoDriverCvPubToEdPub(__VA_ARGS__))
+#define omemoDriverEdPubToCvPub(...)                                   \
+  TRACEV(OMEMO2_TRACE_EDPUBTOCVPUB, omemoDriverEdPubToCvPub(__VA_ARGS__))
+#define omemoDriverCvPubToEdPubBatch(...)                              \
+  TRACEV(OMEMO2_TRACE_CVPUBTOEDPUBBATCH,                                \
+         omemoDriverCvPubToEdPubBatch(__VA_ARGS__))
+#define omemoDriverEdPubToCvPubBatch(...)                              \
+  TRACEV(OMEMO2_TRACE_EDPUBTOCVPUBBATCH,                                \
+         omemoDriverEdPubToCvPubBatch(__VA_ARGS__))
+#define omemoDriverEdSeedToPubPrv(...)                                 \
+  TRACEV(OMEMO2_TRACE_EDSEEDTOPUBPRV, omemoDriverEdSeedToPubPrv(__VA_ARGS__))
+#define omemoDriverEdSignMod(...)                                      \
+  TRACEV(OMEMO2_TRACE_EDSIGN, omemoDriverEdSignMod(__VA_ARGS__))
+#define omemoDriverEdVerify(...)                                       \
+  TRACE(OMEMO2_TRACE_EDVERIFY, omemoDriverEdVerify(__VA_ARGS__))
+#define omemoDriverEdVerifyBatch(...)                                  \
+  TRACE(OMEMO2_TRACE_EDVERIFYBATCH, omemoDriverEdVerifyBatch(__VA_ARGS__))
+#define omemoDriverHmac(...) omemoCoreHmac(&Protocol, __VA_ARGS__)
+#define omemoDriverHkdf(...) omemoCoreHkdf(&Protocol, __VA_ARGS__)
+#define omemoDriverAesEncrypt(...)                                     \
+  omemoCoreAesEncrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesDecrypt(...)                                     \
+  omemoCoreAesDecrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesCbcHmac(...)                                     \
+  omemoCoreAesCbcHmac(&Protocol, __VA_ARGS__)
+#define omemoDriverGcmEncrypt(...)                                     \
+  omemoCoreGcmEncrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverGcmDecrypt(...)                                     \
+  omemoCoreGcmDecrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesSetKey(...)                                      \
+  TRACE(OMEMO2_TRACE_AESSETKEY, omemoDriverAesSetKey(__VA_ARGS__))
+#define omemoDriverAesSetGcmKey(...)                                   \
+  TRACE(OMEMO2_TRACE_AESSETKEY, omemoDriverAesSetGcmKey(__VA_ARGS__))
+#define omemoDriverAesCbc(...)                                         \
+  TRACE(OMEMO2_TRACE_AESCBC, omemoDriverAesCbc(__VA_ARGS__))
+#define omemoDriverAesGcmStart(...)                                    \
+  TRACE(OMEMO2_TRACE_AESGCMSTART, omemoDriverAesGcmStart(__VA_ARGS__))
+#define omemoDriverAesGcmUpdate(...)                                   \
+  TRACE(OMEMO2_TRACE_AESGCMUPDATE, omemoDriverAesGcmUpdate(__VA_ARGS__))
+#define omemoDriverAesGcmFinish(...)                                   \
+  TRACE(OMEMO2_TRACE_AESGCMFINISH, omemoDriverAesGcmFinish(__VA_ARGS__))
+#define omemoDriverHmacStart(...)                                      \
+  TRACE(OMEMO2_TRACE_HMACSTART, omemoDriverHmacStart(__VA_ARGS__))
+#define omemoDriverHmacUpdate(...)                                     \
+  TRACE(OMEMO2_TRACE_HMACUPDATE, omemoDriverHmacUpdate(__VA_ARGS__))
+#define omemoDriverHmacFinish(...)                                     \
+  TRACE(OMEMO2_TRACE_HMACFINISH, omemoDriverHmacFinish(__VA_ARGS__))
+
+uint32_t omemo2GetCpuFeatures(void) {
+  return omemoDriverGetCpuFeatures();
+}
+
+void omemo2SetCpuFeatures(uint32_t mask) {
+  omemoDriverSetCpuFeatures(mask);
+}
+
+
+#define STAT(name) omemoCoreStat(&Protocol, name)
 
-// Protobuf: https://protobuf.dev/programming-guides/encoding/
+#ifdef OMEMO2_STATS
 
-// Only supports uint32 and len prefixed.
-struct ProtobufField {
-  int type;         // PB_*
-  uint32_t v;       // destination varint or LEN
-  const uint8_t *p; // LEN element data pointer or NULL
+static uint64_t StatNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct StatTimer {
+  int api;
+  uint64_t start;
 };
 
-#define PB_REQUIRED (1 << 3)
-#define PB_UINT32   0
-#define PB_LEN      2
+static void StopStatTimer(struct StatTimer *t) {
+  uint64_t ns = StatNow() - t->start;
+  int i = ns ? 63 - __builtin_clzll(ns) : 0;
+  if (i >= OMEMO2_STAT_NUMBUCKETS)
+    i = OMEMO2_STAT_NUMBUCKETS - 1;
+  __atomic_fetch_add(&Runtime()->stats.latency[t->api][i], 1,
+                     __ATOMIC_RELAXED);
+}
 
-/**
- * Parse Protobuf varint.
- *
- * Only supports uint32, higher bits are skipped so it will neither
- * overflow nor clamp to UINT32_MAX.
- *
- * @param s points to the location of the varint in the protobuf data
- * @param e points to the end of the protobuf data
- * @param v (out) points to the location where the parsed varint will be
- * written
- * @returns pointer to first byte after the varint or NULL if parsing is
- * not finished before reaching e
- */
-static const uint8_t *ParseVarInt(const uint8_t *s, const uint8_t *e,
-                                  uint32_t *v) {
-  int i = 0;
-  *v = 0;
-  do {
-    if (s >= e)
-      return NULL;
-    *v |= (*s & 0x7f) << i;
-    i += 7;
-  } while (*s++ & 0x80);
-  return s;
+// Adds the time until the function returns to the histogram of api.
+#define STATTIME(api)                                                  \
+  struct StatTimer _st_ __attribute__((cleanup(StopStatTimer))) = {   \
+      api, StatNow()}
+
+int omemo2GetStats(struct omemo2Stats *stats, bool reset) {
+  if (!stats)
+    return OMEMO2_EPARAM;
+  uint64_t *s = (uint64_t *)&Runtime()->stats, *d = (uint64_t *)stats;
+  for (size_t i = 0; i < sizeof(struct omemo2Stats) / sizeof(uint64_t); i++)
+    d[i] = reset ? __atomic_exchange_n(s + i, 0, __ATOMIC_RELAXED)
+                 : __atomic_load_n(s + i, __ATOMIC_RELAXED);
+  return 0;
 }
 
-/**
- * Parse data in Protobuf format.
- *
- * For each field encountered it does the following:
- * - Make sure the field number can be stored in `fields` and that the
- *   type corresponds with the one specified in the associated field.
- * - Mark the field number as found which later will be used to check
- *   whether all required fields are found.
- * - Parse the value.
- * - If there already is a non-zero value specified in the field, it is
- *   used to check whether the parsed value is the same.
- * `nfields` should have the value of the highest possible field number
- * + 1. `nfields` must be less than or equal to 16 because we only
- * support a single byte field number, the number is stored like this in
- * the byte: 0nnnnttt where n is the field number and t is the type.
- *
- * @param s is protobuf data
- * @param n is the length of said data
- * @param nfields is the amount of fields in the `fields` array
- * @returns false if successful, true if error
- */
-static bool ParseProtobuf(const uint8_t *s, size_t n,
-                          struct ProtobufField *fields, int nfields) {
-  int type, id;
-  uint32_t v;
-  const uint8_t *e = s + n;
-  uint32_t found = 0;
-  ASSERT(nfields <= 16);
-  while (s < e) {
-    // This is actually a varint, but we only support id < 16 and return
-    // an error otherwise, so we don't have to account for multiple-byte
-    // tags.
-    type = *s & 7;
-    id = *s >> 3;
-    s++;
-    if (id >= nfields || type != (fields[id].type & 7))
-      return true;
-    found |= 1 << id;
-    if (!(s = ParseVarInt(s, e, &v)))
-      return true;
-    // If field is fixed size, enforce it
-    if (fields[id].v && v != fields[id].v)
-      return true;
-    fields[id].v = v;
-    if (type == PB_LEN) {
-      fields[id].p = s;
-      s += fields[id].v;
-    }
-  }
-  if (s > e)
-    return true;
-  for (int i = 0; i < nfields; i++) {
-    if ((fields[i].type & PB_REQUIRED) && !(found & (1 << i)))
-      return true;
-  }
-  return false;
+#else
+
+#define STATTIME(api) (void)0
+
+int omemo2GetStats(struct omemo2Stats *stats, bool reset) {
+  if (!stats)
+    return OMEMO2_EPARAM;
+  memset(stats, 0, sizeof(struct omemo2Stats));
+  return OMEMO2_ESTATE;
 }
 
-static bool ParseRepeatingField(const uint8_t *s, const uint8_t *e,
-                                struct ProtobufField *field,
-                                int fieldid) {
-  int type, id;
-  uint32_t v;
-  ASSERT(fieldid <= 16);
-  while (s < e) {
-    type = *s & 7;
-    id = *s >> 3;
-    s++;
-    if (id >= 16 || (id == fieldid && type != (field->type & 7)))
-      return true;
-    if (!(s = ParseVarInt(s, e, &v)))
-      return true;
-    if (id == fieldid)
-      field->v = v;
-    if (type == PB_LEN) {
-      if (id == fieldid)
-        field->p = s;
-      s += v;
-    }
-    if (id == fieldid)
-      break;
+#endif
+
+struct Scratch {
+  void *p;
+  size_t n;
+};
+
+// The barrier keeps the compiler from dropping the stores to a buffer
+// that is about to go out of scope.
+static void WipeScratch(struct Scratch *s) {
+  memset(s->p, 0, s->n);
+  __asm__ volatile("" : : "r"(s->p) : "memory");
+}
+
+#define SCRATCHSIZE(name) sizeof(((struct omemo2Scratch *)0)->name)
+
+#ifdef OMEMO2_SMALLSTACK
+
+// Declares the temporary name as a pointer into the context of this
+// thread, it must be the first element of an array field. It is wiped
+// when the function returns.
+#define SCRATCH(name)                                                  \
+  if (!GetContext())                                                   \
+    return OMEMO2_ESTATE;                                               \
+  __typeof__(*GetContext()->scratch.name) *name =                      \
+      GetContext()->scratch.name;                                      \
+  struct Scratch name##_w_ __attribute__((cleanup(WipeScratch))) = {  \
+      name, SCRATCHSIZE(name)}
+
+#else
+
+// Same as above, but on the stack when this thread has no context.
+#define SCRATCH(name)                                                  \
+  __typeof__(((struct omemo2Scratch *)0)->name) name##_;               \
+  __typeof__(*name##_) *name =                                        \
+      GetContext() ? GetContext()->scratch.name : name##_;            \
+  struct Scratch name##_w_ __attribute__((cleanup(WipeScratch))) = {  \
+      name, SCRATCHSIZE(name)}
+
+#endif
+
+const char *omemo2GetDriverImpl(int kind) {
+  switch (kind) {
+  case OMEMO2_DRIVER_CURVE: return omemoDriverCurveImpl();
+  case OMEMO2_DRIVER_AES:   return omemoDriverAesImpl();
+  case OMEMO2_DRIVER_HASH:  return omemoDriverHashImpl();
   }
-  return s > e;
+  return NULL;
 }
 
-/**
- * Get the size of a properly formatted varint in bytes.
- */
-static inline int GetVarIntSize(uint32_t v) {
-  return 1 + (v > 0x7f) + (v > 0x3fff) + (v > 0x1fffff) +
-         (v > 0xfffffff);
+void omemo2SerializeKey(omemo2SerializedKey k,
+                                    const omemo2Key pub) {
+  omemoCoreSerializeKey(&Protocol, k, pub);
 }
 
-static uint8_t *FormatVarInt(uint8_t d[static 6], int type, int id,
-                             uint32_t v) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | type;
-  do {
-    *d = v & 0x7f;
-    v >>= 7;
-    *d++ |= (!!v << 7);
-  } while (v);
-  return d;
+static inline const uint8_t *GetRawKey(const omemo2SerializedKey k) {
+  return omemoCoreGetRawKey(&Protocol, k);
 }
 
+/***************************** PROTOBUF ******************************/
 
-static uint8_t *FormatKey(uint8_t d[static 34], int id,
-                          const omemo2Key k) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | PB_LEN;
-  *d++ = 32;
-  memcpy(d, k, 32);
-  return d + 32;
-}
+// The wire format is in core.c, these pass it the constants of this
+// version.
+
+#define ParseProtobuf       omemoCoreParseProtobuf
+#define ParseRepeatingField omemoCoreParseRepeatingField
+#define FormatVarInt        omemoCoreFormatVarInt
+#define FormatKey           omemoCoreFormatKey
 
-// Format Protobuf PreKeyWhisperMessage without message (it should be
-// appended right after this call).
-// This is OMEMOKeyExchange in schema
 static size_t FormatPreKeyMessage(
     uint8_t d[static OMEMO2_INTERNAL_PREKEYHEADER_MAXSIZE],
     uint32_t pk_id, uint32_t spk_id, const omemo2Key ik,
     const omemo2Key ek, uint32_t msgsz) {
-  uint8_t *p = d;
-  p = FormatVarInt(p, PB_UINT32, 1, pk_id);
-  p = FormatVarInt(p, PB_UINT32, 2, spk_id);
-  p = FormatKey(p, 3, ik);
-  p = FormatKey(p, 4, ek);
-  // msgsz can be > 127 so we reserve 3 bytes for this
-  p = FormatVarInt(p, PB_LEN, 5, msgsz);
-  return p - d;
-}
-
-// Format Protobuf WhisperMessage without ciphertext.
-//  HEADER(dh_pair, pn, n)
+  return omemoCoreFormatPreKeyMessage(&Protocol, d, pk_id, spk_id, ik,
+                                      ek, msgsz);
+}
+
 static size_t
 FormatMessageHeader(uint8_t d[static OMEMO2_INTERNAL_HEADER_MAXSIZE],
                     uint32_t n, uint32_t pn, const omemo2Key dhs,
                     size_t keyn) {
-  uint8_t *p = d;
-  p = FormatVarInt(p, PB_UINT32, 1, n);
-  p = FormatVarInt(p, PB_UINT32, 2, pn);
-  p = FormatKey(p, 3, dhs);
-  p = FormatVarInt(p, PB_LEN, 4, keyn);
-  return p - d;
+  return omemoCoreFormatMessageHeader(&Protocol, d, n, pn, dhs, keyn);
+}
+
+// Size of the message formatted by EncryptKeyImpl, without the prekey
+// header.
+static size_t GetMessageSize(uint32_t n, uint32_t pn, size_t encn) {
+  return omemoCoreGetMessageSize(&Protocol, n, pn, encn);
+}
+
+// Size of what FormatPreKeyMessage writes.
+static size_t GetPreKeyHeaderSize(uint32_t pk_id, uint32_t spk_id,
+                                  size_t msgsz) {
+  return omemoCoreGetPreKeyHeaderSize(&Protocol, pk_id, spk_id, msgsz);
 }
 
 /*************************** CRYPTOGRAPHY ****************************/
@@ -307,10 +448,7 @@ FormatMessageHeader(uint8_t d[static OMEMO2_INTERNAL_HEADER_MAXSIZE],
  */
 static int DoX25519(omemo2Key shared, const omemo2Key prv,
                     const omemo2Key pub) {
-  omemo2Key tmp, tmp2;
-  memcpy(tmp, prv, 32);
-  memcpy(tmp2, pub, 32);
-  return omemoDriverX25519(shared, tmp, tmp2);
+  return omemoCoreX25519(&Protocol, shared, prv, pub);
 }
 
 // For OMEMO 0.3, we use the sign_modified as is required.
@@ -328,42 +466,146 @@ static int DoX25519(omemo2Key shared, const omemo2Key prv,
 // Essentially the only deviations from regular EdDSA is the
 // addition of a randomized nonce to msg and the usage of the hash1(X)
 // variation on SHA-512.
+// ed is the Ed25519 public key of ik, see GetIdentityEd.
 static int CalculateCurveSignature(omemo2CurveSignature sig,
                                    const struct omemo2KeyPair *ik,
+                                   const omemo2Key ed,
                                    const uint8_t rnd[static 64],
                                    const uint8_t *msg, size_t msgn) {
   ASSERT(msgn <= SerLen);
   uint8_t msgbuf[SerLen + 64];
   memcpy(msgbuf, msg, msgn);
   memcpy(msgbuf + msgn, rnd, 64);
-  omemo2Key ikprv, ikpub;
+  omemo2Key ikprv, edpub;
   memcpy(ikprv, ik->prv, 32);
-  memcpy(ikpub, ik->pub, 32);
-  omemoDriverEdSignMod(sig, ikpub, ikprv, msgbuf, msgn);
+  memcpy(edpub, ed, 32);
+  omemoDriverEdSignMod(sig, edpub, ikprv, msgbuf, msgn);
   return 0;
 }
 
+// Our identity key as Ed25519 public key, for OMEMO 0.3 it is cached in
+// store->identityalt.
+static void GetIdentityEd(omemo2Key ed, const struct omemo2Store *store) {
+  memcpy(ed, store->identity.pub, 32);
+}
+
+static void DeriveIdentityAlt(struct omemo2Store *store) {
+  omemo2Key k;
+  memcpy(k, store->identity.pub, 32);
+  k[31] &= 0x7f;
+  omemoDriverEdPubToCvPub(store->identityalt, k);
+}
+
+// Remote identity key ik in the other curve form (without sign bit),
+// taken from session->remoteidentityalt when it was cached for ik.
+static void GetRemoteIdentityAlt(omemo2Key alt,
+                                 const struct omemo2Session *session,
+                                 const omemo2Key ik) {
+  if (session && !memcmp(session->remoteidentity, ik, 32) &&
+      memcmp(session->remoteidentityalt, Zero32, 32)) {
+    memcpy(alt, session->remoteidentityalt, 32);
+    return;
+  }
+  omemo2Key k;
+  memcpy(k, ik, 32);
+  k[31] &= 0x7f;
+  omemoDriverEdPubToCvPub(alt, k);
+}
+
+// GetRemoteIdentityAlt for n keys without the session cache, sharing
+// the field inversion.
+static void GetRemoteIdentityAlts(omemo2Key *alt, const uint8_t *const *ik,
+                                  size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    memcpy(alt[i], ik[i], 32);
+    alt[i][31] &= 0x7f;
+  }
+  omemoDriverEdPubToCvPubBatch(n, alt, alt);
+}
+
+// alt is the result of GetRemoteIdentityAlt or NULL when unknown.
+static void SetRemoteIdentity(struct omemo2Session *session,
+                              const omemo2Key ik, const omemo2Key alt) {
+  if (alt)
+    memcpy(session->remoteidentityalt, alt, 32);
+  else if (memcmp(session->remoteidentity, ik, 32))
+    memset(session->remoteidentityalt, 0, 32);
+  memcpy(session->remoteidentity, ik, 32);
+}
+
+// Converts the signature and public key to what omemoDriverEdVerify
+// expects. alt is pub from GetRemoteIdentityAlt or NULL.
+static void PrepareSignature(omemo2CurveSignature sig2, omemo2Key ed,
+                             const omemo2CurveSignature sig,
+                             const omemo2Key pub, const uint8_t *alt) {
+  memcpy(sig2, sig, 64);
+  memcpy(ed, pub, 32);
+}
+
 //  Sig(PK, M)
 static bool VerifySignature(const omemo2CurveSignature sig,
-                            const omemo2Key pub, const uint8_t *msg,
-                            size_t msgn) {
+                            const omemo2Key pub, const uint8_t *alt,
+                            const uint8_t *msg, size_t msgn) {
   ASSERT(msgn <= SerLen);
   uint8_t msgbuf[SerLen];
   memcpy(msgbuf, msg, msgn);
-  omemo2Key pubcpy;
-  memcpy(pubcpy, pub, 32);
+  omemo2Key ed;
   omemo2CurveSignature sig2;
-  memcpy(sig2, sig, 64);
-  return omemoDriverEdVerify(sig2, pubcpy, msgbuf, msgn);
+  PrepareSignature(sig2, ed, sig, pub, alt);
+  return omemoDriverEdVerify(sig2, ed, msgbuf, msgn);
+}
+
+int omemo2SetupSignatureCache(struct omemo2SignatureCache *cache) {
+  if (!cache)
+    return OMEMO2_EPARAM;
+  memset(cache, 0, sizeof(struct omemo2SignatureCache));
+  return omemo2Random(cache->salt, 32);
+}
+
+void omemo2SetSignatureCache(struct omemo2SignatureCache *cache) {
+  Runtime()->sigcache = cache;
+}
+
+static inline struct omemo2SignatureCache *GetSignatureCache(void) {
+  return Runtime()->sigcache;
+}
+
+// Cache entry for a bundle's signed prekey signature, returns false when
+// there is no cache.
+static bool HashBundle(uint8_t h[static 16], const omemo2CurveSignature spks,
+                       const omemo2SerializedKey spk,
+                       const omemo2SerializedKey ik) {
+  struct omemo2SignatureCache *c = GetSignatureCache();
+  uint8_t buf[SerLen * 2 + 64], mac[32];
+  if (!c)
+    return false;
+  memcpy(buf, ik, SerLen);
+  memcpy(buf + SerLen, spk, SerLen);
+  memcpy(buf + SerLen * 2, spks, 64);
+  STAT(hmac);
+  if (omemoDriverHmac(c->salt, buf, sizeof(buf), mac))
+    return false;
+  memcpy(h, mac, 16);
+  return true;
+}
+
+static bool IsBundleCached(const uint8_t h[static 16]) {
+  for (int i = 0; i < OMEMO2_SIGCACHE_SIZE; i++) {
+    if (!memcmp(GetSignatureCache()->entries[i], h, 16))
+      return true;
+  }
+  return false;
+}
+
+static void CacheBundle(const uint8_t h[static 16]) {
+  struct omemo2SignatureCache *c = GetSignatureCache();
+  uint32_t i = c->next % OMEMO2_SIGCACHE_SIZE;
+  memcpy(c->entries[i], h, 16);
+  c->next = (i + 1) % OMEMO2_SIGCACHE_SIZE;
 }
 
 static int GenerateKeyPair(struct omemo2KeyPair *kp) {
-  TRY(omemo2Random(kp->prv, sizeof(kp->prv)));
-  kp->prv[0] &= 0xf8;
-  kp->prv[31] &= 0x7f;
-  kp->prv[31] |= 0x40;
-  omemoDriverCvPrvToPub(kp->pub, kp->prv);
-  return 0;
+  return omemoCoreGenerateKeyPair(&Protocol, (omemoCoreKeyPair *)kp);
 }
 
 static int GenerateEdKeyPair(struct omemo2KeyPair *kp) {
@@ -375,14 +617,17 @@ static int GenerateEdKeyPair(struct omemo2KeyPair *kp) {
 
 static int GenerateSignedPreKey(struct omemo2SignedPreKey *spk,
                                 uint32_t id,
-                                const struct omemo2KeyPair *idkp) {
+                                const struct omemo2Store *store) {
   omemo2SerializedKey ser;
+  omemo2Key ed;
   spk->id = id;
   TRY(GenerateKeyPair(&spk->kp));
   omemo2SerializeKey(ser, spk->kp.pub);
   uint8_t rnd[64];
   TRY(omemo2Random(rnd, 64));
-  return CalculateCurveSignature(spk->sig, idkp, rnd, ser, SerLen);
+  GetIdentityEd(ed, store);
+  return CalculateCurveSignature(spk->sig, &store->identity, ed, rnd, ser,
+                                 SerLen);
 }
 
 /****************************** STORE ********************************/
@@ -393,6 +638,7 @@ static inline uint32_t IncrementWrapSkipZero(uint32_t n) {
 }
 
 int omemo2RefillPreKeys(struct omemo2Store *store) {
+  STATTIME(OMEMO2_STAT_REFILLPREKEYS);
   if (!store)
     return OMEMO2_EPARAM;
   int i;
@@ -414,14 +660,15 @@ static int omemo2SetupStoreImpl(struct omemo2Store *store) {
     return OMEMO2_EPARAM;
   memset(store, 0, sizeof(struct omemo2Store));
   TRY(GenerateEdKeyPair(&store->identity));
-  TRY(GenerateSignedPreKey(&store->cursignedprekey, 1,
-                           &store->identity));
+  DeriveIdentityAlt(store);
+  TRY(GenerateSignedPreKey(&store->cursignedprekey, 1, store));
   TRY(omemo2RefillPreKeys(store));
   store->init = true;
   return 0;
 }
 
 int omemo2SetupStore(struct omemo2Store *store) {
+  STATTIME(OMEMO2_STAT_SETUPSTORE);
   if (!store)
     return OMEMO2_EPARAM;
   int r;
@@ -432,140 +679,81 @@ int omemo2SetupStore(struct omemo2Store *store) {
 
 /*********************************************************************/
 
-#define ADSIZE (2 * SerLen)
-#define MACSIZE 16
-
-//  AD = Encode(IKA) || Encode(IKB)
-static void GetAd(uint8_t ad[static ADSIZE], const omemo2Key ika,
-                  const omemo2Key ikb) {
-  omemo2SerializeKey(ad, ika);
-  omemo2SerializeKey(ad + SerLen, ikb);
-}
-
-static int GetMac(uint8_t d[static MACSIZE], const omemo2Key ika,
-                  const omemo2Key ikb, const omemo2Key mk,
-                  const uint8_t *msg, size_t msgn) {
-  // This could theoretically happen while decrypting when the protobuf
-  // is needlessly large.
-  if (msgn > OMEMO2_INTERNAL_FULLMSG_MAXSIZE + 4)
-    return OMEMO2_ECORRUPT;
-  // Adding 4 in case some client has a large registration id
-  uint8_t macinput[ADSIZE + OMEMO2_INTERNAL_FULLMSG_MAXSIZE + 4],
-      mac[32];
-  GetAd(macinput, ika, ikb);
-  memcpy(macinput + ADSIZE, msg, msgn);
-  TRY(omemoDriverHmac(mk, macinput, ADSIZE + msgn, mac));
-  memcpy(d, mac, MACSIZE);
-  return 0;
-}
-
-#define GetPad(n) (16 - ((n) % 16))
-
-static int Encrypt(uint8_t out[OMEMO2_INTERNAL_PAYLOAD_MAXPADDEDSIZE],
-                   const uint8_t *in, size_t n, omemo2Key key,
-                   uint8_t iv[static 16]) {
-  uint8_t tmp[OMEMO2_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
-  int pad = GetPad(n);
-  memcpy(tmp, in, n);
-  memset(tmp + n, pad, pad);
-  TRY(omemoDriverAesEncrypt(key, n+pad, iv, tmp, out));
-  return n + pad;
-}
-
-static const uint8_t Zero32[32];
-
-#define DeriveKey(salt, secret, info, out)                             \
-  omemoDriverHkdf(salt,    \
-                sizeof(salt), secret, sizeof(secret), info,            \
-                sizeof(info) - 1, (uint8_t *)out, sizeof(out))
-
-struct __attribute__((__packed__)) DeriveChainKeyOutput {
-  omemo2Key cipher, mac;
-  uint8_t iv[16];
-};
+// Fills *out from the 32 byte secret with the HKDF info of Protocol,
+// out may point into the scratch.
+#define DeriveKey(secret, info, out)                                   \
+  omemoCoreDeriveKeys(&Protocol, (uint8_t *)(out), secret,             \
+                      Protocol.info)
 
 // d may be the same pointer as ck
 //  ck, mk = KDF_CK(ck)
 static int GetBaseMaterials(omemo2Key d, omemo2Key mk,
                              const omemo2Key ck) {
-  uint8_t data[1] = {1};
-  TRY(omemoDriverHmac(ck, data, 1, mk));
-  data[0] = 2;
-  TRY(omemoDriverHmac(ck, data, 1, d));
-  return 0;
-}
-
-// CKs, mk = KDF_CK(CKs)
-// header = HEADER(DHs, PN, Ns)
-// Ns += 1
-// return header, ENCRYPT(mk, plaintext, CONCAT(AD, header))
-static int EncryptKeyImpl(struct omemo2Session *session,
-                          struct omemo2KeyMessage *msg,
-                          const uint8_t *key, size_t keyn) {
-  if (!session->init)
-    return OMEMO2_ESTATE;
-  omemo2Key mk;
-  TRY(GetBaseMaterials(session->state.cks, mk, session->state.cks));
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, mk, HkdfInfoMessageKeys, kdfout));
-  msg->n = 0;
-  msg->p[msg->n++] = (1 << 3) | PB_LEN;
-  msg->p[msg->n++] = 16;
-  msg->n += 16;
-  msg->p[msg->n++] = (2 << 3) | PB_LEN;
-  // Hmac'd message will always be smaller than 128
-  msg->p[msg->n++] = 0x55; // replaced with actual size
-  msg->n += FormatMessageHeader(
-      msg->p + msg->n, session->state.ns, session->state.pn,
-      session->state.dhs.pub, keyn + GetPad(keyn));
-  msg->n +=
-      Encrypt(msg->p + msg->n, key, keyn, kdfout->cipher, kdfout->iv);
-  msg->p[19] = msg->n - 20;
-  TRY(GetMac(msg->p + 2, session->identity, session->remoteidentity,
-             kdfout->mac, msg->p + 20, msg->n - 20));
-  session->state.ns++;
-  if (session->init == SESSION_INIT) {
-    msg->isprekey = true;
-    // [message 00...] -> [00... message] -> [header 00... message] ->
-    // [header message]
-    memmove(msg->p + OMEMO2_INTERNAL_PREKEYHEADER_MAXSIZE, msg->p,
-            msg->n);
-    int headersz = FormatPreKeyMessage(
-        msg->p, session->usedpk_id, session->usedspk_id,
-        session->identity, session->usedek, msg->n);
-    memmove(msg->p + headersz,
-            msg->p + OMEMO2_INTERNAL_PREKEYHEADER_MAXSIZE, msg->n);
-    msg->n += headersz;
-  }
-  return 0;
+  return omemoCoreKdfCk(&Protocol, d, mk, ck);
 }
 
 int omemo2EncryptKey(struct omemo2Session *session,
                                  struct omemo2KeyMessage *msg,
                                  const uint8_t *key, size_t keyn) {
+  STATTIME(OMEMO2_STAT_ENCRYPTKEY);
+  TRACESESSION(session);
   if (!session || !msg || keyn > OMEMO2_KEYSIZE)
     return OMEMO2_EPARAM;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
   int r;
-  // Fields outside of session->state are not modified in
-  // EncryptKeyImpl() but we'll back them up to save a future headache.
-  struct omemo2Session backup;
-  memcpy(&backup, session, sizeof(struct omemo2Session));
-  memset(msg, 0, sizeof(struct omemo2KeyMessage));
-  if ((r = EncryptKeyImpl(session, msg, key, keyn))) {
-    memcpy(session, &backup, sizeof(struct omemo2Session));
+  msg->n = sizeof(msg->p);
+  if ((r = omemoCoreEncryptKey(&Protocol, (omemoCoreSession *)session,
+                               msg->p, &msg->n, &msg->isprekey, key, keyn,
+                               &sc)))
     memset(msg, 0, sizeof(struct omemo2KeyMessage));
-  }
   return r;
 }
 
+int omemo2EncryptKeyTo(struct omemo2Session *session, uint8_t *d,
+                      size_t *dn, bool *isprekey, const uint8_t *key,
+                      size_t keyn) {
+  STATTIME(OMEMO2_STAT_ENCRYPTKEY);
+  TRACESESSION(session);
+  if (!session || !d || !dn || !isprekey || keyn > OMEMO2_KEYSIZE)
+    return OMEMO2_EPARAM;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
+  return omemoCoreEncryptKey(&Protocol, (omemoCoreSession *)session, d, dn,
+                             isprekey, key, keyn, &sc);
+}
+
+size_t omemo2GetKeyMessageSize(const struct omemo2Session *session,
+                              size_t keyn) {
+  if (!session)
+    return 0;
+  return omemoCoreGetKeyMessageSize(&Protocol,
+                                    (const omemoCoreSession *)session, keyn);
+}
+
 // RK, ck = KDF_RK(RK, DH(DHs, DHr))
 static int DeriveRootKey(struct omemo2State *state, omemo2Key ck) {
-  uint8_t secret[32], masterkey[64];
-  TRY(DoX25519(secret, state->dhs.prv, state->dhr));
-  TRY(DeriveKey(state->rk, secret, HkdfInfoRootChain, masterkey));
-  memcpy(state->rk, masterkey, 32);
-  memcpy(ck, masterkey + 32, 32);
-  return 0;
+  SCRATCH(dh);
+  SCRATCH(masterkey);
+  struct omemoCoreScratch sc = {.dh = dh, .masterkey = masterkey};
+  return omemoCoreDeriveRootKey(&Protocol, (omemoCoreState *)state, ck,
+                                &sc);
 }
 
 // DH1 = DH(IKA, SPKB)
@@ -577,7 +765,7 @@ static int GetSharedSecret(omemo2Key sk, bool isbob, const omemo2Key ika,
                            const omemo2Key ska, const omemo2Key eka,
                            const omemo2Key ikb, const omemo2Key spkb,
                            const omemo2Key opkb) {
-  uint8_t secret[32 * 5] = {0}, tmpkey[32];
+  SCRATCH(secret);
   memset(secret, 0xff, 32);
   // When we are bob, we must swap the first two.
   TRY(DoX25519(secret + 32, isbob ? ska : ika, isbob ? ikb : spkb));
@@ -585,9 +773,7 @@ static int GetSharedSecret(omemo2Key sk, bool isbob, const omemo2Key ika,
   TRY(DoX25519(secret + 96, ska, spkb));
   // OMEMO mandates that the bundle MUST contain a prekey.
   TRY(DoX25519(secret + 128, eka, opkb));
-  TRY(DeriveKey(Zero32, secret, HkdfInfoKeyExchange, tmpkey));
-  memcpy(sk, tmpkey, 32);
-  return 0;
+  return omemoCoreKdfSharedSecret(&Protocol, sk, secret);
 }
 
 //  state.DHs = GENERATE_DH()
@@ -608,27 +794,96 @@ static int RatchetInitAlice(struct omemo2State *state, const omemo2Key sk,
   return DeriveRootKey(state, state->cks);
 }
 
-int omemo2InitiateSession(struct omemo2Session *session,
-                                      const struct omemo2Store *store,
-                                      const omemo2CurveSignature spks,
-                                      const omemo2SerializedKey spk,
-                                      const omemo2SerializedKey ik,
-                                      const omemo2SerializedKey pk,
-                                      uint32_t spk_id, uint32_t pk_id) {
-  if (!session || !store)
+#define VERIFYBATCH OMEMO2_INTERNAL_VERIFYBATCH
+
+int omemo2VerifyBundles(const struct omemo2Bundle *bundles, bool *ok,
+                       size_t n) {
+  STATTIME(OMEMO2_STAT_VERIFYBUNDLES);
+  if (!bundles || !ok)
     return OMEMO2_EPARAM;
-  if (!VerifySignature(spks, GetRawKey(ik), spk, SerLen)) {
-    return OMEMO2_ECORRUPT;
+  SCRATCH(sigs);
+  SCRATCH(pubs);
+  SCRATCH(alts);
+  SCRATCH(iks);
+  SCRATCH(msgs);
+  SCRATCH(msgp);
+  SCRATCH(msgn);
+  SCRATCH(idx);
+  SCRATCH(hashes);
+  SCRATCH(cache);
+  uint8_t seed[32];
+  int r = 0;
+  for (size_t i = 0; i < n;) {
+    size_t m = 0;
+    for (; i < n && m < VERIFYBATCH; i++) {
+      const struct omemo2Bundle *b = bundles + i;
+      cache[m] = HashBundle(hashes[m], b->spks, b->spk, b->ik);
+      if (cache[m] && IsBundleCached(hashes[m])) {
+        ok[i] = true;
+        continue;
+      }
+      iks[m] = GetRawKey(b->ik);
+      memcpy(msgs[m], b->spk, SerLen);
+      msgp[m] = msgs[m];
+      msgn[m] = SerLen;
+      idx[m++] = i;
+    }
+    if (!m)
+      break;
+    for (size_t j = 0; j < m; j++)
+      PrepareSignature(sigs[j], pubs[j], bundles[idx[j]].spks, iks[j],
+                       alts[j]);
+    TRY(omemo2Random(seed, 32));
+    bool all = omemoDriverEdVerifyBatch(m, sigs, pubs, msgp, msgn, seed);
+    // Find out which ones are bad.
+    for (size_t j = 0; j < m; j++) {
+      ok[idx[j]] =
+          all || omemoDriverEdVerify(sigs[j], pubs[j], msgp[j], SerLen);
+      if (!ok[idx[j]])
+        r = OMEMO2_ECORRUPT;
+      else if (cache[j])
+        CacheBundle(hashes[j]);
+    }
   }
+  return r;
+}
+
+int omemo2ImportRemoteIdentities(struct omemo2Session **sessions,
+                                const omemo2SerializedKey *iks, size_t n) {
+  if (!sessions || !iks)
+    return OMEMO2_EPARAM;
+  for (size_t i = 0; i < n; i++) {
+    if (!sessions[i])
+      return OMEMO2_EPARAM;
+    if (sessions[i]->init != SESSION_UNINIT &&
+        memcmp(sessions[i]->remoteidentity, GetRawKey(iks[i]), 32))
+      return OMEMO2_ESTATE;
+  }
+  SCRATCH(alts);
+  const uint8_t *raw[VERIFYBATCH];
+  for (size_t i = 0; i < n; i += VERIFYBATCH) {
+    size_t m = n - i < VERIFYBATCH ? n - i : VERIFYBATCH;
+    for (size_t j = 0; j < m; j++)
+      raw[j] = GetRawKey(iks[i + j]);
+    GetRemoteIdentityAlts(alts, raw, m);
+    for (size_t j = 0; j < m; j++)
+      SetRemoteIdentity(sessions[i + j], raw[j], alts[j]);
+  }
+  return 0;
+}
+
+static int InitiateSessionImpl(struct omemo2Session *session,
+                               const struct omemo2Store *store,
+                               const omemo2SerializedKey spk,
+                               const omemo2SerializedKey ik,
+                               const omemo2SerializedKey pk,
+                               uint32_t spk_id, uint32_t pk_id) {
   struct omemo2KeyPair eka;
   TRY(GenerateKeyPair(&eka));
-  omemo2Key sk;
-  omemo2Key ikx, edy;
-  memcpy(edy, GetRawKey(ik), 32);
-  edy[31] &= 0x7f;
-  omemoDriverEdPubToCvPub(ikx, edy);
+  omemo2Key sk, alt;
+  GetRemoteIdentityAlt(alt, session, GetRawKey(ik));
   TRY(GetSharedSecret(sk, false, store->identity.prv, eka.prv, eka.prv,
-                      ikx, GetRawKey(spk), GetRawKey(pk)));
+                      alt, GetRawKey(spk), GetRawKey(pk)));
   int r = RatchetInitAlice(&session->state, sk, GetRawKey(spk), &eka);
   if (r) {
     memset(&session->state, 0, sizeof(struct omemo2State));
@@ -636,13 +891,50 @@ int omemo2InitiateSession(struct omemo2Session *session,
   }
   memcpy(session->usedek, eka.pub, 32);
   memcpy(session->identity, store->identity.pub, 32);
-  memcpy(session->remoteidentity, GetRawKey(ik), 32);
+  SetRemoteIdentity(session, GetRawKey(ik), alt);
   session->usedpk_id = pk_id;
   session->usedspk_id = spk_id;
   session->init = SESSION_INIT;
   return 0;
 }
 
+int omemo2InitiateSession(struct omemo2Session *session,
+                                      const struct omemo2Store *store,
+                                      const omemo2CurveSignature spks,
+                                      const omemo2SerializedKey spk,
+                                      const omemo2SerializedKey ik,
+                                      const omemo2SerializedKey pk,
+                                      uint32_t spk_id, uint32_t pk_id) {
+  STATTIME(OMEMO2_STAT_INITIATESESSION);
+  TRACESESSION(session);
+  if (!session || !store)
+    return OMEMO2_EPARAM;
+  uint8_t h[16];
+  bool cache = HashBundle(h, spks, spk, ik);
+  if (!cache || !IsBundleCached(h)) {
+    omemo2Key alt;
+    GetRemoteIdentityAlt(alt, session, GetRawKey(ik));
+    if (!VerifySignature(spks, GetRawKey(ik), alt, spk, SerLen))
+      return OMEMO2_ECORRUPT;
+    if (cache)
+      CacheBundle(h);
+  }
+  return InitiateSessionImpl(session, store, spk, ik, pk, spk_id, pk_id);
+}
+
+int omemo2InitiateVerifiedSession(struct omemo2Session *session,
+                                 const struct omemo2Store *store,
+                                 const omemo2SerializedKey spk,
+                                 const omemo2SerializedKey ik,
+                                 const omemo2SerializedKey pk,
+                                 uint32_t spk_id, uint32_t pk_id) {
+  STATTIME(OMEMO2_STAT_INITIATESESSION);
+  TRACESESSION(session);
+  if (!session || !store)
+    return OMEMO2_EPARAM;
+  return InitiateSessionImpl(session, store, spk, ik, pk, spk_id, pk_id);
+}
+
 static const struct omemo2PreKey *FindPreKey(const struct omemo2Store *store,
                                       uint32_t pk_id) {
   for (int i = 0; i < OMEMO2_NUMPREKEYS; i++) {
@@ -664,12 +956,12 @@ FindSignedPreKey(const struct omemo2Store *store, uint32_t spk_id) {
 }
 
 int omemo2RotateSignedPreKey(struct omemo2Store *store) {
+  STATTIME(OMEMO2_STAT_ROTATESIGNEDPREKEY);
   if (!store)
     return OMEMO2_EPARAM;
   struct omemo2SignedPreKey spk;
   int r = GenerateSignedPreKey(
-      &spk, IncrementWrapSkipZero(store->cursignedprekey.id),
-      &store->identity);
+      &spk, IncrementWrapSkipZero(store->cursignedprekey.id), store);
   if (!r) {
     memcpy(&store->prevsignedprekey, &store->cursignedprekey,
            sizeof(struct omemo2SignedPreKey));
@@ -678,184 +970,86 @@ int omemo2RotateSignedPreKey(struct omemo2Store *store) {
   return r;
 }
 
-//  PN = Ns
-//  Ns = 0
-//  Nr = 0
-//  DHr = dh
-//  RK, CKr = KDF_RK(RK, DH(DHs, DHr))
-//  DHs = GENERATE_DH()
-//  RK, CKs = KDF_RK(RK, DH(DHs, DHr))
-static int DHRatchet(struct omemo2State *state, const omemo2Key dh) {
-  state->pn = state->ns;
-  state->ns = 0;
-  state->nr = 0;
-  memcpy(state->dhr, dh, 32);
-  TRY(DeriveRootKey(state, state->ckr));
-  TRY(GenerateKeyPair(&state->dhs));
-  TRY(DeriveRootKey(state, state->cks));
-  return 0;
-}
-
 static void RatchetInitBob(struct omemo2State *state, const omemo2Key sk,
                            const struct omemo2KeyPair *ekb) {
   memcpy(&state->dhs, ekb, sizeof(struct omemo2KeyPair));
   memcpy(state->rk, sk, 32);
 }
 
-#define CLAMP0(v) ((v) > 0 ? (v) : 0)
-
-static inline uint32_t GetAmountSkipped(int64_t nr, int64_t n) {
-  return CLAMP0(n - nr);
-}
-
-static int SkipMessageKeys(struct omemo2Session *session, uint32_t n,
-                           uint64_t fullamount) {
-  struct omemo2MessageKey k;
-  while (session->state.nr < n) {
-    TRY(GetBaseMaterials(session->state.ckr, k.mk, session->state.ckr));
-    memcpy(k.dh, session->state.dhr, 32);
-    k.nr = session->state.nr;
-    TRY(omemo2StoreMessageKey(session, &k, fullamount--));
-    session->state.nr++;
-  }
-  return 0;
-}
-
-static int DecryptKeyImpl(struct omemo2Session *session,
-                          uint8_t *key, size_t *keyn,
-                          const uint8_t *msg, size_t msgn) {
-  struct ProtobufField fields1[3] = {
-      [1] = {PB_REQUIRED | PB_LEN, 16}, // mac
-      [2] = {PB_REQUIRED | PB_LEN},     // message
-  };
-  if (ParseProtobuf(msg, msgn, fields1, 3))
-    return OMEMO2_EPROTOBUF;
-
-  struct ProtobufField fields[5] = {
-      [PbMsg_n] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_pn] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_dh_pub] = {PB_REQUIRED | PB_LEN, SerLen},
-      [PbMsg_ciphertext] = {PB_REQUIRED | PB_LEN},
-  };
-  if (ParseProtobuf(fields1[2].p, fields1[2].v, fields, 5))
-    return OMEMO2_EPROTOBUF;
-  const uint8_t *realmac = fields1[1].p;
-
-  uint32_t encn = fields[PbMsg_ciphertext].v;
-  if (encn < 16 || encn % 16 ||
-      encn > OMEMO2_INTERNAL_PAYLOAD_MAXPADDEDSIZE)
-    return OMEMO2_ECORRUPT;
-
-  uint32_t headern = fields[PbMsg_n].v;
-  uint32_t headerpn = fields[PbMsg_pn].v;
-  const uint8_t *headerdh = GetRawKey(fields[PbMsg_dh_pub].p);
-
-  bool shouldstep = !!memcmp(session->state.dhr, headerdh, 32);
-
-  // We first check for maxskip, if that does not pass we should not
-  // process the message. If it does pass, we know the total capacity of
-  // the array is large enough because c >= maxskip. Then we check if
-  // the new keys fit in the remaining space. If that is not the case we
-  // return and let the user either remove the old message keys or
-  // ignore the message.
-
-  omemo2Key mk;
-  struct omemo2MessageKey mkey = {0};
-  memcpy(mkey.dh, headerdh, 32);
-  mkey.nr = headern;
-  int r;
-  if (!(r = omemo2LoadMessageKey(session, &mkey))) {
-    memcpy(mk, mkey.mk, 32);
-  } else if (r < 0) {
-    return r;
-  } else {
-    if (!shouldstep && headern < session->state.nr)
-      return OMEMO2_EKEYGONE;
-    uint64_t nskips =
-        shouldstep
-            ? GetAmountSkipped(session->state.nr, headerpn) + headern
-            : GetAmountSkipped(session->state.nr, headern);
-    if (shouldstep) {
-      TRY(SkipMessageKeys(session, headerpn, nskips));
-      nskips -= headern;
-      TRY(DHRatchet(&session->state, headerdh));
-    }
-    TRY(SkipMessageKeys(session, headern, nskips));
-    TRY(GetBaseMaterials(session->state.ckr, mk, session->state.ckr));
-    session->state.nr++;
-  }
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, mk, HkdfInfoMessageKeys, kdfout));
-  uint8_t mac[MACSIZE];
-  TRY(GetMac(mac, session->remoteidentity, session->identity,
-             kdfout->mac, fields1[2].p, fields1[2].v));
-  if (omemoDriverCompare(mac, realmac, MACSIZE))
-    return OMEMO2_ECORRUPT;
-  uint8_t tmp[OMEMO2_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
-  TRY(omemoDriverAesDecrypt(kdfout->cipher, encn, kdfout->iv,
-         fields[PbMsg_ciphertext].p, tmp));
-  uint8_t pad = tmp[encn - 1];
-  if (pad > 16 || pad > encn || encn - pad > *keyn)
-    return OMEMO2_ECORRUPT;
-  memcpy(key, tmp, encn - pad);
-  *keyn = encn - pad;
-  session->init = SESSION_READY;
-  return 0;
-}
-
+// Nothing in session is changed until the message is decrypted, then
+// state is copied to it together with the other changes.
 static int DecryptGenericKeyImpl(struct omemo2Session *session,
                                  const struct omemo2Store *store,
+                                 struct omemo2State *state,
                                  uint8_t *key, size_t *keyn,
                                  bool isprekey, const uint8_t *msg,
                                  size_t msgn) {
   const struct omemo2PreKey *pk = NULL;
+  // Remote identity key of a new session and the alt form if known.
+  omemo2Key ik[2];
+  const uint8_t *remote = session->remoteidentity, *remotealt = NULL;
+  uint32_t pkid = 0;
   if (isprekey) {
     // Can't receive prekey when we sent a prekey...
     if (session->init == SESSION_INIT)
       return OMEMO2_ESTATE;
-    // OMEMOKeyExchange
-    struct ProtobufField fields[6] = {
-        [PbKeyEx_pk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_spk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_ik] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_ek] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_message] = {PB_REQUIRED | PB_LEN},
-    };
-    if (ParseProtobuf(msg, msgn, fields, 6))
-      return OMEMO2_EPROTOBUF;
+    struct omemoCoreKeyExchange kx;
+    TRY(omemoCoreParseKeyExchange(&Protocol, &kx, msg, msgn));
     if (session->init == SESSION_UNINIT) {
-      pk = FindPreKey(store, fields[PbKeyEx_pk_id].v);
+      pk = FindPreKey(store, kx.pk_id);
       const struct omemo2SignedPreKey *spk =
-          FindSignedPreKey(store, fields[PbKeyEx_spk_id].v);
+          FindSignedPreKey(store, kx.spk_id);
       if (!pk || !spk)
         return OMEMO2_ECORRUPT;
-      session->usedpk_id = fields[PbKeyEx_pk_id].v;
+      pkid = kx.pk_id;
       omemo2Key sk;
-      memcpy(session->identity, store->identity.pub, 32);
-      memcpy(session->remoteidentity, GetRawKey(fields[PbKeyEx_ik].p),
-             32);
-      omemo2Key ik, edy;
-      memcpy(edy, fields[PbKeyEx_ik].p, 32);
-      edy[31] &= 0x7f;
-      omemoDriverEdPubToCvPub(ik, edy);
+      memcpy(ik[0], msg + kx.ik, 32);
+      GetRemoteIdentityAlt(ik[1], session, ik[0]);
+      remotealt = ik[1];
       TRY(GetSharedSecret(sk, true, store->identity.prv, spk->kp.prv,
-                          pk->kp.prv, ik, fields[PbKeyEx_ek].p,
-                          fields[PbKeyEx_ek].p));
-      RatchetInitBob(&session->state, sk, &spk->kp);
+                          pk->kp.prv, ik[1], msg + kx.ek, msg + kx.ek));
+      RatchetInitBob(state, sk, &spk->kp);
+      remote = ik[0];
     }
-    msg = fields[PbKeyEx_message].p;
-    msgn = fields[PbKeyEx_message].v;
+    msgn = kx.messagen;
+    msg += kx.message;
+  } else if (session->init == SESSION_UNINIT) {
+    return OMEMO2_ESTATE;
+  }
+  if (remote != ik[0] &&
+      memcmp(session->identity, store->identity.pub, 32))
+    return OMEMO2_ESTORE;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(dh);
+  SCRATCH(masterkey);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .dh = dh,
+      .masterkey = masterkey,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
+  TRY(omemoCoreDecryptKey(&Protocol, (omemoCoreSession *)session,
+                          (omemoCoreState *)state, remote,
+                          store->identity.pub, key, keyn, msg, msgn, &sc));
+  if (remote == ik[0]) {
+    memcpy(session->identity, store->identity.pub, 32);
+    SetRemoteIdentity(session, remote, remotealt);
+    session->usedpk_id = pkid;
+    STAT(prekeysused);
   } else if (session->init == SESSION_INIT) {
     // We don't need these anymore
     session->usedpk_id = 0;
     session->usedspk_id = 0;
     memset(session->usedek, 0, 32);
-  } else if (session->init == SESSION_UNINIT) {
-    return OMEMO2_ESTATE;
   }
-  if (memcmp(session->identity, store->identity.pub, 32))
-    return OMEMO2_ESTORE;
-  return DecryptKeyImpl(session, key, keyn, msg, msgn);
+  memcpy(&session->state, state, sizeof(struct omemo2State));
+  session->init = SESSION_READY;
+  return 0;
 }
 
 int omemo2DecryptKey(struct omemo2Session *session,
@@ -863,24 +1057,22 @@ int omemo2DecryptKey(struct omemo2Session *session,
                                  uint8_t *key, size_t *keyn,
                                  bool isprekey, const uint8_t *msg,
                                  size_t msgn) {
+  STATTIME(OMEMO2_STAT_DECRYPTKEY);
+  TRACESESSION(session);
   if (!session || !store || !key || !keyn || !store->init || !msg)
     return OMEMO2_EPARAM;
-  // We only have to backup session->state functionality wise, but to
-  // ensure session stays the same before and after an error we backup
-  // everything.
-  struct omemo2Session backup;
-  memcpy(&backup, session, sizeof(struct omemo2Session));
-  int r;
-  if ((r = DecryptGenericKeyImpl(session, store, key, keyn, isprekey,
-                                 msg, msgn))) {
-    memcpy(session, &backup, sizeof(struct omemo2Session));
-  }
-  return r;
+  // The ratchet is advanced in a copy of the state, so session stays the
+  // same when there is an error.
+  SCRATCH(state);
+  memcpy(state, &session->state, sizeof(struct omemo2State));
+  return DecryptGenericKeyImpl(session, store, state, key, keyn,
+                               isprekey, msg, msgn);
 }
 
 int omemo2Heartbeat(struct omemo2Session *session,
                                 const struct omemo2Store *store,
                                 struct omemo2KeyMessage *msg) {
+  TRACESESSION(session);
   if (!session || !store || !msg) return OMEMO2_EPARAM;
   if (session->state.nr >= 53) {
     if (session->init == SESSION_READY) {
@@ -900,143 +1092,266 @@ int omemo2Heartbeat(struct omemo2Session *session,
 int omemo2DecryptMessage(uint8_t *d, size_t *olen,
                                      const uint8_t *key, size_t keyn,
                                      const uint8_t *s, size_t n) {
+  STATTIME(OMEMO2_STAT_DECRYPTMESSAGE);
   if (!d || !olen || !key || !s)
     return OMEMO2_EPARAM;
   if (keyn != 48)
     return OMEMO2_ECORRUPT;
   if (n < 16 || n % 16)
     return OMEMO2_ECORRUPT;
-  uint8_t k[32];
+  SCRATCH(kdfout);
+  uint8_t k[32], mac[32], p;
+  int r;
   memcpy(k, key, 32);
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, k, HkdfInfoPayload, kdfout));
-  uint8_t mac[32];
-  TRY(omemoDriverHmac(kdfout->mac, s, n, mac));
-  if (omemoDriverCompare(mac, key + 32, 16))
-    return OMEMO2_ECORRUPT;
-  TRY(omemoDriverAesDecrypt(kdfout->cipher, n, kdfout->iv, s, d));
-  uint8_t p = d[n - 1];
-  if (p > n)
-    return OMEMO2_ECORRUPT;
+  if ((r = DeriveKey(k, info_payload, kdfout)))
+    goto out;
+  STAT(aes);
+  STAT(hmac);
+  // d has plaintext from here on, even if the call fails partway, so it
+  // is cleared on every error.
+  r = omemoDriverAesCbcHmac(kdfout->cipher, kdfout->mac, false, n,
+                            kdfout->iv, s, d, mac);
+  if (!r && omemoDriverCompare(mac, key + 32, 16))
+    r = OMEMO2_ECORRUPT;
+  if (!r && (!(p = d[n - 1]) || p > 16))
+    r = OMEMO2_ECORRUPT;
+  if (r) {
+    memset(d, 0, n);
+    goto out;
+  }
   memset(d + n - p, 0, p);
   *olen = n - p;
-  return 0;
+out:
+  memset(k, 0, 32);
+  memset(mac, 0, 32);
+  return r;
 }
 
 int omemo2EncryptMessage(uint8_t *d, uint8_t key[48],
                                      uint8_t *s, size_t n) {
+  STATTIME(OMEMO2_STAT_ENCRYPTMESSAGE);
   if (!d || !key || !s)
     return OMEMO2_EPARAM;
   uint8_t k[32];
   TRY(omemo2Random(k, 32));
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, k, HkdfInfoPayload, kdfout));
+  SCRATCH(kdfout);
+  TRY(DeriveKey(k, info_payload, kdfout));
   // PKCS#7
   size_t extend = omemo2GetMessagePadSize(n);
   memset(s + n, extend, extend);
-  TRY(omemoDriverAesEncrypt(kdfout->cipher, n + extend, kdfout->iv, s, d));
   uint8_t mac[32];
-  TRY(omemoDriverHmac(kdfout->mac, d, n + extend, mac));
+  STAT(aes);
+  STAT(hmac);
+  TRY(omemoDriverAesCbcHmac(kdfout->cipher, kdfout->mac, true, n + extend,
+                            kdfout->iv, s, d, mac));
   memcpy(key, k, 32);
   memcpy(key + 32, mac, 16);
   return 0;
 }
 
+void omemo2FreeMessageStream(struct omemo2PayloadStream *st) {
+  if (st) {
+    omemoDriverAesDestroy(st->aes);
+    omemoDriverHmacDestroy(st->hmac);
+    memset(st, 0, sizeof(*st));
+  }
+}
+
+// Frees the stream when r is an error.
+static int CheckStream(struct omemo2PayloadStream *st, int r) {
+  if (r)
+    omemo2FreeMessageStream(st);
+  return r;
+}
+
+static int StartStream(struct omemo2PayloadStream *st, bool enc) {
+  struct omemo2InternalDerivedKeys kdfout[1];
+  uint8_t k[32];
+  int r;
+  if (!(st->aes = omemoDriverAesCreate()) ||
+      !(st->hmac = omemoDriverHmacCreate()))
+    return OMEMO2_ECRYPTO;
+  memcpy(k, st->key, 32);
+  if ((r = DeriveKey(k, info_payload, kdfout)) ||
+      (r = omemoDriverAesSetKey(st->aes, kdfout->cipher, enc)) ||
+      (r = omemoDriverHmacStart(st->hmac, kdfout->mac)))
+    return r;
+  memcpy(st->iv, kdfout->iv, 16);
+  memset(kdfout, 0, sizeof(*kdfout));
+  return 0;
+}
+
+int omemo2EncryptMessageInit(struct omemo2PayloadStream *st) {
+  if (!st)
+    return OMEMO2_EPARAM;
+  memset(st, 0, sizeof(*st));
+  int r;
+  if ((r = omemo2Random(st->key, 32)))
+    return r;
+  return CheckStream(st, StartStream(st, true));
+}
+
+// Encrypts and authenticates n bytes, a multiple of the block size.
+static int EncryptBlocks(struct omemo2PayloadStream *st, uint8_t *d,
+                         const uint8_t *s, size_t n) {
+  STAT(aes);
+  TRY(omemoDriverAesCbc(st->aes, n, st->iv, s, d));
+  return omemoDriverHmacUpdate(st->hmac, d, n);
+}
+
+static int EncryptUpdate(struct omemo2PayloadStream *st, uint8_t *d,
+                         size_t *outn, const uint8_t *s, size_t n) {
+  *outn = 0;
+  if (st->bufn) {
+    size_t m = n < 16 - st->bufn ? n : 16 - st->bufn;
+    memcpy(st->buf + st->bufn, s, m);
+    st->bufn += m, s += m, n -= m;
+    if (st->bufn < 16)
+      return 0;
+    TRY(EncryptBlocks(st, d, st->buf, 16));
+    st->bufn = 0, d += 16, *outn = 16;
+  }
+  size_t m = n & ~(size_t)15;
+  if (m)
+    TRY(EncryptBlocks(st, d, s, m));
+  *outn += m;
+  memcpy(st->buf, s + m, n - m);
+  st->bufn = n - m;
+  return 0;
+}
+
+int omemo2EncryptMessageUpdate(struct omemo2PayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  if (!st || !d || !outn || (!s && n))
+    return OMEMO2_EPARAM;
+  return CheckStream(st, EncryptUpdate(st, d, outn, s, n));
+}
+
+static int EncryptFinal(struct omemo2PayloadStream *st, uint8_t *d,
+                        uint8_t key[48]) {
+  uint8_t mac[32];
+  // PKCS#7
+  memset(st->buf + st->bufn, 16 - st->bufn, 16 - st->bufn);
+  TRY(EncryptBlocks(st, d, st->buf, 16));
+  STAT(hmac);
+  TRY(omemoDriverHmacFinish(st->hmac, mac));
+  memcpy(key, st->key, 32);
+  memcpy(key + 32, mac, 16);
+  return 0;
+}
+
+int omemo2EncryptMessageFinal(struct omemo2PayloadStream *st, uint8_t *d,
+                             size_t *outn, uint8_t key[48]) {
+  if (!st || !d || !outn || !key)
+    return OMEMO2_EPARAM;
+  int r = EncryptFinal(st, d, key);
+  *outn = r ? 0 : 16;
+  omemo2FreeMessageStream(st);
+  return r;
+}
+
+int omemo2DecryptMessageInit(struct omemo2PayloadStream *st,
+                            const uint8_t *key, size_t keyn) {
+  if (!st || !key)
+    return OMEMO2_EPARAM;
+  if (keyn != 48)
+    return OMEMO2_ECORRUPT;
+  memset(st, 0, sizeof(*st));
+  memcpy(st->key, key, 48);
+  st->keyn = 48;
+  return CheckStream(st, StartStream(st, false));
+}
+
+// The last block is kept in buf, as it has the padding.
+static int DecryptUpdate(struct omemo2PayloadStream *st, uint8_t *d,
+                         size_t *outn, const uint8_t *s, size_t n) {
+  *outn = 0;
+  TRY(omemoDriverHmacUpdate(st->hmac, s, n));
+  if (st->bufn + n <= 16) {
+    memcpy(st->buf + st->bufn, s, n);
+    st->bufn += n;
+    return 0;
+  }
+  if (st->bufn) {
+    size_t m = 16 - st->bufn;
+    memcpy(st->buf + st->bufn, s, m);
+    s += m, n -= m;
+    STAT(aes);
+    TRY(omemoDriverAesCbc(st->aes, 16, st->iv, st->buf, d));
+    d += 16, *outn = 16;
+  }
+  size_t m = n ? (n - 1) & ~(size_t)15 : 0;
+  if (m) {
+    STAT(aes);
+    TRY(omemoDriverAesCbc(st->aes, m, st->iv, s, d));
+  }
+  *outn += m;
+  memcpy(st->buf, s + m, n - m);
+  st->bufn = n - m;
+  return 0;
+}
+
+int omemo2DecryptMessageUpdate(struct omemo2PayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  if (!st || !d || !outn || (!s && n))
+    return OMEMO2_EPARAM;
+  return CheckStream(st, DecryptUpdate(st, d, outn, s, n));
+}
+
+static int DecryptFinal(struct omemo2PayloadStream *st, uint8_t *d,
+                        size_t *outn) {
+  uint8_t mac[32];
+  if (st->bufn != 16)
+    return OMEMO2_ECORRUPT;
+  STAT(hmac);
+  TRY(omemoDriverHmacFinish(st->hmac, mac));
+  if (omemoDriverCompare(mac, st->key + 32, 16))
+    return OMEMO2_ECORRUPT;
+  STAT(aes);
+  TRY(omemoDriverAesCbc(st->aes, 16, st->iv, st->buf, st->buf));
+  uint8_t p = st->buf[15];
+  if (!p || p > 16)
+    return OMEMO2_ECORRUPT;
+  memcpy(d, st->buf, 16 - p);
+  *outn = 16 - p;
+  return 0;
+}
+
+int omemo2DecryptMessageFinal(struct omemo2PayloadStream *st, uint8_t *d,
+                             size_t *outn) {
+  if (!st || !d || !outn)
+    return OMEMO2_EPARAM;
+  *outn = 0;
+  int r = DecryptFinal(st, d, outn);
+  omemo2FreeMessageStream(st);
+  return r;
+}
+
 /************************** SERIALIZATION ****************************/
 
+// The format is the same in both versions, see core.c.
+
 size_t omemo2GetSerializedStoreSize(const struct omemo2Store *store) {
   if (!store)
     return 0;
-  size_t sum = 34 * 6 + (2 + 64) * 2 + 1 * 4 +
-               GetVarIntSize(store->init) +
-               GetVarIntSize(store->cursignedprekey.id) +
-               GetVarIntSize(store->prevsignedprekey.id) +
-               GetVarIntSize(store->pkcounter);
-  for (int i = 0; i < OMEMO2_NUMPREKEYS; i++)
-    sum += 2 + 1 + GetVarIntSize(store->prekeys[i].id) + 2 * 34;
-  return sum;
+  return omemoCoreGetSerializedStoreSize((const omemoCoreStore *)store);
 }
 
 void omemo2SerializeStore(uint8_t *p,
                                       const struct omemo2Store *store) {
   if (!p || !store)
     return;
-  uint8_t *d = p;
-  d = FormatVarInt(d, PB_UINT32, 1, store->init);
-  d = FormatKey(d, 2, store->identity.prv);
-  d = FormatKey(d, 3, store->identity.pub);
-  d = FormatVarInt(d, PB_UINT32, 4, store->cursignedprekey.id);
-  d = FormatKey(d, 5, store->cursignedprekey.kp.prv);
-  d = FormatKey(d, 6, store->cursignedprekey.kp.pub);
-  d = FormatVarInt(d, PB_LEN, 7, 64);
-  d = (memcpy(d, store->cursignedprekey.sig, 64), d + 64);
-  d = FormatVarInt(d, PB_UINT32, 8, store->prevsignedprekey.id);
-  d = FormatKey(d, 9, store->prevsignedprekey.kp.prv);
-  d = FormatKey(d, 10, store->prevsignedprekey.kp.pub);
-  d = FormatVarInt(d, PB_LEN, 11, 64);
-  d = (memcpy(d, store->prevsignedprekey.sig, 64), d + 64);
-  d = FormatVarInt(d, PB_UINT32, 12, store->pkcounter);
-  for (int i = 0; i < OMEMO2_NUMPREKEYS; i++) {
-    const struct omemo2PreKey *pk = store->prekeys + i;
-    d = FormatVarInt(d, PB_LEN, 13, 1 + GetVarIntSize(pk->id) + 2 * 34);
-    d = FormatVarInt(d, PB_UINT32, 1, pk->id);
-    d = FormatKey(d, 2, pk->kp.prv);
-    d = FormatKey(d, 3, pk->kp.pub);
-  }
-  ASSERT(d - p == omemo2GetSerializedStoreSize(store));
+  omemoCoreSerializeStore(p, (const omemoCoreStore *)store);
 }
 
 int omemo2DeserializeStore(const uint8_t *p, size_t n,
                                        struct omemo2Store *store) {
   if (!p || !store)
     return OMEMO2_EPARAM;
-  struct ProtobufField fields[] = {
-      [1] = {PB_REQUIRED | PB_UINT32},
-      [2] = {PB_REQUIRED | PB_LEN, 32},
-      [3] = {PB_REQUIRED | PB_LEN, 32},
-      [4] = {PB_REQUIRED | PB_UINT32},
-      [5] = {PB_REQUIRED | PB_LEN, 32},
-      [6] = {PB_REQUIRED | PB_LEN, 32},
-      [7] = {PB_REQUIRED | PB_LEN, 64},
-      [8] = {PB_REQUIRED | PB_UINT32},
-      [9] = {PB_REQUIRED | PB_LEN, 32},
-      [10] = {PB_REQUIRED | PB_LEN, 32},
-      [11] = {PB_REQUIRED | PB_LEN, 64},
-      [12] = {PB_REQUIRED | PB_UINT32},
-      [13] = {/*PB_REQUIRED |*/ PB_LEN},
-  };
-  if (ParseProtobuf(p, n, fields, 14))
-    return OMEMO2_EPROTOBUF;
-  store->init = fields[1].v;
-  memcpy(store->identity.prv, fields[2].p, 32);
-  memcpy(store->identity.pub, fields[3].p, 32);
-  store->cursignedprekey.id = fields[4].v;
-  memcpy(store->cursignedprekey.kp.prv, fields[5].p, 32);
-  memcpy(store->cursignedprekey.kp.pub, fields[6].p, 32);
-  memcpy(store->cursignedprekey.sig, fields[7].p, 64);
-  store->prevsignedprekey.id = fields[8].v;
-  memcpy(store->prevsignedprekey.kp.prv, fields[9].p, 32);
-  memcpy(store->prevsignedprekey.kp.pub, fields[10].p, 32);
-  memcpy(store->prevsignedprekey.sig, fields[11].p, 64);
-  store->pkcounter = fields[12].v;
-  const uint8_t *e = p + n;
-  int i = 0;
-  while (i < OMEMO2_NUMPREKEYS &&
-         !ParseRepeatingField(p, e, &fields[13], 13) && fields[13].p) {
-    struct ProtobufField innerfields[] = {
-        [1] = {PB_REQUIRED | PB_UINT32},
-        [2] = {PB_REQUIRED | PB_LEN, 32},
-        [3] = {PB_REQUIRED | PB_LEN, 32},
-    };
-    if (ParseProtobuf(fields[13].p, fields[13].v, innerfields, 4))
-      return OMEMO2_EPROTOBUF;
-    store->prekeys[i].id = innerfields[1].v;
-    memcpy(store->prekeys[i].kp.prv, innerfields[2].p, 32);
-    memcpy(store->prekeys[i].kp.pub, innerfields[3].p, 32);
-    i++;
-    p = fields[13].p + fields[13].v;
-    fields[13].v = 0, fields[13].p = NULL;
-  }
+  TRY(omemoCoreDeserializeStore(p, n, (omemoCoreStore *)store));
+  // Stores serialized by older versions don't have it.
+  if (!memcmp(store->identityalt, Zero32, 32))
+    DeriveIdentityAlt(store);
   return 0;
 }
 
@@ -1044,76 +1359,20 @@ size_t
 omemo2GetSerializedSessionSize(const struct omemo2Session *session) {
   if (!session)
     return 0;
-  return 34 * 9 // Key
-         + 1 * 6 + GetVarIntSize(session->state.ns) +
-         GetVarIntSize(session->state.nr) +
-         GetVarIntSize(session->state.pn) +
-         GetVarIntSize(session->usedpk_id) +
-         GetVarIntSize(session->usedspk_id) +
-         GetVarIntSize(session->init);
+  return omemoCoreGetSerializedSessionSize(
+      (const omemoCoreSession *)session);
 }
 
 void
 omemo2SerializeSession(uint8_t *p, const struct omemo2Session *session) {
   if (!p || !session)
     return;
-  uint8_t *d = p;
-  d = FormatKey(d, 1, session->remoteidentity);
-  d = FormatKey(d, 2, session->state.dhs.prv);
-  d = FormatKey(d, 3, session->state.dhs.pub);
-  d = FormatKey(d, 4, session->state.dhr);
-  d = FormatKey(d, 5, session->state.rk);
-  d = FormatKey(d, 6, session->state.cks);
-  d = FormatKey(d, 7, session->state.ckr);
-  d = FormatVarInt(d, PB_UINT32, 8, session->state.ns);
-  d = FormatVarInt(d, PB_UINT32, 9, session->state.nr);
-  d = FormatVarInt(d, PB_UINT32, 10, session->state.pn);
-  // TODO: don't have to include used* after first ratchet
-  d = FormatKey(d, 11, session->usedek);
-  d = FormatVarInt(d, PB_UINT32, 12, session->usedpk_id);
-  d = FormatVarInt(d, PB_UINT32, 13, session->usedspk_id);
-  d = FormatVarInt(d, PB_UINT32, 14, session->init);
-  d = FormatKey(d, 15, session->identity);
-  ASSERT(d - p == omemo2GetSerializedSessionSize(session));
+  omemoCoreSerializeSession(p, (const omemoCoreSession *)session);
 }
 
 int omemo2DeserializeSession(const uint8_t *p, size_t n,
                                          struct omemo2Session *session) {
   if (!p || !session)
     return OMEMO2_EPARAM;
-  struct ProtobufField fields[] = {
-      [1] = {PB_REQUIRED | PB_LEN, 32},
-      [2] = {PB_REQUIRED | PB_LEN, 32},
-      [3] = {PB_REQUIRED | PB_LEN, 32},
-      [4] = {PB_REQUIRED | PB_LEN, 32},
-      [5] = {PB_REQUIRED | PB_LEN, 32},
-      [6] = {PB_REQUIRED | PB_LEN, 32},
-      [7] = {PB_REQUIRED | PB_LEN, 32},
-      [8] = {PB_REQUIRED | PB_UINT32},
-      [9] = {PB_REQUIRED | PB_UINT32},
-      [10] = {PB_REQUIRED | PB_UINT32},
-      [11] = {PB_REQUIRED | PB_LEN, 32},
-      [12] = {PB_REQUIRED | PB_UINT32},
-      [13] = {PB_REQUIRED | PB_UINT32},
-      [14] = {PB_REQUIRED | PB_UINT32},
-      [15] = {PB_REQUIRED | PB_LEN, 32},
-  };
-  if (ParseProtobuf(p, n, fields, 16))
-    return OMEMO2_EPROTOBUF;
-  memcpy(session->remoteidentity, fields[1].p, 32);
-  memcpy(session->state.dhs.prv, fields[2].p, 32);
-  memcpy(session->state.dhs.pub, fields[3].p, 32);
-  memcpy(session->state.dhr, fields[4].p, 32);
-  memcpy(session->state.rk, fields[5].p, 32);
-  memcpy(session->state.cks, fields[6].p, 32);
-  memcpy(session->state.ckr, fields[7].p, 32);
-  session->state.ns = fields[8].v;
-  session->state.nr = fields[9].v;
-  session->state.pn = fields[10].v;
-  memcpy(session->usedek, fields[11].p, 32);
-  session->usedpk_id = fields[12].v;
-  session->usedspk_id = fields[13].v;
-  session->init = fields[14].v;
-  memcpy(session->identity, fields[15].p, 32);
-  return 0;
+  return omemoCoreDeserializeSession(p, n, (omemoCoreSession *)session);
 }
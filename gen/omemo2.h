@@ -28,6 +28,8 @@
 #endif
 
 #define OMEMO2_NUMPREKEYS 100
+#define OMEMO2_SIGCACHE_SIZE 64
+#define OMEMO2_INTERNAL_VERIFYBATCH 16
 
 #define OMEMO2_EPROTOBUF (-1)
 #define OMEMO2_ECRYPTO   (-2)
@@ -39,6 +41,59 @@
 #define OMEMO2_EUSER     (-8)
 #define OMEMO2_ERANDOM   (-9)
 
+#define OMEMO2_CPU_BMI2ADX   (1 << 0)
+#define OMEMO2_CPU_AESNI     (1 << 1)
+#define OMEMO2_CPU_ARMCRYPTO (1 << 2)
+
+#define OMEMO2_DRIVER_CURVE 0
+#define OMEMO2_DRIVER_AES   1
+#define OMEMO2_DRIVER_HASH  2
+
+// Public functions that have a latency histogram in omemo2Stats.
+#define OMEMO2_STAT_SETUPSTORE         0
+#define OMEMO2_STAT_REFILLPREKEYS      1
+#define OMEMO2_STAT_ROTATESIGNEDPREKEY 2
+#define OMEMO2_STAT_VERIFYBUNDLES      3
+#define OMEMO2_STAT_INITIATESESSION    4
+#define OMEMO2_STAT_ENCRYPTKEY         5
+#define OMEMO2_STAT_DECRYPTKEY         6
+#define OMEMO2_STAT_ENCRYPTMESSAGE     7
+#define OMEMO2_STAT_DECRYPTMESSAGE     8
+#define OMEMO2_STAT_NUMAPIS            9
+#define OMEMO2_STAT_NUMBUCKETS         40
+
+// Operations passed to the trace hooks, the driver primitives and the
+// user callbacks.
+#define OMEMO2_TRACE_X25519            0
+#define OMEMO2_TRACE_CVPRVTOPUB        1
+#define OMEMO2_TRACE_CVPRVTOEDPUB      2
+#define OMEMO2_TRACE_CVPUBTOEDPUB      3
+#define OMEMO2_TRACE_EDPUBTOCVPUB      4
+#define OMEMO2_TRACE_CVPUBTOEDPUBBATCH 5
+#define OMEMO2_TRACE_EDPUBTOCVPUBBATCH 6
+#define OMEMO2_TRACE_EDSEEDTOPUBPRV    7
+#define OMEMO2_TRACE_EDSIGN            8
+#define OMEMO2_TRACE_EDVERIFY          9
+#define OMEMO2_TRACE_EDVERIFYBATCH     10
+#define OMEMO2_TRACE_HMAC              11
+#define OMEMO2_TRACE_HKDF              12
+#define OMEMO2_TRACE_AESENCRYPT        13
+#define OMEMO2_TRACE_AESDECRYPT        14
+#define OMEMO2_TRACE_AESCBCHMAC        15
+#define OMEMO2_TRACE_GCMENCRYPT        16
+#define OMEMO2_TRACE_GCMDECRYPT        17
+#define OMEMO2_TRACE_AESSETKEY         18
+#define OMEMO2_TRACE_AESCBC            19
+#define OMEMO2_TRACE_AESGCMSTART       20
+#define OMEMO2_TRACE_AESGCMUPDATE      21
+#define OMEMO2_TRACE_AESGCMFINISH      22
+#define OMEMO2_TRACE_HMACSTART         23
+#define OMEMO2_TRACE_HMACUPDATE        24
+#define OMEMO2_TRACE_HMACFINISH        25
+#define OMEMO2_TRACE_LOADMESSAGEKEY    26
+#define OMEMO2_TRACE_STOREMESSAGEKEY   27
+#define OMEMO2_TRACE_RANDOM            28
+
 
 #define OMEMO2_KEYSIZE                        48
 #define OMEMO2_INTERNAL_PAYLOAD_MAXPADDEDSIZE 64
@@ -54,6 +109,17 @@ typedef uint8_t omemo2Key[32];
 typedef uint8_t omemo2SerializedKey[32];
 typedef uint8_t omemo2CurveSignature[64];
 
+// Counters since the start of the program or the last reset, see
+// omemo2GetStats.
+struct omemo2Stats {
+  uint64_t x25519, hmac, hkdf, aes;
+  uint64_t skippedstored, skippedloaded;
+  uint64_t ratchetsteps, prekeysused;
+  // latency[api][i] counts the calls to api that took less than 2^(i+1)
+  // ns and at least 2^i ns, the last bucket also counts slower ones.
+  uint64_t latency[OMEMO2_STAT_NUMAPIS][OMEMO2_STAT_NUMBUCKETS];
+};
+
 struct omemo2KeyPair {
   omemo2Key prv;
   omemo2Key pub;
@@ -83,9 +149,12 @@ struct omemo2State {
   uint32_t ns, nr, pn;
 };
 
+// Maximum size of an encrypted key message.
+#define OMEMO2_KEYMESSAGE_MAXSIZE                                       \
+  (OMEMO2_INTERNAL_PREKEYHEADER_MAXSIZE + OMEMO2_INTERNAL_ENCRYPTED_MAXSIZE)
+
 struct omemo2KeyMessage {
-  uint8_t p[OMEMO2_INTERNAL_PREKEYHEADER_MAXSIZE +
-            OMEMO2_INTERNAL_ENCRYPTED_MAXSIZE];
+  uint8_t p[OMEMO2_KEYMESSAGE_MAXSIZE];
   size_t n;
   bool isprekey;
 };
@@ -93,15 +162,82 @@ struct omemo2KeyMessage {
 struct omemo2Store {
   bool init;
   struct omemo2KeyPair identity;
+  // identity.pub as Ed25519 key for OMEMO 0.3 and as X25519 key for
+  // OMEMO 2, derived once so signing and X3DH don't convert it again.
+  omemo2Key identityalt;
   struct omemo2SignedPreKey cursignedprekey, prevsignedprekey;
   struct omemo2PreKey prekeys[OMEMO2_NUMPREKEYS];
   uint32_t pkcounter;
 };
 
+// Signed prekey part of a bundle, see omemo2VerifyBundles.
+struct omemo2Bundle {
+  omemo2CurveSignature spks;
+  omemo2SerializedKey spk, ik;
+};
+
+// Hashes of recently verified bundle signatures, see
+// omemo2SetSignatureCache.
+struct omemo2SignatureCache {
+  omemo2Key salt;
+  uint8_t entries[OMEMO2_SIGCACHE_SIZE][16];
+  uint32_t next;
+};
+
+// Cipher key, MAC key and IV derived from a message key.
+struct omemo2InternalDerivedKeys {
+  omemo2Key cipher, mac;
+  uint8_t iv[16];
+};
+
+// The temporaries of the API calls, see omemo2Context.
+struct omemo2Scratch {
+  uint8_t macinput[2 * sizeof(omemo2SerializedKey) +
+                   OMEMO2_INTERNAL_FULLMSG_MAXSIZE + 4];
+  uint8_t payload[OMEMO2_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
+  uint8_t secret[32 * 5];
+  uint8_t dh[32], masterkey[64];
+  omemo2Key mk;
+  struct omemo2InternalDerivedKeys kdfout[1];
+  struct omemo2State state[1];
+  omemo2CurveSignature sigs[OMEMO2_INTERNAL_VERIFYBATCH];
+  omemo2Key pubs[OMEMO2_INTERNAL_VERIFYBATCH];
+  omemo2Key alts[OMEMO2_INTERNAL_VERIFYBATCH];
+  const uint8_t *iks[OMEMO2_INTERNAL_VERIFYBATCH];
+  uint8_t msgs[OMEMO2_INTERNAL_VERIFYBATCH][sizeof(omemo2SerializedKey)];
+  uint8_t *msgp[OMEMO2_INTERNAL_VERIFYBATCH];
+  size_t msgn[OMEMO2_INTERNAL_VERIFYBATCH], idx[OMEMO2_INTERNAL_VERIFYBATCH];
+  uint8_t hashes[OMEMO2_INTERNAL_VERIFYBATCH][16];
+  bool cache[OMEMO2_INTERNAL_VERIFYBATCH];
+};
+
+struct omemoDriverAes;
+struct omemoDriverHmac;
+
+// Memory the API calls of a thread work in, see omemo2SetContext.
+struct omemo2Context {
+  struct omemo2Scratch scratch;
+  struct omemoDriverAes *aes;
+  struct omemoDriverHmac *hmac;
+};
+
+// State of a streamed payload, see omemo2EncryptMessageInit.
+struct omemo2PayloadStream {
+  struct omemoDriverAes *aes;
+  struct omemoDriverHmac *hmac;
+  uint8_t key[48];
+  size_t keyn;
+  uint8_t iv[16], buf[16];
+  size_t bufn;
+};
+
 struct omemo2Session {
   int init;
   omemo2Key identity;
   omemo2Key remoteidentity;
+  // Optional cached remoteidentity in the other curve form, zero when
+  // unknown.
+  omemo2Key remoteidentityalt;
   struct omemo2State state;
   omemo2Key usedek;
   uint32_t usedpk_id, usedspk_id;
@@ -117,6 +253,10 @@ typedef int (*omemo2StoreMessageKeyCallback)(
 
 typedef int (*omemo2RandomCallback)(void *p, size_t n);
 
+// op is one of OMEMO2_TRACE_*, session is the session of the API call
+// that caused it or NULL.
+typedef void (*omemo2TraceCallback)(int op, struct omemo2Session *session);
+
 int omemo2LoadMessageKey(struct omemo2Session *s,
                         struct omemo2MessageKey *sk);
 
@@ -134,6 +274,94 @@ OMEMO2_EXPORT void omemo2SetCallbacks(omemo2LoadMessageKeyCallback,
                                     omemo2StoreMessageKeyCallback,
                                     omemo2RandomCallback);
 
+/**
+ * Set global hooks that are called right before and after every driver
+ * primitive and every call to the callbacks above. Pass NULL to remove
+ * them, which leaves only a branch per call. Like omemo2SetCallbacks
+ * they should be set before other threads use the library, the hooks
+ * themselves may be called from any thread.
+ */
+OMEMO2_EXPORT void omemo2SetTraceHooks(omemo2TraceCallback begin,
+                                     omemo2TraceCallback end);
+
+/**
+ * Initialize an empty signature cache with a random salt.
+ *
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int
+omemo2SetupSignatureCache(struct omemo2SignatureCache *cache);
+
+/**
+ * Remember verified signed prekey signatures in cache, so that
+ * omemo2InitiateSession and omemo2VerifyBundles don't verify the same
+ * bundle twice. Calling omemo2VerifyBundles warms the cache. The cache
+ * contains no pointers, so it can be saved to disk and loaded again as
+ * is. Pass NULL to stop using it. Like omemo2SetCallbacks this is global,
+ * so the cache must not be used from multiple threads at once.
+ */
+OMEMO2_EXPORT void
+omemo2SetSignatureCache(struct omemo2SignatureCache *cache);
+
+/**
+ * Create the driver objects of ctx. This is the only allocation, the
+ * API calls made with ctx set reuse them and keep all their
+ * temporaries in ctx->scratch, so nothing is allocated or left on the
+ * stack while encrypting or decrypting.
+ *
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2SetupContext(struct omemo2Context *ctx);
+
+/**
+ * Destroy the driver objects of ctx and wipe it, which also clears the
+ * leftover key material of all calls made with it.
+ */
+OMEMO2_EXPORT void omemo2FreeContext(struct omemo2Context *ctx);
+
+/**
+ * Use ctx for the API calls made by this thread, NULL goes back to the
+ * stack and the one-shot driver functions. Every thread needs its own
+ * context and the callbacks must not call into the library. When the
+ * library is compiled with -DOMEMO2_SMALLSTACK the calls fail with
+ * OMEMO2_ESTATE until a context is set. GCM payloads are not split over
+ * the threads of omemo2SetGcmThreads while a context is set.
+ */
+OMEMO2_EXPORT void omemo2SetContext(struct omemo2Context *ctx);
+
+/**
+ * @returns OMEMO2_CPU_* features that are detected on this CPU and not
+ * disabled with omemo2SetCpuFeatures()
+ */
+OMEMO2_EXPORT uint32_t omemo2GetCpuFeatures(void);
+
+/**
+ * Only allow the drivers to use the OMEMO2_CPU_* features in mask, 0
+ * forces the portable implementations. This is shared between OMEMO
+ * versions and should not be called while other threads are using the
+ * library.
+ */
+OMEMO2_EXPORT void omemo2SetCpuFeatures(uint32_t mask);
+
+
+/**
+ * @param kind is one of OMEMO2_DRIVER_*
+ * @returns name of the implementation currently used for kind, or NULL
+ */
+OMEMO2_EXPORT const char *omemo2GetDriverImpl(int kind);
+
+/**
+ * Copy the operation counters and latency histograms to stats and
+ * optionally reset them. They are only collected when the library is
+ * compiled with -DOMEMO2_STATS, the counters are atomic but a snapshot
+ * taken while other threads use the library may be slightly
+ * inconsistent. InitiateVerifiedSession is counted as InitiateSession
+ * and EncryptKeyTo as EncryptKey.
+ *
+ * @returns 0 or OMEMO2_ESTATE if statistics are compiled out
+ */
+OMEMO2_EXPORT int omemo2GetStats(struct omemo2Stats *stats, bool reset);
+
 /**
  * Serialize a raw public key into the OMEMO public key format.
  */
@@ -214,6 +442,44 @@ OMEMO2_EXPORT int omemo2InitiateSession(struct omemo2Session *session,
                                       const omemo2SerializedKey pk,
                                       uint32_t spk_id, uint32_t pk_id);
 
+/**
+ * Verify the signed prekey signatures of n bundles at once, which is
+ * faster than letting omemo2InitiateSession verify them one by one.
+ * Sessions can then be started with omemo2InitiateVerifiedSession for the
+ * bundles where ok[i] is true.
+ *
+ * @param ok receives for each bundle whether its signature is valid
+ * @returns 0, OMEMO2_ECORRUPT if any signature is invalid or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2VerifyBundles(const struct omemo2Bundle *bundles,
+                                    bool *ok, size_t n);
+
+/**
+ * Set the remote identity key of n sessions at once, iks[i] for
+ * sessions[i]. The converted forms of the keys that are cached in the
+ * sessions are computed together, which is faster than letting
+ * omemo2InitiateSession or omemo2DecryptKey do it for each device. Use it
+ * when importing the devices of a roster. Sessions that are already
+ * initialized must have the same remote identity.
+ *
+ * @returns 0, OMEMO2_ESTATE when an identity doesn't match or OMEMO2_E*
+ */
+OMEMO2_EXPORT int
+omemo2ImportRemoteIdentities(struct omemo2Session **sessions,
+                            const omemo2SerializedKey *iks, size_t n);
+
+/**
+ * Same as omemo2InitiateSession, but without verifying the signature of
+ * the signed prekey. Only use for bundles that passed
+ * omemo2VerifyBundles.
+ *
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2InitiateVerifiedSession(
+    struct omemo2Session *session, const struct omemo2Store *store,
+    const omemo2SerializedKey spk, const omemo2SerializedKey ik,
+    const omemo2SerializedKey pk, uint32_t spk_id, uint32_t pk_id);
+
 /**
  * Encrypt message encryption key payload for a specific recipient.
  *
@@ -222,6 +488,30 @@ OMEMO2_EXPORT int omemo2InitiateSession(struct omemo2Session *session,
 OMEMO2_EXPORT int omemo2EncryptKey(struct omemo2Session *session,
                                  struct omemo2KeyMessage *msg,
                                  const uint8_t *key, size_t keyn);
+
+/**
+ * Same as omemo2EncryptKey, but the message is written directly to d,
+ * e.g. a buffer shared by the messages for all recipients.
+ *
+ * @param dn is the size of d and is set to the size of the message,
+ * which is omemo2GetKeyMessageSize() and at most
+ * OMEMO2_KEYMESSAGE_MAXSIZE
+ * @param isprekey is set like omemo2KeyMessage.isprekey
+ * @returns 0 or OMEMO2_E*, OMEMO2_EPARAM if d is too small
+ */
+OMEMO2_EXPORT int omemo2EncryptKeyTo(struct omemo2Session *session,
+                                   uint8_t *d, size_t *dn,
+                                   bool *isprekey, const uint8_t *key,
+                                   size_t keyn);
+
+/**
+ * @returns the size of the message the next omemo2EncryptKey or
+ * omemo2EncryptKeyTo call writes for a key of keyn bytes, 0 when session
+ * is NULL
+ */
+OMEMO2_EXPORT size_t
+omemo2GetKeyMessageSize(const struct omemo2Session *session, size_t keyn);
+
 /**
  * Decrypt message encryption key payload for a specific recipient.
  *
@@ -256,13 +546,17 @@ OMEMO2_EXPORT int omemo2Heartbeat(struct omemo2Session *session,
                                 const struct omemo2Store *store,
                                 struct omemo2KeyMessage *msg);
 
-#define omemo2GetMessagePadSize(n) (16 - (n % 16))
+#define omemo2GetMessagePadSize(n) (16 - ((n) % 16))
 /**
  * Encrypt message which will be stored in the <payload> element.
  *
+ * The ciphertext is n + omemo2GetMessagePadSize(n) bytes. d may be s to
+ * encrypt in place, then no other buffer is needed.
+ *
  * @param key (out) will contain the encryption key
  * @param s is a mutable buffer containing the plaintext message with
- * `omemo2GetMessagePadSize(n)` amount of bytes reserved at the end
+ * `omemo2GetMessagePadSize(n)` amount of bytes reserved at the end, the
+ * padding is written there
  * @param d is the destination buffer that is the same size as s
  * @param n is the original message size
  *
@@ -274,6 +568,10 @@ OMEMO2_EXPORT int omemo2EncryptMessage(uint8_t *d, uint8_t key[48],
 /**
  * Decrypt message taken from the <payload> element.
  *
+ * d may be s to decrypt in place. The padding in d is zeroed, and all of
+ * d when the MAC does not match.
+ *
+ * @param outn (out) will contain the size of the plaintext in d
  * @param key is the decrypted key of the omemo2KeyMessage
  * @param keyn is the size of key
  * @param n is the size of the buffer in d and s
@@ -284,4 +582,87 @@ OMEMO2_EXPORT int omemo2DecryptMessage(uint8_t *d, size_t *outn,
                                      const uint8_t *key, size_t keyn,
                                      const uint8_t *s, size_t n);
 
+/**
+ * Start encrypting a payload in pieces, for when it does not fit in
+ * memory at once. Call omemo2EncryptMessageUpdate for each piece and
+ * finish with omemo2EncryptMessageFinal. The result is the same as
+ * omemo2EncryptMessage over the concatenated pieces.
+ *
+ * If any of the streaming functions fails, the stream is freed.
+ * omemo2FreeMessageStream must be called only when a stream is abandoned
+ * before Final.
+ *
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2EncryptMessageInit(struct omemo2PayloadStream *st);
+
+/**
+ * Encrypt the next n bytes of the payload.
+ *
+ * For OMEMO 0.3 n bytes are written to d and d may be s. For OMEMO 2
+ * the output is whole blocks, d must have room for n + 15 bytes and
+ * must not overlap s.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2EncryptMessageUpdate(struct omemo2PayloadStream *st,
+                                           uint8_t *d, size_t *outn,
+                                           const uint8_t *s, size_t n);
+
+/**
+ * Finish the payload and free the stream. For OMEMO 2 the last 16 bytes
+ * are written to d, for OMEMO 0.3 nothing.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @param key (out) will contain the encryption key, like with
+ * omemo2EncryptMessage
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2EncryptMessageFinal(struct omemo2PayloadStream *st,
+                                          uint8_t *d, size_t *outn,
+                                          uint8_t key[OMEMO2_KEYSIZE]);
+
+/**
+ * Start decrypting a payload in pieces, see omemo2EncryptMessageInit.
+ *
+ * The payload is only authenticated by omemo2DecryptMessageFinal, the
+ * output of omemo2DecryptMessageUpdate must not be used before it
+ * succeeds.
+ *
+ * @param key is the decrypted key of the omemo2KeyMessage
+ * @param keyn is the size of key
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2DecryptMessageInit(struct omemo2PayloadStream *st,
+                                         const uint8_t *key, size_t keyn);
+
+/**
+ * Decrypt the next n bytes of the payload, with the same buffer rules
+ * as omemo2EncryptMessageUpdate. For OMEMO 2 the last block is held back
+ * until omemo2DecryptMessageFinal.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO2_E*
+ */
+OMEMO2_EXPORT int omemo2DecryptMessageUpdate(struct omemo2PayloadStream *st,
+                                           uint8_t *d, size_t *outn,
+                                           const uint8_t *s, size_t n);
+
+/**
+ * Check the payload and free the stream. For OMEMO 2 the rest of the
+ * plaintext, at most 15 bytes, is written to d, for OMEMO 0.3 nothing.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO2_E*, in which case the whole output must be
+ * discarded
+ */
+OMEMO2_EXPORT int omemo2DecryptMessageFinal(struct omemo2PayloadStream *st,
+                                          uint8_t *d, size_t *outn);
+
+/**
+ * Free a stream that is not finished.
+ */
+OMEMO2_EXPORT void omemo2FreeMessageStream(struct omemo2PayloadStream *st);
+
 #endif
@@ -9,8 +9,9 @@ for _,ext in ipairs{".c",".h"} do
     s=s:gsub("omemo%.h",version..".h")
     s=s:gsub("OMEMO_",version:upper().."_")
     s=s:gsub("omemo(%u)",version.."%1")
-    -- Don't change omemoDriver
+    -- Don't change omemoDriver and omemoCore
     s=s:gsub(version.."Driver","omemoDriver")
+    s=s:gsub(version.."Core","omemoCore")
     io.open("gen/"..version..ext,"w"):write(s)
   end
 end
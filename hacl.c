@@ -7752,8 +7752,179 @@ void omemoDriverEdSignMod(
   store_56(ss, aq);
 }
 
+// Batch verification checks the random linear combination
+//   [8]([sum z_i S_i]B - sum [z_i]R_i - sum [z_i h_i]A_i) = 0
+// with 128-bit z_i derived from seed. The R_i and A_i are multiplied
+// with one shared chain of doublings using signed 4-bit windows. The
+// tables take 2.5K of stack per signature, -DOMEMO_SMALLSTACK makes the
+// batches smaller.
+#ifdef OMEMO_SMALLSTACK
+#define BATCHMAX 2
+#else
+#define BATCHMAX 8
+#endif
+
+static void Recode4(int8_t *e, const uint8_t *s) {
+  int8_t c = 0;
+  for (int i = 0; i < 32; i++) {
+    e[2 * i] = s[i] & 15;
+    e[2 * i + 1] = s[i] >> 4;
+  }
+  for (int i = 0; i < 63; i++) {
+    e[i] += c;
+    c = (e[i] + 8) >> 4;
+    e[i] -= c * 16;
+  }
+  e[63] += c;
+}
+
+// Same as recover_x, after x^2 = (y^2 - 1) / (d y^2 + 1) is computed.
+static bool RecoverX(uint64_t *x, uint64_t *x2, uint64_t sign) {
+  uint64_t t[5];
+  reduce(x2);
+  if (is_0(x2)) {
+    memset(x, 0, 5 * sizeof(uint64_t));
+    return !sign;
+  }
+  pow2_252m2(x, x2);
+  fsquare(t, x);
+  fdifference(t, t, x2);
+  Hacl_Bignum25519_reduce_513(t);
+  reduce(t);
+  if (!is_0(t))
+    mul_modp_sqrt_m1(x);
+  fsquare(t, x);
+  fdifference(t, t, x2);
+  Hacl_Bignum25519_reduce_513(t);
+  reduce(t);
+  if (!is_0(t))
+    return false;
+  reduce(x);
+  if ((x[0] & 1) != sign) {
+    memset(t, 0, sizeof(t));
+    fdifference(x, t, x);
+    Hacl_Bignum25519_reduce_513(x);
+    reduce(x);
+  }
+  return true;
+}
+
+// Same as Hacl_Impl_Ed25519_PointDecompress_point_decompress for n
+// points, but the inversions of d y^2 + 1 are shared using Montgomery's
+// trick. d y^2 + 1 is never zero as -1/d is not a square.
+static bool DecompressBatch(uint64_t (*out)[8][20], uint8_t **s, size_t n) {
+  uint64_t u[2 * BATCHMAX][5], v[2 * BATCHMAX][5], acc[2 * BATCHMAX][5];
+  uint64_t one[5] = {1}, inv[5], t[5];
+  for (size_t i = 0; i < n; i++) {
+    uint64_t *y = out[i][0] + 5;
+    Hacl_Bignum25519_load_51(y, s[i]);
+    if (y[0] >= 0x7ffffffffffedULL && y[1] == 0x7ffffffffffffULL
+     && y[2] == 0x7ffffffffffffULL && y[3] == 0x7ffffffffffffULL
+     && y[4] == 0x7ffffffffffffULL)
+      return false;
+    fsquare(u[i], y);
+    times_d(v[i], u[i]);
+    fsum(v[i], v[i], one);
+    Hacl_Bignum25519_reduce_513(v[i]);
+    fdifference(u[i], u[i], one);
+    if (i)
+      fmul0(acc[i], acc[i - 1], v[i]);
+    else
+      memcpy(acc[0], v[0], sizeof(acc[0]));
+  }
+  Hacl_Bignum25519_inverse(inv, acc[n - 1]);
+  for (size_t i = n - 1; i > 0; i--) {
+    fmul0(t, inv, acc[i - 1]);
+    fmul0(inv, inv, v[i]);
+    memcpy(v[i], t, sizeof(t));
+  }
+  memcpy(v[0], inv, sizeof(inv));
+  for (size_t i = 0; i < n; i++) {
+    uint64_t *p = out[i][0];
+    fmul0(u[i], u[i], v[i]);
+    if (!RecoverX(p, u[i], s[i][31] >> 7))
+      return false;
+    memcpy(p + 10, one, sizeof(one));
+    fmul0(p + 15, p, p + 5);
+  }
+  return true;
+}
+
+static bool EdVerifyBatch(size_t n, omemoCurveSignature *sigs, omemoKey *pubs, uint8_t **msgs, size_t *msgns, const uint8_t *seed, size_t first) {
+  uint64_t tab[2 * BATCHMAX][8][20];
+  int8_t e[2 * BATCHMAX][64];
+  uint64_t s[5] = {0}, z[5], t[5], p[20], q[20];
+  uint8_t b[32], hash[64], ctr[8], *enc[2 * BATCHMAX];
+  for (size_t i = 0; i < n; i++) {
+    enc[2 * i] = sigs[i];
+    enc[2 * i + 1] = pubs[i];
+  }
+  if (!DecompressBatch(tab, enc, 2 * n))
+    return false;
+  for (size_t i = 0; i < n; i++) {
+    load_32_bytes(t, sigs[i] + 32);
+    if (gte_q(t))
+      return false;
+    store64_le(ctr, (uint64_t)(first + i));
+    sha512_pre_msg(hash, (uint8_t *)seed, 8, ctr);
+    memset(b, 0, 32);
+    memcpy(b, hash, 16);
+    Recode4(e[2 * i], b);
+    load_32_bytes(z, b);
+    mul_modq(t, z, t);
+    add_modq(s, t, s);
+    sha512_modq_pre_pre2(t, sigs[i], pubs[i], msgns[i], msgs[i]);
+    mul_modq(t, z, t);
+    store_56(b, t);
+    Recode4(e[2 * i + 1], b);
+  }
+  for (size_t j = 0; j < 2 * n; j++) {
+    Hacl_Impl_Ed25519_PointDouble_point_double(tab[j][1], tab[j][0]);
+    for (int k = 2; k < 8; k++)
+      Hacl_Impl_Ed25519_PointAdd_point_add(tab[j][k], tab[j][k - 1], tab[j][0]);
+  }
+  Hacl_Impl_Ed25519_PointConstants_make_point_inf(q);
+  for (int i = 63; i >= 0; i--) {
+    if (i < 63) {
+      for (int k = 0; k < 4; k++)
+        Hacl_Impl_Ed25519_PointDouble_point_double(q, q);
+    }
+    for (size_t j = 0; j < 2 * n; j++) {
+      int d = e[j][i];
+      if (d > 0) {
+        Hacl_Impl_Ed25519_PointAdd_point_add(q, q, tab[j][d - 1]);
+      } else if (d < 0) {
+        Hacl_Impl_Ed25519_PointNegate_point_negate(tab[j][-d - 1], p);
+        Hacl_Impl_Ed25519_PointAdd_point_add(q, q, p);
+      }
+    }
+  }
+  store_56(b, s);
+  point_mul_g(p, b);
+  for (int k = 0; k < 3; k++) {
+    Hacl_Impl_Ed25519_PointDouble_point_double(p, p);
+    Hacl_Impl_Ed25519_PointDouble_point_double(q, q);
+  }
+  return Hacl_Impl_Ed25519_PointEqual_point_equal(p, q);
+}
+
+bool omemoDriverEdVerifyBatch(size_t n, omemoCurveSignature *sigs, omemoKey *pubs, uint8_t **msgs, size_t *msgns, const uint8_t seed[static 32]) {
+  for (size_t i = 0; i < n; i += BATCHMAX) {
+    size_t m = n - i < BATCHMAX ? n - i : BATCHMAX;
+    if (!EdVerifyBatch(m, sigs + i, pubs + i, msgs + i, msgns + i, seed, i))
+      return false;
+  }
+  return true;
+}
+
+// Cofactored like the batch, so both accept the same signatures. Valid
+// signatures pass the verified Hacl_Ed25519_verify, only when that fails
+// is the equation checked with [8]. A batch of one needs no random z_i,
+// any fixed z_1 < q other than 0 does.
 bool omemoDriverEdVerify(omemoCurveSignature sig, omemoKey pub, uint8_t *msg, size_t msgn) {
-  return Hacl_Ed25519_verify(pub, msgn, msg, sig);
+  static const uint8_t seed[32];
+  return Hacl_Ed25519_verify(pub, msgn, msg, sig) ||
+         EdVerifyBatch(1, (omemoCurveSignature *)sig, (omemoKey *)pub, &msg, &msgn, seed, 0);
 }
 
 void omemoDriverCvPrvToEdPub(omemoKey pub, omemoKey sec) {
@@ -7789,10 +7960,529 @@ void omemoDriverCvPubToEdPub(omemoKey e, omemoKey m) {
   Hacl_Bignum25519_store_51(e, ey);
 }
 
+#define CONVERTMAX 32
+
+// out = num / den for n elements with one inversion (Montgomery's trick):
+// acc holds the prefix products of den and the inverses are peeled off
+// from the back. As with Hacl_Bignum25519_inverse, den = 0 gives 0.
+static void DivideBatch(omemoKey *out, uint64_t (*num)[5], uint64_t (*den)[5], size_t n) {
+  uint64_t acc[CONVERTMAX][5], inv[5], t[5], one[5] = {1};
+  bool zero[CONVERTMAX];
+  uint8_t b[32];
+  for (size_t i = 0; i < n; i++) {
+    Hacl_Bignum25519_store_51(b, den[i]);
+    uint8_t z = 0;
+    for (int k = 0; k < 32; k++)
+      z |= b[k];
+    if ((zero[i] = !z))
+      memcpy(den[i], one, sizeof(one));
+    if (i)
+      fmul0(acc[i], acc[i - 1], den[i]);
+    else
+      memcpy(acc[0], den[0], sizeof(acc[0]));
+  }
+  Hacl_Bignum25519_inverse(inv, acc[n - 1]);
+  for (size_t i = n - 1; i > 0; i--) {
+    fmul0(t, inv, acc[i - 1]);
+    fmul0(inv, inv, den[i]);
+    memcpy(den[i], t, sizeof(t));
+  }
+  memcpy(den[0], inv, sizeof(inv));
+  for (size_t i = 0; i < n; i++) {
+    if (zero[i])
+      memset(den[i], 0, sizeof(den[i]));
+    fmul0(t, num[i], den[i]);
+    Hacl_Bignum25519_store_51(out[i], t);
+  }
+}
+
+void omemoDriverEdPubToCvPubBatch(size_t n, omemoKey *m, omemoKey *e) {
+  uint64_t num[CONVERTMAX][5], den[CONVERTMAX][5], ey[5], one[5] = {1};
+  for (size_t i = 0; i < n; i += CONVERTMAX) {
+    size_t c = n - i < CONVERTMAX ? n - i : CONVERTMAX;
+    for (size_t j = 0; j < c; j++) {
+      Hacl_Bignum25519_load_51(ey, e[i + j]);
+      fdifference(den[j], one, ey);
+      fsum(num[j], one, ey);
+    }
+    DivideBatch(m + i, num, den, c);
+  }
+}
+
+void omemoDriverCvPubToEdPubBatch(size_t n, omemoKey *e, omemoKey *m) {
+  uint64_t num[CONVERTMAX][5], den[CONVERTMAX][5], mx[5], one[5] = {1};
+  for (size_t i = 0; i < n; i += CONVERTMAX) {
+    size_t c = n - i < CONVERTMAX ? n - i : CONVERTMAX;
+    for (size_t j = 0; j < c; j++) {
+      Hacl_Bignum25519_load_51(mx, m[i + j]);
+      fsum(den[j], mx, one);
+      fdifference(num[j], mx, one);
+    }
+    DivideBatch(e + i, num, den, c);
+  }
+}
+
+// X25519 with the field in four 64-bit limbs, using MULX and ADCX/ADOX
+// on x86-64. This follows Hacl_Curve25519_64.c, but the field add, sub,
+// multiply and square are hand-written inline assembly modeled on its
+// Vale code (curve25519-inline.h), not the verified code itself. So it is
+// only built with -DOMEMO_CURVE64, and then used when the CPU supports
+// BMI2 and ADX. Elsewhere the flag is ignored.
+
+#if defined(OMEMO_CURVE64) && defined(__x86_64__) && \
+    (defined(__GNUC__) || defined(__clang__))
+
+#include <immintrin.h>
+
+#define CURVE64 __attribute__((target("bmi2,adx")))
+
+typedef unsigned long long u64;
+
+// out = f1 + f2, 38 = 2^256 mod p is folded in for the carry.
+static inline void Curve64_fadd(u64 *out, const u64 *f1, const u64 *f2)
+{
+  __asm__ volatile(
+    "movq (%1), %%r8\n"
+    "addq (%2), %%r8\n"
+    "movq 8(%1), %%r9\n"
+    "adcq 8(%2), %%r9\n"
+    "movq 16(%1), %%r10\n"
+    "adcq 16(%2), %%r10\n"
+    "movq 24(%1), %%r11\n"
+    "adcq 24(%2), %%r11\n"
+    "sbbq %%rax, %%rax\n"
+    "andq $38, %%rax\n"
+    "addq %%rax, %%r8\n"
+    "adcq $0, %%r9\n"
+    "adcq $0, %%r10\n"
+    "adcq $0, %%r11\n"
+    "sbbq %%rax, %%rax\n"
+    "andq $38, %%rax\n"
+    "addq %%rax, %%r8\n"
+    "movq %%r8, 0(%0)\n"
+    "movq %%r9, 8(%0)\n"
+    "movq %%r10, 16(%0)\n"
+    "movq %%r11, 24(%0)\n"
+    :
+    : "r"(out), "r"(f1), "r"(f2)
+    : "rax", "r8", "r9", "r10", "r11", "cc", "memory");
+}
+
+static inline void Curve64_fsub(u64 *out, const u64 *f1, const u64 *f2)
+{
+  __asm__ volatile(
+    "movq (%1), %%r8\n"
+    "subq (%2), %%r8\n"
+    "movq 8(%1), %%r9\n"
+    "sbbq 8(%2), %%r9\n"
+    "movq 16(%1), %%r10\n"
+    "sbbq 16(%2), %%r10\n"
+    "movq 24(%1), %%r11\n"
+    "sbbq 24(%2), %%r11\n"
+    "sbbq %%rax, %%rax\n"
+    "andq $38, %%rax\n"
+    "subq %%rax, %%r8\n"
+    "sbbq $0, %%r9\n"
+    "sbbq $0, %%r10\n"
+    "sbbq $0, %%r11\n"
+    "sbbq %%rax, %%rax\n"
+    "andq $38, %%rax\n"
+    "subq %%rax, %%r8\n"
+    "movq %%r8, 0(%0)\n"
+    "movq %%r9, 8(%0)\n"
+    "movq %%r10, 16(%0)\n"
+    "movq %%r11, 24(%0)\n"
+    :
+    : "r"(out), "r"(f1), "r"(f2)
+    : "rax", "r8", "r9", "r10", "r11", "cc", "memory");
+}
+
+// Product scanning with two carry chains, ADCX for the low halves and
+// ADOX for the high halves, then the upper 256 bits are multiplied by 38
+// and added to the lower ones.
+static inline void Curve64_fmul(u64 *out, const u64 *f1, const u64 *f2)
+{
+  u64 tmp[3];
+  __asm__ volatile(
+    "movq (%1), %%rdx\n"
+    "mulxq (%2), %%r8, %%r9\n"
+    "mulxq 8(%2), %%rax, %%r10\n"
+    "addq %%rax, %%r9\n"
+    "mulxq 16(%2), %%rax, %%r11\n"
+    "adcq %%rax, %%r10\n"
+    "mulxq 24(%2), %%rax, %%r12\n"
+    "adcq %%rax, %%r11\n"
+    "adcq $0, %%r12\n"
+    "movq %%r8, 0(%3)\n"
+
+    "movq 8(%1), %%rdx\n"
+    "xorl %%r15d, %%r15d\n"
+    "mulxq (%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r9\n"
+    "adoxq %%r14, %%r10\n"
+    "mulxq 8(%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r10\n"
+    "adoxq %%r14, %%r11\n"
+    "mulxq 16(%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r11\n"
+    "adoxq %%r14, %%r12\n"
+    "mulxq 24(%2), %%rax, %%r8\n"
+    "adcxq %%rax, %%r12\n"
+    "adoxq %%r15, %%r8\n"
+    "adcxq %%r15, %%r8\n"
+    "movq %%r9, 8(%3)\n"
+
+    "movq 16(%1), %%rdx\n"
+    "xorl %%r15d, %%r15d\n"
+    "mulxq (%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r10\n"
+    "adoxq %%r14, %%r11\n"
+    "mulxq 8(%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r11\n"
+    "adoxq %%r14, %%r12\n"
+    "mulxq 16(%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r12\n"
+    "adoxq %%r14, %%r8\n"
+    "mulxq 24(%2), %%rax, %%r9\n"
+    "adcxq %%rax, %%r8\n"
+    "adoxq %%r15, %%r9\n"
+    "adcxq %%r15, %%r9\n"
+    "movq %%r10, 16(%3)\n"
+
+    "movq 24(%1), %%rdx\n"
+    "xorl %%r15d, %%r15d\n"
+    "mulxq (%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r11\n"
+    "adoxq %%r14, %%r12\n"
+    "mulxq 8(%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r12\n"
+    "adoxq %%r14, %%r8\n"
+    "mulxq 16(%2), %%rax, %%r14\n"
+    "adcxq %%rax, %%r8\n"
+    "adoxq %%r14, %%r9\n"
+    "mulxq 24(%2), %%rax, %%r10\n"
+    "adcxq %%rax, %%r9\n"
+    "adoxq %%r15, %%r10\n"
+    "adcxq %%r15, %%r10\n"
+
+    // t0..t2 in tmp, t3 = r11, t4 = r12, t5 = r8, t6 = r9, t7 = r10
+    "movq $38, %%rdx\n"
+    "xorl %%r15d, %%r15d\n"
+    "mulxq %%r12, %%rax, %%r12\n"
+    "adcxq 0(%3), %%rax\n"
+    "mulxq %%r8, %%r13, %%r8\n"
+    "adcxq 8(%3), %%r13\n"
+    "adoxq %%r12, %%r13\n"
+    "mulxq %%r9, %%r14, %%r9\n"
+    "adcxq 16(%3), %%r14\n"
+    "adoxq %%r8, %%r14\n"
+    "mulxq %%r10, %%r12, %%r10\n"
+    "adcxq %%r11, %%r12\n"
+    "adoxq %%r9, %%r12\n"
+    "adcxq %%r15, %%r10\n"
+    "adoxq %%r15, %%r10\n"
+
+    "imulq $38, %%r10, %%r10\n"
+    "addq %%r10, %%rax\n"
+    "adcq %%r15, %%r13\n"
+    "adcq %%r15, %%r14\n"
+    "adcq %%r15, %%r12\n"
+    "sbbq %%r10, %%r10\n"
+    "andq $38, %%r10\n"
+    "addq %%r10, %%rax\n"
+    "movq %%rax, 0(%0)\n"
+    "movq %%r13, 8(%0)\n"
+    "movq %%r14, 16(%0)\n"
+    "movq %%r12, 24(%0)\n"
+    :
+    : "r"(out), "r"(f1), "r"(f2), "r"(tmp)
+    : "rax", "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+      "cc", "memory");
+}
+
+// The cross products are computed once and doubled, then the squares
+// on the diagonal are added.
+static inline void Curve64_fsqr(u64 *out, const u64 *f)
+{
+  u64 tmp[1];
+  __asm__ volatile(
+    "movq (%1), %%rdx\n"
+    "mulxq 8(%1), %%r9, %%r10\n"
+    "mulxq 16(%1), %%rax, %%r11\n"
+    "addq %%rax, %%r10\n"
+    "mulxq 24(%1), %%rax, %%r12\n"
+    "adcq %%rax, %%r11\n"
+    "adcq $0, %%r12\n"
+    "movq 8(%1), %%rdx\n"
+    "xorl %%r15d, %%r15d\n"
+    "mulxq 16(%1), %%rax, %%r14\n"
+    "adcxq %%rax, %%r11\n"
+    "adoxq %%r14, %%r12\n"
+    "mulxq 24(%1), %%rax, %%r13\n"
+    "adcxq %%rax, %%r12\n"
+    "adoxq %%r15, %%r13\n"
+    "adcxq %%r15, %%r13\n"
+    "movq 16(%1), %%rdx\n"
+    "mulxq 24(%1), %%rax, %%r14\n"
+    "addq %%rax, %%r13\n"
+    "adcq $0, %%r14\n"
+
+    "xorl %%r8d, %%r8d\n"
+    "addq %%r9, %%r9\n"
+    "adcq %%r10, %%r10\n"
+    "adcq %%r11, %%r11\n"
+    "adcq %%r12, %%r12\n"
+    "adcq %%r13, %%r13\n"
+    "adcq %%r14, %%r14\n"
+    "adcq %%r8, %%r8\n"
+
+    "movq (%1), %%rdx\n"
+    "mulxq %%rdx, %%rax, %%rcx\n"
+    "movq %%rax, 0(%2)\n"
+    "addq %%rcx, %%r9\n"
+    "movq 8(%1), %%rdx\n"
+    "mulxq %%rdx, %%rax, %%rcx\n"
+    "adcq %%rax, %%r10\n"
+    "adcq %%rcx, %%r11\n"
+    "movq 16(%1), %%rdx\n"
+    "mulxq %%rdx, %%rax, %%rcx\n"
+    "adcq %%rax, %%r12\n"
+    "adcq %%rcx, %%r13\n"
+    "movq 24(%1), %%rdx\n"
+    "mulxq %%rdx, %%rax, %%rcx\n"
+    "adcq %%rax, %%r14\n"
+    "adcq %%rcx, %%r8\n"
+
+    // t0 in tmp, t1..t7 = r9, r10, r11, r12, r13, r14, r8
+    "movq $38, %%rdx\n"
+    "xorl %%r15d, %%r15d\n"
+    "mulxq %%r12, %%rax, %%r12\n"
+    "adcxq 0(%2), %%rax\n"
+    "mulxq %%r13, %%rcx, %%r13\n"
+    "adcxq %%r9, %%rcx\n"
+    "adoxq %%r12, %%rcx\n"
+    "mulxq %%r14, %%r9, %%r14\n"
+    "adcxq %%r10, %%r9\n"
+    "adoxq %%r13, %%r9\n"
+    "mulxq %%r8, %%r10, %%r8\n"
+    "adcxq %%r11, %%r10\n"
+    "adoxq %%r14, %%r10\n"
+    "adcxq %%r15, %%r8\n"
+    "adoxq %%r15, %%r8\n"
+
+    "imulq $38, %%r8, %%r8\n"
+    "addq %%r8, %%rax\n"
+    "adcq %%r15, %%rcx\n"
+    "adcq %%r15, %%r9\n"
+    "adcq %%r15, %%r10\n"
+    "sbbq %%r8, %%r8\n"
+    "andq $38, %%r8\n"
+    "addq %%r8, %%rax\n"
+    "movq %%rax, 0(%0)\n"
+    "movq %%rcx, 8(%0)\n"
+    "movq %%r9, 16(%0)\n"
+    "movq %%r10, 24(%0)\n"
+    :
+    : "r"(out), "r"(f), "r"(tmp)
+    : "rax", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14",
+      "r15", "cc", "memory");
+}
+
+CURVE64 static inline void Curve64_fmul_scalar(u64 *out, const u64 *f, u64 s)
+{
+  u64 hi, lo, carry = 0;
+  unsigned char c;
+  for (int i = 0; i < 4; i++)
+  {
+    lo = _mulx_u64(s, f[i], &hi);
+    c = _addcarryx_u64(0, lo, carry, out + i);
+    carry = hi + c;
+  }
+  c = _addcarryx_u64(0, out[0], carry * 38, out + 0);
+  c = _addcarryx_u64(c, out[1], 0, out + 1);
+  c = _addcarryx_u64(c, out[2], 0, out + 2);
+  c = _addcarryx_u64(c, out[3], 0, out + 3);
+  out[0] += -(u64)c & 38;
+}
+
+static inline void Curve64_cswap2(u64 bit, u64 *p1, u64 *p2)
+{
+  u64 mask = 0ULL - bit;
+  for (int i = 0; i < 8; i++)
+  {
+    u64 dummy = mask & (p1[i] ^ p2[i]);
+    p1[i] ^= dummy;
+    p2[i] ^= dummy;
+  }
+}
+
+CURVE64 static void Curve64_point_add_and_double(const u64 *q, u64 *nq, u64 *nq_p1)
+{
+  u64 *x1 = (u64 *)q;
+  u64 *x2 = nq, *z2 = nq + 4;
+  u64 *x3 = nq_p1, *z3 = nq_p1 + 4;
+  u64 a[4], b[4], c[4], d[4], da[4], cb[4], aa[4], bb[4], e[4];
+  Curve64_fadd(a, x2, z2);
+  Curve64_fsub(b, x2, z2);
+  Curve64_fadd(c, x3, z3);
+  Curve64_fsub(d, x3, z3);
+  Curve64_fmul(da, d, a);
+  Curve64_fmul(cb, c, b);
+  Curve64_fadd(x3, da, cb);
+  Curve64_fsub(z3, da, cb);
+  Curve64_fsqr(aa, a);
+  Curve64_fsqr(bb, b);
+  Curve64_fsqr(x3, x3);
+  Curve64_fsqr(z3, z3);
+  Curve64_fsub(e, aa, bb);
+  Curve64_fmul_scalar(b, e, 121665ULL);
+  Curve64_fadd(b, b, aa);
+  Curve64_fmul(x2, aa, bb);
+  Curve64_fmul(z2, e, b);
+  Curve64_fmul(z3, z3, x1);
+}
+
+CURVE64 static void Curve64_point_double(u64 *nq)
+{
+  u64 *x2 = nq, *z2 = nq + 4;
+  u64 a[4], b[4], aa[4], bb[4], e[4];
+  Curve64_fadd(a, x2, z2);
+  Curve64_fsub(b, x2, z2);
+  Curve64_fsqr(aa, a);
+  Curve64_fsqr(bb, b);
+  Curve64_fsub(e, aa, bb);
+  Curve64_fmul_scalar(b, e, 121665ULL);
+  Curve64_fadd(b, b, aa);
+  Curve64_fmul(x2, aa, bb);
+  Curve64_fmul(z2, e, b);
+}
+
+CURVE64 static void Curve64_montgomery_ladder(u64 *out, const uint8_t *key, const u64 *init)
+{
+  u64 p01[16] = { 0U };
+  u64 *nq = p01, *nq_p1 = p01 + 8;
+  memcpy(nq_p1, init, 8U * sizeof (u64));
+  nq[0] = 1ULL;
+  // Same bit order as montgomery_ladder, bit 254 is always set and the
+  // lowest three bits are handled by the final doublings.
+  Curve64_cswap2(1ULL, nq, nq_p1);
+  Curve64_point_add_and_double(init, nq, nq_p1);
+  u64 swap = 1ULL;
+  for (uint32_t i = 0U; i < 251U; i++)
+  {
+    u64 bit = (u64)((uint32_t)key[(253U - i) / 8U] >> (253U - i) % 8U & 1U);
+    Curve64_cswap2(swap ^ bit, nq, nq_p1);
+    Curve64_point_add_and_double(init, nq, nq_p1);
+    swap = bit;
+  }
+  Curve64_cswap2(swap, nq, nq_p1);
+  Curve64_point_double(nq);
+  Curve64_point_double(nq);
+  Curve64_point_double(nq);
+  memcpy(out, nq, 8U * sizeof (u64));
+}
+
+CURVE64 static void Curve64_fsquare_times(u64 *o, const u64 *inp, uint32_t n)
+{
+  Curve64_fsqr(o, inp);
+  for (uint32_t i = 0U; i < n - 1U; i++)
+    Curve64_fsqr(o, o);
+}
+
+// Same addition chain as Hacl_Curve25519_51_finv.
+CURVE64 static void Curve64_finv(u64 *o, const u64 *i)
+{
+  u64 a[4], b[4], c[4], t0[4];
+  Curve64_fsquare_times(a, i, 1U);
+  Curve64_fsquare_times(t0, a, 2U);
+  Curve64_fmul(b, t0, i);
+  Curve64_fmul(a, b, a);
+  Curve64_fsquare_times(t0, a, 1U);
+  Curve64_fmul(b, t0, b);
+  Curve64_fsquare_times(t0, b, 5U);
+  Curve64_fmul(b, t0, b);
+  Curve64_fsquare_times(t0, b, 10U);
+  Curve64_fmul(c, t0, b);
+  Curve64_fsquare_times(t0, c, 20U);
+  Curve64_fmul(t0, t0, c);
+  Curve64_fsquare_times(t0, t0, 10U);
+  Curve64_fmul(b, t0, b);
+  Curve64_fsquare_times(t0, b, 50U);
+  Curve64_fmul(c, t0, b);
+  Curve64_fsquare_times(t0, c, 100U);
+  Curve64_fmul(t0, t0, c);
+  Curve64_fsquare_times(t0, t0, 50U);
+  Curve64_fmul(t0, t0, b);
+  Curve64_fsquare_times(t0, t0, 5U);
+  Curve64_fmul(o, t0, a);
+}
+
+// Fully reduce mod p = 2^255 - 19 and store little endian.
+CURVE64 static void Curve64_store_felem(uint8_t *o, const u64 *f)
+{
+  u64 x[4], y[4];
+  unsigned char c;
+  u64 top = f[3] >> 63;
+  c = _addcarryx_u64(0, f[0], top * 19, x + 0);
+  c = _addcarryx_u64(c, f[1], 0, x + 1);
+  c = _addcarryx_u64(c, f[2], 0, x + 2);
+  _addcarryx_u64(c, f[3] & 0x7fffffffffffffffULL, 0, x + 3);
+  // x < 2^255 + 19, subtract p if x + 19 >= 2^255.
+  c = _addcarryx_u64(0, x[0], 19, y + 0);
+  c = _addcarryx_u64(c, x[1], 0, y + 1);
+  c = _addcarryx_u64(c, x[2], 0, y + 2);
+  _addcarryx_u64(c, x[3], 0, y + 3);
+  u64 mask = 0ULL - (y[3] >> 63);
+  y[3] &= 0x7fffffffffffffffULL;
+  for (int i = 0; i < 4; i++)
+    store64_le(o + i * 8, (x[i] & ~mask) | (y[i] & mask));
+}
+
+CURVE64 static void Curve64_scalarmult(uint8_t *out, uint8_t *priv, uint8_t *pub)
+{
+  u64 init[8] = { 0U }, tmp[4];
+  for (int i = 0; i < 4; i++)
+    init[i] = load64_le(pub + i * 8);
+  init[3] &= 0x7fffffffffffffffULL;
+  init[4] = 1ULL;
+  Curve64_montgomery_ladder(init, priv, init);
+  Curve64_finv(tmp, init + 4);
+  Curve64_fmul(tmp, tmp, init);
+  Curve64_store_felem(out, tmp);
+}
+
+static bool UseCurve64(void) {
+  return omemoDriverGetCpuFeatures() & OMEMO_CPU_BMI2ADX;
+}
+
+#else
+
+static bool UseCurve64(void) {
+  return false;
+}
+
+#define Curve64_scalarmult Hacl_Curve25519_51_scalarmult
+
+#endif
+
 void omemoDriverCvPrvToPub(omemoKey pub, omemoKey prv) {
-  Hacl_Curve25519_51_secret_to_public(pub, prv);
+  if (UseCurve64())
+    Curve64_scalarmult(pub, prv, (uint8_t *)g25519);
+  else
+    Hacl_Curve25519_51_secret_to_public(pub, prv);
 }
 
 int omemoDriverX25519(omemoKey out, omemoKey prv, omemoKey pub) {
+  if (UseCurve64()) {
+    uint8_t z = 0;
+    Curve64_scalarmult(out, prv, pub);
+    for (int i = 0; i < 32; i++)
+      z |= out[i];
+    return z ? 0 : OMEMO_ECORRUPT;
+  }
   return Hacl_Curve25519_51_ecdh(out, prv, pub) ? 0 : OMEMO_ECORRUPT;
 }
+
+const char *omemoDriverCurveImpl(void) {
+  return UseCurve64() ? "hacl-64" : "hacl-51";
+}
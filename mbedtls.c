@@ -16,38 +16,265 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <mbedtls/aes.h>
 #include <mbedtls/constant_time.h>
 #include <mbedtls/gcm.h>
 #include <mbedtls/hkdf.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform_util.h>
+#include <mbedtls/sha256.h>
 
 #include "omemo.h"
 #include "driver.h"
 
 #define TRY(r) do { if (r) return OMEMO_ECRYPTO; } while (0)
 
+// HMAC-SHA256 on two SHA-256 contexts, which unlike mbedtls_md_setup
+// does not allocate, so a context can live on the stack.
+struct omemoDriverHmac {
+  mbedtls_sha256_context in, out;
+};
+
+int omemoDriverHmacStart(struct omemoDriverHmac *hmac, const omemoKey k) {
+  uint8_t pad[64];
+  int r;
+  memset(pad, 0x36, 64);
+  for (int i = 0; i < 32; i++)
+    pad[i] ^= k[i];
+  if (!(r = mbedtls_sha256_starts(&hmac->in, 0)))
+    r = mbedtls_sha256_update(&hmac->in, pad, 64);
+  for (int i = 0; i < 64; i++)
+    pad[i] ^= 0x36 ^ 0x5c;
+  if (!r && !(r = mbedtls_sha256_starts(&hmac->out, 0)))
+    r = mbedtls_sha256_update(&hmac->out, pad, 64);
+  mbedtls_platform_zeroize(pad, 64);
+  TRY(r);
+  return 0;
+}
+
+int omemoDriverHmacUpdate(struct omemoDriverHmac *hmac, const uint8_t *in, size_t n) {
+  TRY(mbedtls_sha256_update(&hmac->in, in, n));
+  return 0;
+}
+
+int omemoDriverHmacFinish(struct omemoDriverHmac *hmac, uint8_t out[static 32]) {
+  uint8_t h[32];
+  int r;
+  if (!(r = mbedtls_sha256_finish(&hmac->in, h)) &&
+      !(r = mbedtls_sha256_update(&hmac->out, h, 32)))
+    r = mbedtls_sha256_finish(&hmac->out, out);
+  mbedtls_platform_zeroize(h, 32);
+  TRY(r);
+  return 0;
+}
+
+static void InitHmac(struct omemoDriverHmac *hmac) {
+  mbedtls_sha256_init(&hmac->in);
+  mbedtls_sha256_init(&hmac->out);
+}
+
+static void FreeHmac(struct omemoDriverHmac *hmac) {
+  mbedtls_sha256_free(&hmac->in);
+  mbedtls_sha256_free(&hmac->out);
+}
+
+struct omemoDriverHmac *omemoDriverHmacCreate(void) {
+  struct omemoDriverHmac *hmac = calloc(1, sizeof(struct omemoDriverHmac));
+  if (hmac)
+    InitHmac(hmac);
+  return hmac;
+}
+
+void omemoDriverHmacDestroy(struct omemoDriverHmac *hmac) {
+  if (hmac) {
+    FreeHmac(hmac);
+    free(hmac);
+  }
+}
+
 int omemoDriverHmac(const omemoKey k, const uint8_t *in, size_t ilen, uint8_t out[static 32]) {
-  TRY(mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), k, 32, in, ilen, out));
+  struct omemoDriverHmac hmac;
+  int r;
+  InitHmac(&hmac);
+  if (!(r = omemoDriverHmacStart(&hmac, k)) &&
+      !(r = omemoDriverHmacUpdate(&hmac, in, ilen)))
+    r = omemoDriverHmacFinish(&hmac, out);
+  FreeHmac(&hmac);
+  return r;
+}
+
+int omemoDriverAesCbcHmac(const omemoKey k, const omemoKey mk, bool enc, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d, uint8_t mac[static 32]) {
+  struct omemoDriverHmac hmac[1];
+  omemoKey key;
+  int r = OMEMO_ECRYPTO;
+  InitHmac(hmac);
+  memcpy(key, k, 32);
+  if (n % 16 || omemoDriverHmacStart(hmac, mk))
+    goto a;
+  for (size_t i = 0, m; i < n; i += m) {
+    m = n - i < OMEMODRIVER_CHUNKSIZE ? n - i : OMEMODRIVER_CHUNKSIZE;
+    if (enc ? omemoDriverAesEncrypt(key, m, iv, s + i, d + i) ||
+                  omemoDriverHmacUpdate(hmac, d + i, m)
+            : omemoDriverHmacUpdate(hmac, s + i, m) ||
+                  omemoDriverAesDecrypt(key, m, iv, s + i, d + i))
+      goto a;
+  }
+  r = omemoDriverHmacFinish(hmac, mac);
+a:memset(key, 0, 32);
+  FreeHmac(hmac);
+  return r;
+}
+
+int omemoDriverHkdf(const uint8_t *salt, size_t saltn, const uint8_t *key, size_t keyn, const uint8_t *info, size_t infon, uint8_t *out, size_t outn) {
+  TRY(mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), salt, saltn, key, keyn, info, infon, out, outn));
   return 0;
 }
 
+// aes.c provides these
+#ifndef OMEMO_INTREE_AES
 
-int omemoDriverAesEncrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
-  mbedtls_aes_context aes;
-  TRY(mbedtls_aes_setkey_enc(&aes, k, 256));
-  TRY(mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, n, iv, s, d));
+const char *omemoDriverAesImpl(void) {
+  return "mbedtls";
+}
+
+enum { MODE_NONE, MODE_CBCENC, MODE_CBCDEC, MODE_GCM };
+
+struct omemoDriverAes {
+  int mode;
+  bool enc;
+  uint8_t k[32];
+  union {
+    mbedtls_aes_context aes;
+    mbedtls_gcm_context gcm;
+  };
+};
+
+struct omemoDriverAes *omemoDriverAesCreate(void) {
+  return calloc(1, sizeof(struct omemoDriverAes));
+}
+
+static void FreeContext(struct omemoDriverAes *aes) {
+  if (aes->mode == MODE_GCM)
+    mbedtls_gcm_free(&aes->gcm);
+  else if (aes->mode != MODE_NONE)
+    mbedtls_aes_free(&aes->aes);
+  aes->mode = MODE_NONE;
+}
+
+void omemoDriverAesDestroy(struct omemoDriverAes *aes) {
+  if (aes) {
+    FreeContext(aes);
+    mbedtls_platform_zeroize(aes, sizeof(*aes));
+    free(aes);
+  }
+}
+
+int omemoDriverAesSetKey(struct omemoDriverAes *aes, const omemoKey k, bool enc) {
+  int mode = enc ? MODE_CBCENC : MODE_CBCDEC;
+  if (aes->mode == mode && !mbedtls_ct_memcmp(aes->k, k, 32))
+    return 0;
+  FreeContext(aes);
+  mbedtls_aes_init(&aes->aes);
+  aes->mode = mode;
+  memcpy(aes->k, k, 32);
+  if (enc ? mbedtls_aes_setkey_enc(&aes->aes, k, 256)
+          : mbedtls_aes_setkey_dec(&aes->aes, k, 256)) {
+    FreeContext(aes);
+    return OMEMO_ECRYPTO;
+  }
   return 0;
 }
 
-int omemoDriverAesDecrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+int omemoDriverAesCbc(struct omemoDriverAes *aes, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  TRY(aes->mode != MODE_CBCENC && aes->mode != MODE_CBCDEC);
+  TRY(mbedtls_aes_crypt_cbc(&aes->aes, aes->mode == MODE_CBCENC ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT, n, iv, s, d));
+  return 0;
+}
+
+int omemoDriverAesSetGcmKey(struct omemoDriverAes *aes, const uint8_t k[static 16]) {
+  if (aes->mode == MODE_GCM && !mbedtls_ct_memcmp(aes->k, k, 16))
+    return 0;
+  FreeContext(aes);
+  mbedtls_gcm_init(&aes->gcm);
+  aes->mode = MODE_GCM;
+  memcpy(aes->k, k, 16);
+  if (mbedtls_gcm_setkey(&aes->gcm, MBEDTLS_CIPHER_ID_AES, k, 128)) {
+    FreeContext(aes);
+    return OMEMO_ECRYPTO;
+  }
+  return 0;
+}
+
+int omemoDriverAesGcmEncrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s) {
+  TRY(aes->mode != MODE_GCM);
+  TRY(mbedtls_gcm_crypt_and_tag(&aes->gcm, MBEDTLS_GCM_ENCRYPT, n, iv, 12,
+                                "", 0, s, d, 16, tag));
+  return 0;
+}
+
+int omemoDriverAesGcmDecrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s) {
+  TRY(aes->mode != MODE_GCM);
+  TRY(mbedtls_gcm_auth_decrypt(&aes->gcm, n, iv, 12, "", 0, tag, tagn, s, d));
+  return 0;
+}
+
+// GCM is not split over threads here.
+void omemoDriverSetGcmThreads(int n, size_t threshold) {
+  (void)n, (void)threshold;
+}
+
+int omemoDriverAesGcmStart(struct omemoDriverAes *aes, const uint8_t iv[static 12], bool enc) {
+  TRY(aes->mode != MODE_GCM);
+  TRY(mbedtls_gcm_starts(&aes->gcm, enc ? MBEDTLS_GCM_ENCRYPT : MBEDTLS_GCM_DECRYPT, iv, 12));
+  aes->enc = enc;
+  return 0;
+}
+
+int omemoDriverAesGcmUpdate(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t *s) {
+  size_t len;
+  TRY(aes->mode != MODE_GCM);
+  TRY(mbedtls_gcm_update(&aes->gcm, s, n, d, n, &len));
+  TRY(len != n);
+  return 0;
+}
+
+int omemoDriverAesGcmFinish(struct omemoDriverAes *aes, uint8_t *tag, size_t tagn) {
+  uint8_t y[16];
+  size_t len;
+  TRY(aes->mode != MODE_GCM || tagn < 4 || tagn > 16);
+  TRY(mbedtls_gcm_finish(&aes->gcm, NULL, 0, &len, y, 16));
+  if (aes->enc)
+    memcpy(tag, y, tagn);
+  else
+    TRY(mbedtls_ct_memcmp(y, tag, tagn));
+  return 0;
+}
+
+// The one-shot functions set up a context on the stack and free it
+// again, they don't allocate and no key outlives the call.
+
+int omemoDriverAesEncrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  int r;
   mbedtls_aes_context aes;
-  TRY(mbedtls_aes_setkey_dec(&aes, k, 256));
-  TRY(mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT, n, iv, s, d));
+  mbedtls_aes_init(&aes);
+  if (!(r = mbedtls_aes_setkey_enc(&aes, k, 256)))
+    r = mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_ENCRYPT, n, iv, s, d);
+  mbedtls_aes_free(&aes);
+  TRY(r);
   return 0;
 }
 
-int omemoDriverHkdf(const uint8_t *salt, size_t saltn, const uint8_t *key, size_t keyn, const uint8_t *info, size_t infon, uint8_t *out, size_t outn) {
-  TRY(mbedtls_hkdf(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), salt, saltn, key, keyn, info, infon, out, outn));
+int omemoDriverAesDecrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  int r;
+  mbedtls_aes_context aes;
+  mbedtls_aes_init(&aes);
+  if (!(r = mbedtls_aes_setkey_dec(&aes, k, 256)))
+    r = mbedtls_aes_crypt_cbc(&aes, MBEDTLS_AES_DECRYPT, n, iv, s, d);
+  mbedtls_aes_free(&aes);
+  TRY(r);
   return 0;
 }
 
@@ -76,6 +303,12 @@ int omemoDriverGcmDecrypt(uint8_t *d, const uint8_t key[static 16], size_t n, co
   return 0;
 }
 
+#endif
+
+const char *omemoDriverHashImpl(void) {
+  return "mbedtls";
+}
+
 int omemoDriverCompare(const void *a, const void *b, size_t n) {
   return mbedtls_ct_memcmp(a, b, n);
 }
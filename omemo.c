@@ -20,6 +20,10 @@
 #include <sys/random.h>
 #endif
 
+#ifdef OMEMO_STATS
+#include <time.h>
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -29,40 +33,100 @@
 #include "omemo.h"
 #include "driver.h"
 
-#ifdef OMEMO2
+#ifdef OMEMO_INLINECORE
+#define CORESTATIC
+#include "core.c"
+#else
+#include "core.h"
+#endif
+
+// Calls a hook of omemoSetTraceHooks for the core.
+static void Trace(void (*hook)(void), int op, void *session) {
+  ((omemoTraceCallback)hook)(op, session);
+}
 
-#define HkdfInfoKeyExchange "OMEMO X3DH"
-#define HkdfInfoRootChain   "OMEMO Root Chain"
-#define HkdfInfoMessageKeys "OMEMO Message Key Material"
-#define HkdfInfoPayload     "OMEMO Payload"
+// The callbacks of the user for the core, it adds the hooks.
+static int CoreLoadMessageKey(omemoCoreSession *s,
+                              omemoCoreMessageKey *k) {
+  return omemoLoadMessageKey((struct omemoSession *)s,
+                             (struct omemoMessageKey *)k);
+}
 
-#define PbMsg_n          1
-#define PbMsg_pn         2
-#define PbMsg_dh_pub     3
-#define PbMsg_ciphertext 4
+static int CoreStoreMessageKey(omemoCoreSession *s,
+                               const omemoCoreMessageKey *k, uint64_t n) {
+  return omemoStoreMessageKey((struct omemoSession *)s,
+                              (const struct omemoMessageKey *)k, n);
+}
 
-#define PbKeyEx_pk_id   1
-#define PbKeyEx_spk_id  2
-#define PbKeyEx_ik      3
-#define PbKeyEx_ek      4
-#define PbKeyEx_message 5
+_Static_assert(sizeof(struct omemoStore) == sizeof(omemoCoreStore),
+               "store layout differs from the core");
+_Static_assert(sizeof(struct omemoSession) == sizeof(omemoCoreSession),
+               "session layout differs from the core");
 
+#ifdef OMEMO_STATS
+#define COUNTSTATS true
 #else
+#define COUNTSTATS false
+#endif
+
+#ifdef OMEMO2
+
+#define MACSIZE 16
 
-#define HkdfInfoKeyExchange "WhisperText"
-#define HkdfInfoRootChain   "WhisperRatchet"
-#define HkdfInfoMessageKeys "WhisperMessageKeys"
+static const struct omemoCoreProtocol Protocol = {
+    .v2 = true,
+    .serlen = sizeof(omemoSerializedKey),
+    .macsize = MACSIZE,
+    .msg_n = 1,
+    .msg_pn = 2,
+    .msg_dh_pub = 3,
+    .msg_ciphertext = 4,
+    .keyex_pk_id = 1,
+    .keyex_spk_id = 2,
+    .keyex_ik = 3,
+    .keyex_ek = 4,
+    .keyex_message = 5,
+    .info_keyexchange = "OMEMO X3DH",
+    .info_rootchain = "OMEMO Root Chain",
+    .info_messagekeys = "OMEMO Message Key Material",
+    .info_payload = "OMEMO Payload",
+    .maxpayload = OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE,
+    .maxfullmsg = OMEMO_INTERNAL_FULLMSG_MAXSIZE,
+    .stats = COUNTSTATS,
+    .trace = Trace,
+    .random = omemoRandom,
+    .loadmessagekey = CoreLoadMessageKey,
+    .storemessagekey = CoreStoreMessageKey,
+};
 
-#define PbMsg_n          2
-#define PbMsg_pn         3
-#define PbMsg_dh_pub     1
-#define PbMsg_ciphertext 4
+#else
 
-#define PbKeyEx_pk_id   1
-#define PbKeyEx_spk_id  6
-#define PbKeyEx_ik      3
-#define PbKeyEx_ek      2
-#define PbKeyEx_message 4
+#define MACSIZE 8
+
+static const struct omemoCoreProtocol Protocol = {
+    .v2 = false,
+    .serlen = sizeof(omemoSerializedKey),
+    .macsize = MACSIZE,
+    .msg_n = 2,
+    .msg_pn = 3,
+    .msg_dh_pub = 1,
+    .msg_ciphertext = 4,
+    .keyex_pk_id = 1,
+    .keyex_spk_id = 6,
+    .keyex_ik = 3,
+    .keyex_ek = 2,
+    .keyex_message = 4,
+    .info_keyexchange = "WhisperText",
+    .info_rootchain = "WhisperRatchet",
+    .info_messagekeys = "WhisperMessageKeys",
+    .maxpayload = OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE,
+    .maxfullmsg = OMEMO_INTERNAL_FULLMSG_MAXSIZE,
+    .stats = COUNTSTATS,
+    .trace = Trace,
+    .random = omemoRandom,
+    .loadmessagekey = CoreLoadMessageKey,
+    .storemessagekey = CoreStoreMessageKey,
+};
 
 #endif
 
@@ -79,15 +143,10 @@
     assert(_r_);                                                       \
   } while (0)
 
-enum {
-  SESSION_UNINIT = 0,
-  SESSION_INIT,
-  SESSION_READY,
-  SESSION_HEARTBEAT,
-};
-
 #define SerLen sizeof(omemoSerializedKey)
 
+static const uint8_t Zero32[32];
+
 static omemoLoadMessageKeyCallback  g_lmkcb;
 static omemoStoreMessageKeyCallback g_smkcb;
 static omemoRandomCallback          g_rndcb;
@@ -123,238 +182,299 @@ void omemoSetCallbacks(omemoLoadMessageKeyCallback lmk,
   g_rndcb = rnd;
 }
 
-void omemoSerializeKey(omemoSerializedKey k,
-                                    const omemoKey pub) {
-#ifdef OMEMO2
-  memcpy(k, pub, SerLen);
-#else
-  k[0] = 5;
-  memcpy(k + 1, pub, SerLen - 1);
-#endif
-}
+// The state between the API calls is in the core, see
+// omemoCoreRuntime.
 
-static inline const uint8_t *GetRawKey(const omemoSerializedKey k) {
-#ifdef OMEMO2
-  return k;
-#else
-  return k + 1;
-#endif
+static inline struct omemoCoreRuntime *Runtime(void) {
+  return omemoCoreGetRuntime(&Protocol);
 }
 
-/***************************** PROTOBUF ******************************/
+static inline struct omemoCoreThread *Thread(void) {
+  return omemoCoreGetThread(&Protocol);
+}
 
-// Protobuf: https://protobuf.dev/programming-guides/encoding/
+// Context of the API calls on this thread, see omemoSetContext.
+static inline struct omemoContext *GetContext(void) {
+  return Thread()->context;
+}
 
-// Only supports uint32 and len prefixed.
-struct ProtobufField {
-  int type;         // PB_*
-  uint32_t v;       // destination varint or LEN
-  const uint8_t *p; // LEN element data pointer or NULL
-};
+int omemoSetupContext(struct omemoContext *ctx) {
+  if (!ctx)
+    return OMEMO_EPARAM;
+  memset(ctx, 0, sizeof(struct omemoContext));
+  if (!(ctx->aes = omemoDriverAesCreate()) ||
+      !(ctx->hmac = omemoDriverHmacCreate())) {
+    omemoFreeContext(ctx);
+    return OMEMO_ECRYPTO;
+  }
+  return 0;
+}
 
-#define PB_REQUIRED (1 << 3)
-#define PB_UINT32   0
-#define PB_LEN      2
+void omemoFreeContext(struct omemoContext *ctx) {
+  if (ctx) {
+    if (GetContext() == ctx)
+      omemoSetContext(NULL);
+    omemoDriverAesDestroy(ctx->aes);
+    omemoDriverHmacDestroy(ctx->hmac);
+    memset(ctx, 0, sizeof(struct omemoContext));
+  }
+}
 
-/**
- * Parse Protobuf varint.
- *
- * Only supports uint32, higher bits are skipped so it will neither
- * overflow nor clamp to UINT32_MAX.
- *
- * @param s points to the location of the varint in the protobuf data
- * @param e points to the end of the protobuf data
- * @param v (out) points to the location where the parsed varint will be
- * written
- * @returns pointer to first byte after the varint or NULL if parsing is
- * not finished before reaching e
- */
-static const uint8_t *ParseVarInt(const uint8_t *s, const uint8_t *e,
-                                  uint32_t *v) {
-  int i = 0;
-  *v = 0;
-  do {
-    if (s >= e)
-      return NULL;
-    *v |= (*s & 0x7f) << i;
-    i += 7;
-  } while (*s++ & 0x80);
-  return s;
+void omemoSetContext(struct omemoContext *ctx) {
+  struct omemoCoreThread *t = Thread();
+  t->context = ctx;
+  t->aes = ctx ? ctx->aes : NULL;
+  t->hmac = ctx ? ctx->hmac : NULL;
 }
 
-/**
- * Parse data in Protobuf format.
- *
- * For each field encountered it does the following:
- * - Make sure the field number can be stored in `fields` and that the
- *   type corresponds with the one specified in the associated field.
- * - Mark the field number as found which later will be used to check
- *   whether all required fields are found.
- * - Parse the value.
- * - If there already is a non-zero value specified in the field, it is
- *   used to check whether the parsed value is the same.
- * `nfields` should have the value of the highest possible field number
- * + 1. `nfields` must be less than or equal to 16 because we only
- * support a single byte field number, the number is stored like this in
- * the byte: 0nnnnttt where n is the field number and t is the type.
- *
- * @param s is protobuf data
- * @param n is the length of said data
- * @param nfields is the amount of fields in the `fields` array
- * @returns false if successful, true if error
- */
-static bool ParseProtobuf(const uint8_t *s, size_t n,
-                          struct ProtobufField *fields, int nfields) {
-  int type, id;
-  uint32_t v;
-  const uint8_t *e = s + n;
-  uint32_t found = 0;
-  ASSERT(nfields <= 16);
-  while (s < e) {
-    // This is actually a varint, but we only support id < 16 and return
-    // an error otherwise, so we don't have to account for multiple-byte
-    // tags.
-    type = *s & 7;
-    id = *s >> 3;
-    s++;
-    if (id >= nfields || type != (fields[id].type & 7))
-      return true;
-    found |= 1 << id;
-    if (!(s = ParseVarInt(s, e, &v)))
-      return true;
-    // If field is fixed size, enforce it
-    if (fields[id].v && v != fields[id].v)
-      return true;
-    fields[id].v = v;
-    if (type == PB_LEN) {
-      fields[id].p = s;
-      s += fields[id].v;
-    }
-  }
-  if (s > e)
-    return true;
-  for (int i = 0; i < nfields; i++) {
-    if ((fields[i].type & PB_REQUIRED) && !(found & (1 << i)))
-      return true;
-  }
-  return false;
+void omemoSetTraceHooks(omemoTraceCallback begin, omemoTraceCallback end) {
+  Runtime()->tracebegin = (void (*)(void))begin;
+  Runtime()->traceend = (void (*)(void))end;
 }
 
-static bool ParseRepeatingField(const uint8_t *s, const uint8_t *e,
-                                struct ProtobufField *field,
-                                int fieldid) {
-  int type, id;
-  uint32_t v;
-  ASSERT(fieldid <= 16);
-  while (s < e) {
-    type = *s & 7;
-    id = *s >> 3;
-    s++;
-    if (id >= 16 || (id == fieldid && type != (field->type & 7)))
-      return true;
-    if (!(s = ParseVarInt(s, e, &v)))
-      return true;
-    if (id == fieldid)
-      field->v = v;
-    if (type == PB_LEN) {
-      if (id == fieldid)
-        field->p = s;
-      s += v;
-    }
-    if (id == fieldid)
-      break;
-  }
-  return s > e;
+static void EndTraceSession(void **prev) {
+  Thread()->session = *prev;
 }
 
-/**
- * Get the size of a properly formatted varint in bytes.
- */
-static inline int GetVarIntSize(uint32_t v) {
-  return 1 + (v > 0x7f) + (v > 0x3fff) + (v > 0x1fffff) +
-         (v > 0xfffffff);
+// Reports session to the hooks until the function returns.
+#define TRACESESSION(session)                                          \
+  void *_ts_ __attribute__((cleanup(EndTraceSession))) =               \
+      Thread()->session;                                               \
+  Thread()->session = session
+
+#define TRACE(op, call)                                                \
+  ({                                                                   \
+    omemoCoreTraceBegin(&Protocol, op);                                \
+    __typeof__(call) _tr_ = call;                                      \
+    omemoCoreTraceEnd(&Protocol, op);                                  \
+    _tr_;                                                              \
+  })
+
+#define TRACEV(op, call)                                               \
+  (omemoCoreTraceBegin(&Protocol, op), call,                           \
+   omemoCoreTraceEnd(&Protocol, op))
+
+// Every call below goes through the hooks, a macro is not expanded
+// again inside its own expansion. The one-shot primitives go through
+// the core, which also uses the context.
+#define omemoLoadMessageKey(...)                                       \
+  TRACE(OMEMO_TRACE_LOADMESSAGEKEY, omemoLoadMessageKey(__VA_ARGS__))
+#define omemoStoreMessageKey(...)                                      \
+  TRACE(OMEMO_TRACE_STOREMESSAGEKEY, omemoStoreMessageKey(__VA_ARGS__))
+#define omemoRandom(...) TRACE(OMEMO_TRACE_RANDOM, omemoRandom(__VA_ARGS__))
+#define omemoDriverX25519(...)                                         \
+  TRACE(OMEMO_TRACE_X25519, omemoDriverX25519(__VA_ARGS__))
+#define omemoDriverCvPrvToPub(...)                                     \
+  TRACEV(OMEMO_TRACE_CVPRVTOPUB, omemoDriverCvPrvToPub(__VA_ARGS__))
+#define omemoDriverCvPrvToEdPub(...)                                   \
+  TRACEV(OMEMO_TRACE_CVPRVTOEDPUB, omemoDriverCvPrvToEdPub(__VA_ARGS__))
+#define omemoDriverCvPubToEdPub(...)                                   \
+  TRACEV(OMEMO_TRACE_CVPUBTOEDPUB, omemoDriverCvPubToEdPub(__VA_ARGS__))
+#define omemoDriverEdPubToCvPub(...)                                   \
+  TRACEV(OMEMO_TRACE_EDPUBTOCVPUB, omemoDriverEdPubToCvPub(__VA_ARGS__))
+#define omemoDriverCvPubToEdPubBatch(...)                              \
+  TRACEV(OMEMO_TRACE_CVPUBTOEDPUBBATCH,                                \
+         omemoDriverCvPubToEdPubBatch(__VA_ARGS__))
+#define omemoDriverEdPubToCvPubBatch(...)                              \
+  TRACEV(OMEMO_TRACE_EDPUBTOCVPUBBATCH,                                \
+         omemoDriverEdPubToCvPubBatch(__VA_ARGS__))
+#define omemoDriverEdSeedToPubPrv(...)                                 \
+  TRACEV(OMEMO_TRACE_EDSEEDTOPUBPRV, omemoDriverEdSeedToPubPrv(__VA_ARGS__))
+#define omemoDriverEdSignMod(...)                                      \
+  TRACEV(OMEMO_TRACE_EDSIGN, omemoDriverEdSignMod(__VA_ARGS__))
+#define omemoDriverEdVerify(...)                                       \
+  TRACE(OMEMO_TRACE_EDVERIFY, omemoDriverEdVerify(__VA_ARGS__))
+#define omemoDriverEdVerifyBatch(...)                                  \
+  TRACE(OMEMO_TRACE_EDVERIFYBATCH, omemoDriverEdVerifyBatch(__VA_ARGS__))
+#define omemoDriverHmac(...) omemoCoreHmac(&Protocol, __VA_ARGS__)
+#define omemoDriverHkdf(...) omemoCoreHkdf(&Protocol, __VA_ARGS__)
+#define omemoDriverAesEncrypt(...)                                     \
+  omemoCoreAesEncrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesDecrypt(...)                                     \
+  omemoCoreAesDecrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesCbcHmac(...)                                     \
+  omemoCoreAesCbcHmac(&Protocol, __VA_ARGS__)
+#define omemoDriverGcmEncrypt(...)                                     \
+  omemoCoreGcmEncrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverGcmDecrypt(...)                                     \
+  omemoCoreGcmDecrypt(&Protocol, __VA_ARGS__)
+#define omemoDriverAesSetKey(...)                                      \
+  TRACE(OMEMO_TRACE_AESSETKEY, omemoDriverAesSetKey(__VA_ARGS__))
+#define omemoDriverAesSetGcmKey(...)                                   \
+  TRACE(OMEMO_TRACE_AESSETKEY, omemoDriverAesSetGcmKey(__VA_ARGS__))
+#define omemoDriverAesCbc(...)                                         \
+  TRACE(OMEMO_TRACE_AESCBC, omemoDriverAesCbc(__VA_ARGS__))
+#define omemoDriverAesGcmStart(...)                                    \
+  TRACE(OMEMO_TRACE_AESGCMSTART, omemoDriverAesGcmStart(__VA_ARGS__))
+#define omemoDriverAesGcmUpdate(...)                                   \
+  TRACE(OMEMO_TRACE_AESGCMUPDATE, omemoDriverAesGcmUpdate(__VA_ARGS__))
+#define omemoDriverAesGcmFinish(...)                                   \
+  TRACE(OMEMO_TRACE_AESGCMFINISH, omemoDriverAesGcmFinish(__VA_ARGS__))
+#define omemoDriverHmacStart(...)                                      \
+  TRACE(OMEMO_TRACE_HMACSTART, omemoDriverHmacStart(__VA_ARGS__))
+#define omemoDriverHmacUpdate(...)                                     \
+  TRACE(OMEMO_TRACE_HMACUPDATE, omemoDriverHmacUpdate(__VA_ARGS__))
+#define omemoDriverHmacFinish(...)                                     \
+  TRACE(OMEMO_TRACE_HMACFINISH, omemoDriverHmacFinish(__VA_ARGS__))
+
+uint32_t omemoGetCpuFeatures(void) {
+  return omemoDriverGetCpuFeatures();
 }
 
-static uint8_t *FormatVarInt(uint8_t d[static 6], int type, int id,
-                             uint32_t v) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | type;
-  do {
-    *d = v & 0x7f;
-    v >>= 7;
-    *d++ |= (!!v << 7);
-  } while (v);
-  return d;
+void omemoSetCpuFeatures(uint32_t mask) {
+  omemoDriverSetCpuFeatures(mask);
 }
 
 #ifndef OMEMO2
-static uint8_t *FormatSerializedKey(uint8_t d[static 35], int id,
-                                    const omemoKey k) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | PB_LEN;
-  *d++ = 33;
-  omemoSerializeKey(d, k);
-  return d + 33;
+void omemoSetGcmThreads(int n, size_t threshold) {
+  omemoDriverSetGcmThreads(n, threshold);
+}
+#endif
+
+#define STAT(name) omemoCoreStat(&Protocol, name)
+
+#ifdef OMEMO_STATS
+
+static uint64_t StatNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct StatTimer {
+  int api;
+  uint64_t start;
+};
+
+static void StopStatTimer(struct StatTimer *t) {
+  uint64_t ns = StatNow() - t->start;
+  int i = ns ? 63 - __builtin_clzll(ns) : 0;
+  if (i >= OMEMO_STAT_NUMBUCKETS)
+    i = OMEMO_STAT_NUMBUCKETS - 1;
+  __atomic_fetch_add(&Runtime()->stats.latency[t->api][i], 1,
+                     __ATOMIC_RELAXED);
+}
+
+// Adds the time until the function returns to the histogram of api.
+#define STATTIME(api)                                                  \
+  struct StatTimer _st_ __attribute__((cleanup(StopStatTimer))) = {   \
+      api, StatNow()}
+
+int omemoGetStats(struct omemoStats *stats, bool reset) {
+  if (!stats)
+    return OMEMO_EPARAM;
+  uint64_t *s = (uint64_t *)&Runtime()->stats, *d = (uint64_t *)stats;
+  for (size_t i = 0; i < sizeof(struct omemoStats) / sizeof(uint64_t); i++)
+    d[i] = reset ? __atomic_exchange_n(s + i, 0, __ATOMIC_RELAXED)
+                 : __atomic_load_n(s + i, __ATOMIC_RELAXED);
+  return 0;
+}
+
+#else
+
+#define STATTIME(api) (void)0
+
+int omemoGetStats(struct omemoStats *stats, bool reset) {
+  if (!stats)
+    return OMEMO_EPARAM;
+  memset(stats, 0, sizeof(struct omemoStats));
+  return OMEMO_ESTATE;
 }
+
 #endif
 
-static uint8_t *FormatKey(uint8_t d[static 34], int id,
-                          const omemoKey k) {
-  ASSERT(id < 16);
-  *d++ = (id << 3) | PB_LEN;
-  *d++ = 32;
-  memcpy(d, k, 32);
-  return d + 32;
+struct Scratch {
+  void *p;
+  size_t n;
+};
+
+// The barrier keeps the compiler from dropping the stores to a buffer
+// that is about to go out of scope.
+static void WipeScratch(struct Scratch *s) {
+  memset(s->p, 0, s->n);
+  __asm__ volatile("" : : "r"(s->p) : "memory");
 }
 
-// Format Protobuf PreKeyWhisperMessage without message (it should be
-// appended right after this call).
-// This is OMEMOKeyExchange in schema
+#define SCRATCHSIZE(name) sizeof(((struct omemoScratch *)0)->name)
+
+#ifdef OMEMO_SMALLSTACK
+
+// Declares the temporary name as a pointer into the context of this
+// thread, it must be the first element of an array field. It is wiped
+// when the function returns.
+#define SCRATCH(name)                                                  \
+  if (!GetContext())                                                   \
+    return OMEMO_ESTATE;                                               \
+  __typeof__(*GetContext()->scratch.name) *name =                      \
+      GetContext()->scratch.name;                                      \
+  struct Scratch name##_w_ __attribute__((cleanup(WipeScratch))) = {  \
+      name, SCRATCHSIZE(name)}
+
+#else
+
+// Same as above, but on the stack when this thread has no context.
+#define SCRATCH(name)                                                  \
+  __typeof__(((struct omemoScratch *)0)->name) name##_;               \
+  __typeof__(*name##_) *name =                                        \
+      GetContext() ? GetContext()->scratch.name : name##_;            \
+  struct Scratch name##_w_ __attribute__((cleanup(WipeScratch))) = {  \
+      name, SCRATCHSIZE(name)}
+
+#endif
+
+const char *omemoGetDriverImpl(int kind) {
+  switch (kind) {
+  case OMEMO_DRIVER_CURVE: return omemoDriverCurveImpl();
+  case OMEMO_DRIVER_AES:   return omemoDriverAesImpl();
+  case OMEMO_DRIVER_HASH:  return omemoDriverHashImpl();
+  }
+  return NULL;
+}
+
+void omemoSerializeKey(omemoSerializedKey k,
+                                    const omemoKey pub) {
+  omemoCoreSerializeKey(&Protocol, k, pub);
+}
+
+static inline const uint8_t *GetRawKey(const omemoSerializedKey k) {
+  return omemoCoreGetRawKey(&Protocol, k);
+}
+
+/***************************** PROTOBUF ******************************/
+
+// The wire format is in core.c, these pass it the constants of this
+// version.
+
+#define ParseProtobuf       omemoCoreParseProtobuf
+#define ParseRepeatingField omemoCoreParseRepeatingField
+#define FormatVarInt        omemoCoreFormatVarInt
+#define FormatKey           omemoCoreFormatKey
+
 static size_t FormatPreKeyMessage(
     uint8_t d[static OMEMO_INTERNAL_PREKEYHEADER_MAXSIZE],
     uint32_t pk_id, uint32_t spk_id, const omemoKey ik,
     const omemoKey ek, uint32_t msgsz) {
-  uint8_t *p = d;
-#ifdef OMEMO2
-  p = FormatVarInt(p, PB_UINT32, 1, pk_id);
-  p = FormatVarInt(p, PB_UINT32, 2, spk_id);
-  p = FormatKey(p, 3, ik);
-  p = FormatKey(p, 4, ek);
-  // msgsz can be > 127 so we reserve 3 bytes for this
-  p = FormatVarInt(p, PB_LEN, 5, msgsz);
-#else
-  *p++ = (3 << 4) | 3;
-  p = FormatVarInt(p, PB_UINT32, 5, 0); // registration id
-  p = FormatVarInt(p, PB_UINT32, 1, pk_id);
-  p = FormatVarInt(p, PB_UINT32, 6, spk_id);
-  p = FormatSerializedKey(p, 3, ik);
-  p = FormatSerializedKey(p, 2, ek);
-  ASSERT(msgsz < 128);
-  p = FormatVarInt(p, PB_LEN, 4, msgsz);
-#endif
-  return p - d;
+  return omemoCoreFormatPreKeyMessage(&Protocol, d, pk_id, spk_id, ik,
+                                      ek, msgsz);
 }
 
-// Format Protobuf WhisperMessage without ciphertext.
-//  HEADER(dh_pair, pn, n)
 static size_t
 FormatMessageHeader(uint8_t d[static OMEMO_INTERNAL_HEADER_MAXSIZE],
                     uint32_t n, uint32_t pn, const omemoKey dhs,
                     size_t keyn) {
-  uint8_t *p = d;
-#ifdef OMEMO2
-  p = FormatVarInt(p, PB_UINT32, 1, n);
-  p = FormatVarInt(p, PB_UINT32, 2, pn);
-  p = FormatKey(p, 3, dhs);
-  p = FormatVarInt(p, PB_LEN, 4, keyn);
-#else
-  *p++ = (3 << 4) | 3;
-  p = FormatSerializedKey(p, 1, dhs);
-  p = FormatVarInt(p, PB_UINT32, 2, n);
-  p = FormatVarInt(p, PB_UINT32, 3, pn);
-  p = FormatVarInt(p, PB_LEN, 4, keyn);
-#endif
-  return p - d;
+  return omemoCoreFormatMessageHeader(&Protocol, d, n, pn, dhs, keyn);
+}
+
+// Size of the message formatted by EncryptKeyImpl, without the prekey
+// header.
+static size_t GetMessageSize(uint32_t n, uint32_t pn, size_t encn) {
+  return omemoCoreGetMessageSize(&Protocol, n, pn, encn);
+}
+
+// Size of what FormatPreKeyMessage writes.
+static size_t GetPreKeyHeaderSize(uint32_t pk_id, uint32_t spk_id,
+                                  size_t msgsz) {
+  return omemoCoreGetPreKeyHeaderSize(&Protocol, pk_id, spk_id, msgsz);
 }
 
 /*************************** CRYPTOGRAPHY ****************************/
@@ -364,10 +484,7 @@ FormatMessageHeader(uint8_t d[static OMEMO_INTERNAL_HEADER_MAXSIZE],
  */
 static int DoX25519(omemoKey shared, const omemoKey prv,
                     const omemoKey pub) {
-  omemoKey tmp, tmp2;
-  memcpy(tmp, prv, 32);
-  memcpy(tmp2, pub, 32);
-  return omemoDriverX25519(shared, tmp, tmp2);
+  return omemoCoreX25519(&Protocol, shared, prv, pub);
 }
 
 // For OMEMO 0.3, we use the sign_modified as is required.
@@ -385,60 +502,189 @@ static int DoX25519(omemoKey shared, const omemoKey prv,
 // Essentially the only deviations from regular EdDSA is the
 // addition of a randomized nonce to msg and the usage of the hash1(X)
 // variation on SHA-512.
+// ed is the Ed25519 public key of ik, see GetIdentityEd.
 static int CalculateCurveSignature(omemoCurveSignature sig,
                                    const struct omemoKeyPair *ik,
+                                   const omemoKey ed,
                                    const uint8_t rnd[static 64],
                                    const uint8_t *msg, size_t msgn) {
   ASSERT(msgn <= SerLen);
   uint8_t msgbuf[SerLen + 64];
   memcpy(msgbuf, msg, msgn);
   memcpy(msgbuf + msgn, rnd, 64);
-  omemoKey ikprv, ikpub;
+  omemoKey ikprv, edpub;
   memcpy(ikprv, ik->prv, 32);
-  memcpy(ikpub, ik->pub, 32);
-#ifdef OMEMO2
-  omemoDriverEdSignMod(sig, ikpub, ikprv, msgbuf, msgn);
-#else
-  omemoKey ed;
-  omemoDriverCvPrvToEdPub(ed, ikprv);
-  int sign = ed[31] & 0x80;
-  omemoDriverEdSignMod(sig, ed, ikprv, msgbuf, msgn);
+  memcpy(edpub, ed, 32);
+  omemoDriverEdSignMod(sig, edpub, ikprv, msgbuf, msgn);
+#ifndef OMEMO2
   sig[63] &= 0x7f;
-  sig[63] |= sign;
+  sig[63] |= ed[31] & 0x80;
 #endif
   return 0;
 }
 
-//  Sig(PK, M)
-static bool VerifySignature(const omemoCurveSignature sig,
-                            const omemoKey pub, const uint8_t *msg,
-                            size_t msgn) {
-  ASSERT(msgn <= SerLen);
-  uint8_t msgbuf[SerLen];
-  memcpy(msgbuf, msg, msgn);
-  omemoKey pubcpy;
-  memcpy(pubcpy, pub, 32);
-  omemoCurveSignature sig2;
+// Our identity key as Ed25519 public key, for OMEMO 0.3 it is cached in
+// store->identityalt.
+static void GetIdentityEd(omemoKey ed, const struct omemoStore *store) {
+#ifdef OMEMO2
+  memcpy(ed, store->identity.pub, 32);
+#else
+  if (memcmp(store->identityalt, Zero32, 32)) {
+    memcpy(ed, store->identityalt, 32);
+  } else {
+    omemoKey prv;
+    memcpy(prv, store->identity.prv, 32);
+    omemoDriverCvPrvToEdPub(ed, prv);
+  }
+#endif
+}
+
+static void DeriveIdentityAlt(struct omemoStore *store) {
+  omemoKey k;
+  memcpy(k, store->identity.pub, 32);
+#ifdef OMEMO2
+  k[31] &= 0x7f;
+  omemoDriverEdPubToCvPub(store->identityalt, k);
+#else
+  memset(store->identityalt, 0, 32);
+  GetIdentityEd(k, store);
+  memcpy(store->identityalt, k, 32);
+#endif
+}
+
+// Remote identity key ik in the other curve form (without sign bit),
+// taken from session->remoteidentityalt when it was cached for ik.
+static void GetRemoteIdentityAlt(omemoKey alt,
+                                 const struct omemoSession *session,
+                                 const omemoKey ik) {
+  if (session && !memcmp(session->remoteidentity, ik, 32) &&
+      memcmp(session->remoteidentityalt, Zero32, 32)) {
+    memcpy(alt, session->remoteidentityalt, 32);
+    return;
+  }
+  omemoKey k;
+  memcpy(k, ik, 32);
+#ifdef OMEMO2
+  k[31] &= 0x7f;
+  omemoDriverEdPubToCvPub(alt, k);
+#else
+  omemoDriverCvPubToEdPub(alt, k);
+  alt[31] &= 0x7f;
+#endif
+}
+
+// GetRemoteIdentityAlt for n keys without the session cache, sharing
+// the field inversion.
+static void GetRemoteIdentityAlts(omemoKey *alt, const uint8_t *const *ik,
+                                  size_t n) {
+#ifdef OMEMO2
+  for (size_t i = 0; i < n; i++) {
+    memcpy(alt[i], ik[i], 32);
+    alt[i][31] &= 0x7f;
+  }
+  omemoDriverEdPubToCvPubBatch(n, alt, alt);
+#else
+  for (size_t i = 0; i < n; i++)
+    memcpy(alt[i], ik[i], 32);
+  omemoDriverCvPubToEdPubBatch(n, alt, alt);
+  for (size_t i = 0; i < n; i++)
+    alt[i][31] &= 0x7f;
+#endif
+}
+
+// alt is the result of GetRemoteIdentityAlt or NULL when unknown.
+static void SetRemoteIdentity(struct omemoSession *session,
+                              const omemoKey ik, const omemoKey alt) {
+  if (alt)
+    memcpy(session->remoteidentityalt, alt, 32);
+  else if (memcmp(session->remoteidentity, ik, 32))
+    memset(session->remoteidentityalt, 0, 32);
+  memcpy(session->remoteidentity, ik, 32);
+}
+
+// Converts the signature and public key to what omemoDriverEdVerify
+// expects. alt is pub from GetRemoteIdentityAlt or NULL.
+static void PrepareSignature(omemoCurveSignature sig2, omemoKey ed,
+                             const omemoCurveSignature sig,
+                             const omemoKey pub, const uint8_t *alt) {
   memcpy(sig2, sig, 64);
 #ifdef OMEMO2
-  return omemoDriverEdVerify(sig2, pubcpy, msgbuf, msgn);
+  memcpy(ed, pub, 32);
 #else
-  omemoKey ed;
-  omemoDriverCvPubToEdPub(ed, pubcpy);
+  if (alt)
+    memcpy(ed, alt, 32);
+  else
+    GetRemoteIdentityAlt(ed, NULL, pub);
   ed[31] &= 0x7f;
   ed[31] |= sig[63] & 0x80;
   sig2[63] &= 0x7f;
-  return omemoDriverEdVerify(sig2, ed, msgbuf, msgn);
 #endif
 }
 
+//  Sig(PK, M)
+static bool VerifySignature(const omemoCurveSignature sig,
+                            const omemoKey pub, const uint8_t *alt,
+                            const uint8_t *msg, size_t msgn) {
+  ASSERT(msgn <= SerLen);
+  uint8_t msgbuf[SerLen];
+  memcpy(msgbuf, msg, msgn);
+  omemoKey ed;
+  omemoCurveSignature sig2;
+  PrepareSignature(sig2, ed, sig, pub, alt);
+  return omemoDriverEdVerify(sig2, ed, msgbuf, msgn);
+}
+
+int omemoSetupSignatureCache(struct omemoSignatureCache *cache) {
+  if (!cache)
+    return OMEMO_EPARAM;
+  memset(cache, 0, sizeof(struct omemoSignatureCache));
+  return omemoRandom(cache->salt, 32);
+}
+
+void omemoSetSignatureCache(struct omemoSignatureCache *cache) {
+  Runtime()->sigcache = cache;
+}
+
+static inline struct omemoSignatureCache *GetSignatureCache(void) {
+  return Runtime()->sigcache;
+}
+
+// Cache entry for a bundle's signed prekey signature, returns false when
+// there is no cache.
+static bool HashBundle(uint8_t h[static 16], const omemoCurveSignature spks,
+                       const omemoSerializedKey spk,
+                       const omemoSerializedKey ik) {
+  struct omemoSignatureCache *c = GetSignatureCache();
+  uint8_t buf[SerLen * 2 + 64], mac[32];
+  if (!c)
+    return false;
+  memcpy(buf, ik, SerLen);
+  memcpy(buf + SerLen, spk, SerLen);
+  memcpy(buf + SerLen * 2, spks, 64);
+  STAT(hmac);
+  if (omemoDriverHmac(c->salt, buf, sizeof(buf), mac))
+    return false;
+  memcpy(h, mac, 16);
+  return true;
+}
+
+static bool IsBundleCached(const uint8_t h[static 16]) {
+  for (int i = 0; i < OMEMO_SIGCACHE_SIZE; i++) {
+    if (!memcmp(GetSignatureCache()->entries[i], h, 16))
+      return true;
+  }
+  return false;
+}
+
+static void CacheBundle(const uint8_t h[static 16]) {
+  struct omemoSignatureCache *c = GetSignatureCache();
+  uint32_t i = c->next % OMEMO_SIGCACHE_SIZE;
+  memcpy(c->entries[i], h, 16);
+  c->next = (i + 1) % OMEMO_SIGCACHE_SIZE;
+}
+
 static int GenerateKeyPair(struct omemoKeyPair *kp) {
-  TRY(omemoRandom(kp->prv, sizeof(kp->prv)));
-  kp->prv[0] &= 0xf8;
-  kp->prv[31] &= 0x7f;
-  kp->prv[31] |= 0x40;
-  omemoDriverCvPrvToPub(kp->pub, kp->prv);
-  return 0;
+  return omemoCoreGenerateKeyPair(&Protocol, (omemoCoreKeyPair *)kp);
 }
 
 #ifdef OMEMO2
@@ -452,14 +698,17 @@ static int GenerateEdKeyPair(struct omemoKeyPair *kp) {
 
 static int GenerateSignedPreKey(struct omemoSignedPreKey *spk,
                                 uint32_t id,
-                                const struct omemoKeyPair *idkp) {
+                                const struct omemoStore *store) {
   omemoSerializedKey ser;
+  omemoKey ed;
   spk->id = id;
   TRY(GenerateKeyPair(&spk->kp));
   omemoSerializeKey(ser, spk->kp.pub);
   uint8_t rnd[64];
   TRY(omemoRandom(rnd, 64));
-  return CalculateCurveSignature(spk->sig, idkp, rnd, ser, SerLen);
+  GetIdentityEd(ed, store);
+  return CalculateCurveSignature(spk->sig, &store->identity, ed, rnd, ser,
+                                 SerLen);
 }
 
 /****************************** STORE ********************************/
@@ -470,6 +719,7 @@ static inline uint32_t IncrementWrapSkipZero(uint32_t n) {
 }
 
 int omemoRefillPreKeys(struct omemoStore *store) {
+  STATTIME(OMEMO_STAT_REFILLPREKEYS);
   if (!store)
     return OMEMO_EPARAM;
   int i;
@@ -495,14 +745,15 @@ static int omemoSetupStoreImpl(struct omemoStore *store) {
 #else
   TRY(GenerateKeyPair(&store->identity));
 #endif
-  TRY(GenerateSignedPreKey(&store->cursignedprekey, 1,
-                           &store->identity));
+  DeriveIdentityAlt(store);
+  TRY(GenerateSignedPreKey(&store->cursignedprekey, 1, store));
   TRY(omemoRefillPreKeys(store));
   store->init = true;
   return 0;
 }
 
 int omemoSetupStore(struct omemoStore *store) {
+  STATTIME(OMEMO_STAT_SETUPSTORE);
   if (!store)
     return OMEMO_EPARAM;
   int r;
@@ -513,152 +764,81 @@ int omemoSetupStore(struct omemoStore *store) {
 
 /*********************************************************************/
 
-#define ADSIZE (2 * SerLen)
-#ifdef OMEMO2
-#define MACSIZE 16
-#else
-#define MACSIZE 8
-#endif
-
-//  AD = Encode(IKA) || Encode(IKB)
-static void GetAd(uint8_t ad[static ADSIZE], const omemoKey ika,
-                  const omemoKey ikb) {
-  omemoSerializeKey(ad, ika);
-  omemoSerializeKey(ad + SerLen, ikb);
-}
-
-static int GetMac(uint8_t d[static MACSIZE], const omemoKey ika,
-                  const omemoKey ikb, const omemoKey mk,
-                  const uint8_t *msg, size_t msgn) {
-  // This could theoretically happen while decrypting when the protobuf
-  // is needlessly large.
-  if (msgn > OMEMO_INTERNAL_FULLMSG_MAXSIZE + 4)
-    return OMEMO_ECORRUPT;
-  // Adding 4 in case some client has a large registration id
-  uint8_t macinput[ADSIZE + OMEMO_INTERNAL_FULLMSG_MAXSIZE + 4],
-      mac[32];
-  GetAd(macinput, ika, ikb);
-  memcpy(macinput + ADSIZE, msg, msgn);
-  TRY(omemoDriverHmac(mk, macinput, ADSIZE + msgn, mac));
-  memcpy(d, mac, MACSIZE);
-  return 0;
-}
-
-#define GetPad(n) (16 - ((n) % 16))
-
-static int Encrypt(uint8_t out[OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE],
-                   const uint8_t *in, size_t n, omemoKey key,
-                   uint8_t iv[static 16]) {
-  uint8_t tmp[OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
-  int pad = GetPad(n);
-  memcpy(tmp, in, n);
-  memset(tmp + n, pad, pad);
-  TRY(omemoDriverAesEncrypt(key, n+pad, iv, tmp, out));
-  return n + pad;
-}
-
-static const uint8_t Zero32[32];
-
-#define DeriveKey(salt, secret, info, out)                             \
-  omemoDriverHkdf(salt,    \
-                sizeof(salt), secret, sizeof(secret), info,            \
-                sizeof(info) - 1, (uint8_t *)out, sizeof(out))
-
-struct __attribute__((__packed__)) DeriveChainKeyOutput {
-  omemoKey cipher, mac;
-  uint8_t iv[16];
-};
+// Fills *out from the 32 byte secret with the HKDF info of Protocol,
+// out may point into the scratch.
+#define DeriveKey(secret, info, out)                                   \
+  omemoCoreDeriveKeys(&Protocol, (uint8_t *)(out), secret,             \
+                      Protocol.info)
 
 // d may be the same pointer as ck
 //  ck, mk = KDF_CK(ck)
 static int GetBaseMaterials(omemoKey d, omemoKey mk,
                              const omemoKey ck) {
-  uint8_t data[1] = {1};
-  TRY(omemoDriverHmac(ck, data, 1, mk));
-  data[0] = 2;
-  TRY(omemoDriverHmac(ck, data, 1, d));
-  return 0;
-}
-
-// CKs, mk = KDF_CK(CKs)
-// header = HEADER(DHs, PN, Ns)
-// Ns += 1
-// return header, ENCRYPT(mk, plaintext, CONCAT(AD, header))
-static int EncryptKeyImpl(struct omemoSession *session,
-                          struct omemoKeyMessage *msg,
-                          const uint8_t *key, size_t keyn) {
-  if (!session->init)
-    return OMEMO_ESTATE;
-  omemoKey mk;
-  TRY(GetBaseMaterials(session->state.cks, mk, session->state.cks));
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, mk, HkdfInfoMessageKeys, kdfout));
-  msg->n = 0;
-#ifdef OMEMO2
-  msg->p[msg->n++] = (1 << 3) | PB_LEN;
-  msg->p[msg->n++] = 16;
-  msg->n += 16;
-  msg->p[msg->n++] = (2 << 3) | PB_LEN;
-  // Hmac'd message will always be smaller than 128
-  msg->p[msg->n++] = 0x55; // replaced with actual size
-#endif
-  msg->n += FormatMessageHeader(
-      msg->p + msg->n, session->state.ns, session->state.pn,
-      session->state.dhs.pub, keyn + GetPad(keyn));
-  msg->n +=
-      Encrypt(msg->p + msg->n, key, keyn, kdfout->cipher, kdfout->iv);
-#ifdef OMEMO2
-  msg->p[19] = msg->n - 20;
-  TRY(GetMac(msg->p + 2, session->identity, session->remoteidentity,
-             kdfout->mac, msg->p + 20, msg->n - 20));
-#else
-  TRY(GetMac(msg->p + msg->n, session->identity,
-             session->remoteidentity, kdfout->mac, msg->p, msg->n));
-  msg->n += 8;
-#endif
-  session->state.ns++;
-  if (session->init == SESSION_INIT) {
-    msg->isprekey = true;
-    // [message 00...] -> [00... message] -> [header 00... message] ->
-    // [header message]
-    memmove(msg->p + OMEMO_INTERNAL_PREKEYHEADER_MAXSIZE, msg->p,
-            msg->n);
-    int headersz = FormatPreKeyMessage(
-        msg->p, session->usedpk_id, session->usedspk_id,
-        session->identity, session->usedek, msg->n);
-    memmove(msg->p + headersz,
-            msg->p + OMEMO_INTERNAL_PREKEYHEADER_MAXSIZE, msg->n);
-    msg->n += headersz;
-  }
-  return 0;
+  return omemoCoreKdfCk(&Protocol, d, mk, ck);
 }
 
 int omemoEncryptKey(struct omemoSession *session,
                                  struct omemoKeyMessage *msg,
                                  const uint8_t *key, size_t keyn) {
+  STATTIME(OMEMO_STAT_ENCRYPTKEY);
+  TRACESESSION(session);
   if (!session || !msg || keyn > OMEMO_KEYSIZE)
     return OMEMO_EPARAM;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
   int r;
-  // Fields outside of session->state are not modified in
-  // EncryptKeyImpl() but we'll back them up to save a future headache.
-  struct omemoSession backup;
-  memcpy(&backup, session, sizeof(struct omemoSession));
-  memset(msg, 0, sizeof(struct omemoKeyMessage));
-  if ((r = EncryptKeyImpl(session, msg, key, keyn))) {
-    memcpy(session, &backup, sizeof(struct omemoSession));
+  msg->n = sizeof(msg->p);
+  if ((r = omemoCoreEncryptKey(&Protocol, (omemoCoreSession *)session,
+                               msg->p, &msg->n, &msg->isprekey, key, keyn,
+                               &sc)))
     memset(msg, 0, sizeof(struct omemoKeyMessage));
-  }
   return r;
 }
 
+int omemoEncryptKeyTo(struct omemoSession *session, uint8_t *d,
+                      size_t *dn, bool *isprekey, const uint8_t *key,
+                      size_t keyn) {
+  STATTIME(OMEMO_STAT_ENCRYPTKEY);
+  TRACESESSION(session);
+  if (!session || !d || !dn || !isprekey || keyn > OMEMO_KEYSIZE)
+    return OMEMO_EPARAM;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
+  return omemoCoreEncryptKey(&Protocol, (omemoCoreSession *)session, d, dn,
+                             isprekey, key, keyn, &sc);
+}
+
+size_t omemoGetKeyMessageSize(const struct omemoSession *session,
+                              size_t keyn) {
+  if (!session)
+    return 0;
+  return omemoCoreGetKeyMessageSize(&Protocol,
+                                    (const omemoCoreSession *)session, keyn);
+}
+
 // RK, ck = KDF_RK(RK, DH(DHs, DHr))
 static int DeriveRootKey(struct omemoState *state, omemoKey ck) {
-  uint8_t secret[32], masterkey[64];
-  TRY(DoX25519(secret, state->dhs.prv, state->dhr));
-  TRY(DeriveKey(state->rk, secret, HkdfInfoRootChain, masterkey));
-  memcpy(state->rk, masterkey, 32);
-  memcpy(ck, masterkey + 32, 32);
-  return 0;
+  SCRATCH(dh);
+  SCRATCH(masterkey);
+  struct omemoCoreScratch sc = {.dh = dh, .masterkey = masterkey};
+  return omemoCoreDeriveRootKey(&Protocol, (omemoCoreState *)state, ck,
+                                &sc);
 }
 
 // DH1 = DH(IKA, SPKB)
@@ -670,7 +850,7 @@ static int GetSharedSecret(omemoKey sk, bool isbob, const omemoKey ika,
                            const omemoKey ska, const omemoKey eka,
                            const omemoKey ikb, const omemoKey spkb,
                            const omemoKey opkb) {
-  uint8_t secret[32 * 5] = {0}, tmpkey[32];
+  SCRATCH(secret);
   memset(secret, 0xff, 32);
   // When we are bob, we must swap the first two.
   TRY(DoX25519(secret + 32, isbob ? ska : ika, isbob ? ikb : spkb));
@@ -678,9 +858,7 @@ static int GetSharedSecret(omemoKey sk, bool isbob, const omemoKey ika,
   TRY(DoX25519(secret + 96, ska, spkb));
   // OMEMO mandates that the bundle MUST contain a prekey.
   TRY(DoX25519(secret + 128, eka, opkb));
-  TRY(DeriveKey(Zero32, secret, HkdfInfoKeyExchange, tmpkey));
-  memcpy(sk, tmpkey, 32);
-  return 0;
+  return omemoCoreKdfSharedSecret(&Protocol, sk, secret);
 }
 
 //  state.DHs = GENERATE_DH()
@@ -701,28 +879,100 @@ static int RatchetInitAlice(struct omemoState *state, const omemoKey sk,
   return DeriveRootKey(state, state->cks);
 }
 
-int omemoInitiateSession(struct omemoSession *session,
-                                      const struct omemoStore *store,
-                                      const omemoCurveSignature spks,
-                                      const omemoSerializedKey spk,
-                                      const omemoSerializedKey ik,
-                                      const omemoSerializedKey pk,
-                                      uint32_t spk_id, uint32_t pk_id) {
-  if (!session || !store)
+#define VERIFYBATCH OMEMO_INTERNAL_VERIFYBATCH
+
+int omemoVerifyBundles(const struct omemoBundle *bundles, bool *ok,
+                       size_t n) {
+  STATTIME(OMEMO_STAT_VERIFYBUNDLES);
+  if (!bundles || !ok)
     return OMEMO_EPARAM;
-  if (!VerifySignature(spks, GetRawKey(ik), spk, SerLen)) {
-    return OMEMO_ECORRUPT;
+  SCRATCH(sigs);
+  SCRATCH(pubs);
+  SCRATCH(alts);
+  SCRATCH(iks);
+  SCRATCH(msgs);
+  SCRATCH(msgp);
+  SCRATCH(msgn);
+  SCRATCH(idx);
+  SCRATCH(hashes);
+  SCRATCH(cache);
+  uint8_t seed[32];
+  int r = 0;
+  for (size_t i = 0; i < n;) {
+    size_t m = 0;
+    for (; i < n && m < VERIFYBATCH; i++) {
+      const struct omemoBundle *b = bundles + i;
+      cache[m] = HashBundle(hashes[m], b->spks, b->spk, b->ik);
+      if (cache[m] && IsBundleCached(hashes[m])) {
+        ok[i] = true;
+        continue;
+      }
+      iks[m] = GetRawKey(b->ik);
+      memcpy(msgs[m], b->spk, SerLen);
+      msgp[m] = msgs[m];
+      msgn[m] = SerLen;
+      idx[m++] = i;
+    }
+    if (!m)
+      break;
+#ifndef OMEMO2
+    GetRemoteIdentityAlts(alts, iks, m);
+#endif
+    for (size_t j = 0; j < m; j++)
+      PrepareSignature(sigs[j], pubs[j], bundles[idx[j]].spks, iks[j],
+                       alts[j]);
+    TRY(omemoRandom(seed, 32));
+    bool all = omemoDriverEdVerifyBatch(m, sigs, pubs, msgp, msgn, seed);
+    // Find out which ones are bad.
+    for (size_t j = 0; j < m; j++) {
+      ok[idx[j]] =
+          all || omemoDriverEdVerify(sigs[j], pubs[j], msgp[j], SerLen);
+      if (!ok[idx[j]])
+        r = OMEMO_ECORRUPT;
+      else if (cache[j])
+        CacheBundle(hashes[j]);
+    }
+  }
+  return r;
+}
+
+int omemoImportRemoteIdentities(struct omemoSession **sessions,
+                                const omemoSerializedKey *iks, size_t n) {
+  if (!sessions || !iks)
+    return OMEMO_EPARAM;
+  for (size_t i = 0; i < n; i++) {
+    if (!sessions[i])
+      return OMEMO_EPARAM;
+    if (sessions[i]->init != SESSION_UNINIT &&
+        memcmp(sessions[i]->remoteidentity, GetRawKey(iks[i]), 32))
+      return OMEMO_ESTATE;
   }
+  SCRATCH(alts);
+  const uint8_t *raw[VERIFYBATCH];
+  for (size_t i = 0; i < n; i += VERIFYBATCH) {
+    size_t m = n - i < VERIFYBATCH ? n - i : VERIFYBATCH;
+    for (size_t j = 0; j < m; j++)
+      raw[j] = GetRawKey(iks[i + j]);
+    GetRemoteIdentityAlts(alts, raw, m);
+    for (size_t j = 0; j < m; j++)
+      SetRemoteIdentity(sessions[i + j], raw[j], alts[j]);
+  }
+  return 0;
+}
+
+static int InitiateSessionImpl(struct omemoSession *session,
+                               const struct omemoStore *store,
+                               const omemoSerializedKey spk,
+                               const omemoSerializedKey ik,
+                               const omemoSerializedKey pk,
+                               uint32_t spk_id, uint32_t pk_id) {
   struct omemoKeyPair eka;
   TRY(GenerateKeyPair(&eka));
-  omemoKey sk;
+  omemoKey sk, alt;
+  GetRemoteIdentityAlt(alt, session, GetRawKey(ik));
 #ifdef OMEMO2
-  omemoKey ikx, edy;
-  memcpy(edy, GetRawKey(ik), 32);
-  edy[31] &= 0x7f;
-  omemoDriverEdPubToCvPub(ikx, edy);
   TRY(GetSharedSecret(sk, false, store->identity.prv, eka.prv, eka.prv,
-                      ikx, GetRawKey(spk), GetRawKey(pk)));
+                      alt, GetRawKey(spk), GetRawKey(pk)));
 #else
   TRY(GetSharedSecret(sk, false, store->identity.prv, eka.prv, eka.prv,
                       GetRawKey(ik), GetRawKey(spk), GetRawKey(pk)));
@@ -734,13 +984,50 @@ int omemoInitiateSession(struct omemoSession *session,
   }
   memcpy(session->usedek, eka.pub, 32);
   memcpy(session->identity, store->identity.pub, 32);
-  memcpy(session->remoteidentity, GetRawKey(ik), 32);
+  SetRemoteIdentity(session, GetRawKey(ik), alt);
   session->usedpk_id = pk_id;
   session->usedspk_id = spk_id;
   session->init = SESSION_INIT;
   return 0;
 }
 
+int omemoInitiateSession(struct omemoSession *session,
+                                      const struct omemoStore *store,
+                                      const omemoCurveSignature spks,
+                                      const omemoSerializedKey spk,
+                                      const omemoSerializedKey ik,
+                                      const omemoSerializedKey pk,
+                                      uint32_t spk_id, uint32_t pk_id) {
+  STATTIME(OMEMO_STAT_INITIATESESSION);
+  TRACESESSION(session);
+  if (!session || !store)
+    return OMEMO_EPARAM;
+  uint8_t h[16];
+  bool cache = HashBundle(h, spks, spk, ik);
+  if (!cache || !IsBundleCached(h)) {
+    omemoKey alt;
+    GetRemoteIdentityAlt(alt, session, GetRawKey(ik));
+    if (!VerifySignature(spks, GetRawKey(ik), alt, spk, SerLen))
+      return OMEMO_ECORRUPT;
+    if (cache)
+      CacheBundle(h);
+  }
+  return InitiateSessionImpl(session, store, spk, ik, pk, spk_id, pk_id);
+}
+
+int omemoInitiateVerifiedSession(struct omemoSession *session,
+                                 const struct omemoStore *store,
+                                 const omemoSerializedKey spk,
+                                 const omemoSerializedKey ik,
+                                 const omemoSerializedKey pk,
+                                 uint32_t spk_id, uint32_t pk_id) {
+  STATTIME(OMEMO_STAT_INITIATESESSION);
+  TRACESESSION(session);
+  if (!session || !store)
+    return OMEMO_EPARAM;
+  return InitiateSessionImpl(session, store, spk, ik, pk, spk_id, pk_id);
+}
+
 static const struct omemoPreKey *FindPreKey(const struct omemoStore *store,
                                       uint32_t pk_id) {
   for (int i = 0; i < OMEMO_NUMPREKEYS; i++) {
@@ -762,12 +1049,12 @@ FindSignedPreKey(const struct omemoStore *store, uint32_t spk_id) {
 }
 
 int omemoRotateSignedPreKey(struct omemoStore *store) {
+  STATTIME(OMEMO_STAT_ROTATESIGNEDPREKEY);
   if (!store)
     return OMEMO_EPARAM;
   struct omemoSignedPreKey spk;
   int r = GenerateSignedPreKey(
-      &spk, IncrementWrapSkipZero(store->cursignedprekey.id),
-      &store->identity);
+      &spk, IncrementWrapSkipZero(store->cursignedprekey.id), store);
   if (!r) {
     memcpy(&store->prevsignedprekey, &store->cursignedprekey,
            sizeof(struct omemoSignedPreKey));
@@ -776,226 +1063,91 @@ int omemoRotateSignedPreKey(struct omemoStore *store) {
   return r;
 }
 
-//  PN = Ns
-//  Ns = 0
-//  Nr = 0
-//  DHr = dh
-//  RK, CKr = KDF_RK(RK, DH(DHs, DHr))
-//  DHs = GENERATE_DH()
-//  RK, CKs = KDF_RK(RK, DH(DHs, DHr))
-static int DHRatchet(struct omemoState *state, const omemoKey dh) {
-  state->pn = state->ns;
-  state->ns = 0;
-  state->nr = 0;
-  memcpy(state->dhr, dh, 32);
-  TRY(DeriveRootKey(state, state->ckr));
-  TRY(GenerateKeyPair(&state->dhs));
-  TRY(DeriveRootKey(state, state->cks));
-  return 0;
-}
-
 static void RatchetInitBob(struct omemoState *state, const omemoKey sk,
                            const struct omemoKeyPair *ekb) {
   memcpy(&state->dhs, ekb, sizeof(struct omemoKeyPair));
   memcpy(state->rk, sk, 32);
 }
 
-#define CLAMP0(v) ((v) > 0 ? (v) : 0)
-
-static inline uint32_t GetAmountSkipped(int64_t nr, int64_t n) {
-  return CLAMP0(n - nr);
-}
-
-static int SkipMessageKeys(struct omemoSession *session, uint32_t n,
-                           uint64_t fullamount) {
-  struct omemoMessageKey k;
-  while (session->state.nr < n) {
-    TRY(GetBaseMaterials(session->state.ckr, k.mk, session->state.ckr));
-    memcpy(k.dh, session->state.dhr, 32);
-    k.nr = session->state.nr;
-    TRY(omemoStoreMessageKey(session, &k, fullamount--));
-    session->state.nr++;
-  }
-  return 0;
-}
-
-static int DecryptKeyImpl(struct omemoSession *session,
-                          uint8_t *key, size_t *keyn,
-                          const uint8_t *msg, size_t msgn) {
-#ifdef OMEMO2
-  struct ProtobufField fields1[3] = {
-      [1] = {PB_REQUIRED | PB_LEN, 16}, // mac
-      [2] = {PB_REQUIRED | PB_LEN},     // message
-  };
-  if (ParseProtobuf(msg, msgn, fields1, 3))
-    return OMEMO_EPROTOBUF;
-
-  struct ProtobufField fields[5] = {
-      [PbMsg_n] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_pn] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_dh_pub] = {PB_REQUIRED | PB_LEN, SerLen},
-      [PbMsg_ciphertext] = {PB_REQUIRED | PB_LEN},
-  };
-  if (ParseProtobuf(fields1[2].p, fields1[2].v, fields, 5))
-    return OMEMO_EPROTOBUF;
-  const uint8_t *realmac = fields1[1].p;
-#else
-  if (msgn < 9 || msg[0] != ((3 << 4) | 3))
-    return OMEMO_ECORRUPT;
-  struct ProtobufField fields[5] = {
-      [PbMsg_dh_pub] = {PB_REQUIRED | PB_LEN, SerLen},
-      [PbMsg_n] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_pn] = {PB_REQUIRED | PB_UINT32},
-      [PbMsg_ciphertext] = {PB_REQUIRED | PB_LEN},
-  };
-  if (ParseProtobuf(msg + 1, msgn - 9, fields, 5))
-    return OMEMO_EPROTOBUF;
-  const uint8_t *realmac = msg + msgn - 8;
-#endif
-
-  uint32_t encn = fields[PbMsg_ciphertext].v;
-  if (encn < 16 || encn % 16 ||
-      encn > OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE)
-    return OMEMO_ECORRUPT;
-
-  uint32_t headern = fields[PbMsg_n].v;
-  uint32_t headerpn = fields[PbMsg_pn].v;
-  const uint8_t *headerdh = GetRawKey(fields[PbMsg_dh_pub].p);
-
-  bool shouldstep = !!memcmp(session->state.dhr, headerdh, 32);
-
-  // We first check for maxskip, if that does not pass we should not
-  // process the message. If it does pass, we know the total capacity of
-  // the array is large enough because c >= maxskip. Then we check if
-  // the new keys fit in the remaining space. If that is not the case we
-  // return and let the user either remove the old message keys or
-  // ignore the message.
-
-  omemoKey mk;
-  struct omemoMessageKey mkey = {0};
-  memcpy(mkey.dh, headerdh, 32);
-  mkey.nr = headern;
-  int r;
-  if (!(r = omemoLoadMessageKey(session, &mkey))) {
-    memcpy(mk, mkey.mk, 32);
-  } else if (r < 0) {
-    return r;
-  } else {
-    if (!shouldstep && headern < session->state.nr)
-      return OMEMO_EKEYGONE;
-    uint64_t nskips =
-        shouldstep
-            ? GetAmountSkipped(session->state.nr, headerpn) + headern
-            : GetAmountSkipped(session->state.nr, headern);
-    if (shouldstep) {
-      TRY(SkipMessageKeys(session, headerpn, nskips));
-      nskips -= headern;
-      TRY(DHRatchet(&session->state, headerdh));
-    }
-    TRY(SkipMessageKeys(session, headern, nskips));
-    TRY(GetBaseMaterials(session->state.ckr, mk, session->state.ckr));
-    session->state.nr++;
-  }
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, mk, HkdfInfoMessageKeys, kdfout));
-  uint8_t mac[MACSIZE];
-#ifdef OMEMO2
-  TRY(GetMac(mac, session->remoteidentity, session->identity,
-             kdfout->mac, fields1[2].p, fields1[2].v));
-#else
-  TRY(GetMac(mac, session->remoteidentity, session->identity,
-             kdfout->mac, msg, msgn - 8));
-#endif
-  if (omemoDriverCompare(mac, realmac, MACSIZE))
-    return OMEMO_ECORRUPT;
-  uint8_t tmp[OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
-  TRY(omemoDriverAesDecrypt(kdfout->cipher, encn, kdfout->iv,
-         fields[PbMsg_ciphertext].p, tmp));
-  uint8_t pad = tmp[encn - 1];
-  if (pad > 16 || pad > encn || encn - pad > *keyn)
-    return OMEMO_ECORRUPT;
-  memcpy(key, tmp, encn - pad);
-  *keyn = encn - pad;
-  session->init = SESSION_READY;
-  return 0;
-}
-
+// Nothing in session is changed until the message is decrypted, then
+// state is copied to it together with the other changes.
 static int DecryptGenericKeyImpl(struct omemoSession *session,
                                  const struct omemoStore *store,
+                                 struct omemoState *state,
                                  uint8_t *key, size_t *keyn,
                                  bool isprekey, const uint8_t *msg,
                                  size_t msgn) {
   const struct omemoPreKey *pk = NULL;
+  // Remote identity key of a new session and the alt form if known.
+  omemoKey ik[2];
+  const uint8_t *remote = session->remoteidentity, *remotealt = NULL;
+  uint32_t pkid = 0;
   if (isprekey) {
     // Can't receive prekey when we sent a prekey...
     if (session->init == SESSION_INIT)
       return OMEMO_ESTATE;
-#ifdef OMEMO2
-    // OMEMOKeyExchange
-    struct ProtobufField fields[6] = {
-        [PbKeyEx_pk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_spk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_ik] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_ek] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_message] = {PB_REQUIRED | PB_LEN},
-    };
-    if (ParseProtobuf(msg, msgn, fields, 6))
-      return OMEMO_EPROTOBUF;
-#else
-    if (msgn == 0 || msg[0] != ((3 << 4) | 3))
-      return OMEMO_ECORRUPT;
-    // PreKeyWhisperMessage
-    struct ProtobufField fields[7] = {
-        [5] = {PB_UINT32},                             // registrationid
-        [PbKeyEx_pk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_spk_id] = {PB_REQUIRED | PB_UINT32},
-        [PbKeyEx_ek] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_ik] = {PB_REQUIRED | PB_LEN, SerLen},
-        [PbKeyEx_message] = {PB_REQUIRED | PB_LEN},
-    };
-    if (ParseProtobuf(msg + 1, msgn - 1, fields, 7))
-      return OMEMO_EPROTOBUF;
-#endif
+    struct omemoCoreKeyExchange kx;
+    TRY(omemoCoreParseKeyExchange(&Protocol, &kx, msg, msgn));
     if (session->init == SESSION_UNINIT) {
-      pk = FindPreKey(store, fields[PbKeyEx_pk_id].v);
+      pk = FindPreKey(store, kx.pk_id);
       const struct omemoSignedPreKey *spk =
-          FindSignedPreKey(store, fields[PbKeyEx_spk_id].v);
+          FindSignedPreKey(store, kx.spk_id);
       if (!pk || !spk)
         return OMEMO_ECORRUPT;
-      session->usedpk_id = fields[PbKeyEx_pk_id].v;
+      pkid = kx.pk_id;
       omemoKey sk;
-      memcpy(session->identity, store->identity.pub, 32);
-      memcpy(session->remoteidentity, GetRawKey(fields[PbKeyEx_ik].p),
-             32);
+      memcpy(ik[0], msg + kx.ik, 32);
 #ifdef OMEMO2
-      omemoKey ik, edy;
-      memcpy(edy, fields[PbKeyEx_ik].p, 32);
-      edy[31] &= 0x7f;
-      omemoDriverEdPubToCvPub(ik, edy);
+      GetRemoteIdentityAlt(ik[1], session, ik[0]);
+      remotealt = ik[1];
       TRY(GetSharedSecret(sk, true, store->identity.prv, spk->kp.prv,
-                          pk->kp.prv, ik, fields[PbKeyEx_ek].p,
-                          fields[PbKeyEx_ek].p));
+                          pk->kp.prv, ik[1], msg + kx.ek, msg + kx.ek));
 #else
       TRY(GetSharedSecret(sk, true, store->identity.prv, spk->kp.prv,
-                          pk->kp.prv, GetRawKey(fields[PbKeyEx_ik].p),
-                          GetRawKey(fields[PbKeyEx_ek].p),
-                          GetRawKey(fields[PbKeyEx_ek].p)));
+                          pk->kp.prv, ik[0], msg + kx.ek, msg + kx.ek));
 #endif
-      RatchetInitBob(&session->state, sk, &spk->kp);
+      RatchetInitBob(state, sk, &spk->kp);
+      remote = ik[0];
     }
-    msg = fields[PbKeyEx_message].p;
-    msgn = fields[PbKeyEx_message].v;
+    msgn = kx.messagen;
+    msg += kx.message;
+  } else if (session->init == SESSION_UNINIT) {
+    return OMEMO_ESTATE;
+  }
+  if (remote != ik[0] &&
+      memcmp(session->identity, store->identity.pub, 32))
+    return OMEMO_ESTORE;
+  SCRATCH(macinput);
+  SCRATCH(payload);
+  SCRATCH(mk);
+  SCRATCH(dh);
+  SCRATCH(masterkey);
+  SCRATCH(kdfout);
+  struct omemoCoreScratch sc = {
+      .macinput = macinput,
+      .payload = payload,
+      .mk = mk,
+      .dh = dh,
+      .masterkey = masterkey,
+      .kdfout = (omemoCoreDerivedKeys *)kdfout,
+  };
+  TRY(omemoCoreDecryptKey(&Protocol, (omemoCoreSession *)session,
+                          (omemoCoreState *)state, remote,
+                          store->identity.pub, key, keyn, msg, msgn, &sc));
+  if (remote == ik[0]) {
+    memcpy(session->identity, store->identity.pub, 32);
+    SetRemoteIdentity(session, remote, remotealt);
+    session->usedpk_id = pkid;
+    STAT(prekeysused);
   } else if (session->init == SESSION_INIT) {
     // We don't need these anymore
     session->usedpk_id = 0;
     session->usedspk_id = 0;
     memset(session->usedek, 0, 32);
-  } else if (session->init == SESSION_UNINIT) {
-    return OMEMO_ESTATE;
   }
-  if (memcmp(session->identity, store->identity.pub, 32))
-    return OMEMO_ESTORE;
-  return DecryptKeyImpl(session, key, keyn, msg, msgn);
+  memcpy(&session->state, state, sizeof(struct omemoState));
+  session->init = SESSION_READY;
+  return 0;
 }
 
 int omemoDecryptKey(struct omemoSession *session,
@@ -1003,24 +1155,22 @@ int omemoDecryptKey(struct omemoSession *session,
                                  uint8_t *key, size_t *keyn,
                                  bool isprekey, const uint8_t *msg,
                                  size_t msgn) {
+  STATTIME(OMEMO_STAT_DECRYPTKEY);
+  TRACESESSION(session);
   if (!session || !store || !key || !keyn || !store->init || !msg)
     return OMEMO_EPARAM;
-  // We only have to backup session->state functionality wise, but to
-  // ensure session stays the same before and after an error we backup
-  // everything.
-  struct omemoSession backup;
-  memcpy(&backup, session, sizeof(struct omemoSession));
-  int r;
-  if ((r = DecryptGenericKeyImpl(session, store, key, keyn, isprekey,
-                                 msg, msgn))) {
-    memcpy(session, &backup, sizeof(struct omemoSession));
-  }
-  return r;
+  // The ratchet is advanced in a copy of the state, so session stays the
+  // same when there is an error.
+  SCRATCH(state);
+  memcpy(state, &session->state, sizeof(struct omemoState));
+  return DecryptGenericKeyImpl(session, store, state, key, keyn,
+                               isprekey, msg, msgn);
 }
 
 int omemoHeartbeat(struct omemoSession *session,
                                 const struct omemoStore *store,
                                 struct omemoKeyMessage *msg) {
+  TRACESESSION(session);
   if (!session || !store || !msg) return OMEMO_EPARAM;
   if (session->state.nr >= 53) {
     if (session->init == SESSION_READY) {
@@ -1041,37 +1191,51 @@ int omemoHeartbeat(struct omemoSession *session,
 int omemoDecryptMessage(uint8_t *d, size_t *olen,
                                      const uint8_t *key, size_t keyn,
                                      const uint8_t *s, size_t n) {
+  STATTIME(OMEMO_STAT_DECRYPTMESSAGE);
   if (!d || !olen || !key || !s)
     return OMEMO_EPARAM;
   if (keyn != 48)
     return OMEMO_ECORRUPT;
   if (n < 16 || n % 16)
     return OMEMO_ECORRUPT;
-  uint8_t k[32];
+  SCRATCH(kdfout);
+  uint8_t k[32], mac[32], p;
+  int r;
   memcpy(k, key, 32);
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, k, HkdfInfoPayload, kdfout));
-  uint8_t mac[32];
-  TRY(omemoDriverHmac(kdfout->mac, s, n, mac));
-  if (omemoDriverCompare(mac, key + 32, 16))
-    return OMEMO_ECORRUPT;
-  TRY(omemoDriverAesDecrypt(kdfout->cipher, n, kdfout->iv, s, d));
-  uint8_t p = d[n - 1];
-  if (p > n)
-    return OMEMO_ECORRUPT;
+  if ((r = DeriveKey(k, info_payload, kdfout)))
+    goto out;
+  STAT(aes);
+  STAT(hmac);
+  // d has plaintext from here on, even if the call fails partway, so it
+  // is cleared on every error.
+  r = omemoDriverAesCbcHmac(kdfout->cipher, kdfout->mac, false, n,
+                            kdfout->iv, s, d, mac);
+  if (!r && omemoDriverCompare(mac, key + 32, 16))
+    r = OMEMO_ECORRUPT;
+  if (!r && (!(p = d[n - 1]) || p > 16))
+    r = OMEMO_ECORRUPT;
+  if (r) {
+    memset(d, 0, n);
+    goto out;
+  }
   memset(d + n - p, 0, p);
   *olen = n - p;
-  return 0;
+out:
+  memset(k, 0, 32);
+  memset(mac, 0, 32);
+  return r;
 }
 #else
 int omemoDecryptMessage(uint8_t *d, const uint8_t *key,
                                      size_t keyn, const uint8_t iv[12],
                                      const uint8_t *s, size_t n) {
+  STATTIME(OMEMO_STAT_DECRYPTMESSAGE);
   if (!d || !key || !iv || !s)
     return OMEMO_EPARAM;
   int r = 0;
   if (keyn < 32)
     return OMEMO_ECORRUPT;
+  STAT(aes);
   TRY(omemoDriverGcmDecrypt(d, key, n, iv, key+16, keyn-16, s));
   return r ? OMEMO_ECRYPTO : 0;
 }
@@ -1080,18 +1244,21 @@ int omemoDecryptMessage(uint8_t *d, const uint8_t *key,
 #ifdef OMEMO2
 int omemoEncryptMessage(uint8_t *d, uint8_t key[48],
                                      uint8_t *s, size_t n) {
+  STATTIME(OMEMO_STAT_ENCRYPTMESSAGE);
   if (!d || !key || !s)
     return OMEMO_EPARAM;
   uint8_t k[32];
   TRY(omemoRandom(k, 32));
-  struct DeriveChainKeyOutput kdfout[1];
-  TRY(DeriveKey(Zero32, k, HkdfInfoPayload, kdfout));
+  SCRATCH(kdfout);
+  TRY(DeriveKey(k, info_payload, kdfout));
   // PKCS#7
   size_t extend = omemoGetMessagePadSize(n);
   memset(s + n, extend, extend);
-  TRY(omemoDriverAesEncrypt(kdfout->cipher, n + extend, kdfout->iv, s, d));
   uint8_t mac[32];
-  TRY(omemoDriverHmac(kdfout->mac, d, n + extend, mac));
+  STAT(aes);
+  STAT(hmac);
+  TRY(omemoDriverAesCbcHmac(kdfout->cipher, kdfout->mac, true, n + extend,
+                            kdfout->iv, s, d, mac));
   memcpy(key, k, 32);
   memcpy(key + 32, mac, 16);
   return 0;
@@ -1100,110 +1267,290 @@ int omemoEncryptMessage(uint8_t *d, uint8_t key[48],
 int omemoEncryptMessage(uint8_t *d, uint8_t key[32],
                                      uint8_t iv[12], const uint8_t *s,
                                      size_t n) {
+  STATTIME(OMEMO_STAT_ENCRYPTMESSAGE);
   if (!d || !key || !iv || !s)
     return OMEMO_EPARAM;
   int r = 0;
   if ((r = omemoRandom(key, 16)) || (r = omemoRandom(iv, 12)))
     return r;
+  STAT(aes);
   return omemoDriverGcmEncrypt(d, key, n, iv, key + 16, s);
 }
 #endif
 
+void omemoFreeMessageStream(struct omemoPayloadStream *st) {
+  if (st) {
+    omemoDriverAesDestroy(st->aes);
+    omemoDriverHmacDestroy(st->hmac);
+    memset(st, 0, sizeof(*st));
+  }
+}
+
+// Frees the stream when r is an error.
+static int CheckStream(struct omemoPayloadStream *st, int r) {
+  if (r)
+    omemoFreeMessageStream(st);
+  return r;
+}
+
+#ifdef OMEMO2
+static int StartStream(struct omemoPayloadStream *st, bool enc) {
+  struct omemoInternalDerivedKeys kdfout[1];
+  uint8_t k[32];
+  int r;
+  if (!(st->aes = omemoDriverAesCreate()) ||
+      !(st->hmac = omemoDriverHmacCreate()))
+    return OMEMO_ECRYPTO;
+  memcpy(k, st->key, 32);
+  if ((r = DeriveKey(k, info_payload, kdfout)) ||
+      (r = omemoDriverAesSetKey(st->aes, kdfout->cipher, enc)) ||
+      (r = omemoDriverHmacStart(st->hmac, kdfout->mac)))
+    return r;
+  memcpy(st->iv, kdfout->iv, 16);
+  memset(kdfout, 0, sizeof(*kdfout));
+  return 0;
+}
+
+int omemoEncryptMessageInit(struct omemoPayloadStream *st) {
+  if (!st)
+    return OMEMO_EPARAM;
+  memset(st, 0, sizeof(*st));
+  int r;
+  if ((r = omemoRandom(st->key, 32)))
+    return r;
+  return CheckStream(st, StartStream(st, true));
+}
+
+// Encrypts and authenticates n bytes, a multiple of the block size.
+static int EncryptBlocks(struct omemoPayloadStream *st, uint8_t *d,
+                         const uint8_t *s, size_t n) {
+  STAT(aes);
+  TRY(omemoDriverAesCbc(st->aes, n, st->iv, s, d));
+  return omemoDriverHmacUpdate(st->hmac, d, n);
+}
+
+static int EncryptUpdate(struct omemoPayloadStream *st, uint8_t *d,
+                         size_t *outn, const uint8_t *s, size_t n) {
+  *outn = 0;
+  if (st->bufn) {
+    size_t m = n < 16 - st->bufn ? n : 16 - st->bufn;
+    memcpy(st->buf + st->bufn, s, m);
+    st->bufn += m, s += m, n -= m;
+    if (st->bufn < 16)
+      return 0;
+    TRY(EncryptBlocks(st, d, st->buf, 16));
+    st->bufn = 0, d += 16, *outn = 16;
+  }
+  size_t m = n & ~(size_t)15;
+  if (m)
+    TRY(EncryptBlocks(st, d, s, m));
+  *outn += m;
+  memcpy(st->buf, s + m, n - m);
+  st->bufn = n - m;
+  return 0;
+}
+
+int omemoEncryptMessageUpdate(struct omemoPayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  if (!st || !d || !outn || (!s && n))
+    return OMEMO_EPARAM;
+  return CheckStream(st, EncryptUpdate(st, d, outn, s, n));
+}
+
+static int EncryptFinal(struct omemoPayloadStream *st, uint8_t *d,
+                        uint8_t key[48]) {
+  uint8_t mac[32];
+  // PKCS#7
+  memset(st->buf + st->bufn, 16 - st->bufn, 16 - st->bufn);
+  TRY(EncryptBlocks(st, d, st->buf, 16));
+  STAT(hmac);
+  TRY(omemoDriverHmacFinish(st->hmac, mac));
+  memcpy(key, st->key, 32);
+  memcpy(key + 32, mac, 16);
+  return 0;
+}
+
+int omemoEncryptMessageFinal(struct omemoPayloadStream *st, uint8_t *d,
+                             size_t *outn, uint8_t key[48]) {
+  if (!st || !d || !outn || !key)
+    return OMEMO_EPARAM;
+  int r = EncryptFinal(st, d, key);
+  *outn = r ? 0 : 16;
+  omemoFreeMessageStream(st);
+  return r;
+}
+
+int omemoDecryptMessageInit(struct omemoPayloadStream *st,
+                            const uint8_t *key, size_t keyn) {
+  if (!st || !key)
+    return OMEMO_EPARAM;
+  if (keyn != 48)
+    return OMEMO_ECORRUPT;
+  memset(st, 0, sizeof(*st));
+  memcpy(st->key, key, 48);
+  st->keyn = 48;
+  return CheckStream(st, StartStream(st, false));
+}
+
+// The last block is kept in buf, as it has the padding.
+static int DecryptUpdate(struct omemoPayloadStream *st, uint8_t *d,
+                         size_t *outn, const uint8_t *s, size_t n) {
+  *outn = 0;
+  TRY(omemoDriverHmacUpdate(st->hmac, s, n));
+  if (st->bufn + n <= 16) {
+    memcpy(st->buf + st->bufn, s, n);
+    st->bufn += n;
+    return 0;
+  }
+  if (st->bufn) {
+    size_t m = 16 - st->bufn;
+    memcpy(st->buf + st->bufn, s, m);
+    s += m, n -= m;
+    STAT(aes);
+    TRY(omemoDriverAesCbc(st->aes, 16, st->iv, st->buf, d));
+    d += 16, *outn = 16;
+  }
+  size_t m = n ? (n - 1) & ~(size_t)15 : 0;
+  if (m) {
+    STAT(aes);
+    TRY(omemoDriverAesCbc(st->aes, m, st->iv, s, d));
+  }
+  *outn += m;
+  memcpy(st->buf, s + m, n - m);
+  st->bufn = n - m;
+  return 0;
+}
+
+int omemoDecryptMessageUpdate(struct omemoPayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  if (!st || !d || !outn || (!s && n))
+    return OMEMO_EPARAM;
+  return CheckStream(st, DecryptUpdate(st, d, outn, s, n));
+}
+
+static int DecryptFinal(struct omemoPayloadStream *st, uint8_t *d,
+                        size_t *outn) {
+  uint8_t mac[32];
+  if (st->bufn != 16)
+    return OMEMO_ECORRUPT;
+  STAT(hmac);
+  TRY(omemoDriverHmacFinish(st->hmac, mac));
+  if (omemoDriverCompare(mac, st->key + 32, 16))
+    return OMEMO_ECORRUPT;
+  STAT(aes);
+  TRY(omemoDriverAesCbc(st->aes, 16, st->iv, st->buf, st->buf));
+  uint8_t p = st->buf[15];
+  if (!p || p > 16)
+    return OMEMO_ECORRUPT;
+  memcpy(d, st->buf, 16 - p);
+  *outn = 16 - p;
+  return 0;
+}
+
+int omemoDecryptMessageFinal(struct omemoPayloadStream *st, uint8_t *d,
+                             size_t *outn) {
+  if (!st || !d || !outn)
+    return OMEMO_EPARAM;
+  *outn = 0;
+  int r = DecryptFinal(st, d, outn);
+  omemoFreeMessageStream(st);
+  return r;
+}
+#else
+static int StartStream(struct omemoPayloadStream *st, const uint8_t *iv,
+                       bool enc) {
+  if (!(st->aes = omemoDriverAesCreate()))
+    return OMEMO_ECRYPTO;
+  TRY(omemoDriverAesSetGcmKey(st->aes, st->key));
+  return omemoDriverAesGcmStart(st->aes, iv, enc);
+}
+
+int omemoEncryptMessageInit(struct omemoPayloadStream *st,
+                            uint8_t iv[12]) {
+  if (!st || !iv)
+    return OMEMO_EPARAM;
+  memset(st, 0, sizeof(*st));
+  int r;
+  if ((r = omemoRandom(st->key, 16)) || (r = omemoRandom(iv, 12)))
+    return r;
+  return CheckStream(st, StartStream(st, iv, true));
+}
+
+int omemoEncryptMessageUpdate(struct omemoPayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  if (!st || !d || !outn || (!s && n))
+    return OMEMO_EPARAM;
+  *outn = n;
+  STAT(aes);
+  return CheckStream(st, omemoDriverAesGcmUpdate(st->aes, d, n, s));
+}
+
+int omemoEncryptMessageFinal(struct omemoPayloadStream *st, uint8_t *d,
+                             size_t *outn, uint8_t key[32]) {
+  if (!st || !outn || !key)
+    return OMEMO_EPARAM;
+  *outn = 0;
+  int r = omemoDriverAesGcmFinish(st->aes, st->key + 16, 16);
+  if (!r)
+    memcpy(key, st->key, 32);
+  omemoFreeMessageStream(st);
+  return r;
+}
+
+int omemoDecryptMessageInit(struct omemoPayloadStream *st,
+                            const uint8_t *key, size_t keyn,
+                            const uint8_t iv[12]) {
+  if (!st || !key || !iv)
+    return OMEMO_EPARAM;
+  if (keyn < 32 || keyn > sizeof(st->key))
+    return OMEMO_ECORRUPT;
+  memset(st, 0, sizeof(*st));
+  memcpy(st->key, key, keyn);
+  st->keyn = keyn;
+  return CheckStream(st, StartStream(st, iv, false));
+}
+
+int omemoDecryptMessageUpdate(struct omemoPayloadStream *st, uint8_t *d,
+                              size_t *outn, const uint8_t *s, size_t n) {
+  return omemoEncryptMessageUpdate(st, d, outn, s, n);
+}
+
+int omemoDecryptMessageFinal(struct omemoPayloadStream *st, uint8_t *d,
+                             size_t *outn) {
+  if (!st || !outn)
+    return OMEMO_EPARAM;
+  *outn = 0;
+  int r = omemoDriverAesGcmFinish(st->aes, st->key + 16, st->keyn - 16);
+  omemoFreeMessageStream(st);
+  return r;
+}
+#endif
+
 /************************** SERIALIZATION ****************************/
 
+// The format is the same in both versions, see core.c.
+
 size_t omemoGetSerializedStoreSize(const struct omemoStore *store) {
   if (!store)
     return 0;
-  size_t sum = 34 * 6 + (2 + 64) * 2 + 1 * 4 +
-               GetVarIntSize(store->init) +
-               GetVarIntSize(store->cursignedprekey.id) +
-               GetVarIntSize(store->prevsignedprekey.id) +
-               GetVarIntSize(store->pkcounter);
-  for (int i = 0; i < OMEMO_NUMPREKEYS; i++)
-    sum += 2 + 1 + GetVarIntSize(store->prekeys[i].id) + 2 * 34;
-  return sum;
+  return omemoCoreGetSerializedStoreSize((const omemoCoreStore *)store);
 }
 
 void omemoSerializeStore(uint8_t *p,
                                       const struct omemoStore *store) {
   if (!p || !store)
     return;
-  uint8_t *d = p;
-  d = FormatVarInt(d, PB_UINT32, 1, store->init);
-  d = FormatKey(d, 2, store->identity.prv);
-  d = FormatKey(d, 3, store->identity.pub);
-  d = FormatVarInt(d, PB_UINT32, 4, store->cursignedprekey.id);
-  d = FormatKey(d, 5, store->cursignedprekey.kp.prv);
-  d = FormatKey(d, 6, store->cursignedprekey.kp.pub);
-  d = FormatVarInt(d, PB_LEN, 7, 64);
-  d = (memcpy(d, store->cursignedprekey.sig, 64), d + 64);
-  d = FormatVarInt(d, PB_UINT32, 8, store->prevsignedprekey.id);
-  d = FormatKey(d, 9, store->prevsignedprekey.kp.prv);
-  d = FormatKey(d, 10, store->prevsignedprekey.kp.pub);
-  d = FormatVarInt(d, PB_LEN, 11, 64);
-  d = (memcpy(d, store->prevsignedprekey.sig, 64), d + 64);
-  d = FormatVarInt(d, PB_UINT32, 12, store->pkcounter);
-  for (int i = 0; i < OMEMO_NUMPREKEYS; i++) {
-    const struct omemoPreKey *pk = store->prekeys + i;
-    d = FormatVarInt(d, PB_LEN, 13, 1 + GetVarIntSize(pk->id) + 2 * 34);
-    d = FormatVarInt(d, PB_UINT32, 1, pk->id);
-    d = FormatKey(d, 2, pk->kp.prv);
-    d = FormatKey(d, 3, pk->kp.pub);
-  }
-  ASSERT(d - p == omemoGetSerializedStoreSize(store));
+  omemoCoreSerializeStore(p, (const omemoCoreStore *)store);
 }
 
 int omemoDeserializeStore(const uint8_t *p, size_t n,
                                        struct omemoStore *store) {
   if (!p || !store)
     return OMEMO_EPARAM;
-  struct ProtobufField fields[] = {
-      [1] = {PB_REQUIRED | PB_UINT32},
-      [2] = {PB_REQUIRED | PB_LEN, 32},
-      [3] = {PB_REQUIRED | PB_LEN, 32},
-      [4] = {PB_REQUIRED | PB_UINT32},
-      [5] = {PB_REQUIRED | PB_LEN, 32},
-      [6] = {PB_REQUIRED | PB_LEN, 32},
-      [7] = {PB_REQUIRED | PB_LEN, 64},
-      [8] = {PB_REQUIRED | PB_UINT32},
-      [9] = {PB_REQUIRED | PB_LEN, 32},
-      [10] = {PB_REQUIRED | PB_LEN, 32},
-      [11] = {PB_REQUIRED | PB_LEN, 64},
-      [12] = {PB_REQUIRED | PB_UINT32},
-      [13] = {/*PB_REQUIRED |*/ PB_LEN},
-  };
-  if (ParseProtobuf(p, n, fields, 14))
-    return OMEMO_EPROTOBUF;
-  store->init = fields[1].v;
-  memcpy(store->identity.prv, fields[2].p, 32);
-  memcpy(store->identity.pub, fields[3].p, 32);
-  store->cursignedprekey.id = fields[4].v;
-  memcpy(store->cursignedprekey.kp.prv, fields[5].p, 32);
-  memcpy(store->cursignedprekey.kp.pub, fields[6].p, 32);
-  memcpy(store->cursignedprekey.sig, fields[7].p, 64);
-  store->prevsignedprekey.id = fields[8].v;
-  memcpy(store->prevsignedprekey.kp.prv, fields[9].p, 32);
-  memcpy(store->prevsignedprekey.kp.pub, fields[10].p, 32);
-  memcpy(store->prevsignedprekey.sig, fields[11].p, 64);
-  store->pkcounter = fields[12].v;
-  const uint8_t *e = p + n;
-  int i = 0;
-  while (i < OMEMO_NUMPREKEYS &&
-         !ParseRepeatingField(p, e, &fields[13], 13) && fields[13].p) {
-    struct ProtobufField innerfields[] = {
-        [1] = {PB_REQUIRED | PB_UINT32},
-        [2] = {PB_REQUIRED | PB_LEN, 32},
-        [3] = {PB_REQUIRED | PB_LEN, 32},
-    };
-    if (ParseProtobuf(fields[13].p, fields[13].v, innerfields, 4))
-      return OMEMO_EPROTOBUF;
-    store->prekeys[i].id = innerfields[1].v;
-    memcpy(store->prekeys[i].kp.prv, innerfields[2].p, 32);
-    memcpy(store->prekeys[i].kp.pub, innerfields[3].p, 32);
-    i++;
-    p = fields[13].p + fields[13].v;
-    fields[13].v = 0, fields[13].p = NULL;
-  }
+  TRY(omemoCoreDeserializeStore(p, n, (omemoCoreStore *)store));
+  // Stores serialized by older versions don't have it.
+  if (!memcmp(store->identityalt, Zero32, 32))
+    DeriveIdentityAlt(store);
   return 0;
 }
 
@@ -1211,76 +1558,20 @@ size_t
 omemoGetSerializedSessionSize(const struct omemoSession *session) {
   if (!session)
     return 0;
-  return 34 * 9 // Key
-         + 1 * 6 + GetVarIntSize(session->state.ns) +
-         GetVarIntSize(session->state.nr) +
-         GetVarIntSize(session->state.pn) +
-         GetVarIntSize(session->usedpk_id) +
-         GetVarIntSize(session->usedspk_id) +
-         GetVarIntSize(session->init);
+  return omemoCoreGetSerializedSessionSize(
+      (const omemoCoreSession *)session);
 }
 
 void
 omemoSerializeSession(uint8_t *p, const struct omemoSession *session) {
   if (!p || !session)
     return;
-  uint8_t *d = p;
-  d = FormatKey(d, 1, session->remoteidentity);
-  d = FormatKey(d, 2, session->state.dhs.prv);
-  d = FormatKey(d, 3, session->state.dhs.pub);
-  d = FormatKey(d, 4, session->state.dhr);
-  d = FormatKey(d, 5, session->state.rk);
-  d = FormatKey(d, 6, session->state.cks);
-  d = FormatKey(d, 7, session->state.ckr);
-  d = FormatVarInt(d, PB_UINT32, 8, session->state.ns);
-  d = FormatVarInt(d, PB_UINT32, 9, session->state.nr);
-  d = FormatVarInt(d, PB_UINT32, 10, session->state.pn);
-  // TODO: don't have to include used* after first ratchet
-  d = FormatKey(d, 11, session->usedek);
-  d = FormatVarInt(d, PB_UINT32, 12, session->usedpk_id);
-  d = FormatVarInt(d, PB_UINT32, 13, session->usedspk_id);
-  d = FormatVarInt(d, PB_UINT32, 14, session->init);
-  d = FormatKey(d, 15, session->identity);
-  ASSERT(d - p == omemoGetSerializedSessionSize(session));
+  omemoCoreSerializeSession(p, (const omemoCoreSession *)session);
 }
 
 int omemoDeserializeSession(const uint8_t *p, size_t n,
                                          struct omemoSession *session) {
   if (!p || !session)
     return OMEMO_EPARAM;
-  struct ProtobufField fields[] = {
-      [1] = {PB_REQUIRED | PB_LEN, 32},
-      [2] = {PB_REQUIRED | PB_LEN, 32},
-      [3] = {PB_REQUIRED | PB_LEN, 32},
-      [4] = {PB_REQUIRED | PB_LEN, 32},
-      [5] = {PB_REQUIRED | PB_LEN, 32},
-      [6] = {PB_REQUIRED | PB_LEN, 32},
-      [7] = {PB_REQUIRED | PB_LEN, 32},
-      [8] = {PB_REQUIRED | PB_UINT32},
-      [9] = {PB_REQUIRED | PB_UINT32},
-      [10] = {PB_REQUIRED | PB_UINT32},
-      [11] = {PB_REQUIRED | PB_LEN, 32},
-      [12] = {PB_REQUIRED | PB_UINT32},
-      [13] = {PB_REQUIRED | PB_UINT32},
-      [14] = {PB_REQUIRED | PB_UINT32},
-      [15] = {PB_REQUIRED | PB_LEN, 32},
-  };
-  if (ParseProtobuf(p, n, fields, 16))
-    return OMEMO_EPROTOBUF;
-  memcpy(session->remoteidentity, fields[1].p, 32);
-  memcpy(session->state.dhs.prv, fields[2].p, 32);
-  memcpy(session->state.dhs.pub, fields[3].p, 32);
-  memcpy(session->state.dhr, fields[4].p, 32);
-  memcpy(session->state.rk, fields[5].p, 32);
-  memcpy(session->state.cks, fields[6].p, 32);
-  memcpy(session->state.ckr, fields[7].p, 32);
-  session->state.ns = fields[8].v;
-  session->state.nr = fields[9].v;
-  session->state.pn = fields[10].v;
-  memcpy(session->usedek, fields[11].p, 32);
-  session->usedpk_id = fields[12].v;
-  session->usedspk_id = fields[13].v;
-  session->init = fields[14].v;
-  memcpy(session->identity, fields[15].p, 32);
-  return 0;
+  return omemoCoreDeserializeSession(p, n, (omemoCoreSession *)session);
 }
@@ -28,6 +28,8 @@
 #endif
 
 #define OMEMO_NUMPREKEYS 100
+#define OMEMO_SIGCACHE_SIZE 64
+#define OMEMO_INTERNAL_VERIFYBATCH 16
 
 #define OMEMO_EPROTOBUF (-1)
 #define OMEMO_ECRYPTO   (-2)
@@ -39,6 +41,59 @@
 #define OMEMO_EUSER     (-8)
 #define OMEMO_ERANDOM   (-9)
 
+#define OMEMO_CPU_BMI2ADX   (1 << 0)
+#define OMEMO_CPU_AESNI     (1 << 1)
+#define OMEMO_CPU_ARMCRYPTO (1 << 2)
+
+#define OMEMO_DRIVER_CURVE 0
+#define OMEMO_DRIVER_AES   1
+#define OMEMO_DRIVER_HASH  2
+
+// Public functions that have a latency histogram in omemoStats.
+#define OMEMO_STAT_SETUPSTORE         0
+#define OMEMO_STAT_REFILLPREKEYS      1
+#define OMEMO_STAT_ROTATESIGNEDPREKEY 2
+#define OMEMO_STAT_VERIFYBUNDLES      3
+#define OMEMO_STAT_INITIATESESSION    4
+#define OMEMO_STAT_ENCRYPTKEY         5
+#define OMEMO_STAT_DECRYPTKEY         6
+#define OMEMO_STAT_ENCRYPTMESSAGE     7
+#define OMEMO_STAT_DECRYPTMESSAGE     8
+#define OMEMO_STAT_NUMAPIS            9
+#define OMEMO_STAT_NUMBUCKETS         40
+
+// Operations passed to the trace hooks, the driver primitives and the
+// user callbacks.
+#define OMEMO_TRACE_X25519            0
+#define OMEMO_TRACE_CVPRVTOPUB        1
+#define OMEMO_TRACE_CVPRVTOEDPUB      2
+#define OMEMO_TRACE_CVPUBTOEDPUB      3
+#define OMEMO_TRACE_EDPUBTOCVPUB      4
+#define OMEMO_TRACE_CVPUBTOEDPUBBATCH 5
+#define OMEMO_TRACE_EDPUBTOCVPUBBATCH 6
+#define OMEMO_TRACE_EDSEEDTOPUBPRV    7
+#define OMEMO_TRACE_EDSIGN            8
+#define OMEMO_TRACE_EDVERIFY          9
+#define OMEMO_TRACE_EDVERIFYBATCH     10
+#define OMEMO_TRACE_HMAC              11
+#define OMEMO_TRACE_HKDF              12
+#define OMEMO_TRACE_AESENCRYPT        13
+#define OMEMO_TRACE_AESDECRYPT        14
+#define OMEMO_TRACE_AESCBCHMAC        15
+#define OMEMO_TRACE_GCMENCRYPT        16
+#define OMEMO_TRACE_GCMDECRYPT        17
+#define OMEMO_TRACE_AESSETKEY         18
+#define OMEMO_TRACE_AESCBC            19
+#define OMEMO_TRACE_AESGCMSTART       20
+#define OMEMO_TRACE_AESGCMUPDATE      21
+#define OMEMO_TRACE_AESGCMFINISH      22
+#define OMEMO_TRACE_HMACSTART         23
+#define OMEMO_TRACE_HMACUPDATE        24
+#define OMEMO_TRACE_HMACFINISH        25
+#define OMEMO_TRACE_LOADMESSAGEKEY    26
+#define OMEMO_TRACE_STOREMESSAGEKEY   27
+#define OMEMO_TRACE_RANDOM            28
+
 #ifdef OMEMO2
 
 #define OMEMO_KEYSIZE                        48
@@ -71,6 +126,17 @@ typedef uint8_t omemoSerializedKey[1 + 32];
 #endif
 typedef uint8_t omemoCurveSignature[64];
 
+// Counters since the start of the program or the last reset, see
+// omemoGetStats.
+struct omemoStats {
+  uint64_t x25519, hmac, hkdf, aes;
+  uint64_t skippedstored, skippedloaded;
+  uint64_t ratchetsteps, prekeysused;
+  // latency[api][i] counts the calls to api that took less than 2^(i+1)
+  // ns and at least 2^i ns, the last bucket also counts slower ones.
+  uint64_t latency[OMEMO_STAT_NUMAPIS][OMEMO_STAT_NUMBUCKETS];
+};
+
 struct omemoKeyPair {
   omemoKey prv;
   omemoKey pub;
@@ -100,9 +166,12 @@ struct omemoState {
   uint32_t ns, nr, pn;
 };
 
+// Maximum size of an encrypted key message.
+#define OMEMO_KEYMESSAGE_MAXSIZE                                       \
+  (OMEMO_INTERNAL_PREKEYHEADER_MAXSIZE + OMEMO_INTERNAL_ENCRYPTED_MAXSIZE)
+
 struct omemoKeyMessage {
-  uint8_t p[OMEMO_INTERNAL_PREKEYHEADER_MAXSIZE +
-            OMEMO_INTERNAL_ENCRYPTED_MAXSIZE];
+  uint8_t p[OMEMO_KEYMESSAGE_MAXSIZE];
   size_t n;
   bool isprekey;
 };
@@ -110,15 +179,82 @@ struct omemoKeyMessage {
 struct omemoStore {
   bool init;
   struct omemoKeyPair identity;
+  // identity.pub as Ed25519 key for OMEMO 0.3 and as X25519 key for
+  // OMEMO 2, derived once so signing and X3DH don't convert it again.
+  omemoKey identityalt;
   struct omemoSignedPreKey cursignedprekey, prevsignedprekey;
   struct omemoPreKey prekeys[OMEMO_NUMPREKEYS];
   uint32_t pkcounter;
 };
 
+// Signed prekey part of a bundle, see omemoVerifyBundles.
+struct omemoBundle {
+  omemoCurveSignature spks;
+  omemoSerializedKey spk, ik;
+};
+
+// Hashes of recently verified bundle signatures, see
+// omemoSetSignatureCache.
+struct omemoSignatureCache {
+  omemoKey salt;
+  uint8_t entries[OMEMO_SIGCACHE_SIZE][16];
+  uint32_t next;
+};
+
+// Cipher key, MAC key and IV derived from a message key.
+struct omemoInternalDerivedKeys {
+  omemoKey cipher, mac;
+  uint8_t iv[16];
+};
+
+// The temporaries of the API calls, see omemoContext.
+struct omemoScratch {
+  uint8_t macinput[2 * sizeof(omemoSerializedKey) +
+                   OMEMO_INTERNAL_FULLMSG_MAXSIZE + 4];
+  uint8_t payload[OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE];
+  uint8_t secret[32 * 5];
+  uint8_t dh[32], masterkey[64];
+  omemoKey mk;
+  struct omemoInternalDerivedKeys kdfout[1];
+  struct omemoState state[1];
+  omemoCurveSignature sigs[OMEMO_INTERNAL_VERIFYBATCH];
+  omemoKey pubs[OMEMO_INTERNAL_VERIFYBATCH];
+  omemoKey alts[OMEMO_INTERNAL_VERIFYBATCH];
+  const uint8_t *iks[OMEMO_INTERNAL_VERIFYBATCH];
+  uint8_t msgs[OMEMO_INTERNAL_VERIFYBATCH][sizeof(omemoSerializedKey)];
+  uint8_t *msgp[OMEMO_INTERNAL_VERIFYBATCH];
+  size_t msgn[OMEMO_INTERNAL_VERIFYBATCH], idx[OMEMO_INTERNAL_VERIFYBATCH];
+  uint8_t hashes[OMEMO_INTERNAL_VERIFYBATCH][16];
+  bool cache[OMEMO_INTERNAL_VERIFYBATCH];
+};
+
+struct omemoDriverAes;
+struct omemoDriverHmac;
+
+// Memory the API calls of a thread work in, see omemoSetContext.
+struct omemoContext {
+  struct omemoScratch scratch;
+  struct omemoDriverAes *aes;
+  struct omemoDriverHmac *hmac;
+};
+
+// State of a streamed payload, see omemoEncryptMessageInit.
+struct omemoPayloadStream {
+  struct omemoDriverAes *aes;
+  struct omemoDriverHmac *hmac;
+  uint8_t key[48];
+  size_t keyn;
+  uint8_t iv[16], buf[16];
+  size_t bufn;
+};
+
 struct omemoSession {
   int init;
   omemoKey identity;
   omemoKey remoteidentity;
+  // Optional cached remoteidentity in the other curve form, zero when
+  // unknown.
+  omemoKey remoteidentityalt;
   struct omemoState state;
   omemoKey usedek;
   uint32_t usedpk_id, usedspk_id;
@@ -134,6 +270,10 @@ typedef int (*omemoStoreMessageKeyCallback)(
 
 typedef int (*omemoRandomCallback)(void *p, size_t n);
 
+// op is one of OMEMO_TRACE_*, session is the session of the API call
+// that caused it or NULL.
+typedef void (*omemoTraceCallback)(int op, struct omemoSession *session);
+
 int omemoLoadMessageKey(struct omemoSession *s,
                         struct omemoMessageKey *sk);
 
@@ -151,6 +291,104 @@ OMEMO_EXPORT void omemoSetCallbacks(omemoLoadMessageKeyCallback,
                                     omemoStoreMessageKeyCallback,
                                     omemoRandomCallback);
 
+/**
+ * Set global hooks that are called right before and after every driver
+ * primitive and every call to the callbacks above. Pass NULL to remove
+ * them, which leaves only a branch per call. Like omemoSetCallbacks
+ * they should be set before other threads use the library, the hooks
+ * themselves may be called from any thread.
+ */
+OMEMO_EXPORT void omemoSetTraceHooks(omemoTraceCallback begin,
+                                     omemoTraceCallback end);
+
+/**
+ * Initialize an empty signature cache with a random salt.
+ *
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int
+omemoSetupSignatureCache(struct omemoSignatureCache *cache);
+
+/**
+ * Remember verified signed prekey signatures in cache, so that
+ * omemoInitiateSession and omemoVerifyBundles don't verify the same
+ * bundle twice. Calling omemoVerifyBundles warms the cache. The cache
+ * contains no pointers, so it can be saved to disk and loaded again as
+ * is. Pass NULL to stop using it. Like omemoSetCallbacks this is global,
+ * so the cache must not be used from multiple threads at once.
+ */
+OMEMO_EXPORT void
+omemoSetSignatureCache(struct omemoSignatureCache *cache);
+
+/**
+ * Create the driver objects of ctx. This is the only allocation, the
+ * API calls made with ctx set reuse them and keep all their
+ * temporaries in ctx->scratch, so nothing is allocated or left on the
+ * stack while encrypting or decrypting.
+ *
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoSetupContext(struct omemoContext *ctx);
+
+/**
+ * Destroy the driver objects of ctx and wipe it, which also clears the
+ * leftover key material of all calls made with it.
+ */
+OMEMO_EXPORT void omemoFreeContext(struct omemoContext *ctx);
+
+/**
+ * Use ctx for the API calls made by this thread, NULL goes back to the
+ * stack and the one-shot driver functions. Every thread needs its own
+ * context and the callbacks must not call into the library. When the
+ * library is compiled with -DOMEMO_SMALLSTACK the calls fail with
+ * OMEMO_ESTATE until a context is set. GCM payloads are not split over
+ * the threads of omemoSetGcmThreads while a context is set.
+ */
+OMEMO_EXPORT void omemoSetContext(struct omemoContext *ctx);
+
+/**
+ * @returns OMEMO_CPU_* features that are detected on this CPU and not
+ * disabled with omemoSetCpuFeatures()
+ */
+OMEMO_EXPORT uint32_t omemoGetCpuFeatures(void);
+
+/**
+ * Only allow the drivers to use the OMEMO_CPU_* features in mask, 0
+ * forces the portable implementations. This is shared between OMEMO
+ * versions and should not be called while other threads are using the
+ * library.
+ */
+OMEMO_EXPORT void omemoSetCpuFeatures(uint32_t mask);
+
+#ifndef OMEMO2
+/**
+ * Split AES-GCM of payloads of at least threshold bytes over n threads,
+ * the output is the same as with one thread (the default). Only the
+ * in-tree AES driver (aes.c) does this, other drivers ignore it. Like
+ * omemoSetCpuFeatures it should not be called while other threads are
+ * using the library.
+ */
+OMEMO_EXPORT void omemoSetGcmThreads(int n, size_t threshold);
+#endif
+
+/**
+ * @param kind is one of OMEMO_DRIVER_*
+ * @returns name of the implementation currently used for kind, or NULL
+ */
+OMEMO_EXPORT const char *omemoGetDriverImpl(int kind);
+
+/**
+ * Copy the operation counters and latency histograms to stats and
+ * optionally reset them. They are only collected when the library is
+ * compiled with -DOMEMO_STATS, the counters are atomic but a snapshot
+ * taken while other threads use the library may be slightly
+ * inconsistent. InitiateVerifiedSession is counted as InitiateSession
+ * and EncryptKeyTo as EncryptKey.
+ *
+ * @returns 0 or OMEMO_ESTATE if statistics are compiled out
+ */
+OMEMO_EXPORT int omemoGetStats(struct omemoStats *stats, bool reset);
+
 /**
  * Serialize a raw public key into the OMEMO public key format.
  */
@@ -231,6 +469,44 @@ OMEMO_EXPORT int omemoInitiateSession(struct omemoSession *session,
                                       const omemoSerializedKey pk,
                                       uint32_t spk_id, uint32_t pk_id);
 
+/**
+ * Verify the signed prekey signatures of n bundles at once, which is
+ * faster than letting omemoInitiateSession verify them one by one.
+ * Sessions can then be started with omemoInitiateVerifiedSession for the
+ * bundles where ok[i] is true.
+ *
+ * @param ok receives for each bundle whether its signature is valid
+ * @returns 0, OMEMO_ECORRUPT if any signature is invalid or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoVerifyBundles(const struct omemoBundle *bundles,
+                                    bool *ok, size_t n);
+
+/**
+ * Set the remote identity key of n sessions at once, iks[i] for
+ * sessions[i]. The converted forms of the keys that are cached in the
+ * sessions are computed together, which is faster than letting
+ * omemoInitiateSession or omemoDecryptKey do it for each device. Use it
+ * when importing the devices of a roster. Sessions that are already
+ * initialized must have the same remote identity.
+ *
+ * @returns 0, OMEMO_ESTATE when an identity doesn't match or OMEMO_E*
+ */
+OMEMO_EXPORT int
+omemoImportRemoteIdentities(struct omemoSession **sessions,
+                            const omemoSerializedKey *iks, size_t n);
+
+/**
+ * Same as omemoInitiateSession, but without verifying the signature of
+ * the signed prekey. Only use for bundles that passed
+ * omemoVerifyBundles.
+ *
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoInitiateVerifiedSession(
+    struct omemoSession *session, const struct omemoStore *store,
+    const omemoSerializedKey spk, const omemoSerializedKey ik,
+    const omemoSerializedKey pk, uint32_t spk_id, uint32_t pk_id);
+
 /**
  * Encrypt message encryption key payload for a specific recipient.
  *
@@ -239,6 +515,30 @@ OMEMO_EXPORT int omemoInitiateSession(struct omemoSession *session,
 OMEMO_EXPORT int omemoEncryptKey(struct omemoSession *session,
                                  struct omemoKeyMessage *msg,
                                  const uint8_t *key, size_t keyn);
+
+/**
+ * Same as omemoEncryptKey, but the message is written directly to d,
+ * e.g. a buffer shared by the messages for all recipients.
+ *
+ * @param dn is the size of d and is set to the size of the message,
+ * which is omemoGetKeyMessageSize() and at most
+ * OMEMO_KEYMESSAGE_MAXSIZE
+ * @param isprekey is set like omemoKeyMessage.isprekey
+ * @returns 0 or OMEMO_E*, OMEMO_EPARAM if d is too small
+ */
+OMEMO_EXPORT int omemoEncryptKeyTo(struct omemoSession *session,
+                                   uint8_t *d, size_t *dn,
+                                   bool *isprekey, const uint8_t *key,
+                                   size_t keyn);
+
+/**
+ * @returns the size of the message the next omemoEncryptKey or
+ * omemoEncryptKeyTo call writes for a key of keyn bytes, 0 when session
+ * is NULL
+ */
+OMEMO_EXPORT size_t
+omemoGetKeyMessageSize(const struct omemoSession *session, size_t keyn);
+
 /**
  * Decrypt message encryption key payload for a specific recipient.
  *
@@ -274,13 +574,17 @@ OMEMO_EXPORT int omemoHeartbeat(struct omemoSession *session,
                                 struct omemoKeyMessage *msg);
 
 #ifdef OMEMO2
-#define omemoGetMessagePadSize(n) (16 - (n % 16))
+#define omemoGetMessagePadSize(n) (16 - ((n) % 16))
 /**
  * Encrypt message which will be stored in the <payload> element.
  *
+ * The ciphertext is n + omemoGetMessagePadSize(n) bytes. d may be s to
+ * encrypt in place, then no other buffer is needed.
+ *
  * @param key (out) will contain the encryption key
  * @param s is a mutable buffer containing the plaintext message with
- * `omemoGetMessagePadSize(n)` amount of bytes reserved at the end
+ * `omemoGetMessagePadSize(n)` amount of bytes reserved at the end, the
+ * padding is written there
  * @param d is the destination buffer that is the same size as s
  * @param n is the original message size
  *
@@ -292,6 +596,9 @@ OMEMO_EXPORT int omemoEncryptMessage(uint8_t *d, uint8_t key[48],
 /**
  * Encrypt message which will be stored in the <payload> element.
  *
+ * The ciphertext is as large as the plaintext. d may be s to encrypt in
+ * place.
+ *
  * @param key (out) will contain the encryption key
  * @param n is the size of the buffer in d and s
  *
@@ -306,6 +613,10 @@ OMEMO_EXPORT int omemoEncryptMessage(uint8_t *d, uint8_t key[32],
 /**
  * Decrypt message taken from the <payload> element.
  *
+ * d may be s to decrypt in place. The padding in d is zeroed, and all of
+ * d when the MAC does not match.
+ *
+ * @param outn (out) will contain the size of the plaintext in d
  * @param key is the decrypted key of the omemoKeyMessage
  * @param keyn is the size of key
  * @param n is the size of the buffer in d and s
@@ -319,6 +630,9 @@ OMEMO_EXPORT int omemoDecryptMessage(uint8_t *d, size_t *outn,
 /**
  * Decrypt message taken from the <payload> element.
  *
+ * d may be s to decrypt in place. If the tag does not match, d should
+ * be discarded as it might be partly written.
+ *
  * @param key is the decrypted key of the omemoKeyMessage
  * @param keyn is the size of key, some clients might make the tag
  * larger than 16 bytes
@@ -331,4 +645,122 @@ OMEMO_EXPORT int omemoDecryptMessage(uint8_t *d, const uint8_t *key,
                                      const uint8_t *s, size_t n);
 #endif
 
+#ifdef OMEMO2
+/**
+ * Start encrypting a payload in pieces, for when it does not fit in
+ * memory at once. Call omemoEncryptMessageUpdate for each piece and
+ * finish with omemoEncryptMessageFinal. The result is the same as
+ * omemoEncryptMessage over the concatenated pieces.
+ *
+ * If any of the streaming functions fails, the stream is freed.
+ * omemoFreeMessageStream must be called only when a stream is abandoned
+ * before Final.
+ *
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoEncryptMessageInit(struct omemoPayloadStream *st);
+#else
+/**
+ * Start encrypting a payload in pieces, for when it does not fit in
+ * memory at once. Call omemoEncryptMessageUpdate for each piece and
+ * finish with omemoEncryptMessageFinal. The result is the same as
+ * omemoEncryptMessage over the concatenated pieces.
+ *
+ * If any of the streaming functions fails, the stream is freed.
+ * omemoFreeMessageStream must be called only when a stream is abandoned
+ * before Final.
+ *
+ * @param iv (out) will contain the IV
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoEncryptMessageInit(struct omemoPayloadStream *st,
+                                         uint8_t iv[12]);
+#endif
+
+/**
+ * Encrypt the next n bytes of the payload.
+ *
+ * For OMEMO 0.3 n bytes are written to d and d may be s. For OMEMO 2
+ * the output is whole blocks, d must have room for n + 15 bytes and
+ * must not overlap s.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoEncryptMessageUpdate(struct omemoPayloadStream *st,
+                                           uint8_t *d, size_t *outn,
+                                           const uint8_t *s, size_t n);
+
+/**
+ * Finish the payload and free the stream. For OMEMO 2 the last 16 bytes
+ * are written to d, for OMEMO 0.3 nothing.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @param key (out) will contain the encryption key, like with
+ * omemoEncryptMessage
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoEncryptMessageFinal(struct omemoPayloadStream *st,
+                                          uint8_t *d, size_t *outn,
+                                          uint8_t key[OMEMO_KEYSIZE]);
+
+#ifdef OMEMO2
+/**
+ * Start decrypting a payload in pieces, see omemoEncryptMessageInit.
+ *
+ * The payload is only authenticated by omemoDecryptMessageFinal, the
+ * output of omemoDecryptMessageUpdate must not be used before it
+ * succeeds.
+ *
+ * @param key is the decrypted key of the omemoKeyMessage
+ * @param keyn is the size of key
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoDecryptMessageInit(struct omemoPayloadStream *st,
+                                         const uint8_t *key, size_t keyn);
+#else
+/**
+ * Start decrypting a payload in pieces, see omemoEncryptMessageInit.
+ *
+ * The payload is only authenticated by omemoDecryptMessageFinal, the
+ * output of omemoDecryptMessageUpdate must not be used before it
+ * succeeds.
+ *
+ * @param key is the decrypted key of the omemoKeyMessage
+ * @param keyn is the size of key
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoDecryptMessageInit(struct omemoPayloadStream *st,
+                                         const uint8_t *key, size_t keyn,
+                                         const uint8_t iv[12]);
+#endif
+
+/**
+ * Decrypt the next n bytes of the payload, with the same buffer rules
+ * as omemoEncryptMessageUpdate. For OMEMO 2 the last block is held back
+ * until omemoDecryptMessageFinal.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO_E*
+ */
+OMEMO_EXPORT int omemoDecryptMessageUpdate(struct omemoPayloadStream *st,
+                                           uint8_t *d, size_t *outn,
+                                           const uint8_t *s, size_t n);
+
+/**
+ * Check the payload and free the stream. For OMEMO 2 the rest of the
+ * plaintext, at most 15 bytes, is written to d, for OMEMO 0.3 nothing.
+ *
+ * @param outn (out) will contain the amount of bytes written to d
+ * @returns 0 or OMEMO_E*, in which case the whole output must be
+ * discarded
+ */
+OMEMO_EXPORT int omemoDecryptMessageFinal(struct omemoPayloadStream *st,
+                                          uint8_t *d, size_t *outn);
+
+/**
+ * Free a stream that is not finished.
+ */
+OMEMO_EXPORT void omemoFreeMessageStream(struct omemoPayloadStream *st);
+
 #endif
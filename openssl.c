@@ -16,6 +16,10 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <openssl/kdf.h>
@@ -25,55 +29,126 @@
 
 #define TRY(r) do { if ((r) != 1) goto a; } while (0)
 
-int omemoDriverHmac(const omemoKey k, const uint8_t *in, size_t ilen, uint8_t out[static 32]) {
-  size_t len;
+// The one-shot functions use one HMAC context and, without aes.c, one
+// AES context per thread, freed when the thread exits, so they are only
+// allocated once. The key is wiped from them after every call.
+static pthread_key_t hmackey, aeskey;
+static pthread_once_t cacheonce = PTHREAD_ONCE_INIT;
+
+static void FreeHmacCache(void *p) {
+  omemoDriverHmacDestroy(p);
+}
+
+static void FreeAesCache(void *p) {
+  omemoDriverAesDestroy(p);
+}
+
+static void CreateCacheKeys(void) {
+  pthread_key_create(&hmackey, FreeHmacCache);
+  pthread_key_create(&aeskey, FreeAesCache);
+}
+
+struct omemoDriverHmac {
+  EVP_MAC *mac;
+  EVP_MAC_CTX *ctx;
+};
+
+struct omemoDriverHmac *omemoDriverHmacCreate(void) {
+  struct omemoDriverHmac *hmac = calloc(1, sizeof(struct omemoDriverHmac));
+  if (!hmac)
+    return NULL;
+  if (!(hmac->mac = EVP_MAC_fetch(NULL, "HMAC", NULL)) ||
+      !(hmac->ctx = EVP_MAC_CTX_new(hmac->mac))) {
+    omemoDriverHmacDestroy(hmac);
+    return NULL;
+  }
+  return hmac;
+}
+
+void omemoDriverHmacDestroy(struct omemoDriverHmac *hmac) {
+  if (hmac) {
+    EVP_MAC_CTX_free(hmac->ctx);
+    EVP_MAC_free(hmac->mac);
+    free(hmac);
+  }
+}
+
+int omemoDriverHmacStart(struct omemoDriverHmac *hmac, const omemoKey k) {
   int r = OMEMO_ECRYPTO;
-  EVP_MAC *mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
-  if (!mac) goto c;
-  EVP_MAC_CTX *ctx = EVP_MAC_CTX_new(mac);
-  if (!ctx) goto b;
   OSSL_PARAM params[] = {
 	OSSL_PARAM_construct_utf8_string("digest", "SHA256", 0),
 	OSSL_PARAM_END
   };
-  TRY(EVP_MAC_init(ctx, k, 32, params));
-  TRY(EVP_MAC_update(ctx, in, ilen));
-  TRY(EVP_MAC_final(ctx, out, &len, 32));
-  TRY(len == 32);
+  TRY(EVP_MAC_init(hmac->ctx, k, 32, params));
   r = 0;
-a:EVP_MAC_CTX_free(ctx);
-b:EVP_MAC_free(mac);
-c:return r;
+a:return r;
 }
 
-int omemoDriverAesEncrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
-  int len, r = OMEMO_ECRYPTO;
-  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-  if (!ctx) goto b;
-  TRY(EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, k, iv));
-  TRY(EVP_CIPHER_CTX_set_padding(ctx, 0));
-  TRY(EVP_EncryptUpdate(ctx, d, &len, s, n));
-  TRY(len == n);
-  TRY(EVP_EncryptFinal_ex(ctx, d + len, &len));
-  TRY(len == 0);
-  r = 0;
-a:EVP_CIPHER_CTX_free(ctx);
-b:return r;
+int omemoDriverHmacUpdate(struct omemoDriverHmac *hmac, const uint8_t *in, size_t n) {
+  return EVP_MAC_update(hmac->ctx, in, n) == 1 ? 0 : OMEMO_ECRYPTO;
 }
 
-int omemoDriverAesDecrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
-  int len, r = OMEMO_ECRYPTO;
-  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-  if (!ctx) goto b;
-  TRY(EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, k, iv));
-  TRY(EVP_CIPHER_CTX_set_padding(ctx, 0));
-  TRY(EVP_DecryptUpdate(ctx, d, &len, s, n));
-  TRY(len == n);
-  TRY(EVP_DecryptFinal_ex(ctx, d + len, &len));
-  TRY(len == 0);
+int omemoDriverHmacFinish(struct omemoDriverHmac *hmac, uint8_t out[static 32]) {
+  size_t len;
+  int r = OMEMO_ECRYPTO;
+  TRY(EVP_MAC_final(hmac->ctx, out, &len, 32));
+  TRY(len == 32);
   r = 0;
-a:EVP_CIPHER_CTX_free(ctx);
-b:return r;
+a:return r;
+}
+
+static struct omemoDriverHmac *GetCachedHmac(void) {
+  struct omemoDriverHmac *hmac;
+  pthread_once(&cacheonce, CreateCacheKeys);
+  if (!(hmac = pthread_getspecific(hmackey))) {
+    if (!(hmac = omemoDriverHmacCreate()))
+      return NULL;
+    if (pthread_setspecific(hmackey, hmac)) {
+      omemoDriverHmacDestroy(hmac);
+      return NULL;
+    }
+  }
+  return hmac;
+}
+
+// Returns r after replacing the key in the cached context with zeros.
+static int UncacheHmac(struct omemoDriverHmac *hmac, int r) {
+  static const omemoKey zero;
+  EVP_MAC_init(hmac->ctx, zero, 32, NULL);
+  return r;
+}
+
+int omemoDriverHmac(const omemoKey k, const uint8_t *in, size_t ilen, uint8_t out[static 32]) {
+  struct omemoDriverHmac *hmac = GetCachedHmac();
+  int r;
+  if (!hmac)
+    return OMEMO_ECRYPTO;
+  if (!(r = omemoDriverHmacStart(hmac, k)) &&
+      !(r = omemoDriverHmacUpdate(hmac, in, ilen)))
+    r = omemoDriverHmacFinish(hmac, out);
+  return UncacheHmac(hmac, r);
+}
+
+int omemoDriverAesCbcHmac(const omemoKey k, const omemoKey mk, bool enc, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d, uint8_t mac[static 32]) {
+  struct omemoDriverHmac *hmac = GetCachedHmac();
+  omemoKey key;
+  int r = OMEMO_ECRYPTO;
+  if (!hmac)
+    return r;
+  memcpy(key, k, 32);
+  if (n % 16 || omemoDriverHmacStart(hmac, mk))
+    goto a;
+  for (size_t i = 0, m; i < n; i += m) {
+    m = n - i < OMEMODRIVER_CHUNKSIZE ? n - i : OMEMODRIVER_CHUNKSIZE;
+    if (enc ? omemoDriverAesEncrypt(key, m, iv, s + i, d + i) ||
+                  omemoDriverHmacUpdate(hmac, d + i, m)
+            : omemoDriverHmacUpdate(hmac, s + i, m) ||
+                  omemoDriverAesDecrypt(key, m, iv, s + i, d + i))
+      goto a;
+  }
+  r = omemoDriverHmacFinish(hmac, mac);
+a:memset(key, 0, 32);
+  return UncacheHmac(hmac, r);
 }
 
 int omemoDriverHkdf(const uint8_t *salt, size_t saltn, const uint8_t *key, size_t keyn, const uint8_t *info, size_t infon, uint8_t *out, size_t outn) {
@@ -96,39 +171,212 @@ b:EVP_KDF_free(kdf);
 c:return r;
 }
 
-int omemoDriverGcmEncrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s) {
+// aes.c provides these
+#ifndef OMEMO_INTREE_AES
+
+const char *omemoDriverAesImpl(void) {
+  return "openssl";
+}
+
+enum { MODE_NONE, MODE_CBCENC, MODE_CBCDEC, MODE_GCM };
+
+struct omemoDriverAes {
+  EVP_CIPHER_CTX *ctx;
+  int mode;
+  bool enc;
+  uint8_t k[32];
+};
+
+struct omemoDriverAes *omemoDriverAesCreate(void) {
+  struct omemoDriverAes *aes = calloc(1, sizeof(struct omemoDriverAes));
+  if (aes && !(aes->ctx = EVP_CIPHER_CTX_new())) {
+    free(aes);
+    return NULL;
+  }
+  return aes;
+}
+
+void omemoDriverAesDestroy(struct omemoDriverAes *aes) {
+  if (aes) {
+    EVP_CIPHER_CTX_free(aes->ctx);
+    OPENSSL_cleanse(aes, sizeof(*aes));
+    free(aes);
+  }
+}
+
+// The cipher is only fetched when the mode changes and the key is only
+// expanded when it is different from the previous one.
+static int SetKey(struct omemoDriverAes *aes, int mode, const uint8_t *k, size_t kn) {
+  int r = OMEMO_ECRYPTO;
+  if (aes->mode == mode && !CRYPTO_memcmp(aes->k, k, kn))
+    return 0;
+  const EVP_CIPHER *cipher = NULL;
+  if (aes->mode != mode)
+    cipher = mode == MODE_GCM ? EVP_aes_128_gcm() : EVP_aes_256_cbc();
+  aes->mode = MODE_NONE;
+  TRY(EVP_CipherInit_ex(aes->ctx, cipher, NULL, NULL, NULL, mode != MODE_CBCDEC));
+  if (mode == MODE_GCM)
+    TRY(EVP_CIPHER_CTX_ctrl(aes->ctx, EVP_CTRL_GCM_SET_IVLEN, 12, NULL));
+  else
+    TRY(EVP_CIPHER_CTX_set_padding(aes->ctx, 0));
+  TRY(EVP_CipherInit_ex(aes->ctx, NULL, NULL, k, NULL, -1));
+  memcpy(aes->k, k, kn);
+  aes->mode = mode;
+  r = 0;
+a:return r;
+}
+
+int omemoDriverAesSetKey(struct omemoDriverAes *aes, const omemoKey k, bool enc) {
+  return SetKey(aes, enc ? MODE_CBCENC : MODE_CBCDEC, k, 32);
+}
+
+int omemoDriverAesCbc(struct omemoDriverAes *aes, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  int len, r = OMEMO_ECRYPTO;
+  TRY(aes->mode == MODE_CBCENC || aes->mode == MODE_CBCDEC);
+  TRY(n % 16 == 0);
+  TRY(EVP_CipherInit_ex(aes->ctx, NULL, NULL, NULL, iv, -1));
+  TRY(EVP_CipherUpdate(aes->ctx, d, &len, s, n));
+  TRY(len == n);
+  TRY(EVP_CIPHER_CTX_get_updated_iv(aes->ctx, iv, 16));
+  r = 0;
+a:return r;
+}
+
+int omemoDriverAesSetGcmKey(struct omemoDriverAes *aes, const uint8_t k[static 16]) {
+  return SetKey(aes, MODE_GCM, k, 16);
+}
+
+int omemoDriverAesGcmEncrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s) {
   int len, r = OMEMO_ECRYPTO;
-  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-  if (!ctx) goto b;
-  TRY(EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL));
-  TRY(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 12, NULL));
-  TRY(EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv));
-  TRY(EVP_EncryptUpdate(ctx, d, &len, s, n));
+  TRY(aes->mode == MODE_GCM);
+  TRY(EVP_CipherInit_ex(aes->ctx, NULL, NULL, NULL, iv, 1));
+  TRY(EVP_EncryptUpdate(aes->ctx, d, &len, s, n));
   TRY(len == n);
-  TRY(EVP_EncryptFinal_ex(ctx, d + len, &len));
+  TRY(EVP_EncryptFinal_ex(aes->ctx, d + len, &len));
   TRY(len == 0);
-  TRY(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, (void*)tag));
+  TRY(EVP_CIPHER_CTX_ctrl(aes->ctx, EVP_CTRL_GCM_GET_TAG, 16, (void*)tag));
   r = 0;
-a:EVP_CIPHER_CTX_free(ctx);
-b:return r;
+a:return r;
 }
 
-int omemoDriverGcmDecrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s) {
+int omemoDriverAesGcmDecrypt(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s) {
   int len, r = OMEMO_ECRYPTO;
-  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-  if (!ctx) goto b;
-  TRY(EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL));
-  TRY(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 12, NULL));
-  TRY(EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv));
-  TRY(EVP_DecryptUpdate(ctx, NULL, &len, "", 0));
-  TRY(EVP_DecryptUpdate(ctx, d, &len, s, n));
+  TRY(aes->mode == MODE_GCM);
+  TRY(EVP_CipherInit_ex(aes->ctx, NULL, NULL, NULL, iv, 0));
+  TRY(EVP_DecryptUpdate(aes->ctx, NULL, &len, "", 0));
+  TRY(EVP_DecryptUpdate(aes->ctx, d, &len, s, n));
   TRY(len == n);
-  TRY(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tagn, (void*)tag));
-  TRY(EVP_DecryptFinal_ex(ctx, d + len, &len));
+  TRY(EVP_CIPHER_CTX_ctrl(aes->ctx, EVP_CTRL_GCM_SET_TAG, tagn, (void*)tag));
+  TRY(EVP_DecryptFinal_ex(aes->ctx, d + len, &len));
   TRY(len == 0);
   r = 0;
-a:EVP_CIPHER_CTX_free(ctx);
-b:return r;
+a:return r;
+}
+
+// GCM is not split over threads here.
+void omemoDriverSetGcmThreads(int n, size_t threshold) {
+  (void)n, (void)threshold;
+}
+
+int omemoDriverAesGcmStart(struct omemoDriverAes *aes, const uint8_t iv[static 12], bool enc) {
+  int len, r = OMEMO_ECRYPTO;
+  TRY(aes->mode == MODE_GCM);
+  TRY(EVP_CipherInit_ex(aes->ctx, NULL, NULL, NULL, iv, enc));
+  if (!enc)
+    TRY(EVP_DecryptUpdate(aes->ctx, NULL, &len, "", 0));
+  aes->enc = enc;
+  r = 0;
+a:return r;
+}
+
+int omemoDriverAesGcmUpdate(struct omemoDriverAes *aes, uint8_t *d, size_t n, const uint8_t *s) {
+  int len, r = OMEMO_ECRYPTO;
+  TRY(aes->mode == MODE_GCM);
+  TRY(EVP_CipherUpdate(aes->ctx, d, &len, s, n));
+  TRY(len == n);
+  r = 0;
+a:return r;
+}
+
+int omemoDriverAesGcmFinish(struct omemoDriverAes *aes, uint8_t *tag, size_t tagn) {
+  int len, r = OMEMO_ECRYPTO;
+  uint8_t end[16];
+  TRY(aes->mode == MODE_GCM);
+  if (aes->enc) {
+    TRY(EVP_EncryptFinal_ex(aes->ctx, end, &len));
+    TRY(len == 0);
+    TRY(EVP_CIPHER_CTX_ctrl(aes->ctx, EVP_CTRL_GCM_GET_TAG, tagn, (void*)tag));
+  } else {
+    TRY(EVP_CIPHER_CTX_ctrl(aes->ctx, EVP_CTRL_GCM_SET_TAG, tagn, (void*)tag));
+    TRY(EVP_DecryptFinal_ex(aes->ctx, end, &len));
+    TRY(len == 0);
+  }
+  r = 0;
+a:return r;
+}
+
+static struct omemoDriverAes *GetCached(void) {
+  struct omemoDriverAes *aes;
+  pthread_once(&cacheonce, CreateCacheKeys);
+  if (!(aes = pthread_getspecific(aeskey))) {
+    if (!(aes = omemoDriverAesCreate()))
+      return NULL;
+    if (pthread_setspecific(aeskey, aes)) {
+      omemoDriverAesDestroy(aes);
+      return NULL;
+    }
+  }
+  return aes;
+}
+
+// Returns r after clearing the key from the cached context.
+static int Uncache(struct omemoDriverAes *aes, int r) {
+  EVP_CIPHER_CTX_reset(aes->ctx);
+  OPENSSL_cleanse(aes->k, sizeof(aes->k));
+  aes->mode = MODE_NONE;
+  return r;
+}
+
+int omemoDriverAesEncrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  struct omemoDriverAes *aes = GetCached();
+  if (!aes)
+    return OMEMO_ECRYPTO;
+  if (omemoDriverAesSetKey(aes, k, true))
+    return Uncache(aes, OMEMO_ECRYPTO);
+  return Uncache(aes, omemoDriverAesCbc(aes, n, iv, s, d));
+}
+
+int omemoDriverAesDecrypt(omemoKey k, size_t n, uint8_t iv[static 16], const uint8_t *s, uint8_t *d) {
+  struct omemoDriverAes *aes = GetCached();
+  if (!aes)
+    return OMEMO_ECRYPTO;
+  if (omemoDriverAesSetKey(aes, k, false))
+    return Uncache(aes, OMEMO_ECRYPTO);
+  return Uncache(aes, omemoDriverAesCbc(aes, n, iv, s, d));
+}
+
+int omemoDriverGcmEncrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], uint8_t tag[static 16], const uint8_t *s) {
+  struct omemoDriverAes *aes = GetCached();
+  if (!aes)
+    return OMEMO_ECRYPTO;
+  if (omemoDriverAesSetGcmKey(aes, key))
+    return Uncache(aes, OMEMO_ECRYPTO);
+  return Uncache(aes, omemoDriverAesGcmEncrypt(aes, d, n, iv, tag, s));
+}
+
+int omemoDriverGcmDecrypt(uint8_t *d, const uint8_t key[static 16], size_t n, const uint8_t iv[static 12], const uint8_t *tag, size_t tagn, const uint8_t *s) {
+  struct omemoDriverAes *aes = GetCached();
+  if (!aes)
+    return OMEMO_ECRYPTO;
+  if (omemoDriverAesSetGcmKey(aes, key))
+    return Uncache(aes, OMEMO_ECRYPTO);
+  return Uncache(aes, omemoDriverAesGcmDecrypt(aes, d, n, iv, tag, tagn, s));
+}
+
+#endif
+
+const char *omemoDriverHashImpl(void) {
+  return "openssl";
 }
 
 int omemoDriverCompare(const void *a, const void *b, size_t n) {
@@ -1,7 +1,13 @@
 #!/bin/sh
 set -ex
 V="valgrind --tool=memcheck --track-origins=yes --error-exitcode=1"
-TESTRUNTOOL="$V" DRIVERS="hacl.c   mbedtls.c" make clean test-omemo test-omemo2
-TESTRUNTOOL="$V" DRIVERS="c25519.c mbedtls.c" make clean test-omemo test-omemo2
-TESTRUNTOOL="$V" DRIVERS="hacl.c   openssl.c" make clean test-omemo test-omemo2
-TESTRUNTOOL="$V" DRIVERS="c25519.c openssl.c" make clean test-omemo test-omemo2
+TESTRUNTOOL="$V" DRIVERS="hacl.c   mbedtls.c" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="c25519.c mbedtls.c" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="hacl.c   openssl.c" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="hacl.c   openssl.c" CFLAGS="-O2 -g -DOMEMO_CURVE64" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="c25519.c openssl.c" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="hacl.c   openssl.c aes.c" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="c25519.c mbedtls.c aes.c" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="c25519.c openssl.c" CFLAGS="-O2 -g -DOMEMO_C25519_LIMBS" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="hacl.c   openssl.c" CFLAGS="-O2 -g -DOMEMO_SMALLSTACK -DOMEMO0_SMALLSTACK -DOMEMO2_SMALLSTACK" make clean lib test-omemo test-omemo2 test-dual
+TESTRUNTOOL="$V" DRIVERS="hacl.c   openssl.c" CFLAGS="-O2 -g -DOMEMO_INLINECORE -DOMEMO0_INLINECORE -DOMEMO2_INLINECORE" make clean lib test-omemo test-omemo2 test-dual
@@ -0,0 +1,236 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Benchmarks of the public API, built by `make bench` for every driver
+// combination. See bench.h for the options.
+//
+// $ o/bench-hacl-openssl [-r repeats] [-t ms] [-o file.csv] [filter]
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "omemo.h"
+#include "bench.h"
+
+#ifdef OMEMO2
+#define VERSION "2"
+#else
+#define VERSION "0.3"
+#endif
+
+#define PAYLOADSIZE 1024
+#define NUMSKIP     50
+
+// Skipped message keys are thrown away, nothing is ever found.
+static int LoadMessageKey(struct omemoSession *s, struct omemoMessageKey *k) {
+  return 1;
+}
+
+static int StoreMessageKey(struct omemoSession *s,
+                           const struct omemoMessageKey *k, uint64_t n) {
+  return 0;
+}
+
+static struct omemoStore storea, storeb, tmpstore;
+static struct omemoSession sessiona, sessionb, tmpsession;
+// sessionb before receiving ratchetmsg and before normalmsg
+static struct omemoSession sessionb0, sessionb1;
+static struct omemoKeyMessage prekeymsg, ratchetmsg, normalmsg, skipmsg;
+static omemoSerializedKey spk, ik, pk;
+static struct omemoBundle bundle;
+static uint8_t *storebuf, *sessionbuf;
+static size_t storebufn, sessionbufn;
+// OMEMO 2 writes the padding after the plaintext.
+static uint8_t payload[PAYLOADSIZE + 16], encpayload[PAYLOADSIZE + 16],
+    decpayload[PAYLOADSIZE + 16], key[OMEMO_KEYSIZE];
+#ifndef OMEMO2
+static uint8_t iv[12];
+#endif
+
+static void Initiate(struct omemoSession *session) {
+  memset(session, 0, sizeof(*session));
+  assert(!omemoInitiateSession(session, &storea, storeb.cursignedprekey.sig,
+                               spk, ik, pk, storeb.cursignedprekey.id,
+                               storeb.prekeys[0].id));
+}
+
+static void Decrypt(struct omemoSession *session,
+                    const struct omemoStore *store,
+                    const struct omemoKeyMessage *msg) {
+  uint8_t k[OMEMO_KEYSIZE];
+  size_t kn = sizeof(k);
+  assert(!omemoDecryptKey(session, store, k, &kn, msg->isprekey, msg->p,
+                          msg->n));
+}
+
+// A talks to B: a prekey message, a reply, then messages from A that
+// make B do a DH ratchet step, no step and skip NUMSKIP keys.
+static void Setup(void) {
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  omemoSerializeKey(spk, storeb.cursignedprekey.kp.pub);
+  omemoSerializeKey(ik, storeb.identity.pub);
+  omemoSerializeKey(pk, storeb.prekeys[0].kp.pub);
+  memcpy(bundle.spks, storeb.cursignedprekey.sig, 64);
+  memcpy(bundle.spk, spk, sizeof(spk));
+  memcpy(bundle.ik, ik, sizeof(ik));
+  Initiate(&sessiona);
+  memset(&sessionb, 0, sizeof(sessionb));
+  assert(!omemoRandom(key, sizeof(key)));
+
+  assert(!omemoEncryptKey(&sessiona, &prekeymsg, key, sizeof(key)));
+  Decrypt(&sessionb, &storeb, &prekeymsg);
+  struct omemoKeyMessage reply;
+  assert(!omemoEncryptKey(&sessionb, &reply, key, sizeof(key)));
+  Decrypt(&sessiona, &storea, &reply);
+
+  sessionb0 = sessionb;
+  assert(!omemoEncryptKey(&sessiona, &ratchetmsg, key, sizeof(key)));
+  Decrypt(&sessionb, &storeb, &ratchetmsg);
+  sessionb1 = sessionb;
+  assert(!omemoEncryptKey(&sessiona, &normalmsg, key, sizeof(key)));
+  for (int i = 0; i < NUMSKIP - 1; i++)
+    assert(!omemoEncryptKey(&sessiona, &skipmsg, key, sizeof(key)));
+  assert(!omemoEncryptKey(&sessiona, &skipmsg, key, sizeof(key)));
+
+  storebufn = omemoGetSerializedStoreSize(&storea);
+  sessionbufn = omemoGetSerializedSessionSize(&sessionb1);
+  assert((storebuf = malloc(storebufn)));
+  assert((sessionbuf = malloc(sessionbufn)));
+  omemoSerializeStore(storebuf, &storea);
+  omemoSerializeSession(sessionbuf, &sessionb1);
+  tmpstore = storea;
+
+  assert(!omemoRandom(payload, sizeof(payload)));
+#ifdef OMEMO2
+  assert(!omemoEncryptMessage(encpayload, key, payload, PAYLOADSIZE));
+#else
+  assert(!omemoEncryptMessage(encpayload, key, iv, payload, PAYLOADSIZE));
+#endif
+}
+
+static void BenchSetupStore(void) {
+  assert(!omemoSetupStore(&tmpstore));
+}
+
+static void BenchRotateSignedPreKey(void) {
+  assert(!omemoRotateSignedPreKey(&tmpstore));
+}
+
+static void BenchInitiateSession(void) {
+  Initiate(&tmpsession);
+}
+
+static void BenchVerifyBundle(void) {
+  bool ok;
+  assert(!omemoVerifyBundles(&bundle, &ok, 1));
+}
+
+static void BenchEncryptKey(void) {
+  struct omemoKeyMessage msg;
+  assert(!omemoEncryptKey(&sessiona, &msg, key, sizeof(key)));
+}
+
+// The decryption benchmarks start from a copy of the session each
+// time, the copy is small compared to the work.
+static void BenchDecryptKey(void) {
+  tmpsession = sessionb1;
+  Decrypt(&tmpsession, &storeb, &normalmsg);
+}
+
+static void BenchDecryptKeyRatchet(void) {
+  tmpsession = sessionb0;
+  Decrypt(&tmpsession, &storeb, &ratchetmsg);
+}
+
+static void BenchDecryptKeySkip(void) {
+  tmpsession = sessionb1;
+  Decrypt(&tmpsession, &storeb, &skipmsg);
+}
+
+static void BenchDecryptPreKey(void) {
+  memset(&tmpsession, 0, sizeof(tmpsession));
+  Decrypt(&tmpsession, &storeb, &prekeymsg);
+}
+
+static void BenchSerializeStore(void) {
+  omemoSerializeStore(storebuf, &storea);
+}
+
+static void BenchDeserializeStore(void) {
+  assert(!omemoDeserializeStore(storebuf, storebufn, &tmpstore));
+}
+
+static void BenchSerializeSession(void) {
+  omemoSerializeSession(sessionbuf, &sessionb1);
+}
+
+static void BenchDeserializeSession(void) {
+  assert(!omemoDeserializeSession(sessionbuf, sessionbufn, &tmpsession));
+}
+
+static void BenchEncryptMessage(void) {
+#ifdef OMEMO2
+  assert(!omemoEncryptMessage(encpayload, key, payload, PAYLOADSIZE));
+#else
+  assert(!omemoEncryptMessage(encpayload, key, iv, payload, PAYLOADSIZE));
+#endif
+}
+
+static void BenchDecryptMessage(void) {
+#ifdef OMEMO2
+  size_t n;
+  assert(!omemoDecryptMessage(decpayload, &n, key, sizeof(key), encpayload,
+                              PAYLOADSIZE + omemoGetMessagePadSize(PAYLOADSIZE)));
+#else
+  assert(!omemoDecryptMessage(decpayload, key, sizeof(key), iv, encpayload,
+                              PAYLOADSIZE));
+#endif
+}
+
+static const struct Bench benches[] = {
+    {"SetupStore", BenchSetupStore},
+    {"RotateSignedPreKey", BenchRotateSignedPreKey},
+    {"VerifyBundle", BenchVerifyBundle},
+    {"InitiateSession", BenchInitiateSession},
+    {"EncryptKey", BenchEncryptKey},
+    {"DecryptKey", BenchDecryptKey},
+    {"DecryptKeyRatchet", BenchDecryptKeyRatchet},
+    {"DecryptKeySkip50", BenchDecryptKeySkip},
+    {"DecryptPreKey", BenchDecryptPreKey},
+    {"SerializeStore", BenchSerializeStore},
+    {"DeserializeStore", BenchDeserializeStore},
+    {"SerializeSession", BenchSerializeSession},
+    {"DeserializeSession", BenchDeserializeSession},
+    {"EncryptMessage1K", BenchEncryptMessage, PAYLOADSIZE},
+    {"DecryptMessage1K", BenchDecryptMessage, PAYLOADSIZE},
+};
+
+int main(int argc, char **argv) {
+  omemoSetCallbacks(LoadMessageKey, StoreMessageKey, NULL);
+  Setup();
+  char drivers[128];
+  snprintf(drivers, sizeof(drivers), "%s/%s/%s",
+           omemoGetDriverImpl(OMEMO_DRIVER_CURVE),
+           omemoGetDriverImpl(OMEMO_DRIVER_AES),
+           omemoGetDriverImpl(OMEMO_DRIVER_HASH));
+  return RunBenches(argc, argv, VERSION, drivers, benches,
+                    sizeof(benches) / sizeof(*benches));
+}
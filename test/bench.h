@@ -0,0 +1,189 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Shared by the benchmark programs. Each benchmark is warmed up for
+// about half of -t milliseconds and then timed in -r repeats of batches
+// that take about -t milliseconds, the median repeat is reported. With
+// -o the results are appended as CSV to a file so runs can be compared.
+// Only benchmarks whose name contains the filter argument are run.
+// With -s each benchmark runs once and its peak stack use is reported
+// instead, see stack.h.
+
+#ifndef OMEMO_BENCH_H_
+#define OMEMO_BENCH_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stack.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+// Reference cycles of the TSC, not core cycles when the clock scales.
+static uint64_t Cycles(void) { return __rdtsc(); }
+#else
+static uint64_t Cycles(void) { return 0; }
+#endif
+
+static uint64_t Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct Bench {
+  const char *name;
+  void (*run)(void);
+  // Bytes processed per run, to also report MB/s.
+  size_t bytes;
+};
+
+struct Result {
+  double ns, cycles;
+};
+
+static int CompareResults(const void *a, const void *b) {
+  double x = ((const struct Result *)a)->ns;
+  double y = ((const struct Result *)b)->ns;
+  return (x > y) - (x < y);
+}
+
+// Runs f for a warmup of about ms/2, then repeats batches sized to take
+// about ms each. r is sorted by time per op.
+static void Measure(void (*f)(void), struct Result *r, int repeats,
+                    int ms) {
+  uint64_t target = ms * 1000000ull, start = Now(), n = 0;
+  do {
+    f();
+    n++;
+  } while (Now() - start < target / 2);
+  uint64_t batch = n * 2;
+  for (int i = 0; i < repeats; i++) {
+    uint64_t t = Now(), c = Cycles();
+    for (uint64_t j = 0; j < batch; j++)
+      f();
+    r[i].cycles = (double)(Cycles() - c) / batch;
+    r[i].ns = (double)(Now() - t) / batch;
+  }
+  qsort(r, repeats, sizeof(*r), CompareResults);
+}
+
+// The first run of a benchmark can take other paths (lazy driver setup,
+// signature cache misses), so the peak of a few runs is taken.
+static void MeasureStacks(const char *version, const char *drivers,
+                          const struct Bench *benches, size_t n,
+                          const char *filter, FILE *f) {
+  if (f && !ftell(f))
+    fprintf(f, "version,drivers,benchmark,stack_bytes\n");
+  printf("OMEMO %s, %s\n", version, drivers);
+  printf("%-24s %12s\n", "benchmark", "stack bytes");
+  for (size_t i = 0; i < n; i++) {
+    if (filter && !strstr(benches[i].name, filter))
+      continue;
+    size_t peak = 0;
+    for (int j = 0; j < 3; j++) {
+      size_t used = MEASURESTACK(benches[i].run());
+      if (used > peak)
+        peak = used;
+    }
+    printf("%-24s %12zu\n", benches[i].name, peak);
+    if (f)
+      fprintf(f, "%s,%s,%s,%zu\n", version, drivers, benches[i].name,
+              peak);
+  }
+}
+
+static int RunBenches(int argc, char **argv, const char *version,
+                      const char *drivers, const struct Bench *benches,
+                      size_t n) {
+  int repeats = 7, ms = 100, c;
+  bool stack = false;
+  const char *csv = NULL;
+  while ((c = getopt(argc, argv, "r:t:o:s")) != -1) {
+    switch (c) {
+    case 'r': repeats = atoi(optarg); break;
+    case 't': ms = atoi(optarg); break;
+    case 'o': csv = optarg; break;
+    case 's': stack = true; break;
+    default:
+      fprintf(stderr, "usage: %s [-r repeats] [-t ms] [-o file.csv] [-s] "
+                      "[filter]\n", argv[0]);
+      return 1;
+    }
+  }
+  const char *filter = optind < argc ? argv[optind] : NULL;
+  if (repeats < 1 || ms < 1)
+    return 1;
+
+  FILE *f = NULL;
+  if (stack) {
+    if (!CanMeasureStack()) {
+      fprintf(stderr, "can't measure the stack under valgrind\n");
+      return 1;
+    }
+    if (csv)
+      assert((f = fopen(csv, "a")));
+    MeasureStacks(version, drivers, benches, n, filter, f);
+    if (f)
+      fclose(f);
+    return 0;
+  }
+  if (csv) {
+    assert((f = fopen(csv, "a")));
+    if (!ftell(f))
+      fprintf(f, "version,drivers,benchmark,bytes,ops_per_sec,ns_per_op,"
+                 "cycles_per_op,mb_per_sec,min_ns,max_ns,repeats\n");
+  }
+
+  printf("OMEMO %s, %s, median of %d\n", version, drivers, repeats);
+  printf("%-24s %12s %12s %12s %10s %8s\n", "benchmark", "ops/sec",
+         "ns/op", "cycles/op", "MB/s", "spread");
+  struct Result *r = calloc(repeats, sizeof(*r));
+  assert(r);
+  for (size_t i = 0; i < n; i++) {
+    if (filter && !strstr(benches[i].name, filter))
+      continue;
+    Measure(benches[i].run, r, repeats, ms);
+    struct Result *m = r + repeats / 2;
+    double spread = (r[repeats - 1].ns - r[0].ns) / m->ns * 100;
+    double mbs = benches[i].bytes * 1e3 / m->ns;
+    printf("%-24s %12.1f %12.1f %12.0f ", benches[i].name, 1e9 / m->ns,
+           m->ns, m->cycles);
+    if (benches[i].bytes)
+      printf("%10.1f", mbs);
+    else
+      printf("%10s", "-");
+    printf(" %7.1f%%\n", spread);
+    if (f)
+      fprintf(f, "%s,%s,%s,%zu,%.1f,%.1f,%.0f,%.1f,%.1f,%.1f,%d\n",
+              version, drivers, benches[i].name, benches[i].bytes,
+              1e9 / m->ns, m->ns, m->cycles, mbs, r[0].ns,
+              r[repeats - 1].ns, repeats);
+  }
+  free(r);
+  if (f)
+    fclose(f);
+  return 0;
+}
+
+#endif
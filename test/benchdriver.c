@@ -0,0 +1,289 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Benchmarks of the driver.h primitives, linked with only the driver
+// objects. `make bench-driver` runs it for every combination in
+// BENCHDRIVERS and prints the ns/op of each next to each other with
+// test/benchtable.awk. See bench.h for the options.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "omemo.h"
+#include "driver.h"
+#include "bench.h"
+
+#define BATCH  32
+#define MAXMSG (1 << 20)
+
+static omemoKey prv, pub, edpub, edprv, out;
+static omemoKey cvs[BATCH], eds[BATCH], tmps[BATCH];
+static omemoCurveSignature sig, sigs[BATCH];
+static omemoKey sigpubs[BATCH], seed;
+static uint8_t msg[33 + 64], *msgs[BATCH];
+static size_t msgns[BATCH];
+static uint8_t *buf, *dst, *ct;
+static uint8_t iv[16], tag[16], gcmkey[16], gcmiv[12];
+static struct omemoDriverAes *cbcenc, *cbcdec, *gcm;
+static struct omemoDriverHmac *hmac;
+
+// The AES sizes, gcmtags[i] is the tag of the first sizes[i] bytes of ct.
+static const size_t sizes[] = {16, 256, 4096, 65536, 1048576};
+static uint8_t gcmtags[5][16];
+
+static void Fill(void *p, size_t n) {
+  uint8_t *b = p;
+  for (size_t i = 0; i < n; i++)
+    b[i] = rand();
+}
+
+static void Setup(void) {
+  Fill(prv, 32);
+  omemoDriverCvPrvToPub(pub, prv);
+  omemoDriverEdSeedToPubPrv(edpub, edprv, prv);
+  Fill(msg, sizeof(msg));
+  omemoKey k, p;
+  memcpy(k, edprv, 32);
+  memcpy(p, edpub, 32);
+  omemoDriverEdSignMod(sig, p, k, msg, 33);
+  assert(omemoDriverEdVerify(sig, edpub, msg, 33));
+  for (int i = 0; i < BATCH; i++) {
+    Fill(k, 32);
+    omemoDriverCvPrvToPub(cvs[i], k);
+    omemoDriverCvPubToEdPub(eds[i], cvs[i]);
+    // A signature per key, all of the same message.
+    Fill(p, 32);
+    omemoDriverEdSeedToPubPrv(sigpubs[i], k, p);
+    memcpy(p, sigpubs[i], 32);
+    omemoDriverEdSignMod(sigs[i], p, k, msg, 33);
+    msgs[i] = msg;
+    msgns[i] = 33;
+  }
+  Fill(seed, 32);
+  assert(omemoDriverEdVerifyBatch(BATCH, sigs, sigpubs, msgs, msgns, seed));
+  assert((buf = malloc(MAXMSG)) && (dst = malloc(MAXMSG)) &&
+         (ct = malloc(MAXMSG)));
+  Fill(buf, MAXMSG);
+  Fill(gcmkey, 16);
+  Fill(gcmiv, 12);
+  assert(!omemoDriverGcmEncrypt(ct, gcmkey, MAXMSG, gcmiv, tag, buf));
+  for (int i = 0; i < 5; i++)
+    assert(!omemoDriverGcmEncrypt(dst, gcmkey, sizes[i], gcmiv,
+                                  gcmtags[i], buf));
+  assert((cbcenc = omemoDriverAesCreate()) &&
+         (cbcdec = omemoDriverAesCreate()) && (gcm = omemoDriverAesCreate()));
+  assert((hmac = omemoDriverHmacCreate()));
+}
+
+static void BenchX25519(void) {
+  omemoKey k, p;
+  memcpy(k, prv, 32);
+  memcpy(p, pub, 32);
+  omemoDriverX25519(out, k, p);
+}
+
+static void BenchCvPrvToPub(void) {
+  omemoDriverCvPrvToPub(out, prv);
+}
+
+static void BenchCvPrvToEdPub(void) {
+  omemoDriverCvPrvToEdPub(out, prv);
+}
+
+static void BenchEdSeedToPubPrv(void) {
+  omemoKey k;
+  omemoDriverEdSeedToPubPrv(out, k, prv);
+}
+
+static void BenchEdSignMod(void) {
+  omemoCurveSignature s;
+  omemoKey k, p;
+  memcpy(k, edprv, 32);
+  memcpy(p, edpub, 32);
+  omemoDriverEdSignMod(s, p, k, msg, 33);
+}
+
+static void BenchEdVerify(void) {
+  assert(omemoDriverEdVerify(sig, edpub, msg, 33));
+}
+
+static void BenchEdVerifyBatch(void) {
+  assert(omemoDriverEdVerifyBatch(BATCH, sigs, sigpubs, msgs, msgns, seed));
+}
+
+static void BenchEdPubToCvPub(void) {
+  omemoDriverEdPubToCvPub(out, edpub);
+}
+
+static void BenchCvPubToEdPub(void) {
+  omemoDriverCvPubToEdPub(out, pub);
+}
+
+static void BenchEdPubToCvPubBatch(void) {
+  omemoDriverEdPubToCvPubBatch(BATCH, tmps, eds);
+}
+
+static void BenchCvPubToEdPubBatch(void) {
+  omemoDriverCvPubToEdPubBatch(BATCH, tmps, cvs);
+}
+
+#define HMAC(n)                                                        \
+  static void BenchHmac##n(void) {                                     \
+    uint8_t mac[32];                                                   \
+    omemoDriverHmac(prv, buf, n, mac);                                 \
+  }                                                                    \
+  static void BenchHmacContext##n(void) {                              \
+    uint8_t mac[32];                                                   \
+    assert(!omemoDriverHmacStart(hmac, prv));                          \
+    assert(!omemoDriverHmacUpdate(hmac, buf, n));                      \
+    assert(!omemoDriverHmacFinish(hmac, mac));                         \
+  }
+HMAC(1)
+HMAC(32)
+HMAC(100)
+HMAC(4096)
+
+static void BenchHkdf(void) {
+  uint8_t okm[80];
+  omemoDriverHkdf(pub, 32, prv, 32, msg, 16, okm, sizeof(okm));
+}
+
+// Changes the key before every call, the other one-shot benchmarks use
+// the same key each time.
+static uint8_t *FreshKey(uint8_t *k) {
+  static int i;
+  k[i++ % 16]++;
+  return k;
+}
+
+// i is the index of n in sizes.
+#define AES(i, n)                                                      \
+  static void BenchCbcEncrypt##n(void) {                               \
+    assert(!omemoDriverAesEncrypt(prv, n, iv, buf, dst));              \
+  }                                                                    \
+  static void BenchCbcDecrypt##n(void) {                               \
+    assert(!omemoDriverAesDecrypt(prv, n, iv, buf, dst));              \
+  }                                                                    \
+  static void BenchGcmEncrypt##n(void) {                               \
+    assert(!omemoDriverGcmEncrypt(dst, gcmkey, n, gcmiv, tag, buf));   \
+  }                                                                    \
+  static void BenchGcmDecrypt##n(void) {                               \
+    assert(!omemoDriverGcmDecrypt(dst, gcmkey, n, gcmiv, gcmtags[i],   \
+                                  16, ct));                            \
+  }                                                                    \
+  static void BenchCbcEncryptFresh##n(void) {                          \
+    static omemoKey k;                                                 \
+    assert(!omemoDriverAesEncrypt(FreshKey(k), n, iv, buf, dst));      \
+  }                                                                    \
+  static void BenchGcmEncryptFresh##n(void) {                          \
+    static uint8_t k[16];                                              \
+    assert(!omemoDriverGcmEncrypt(dst, FreshKey(k), n, gcmiv, tag,     \
+                                  buf));                               \
+  }                                                                    \
+  static void BenchCbcHmacEncrypt##n(void) {                           \
+    uint8_t mac[32];                                                   \
+    assert(!omemoDriverAesCbcHmac(prv, pub, true, n, iv, buf, dst,     \
+                                  mac));                               \
+  }                                                                    \
+  static void BenchCbcHmacDecrypt##n(void) {                           \
+    uint8_t mac[32];                                                   \
+    assert(!omemoDriverAesCbcHmac(prv, pub, false, n, iv, buf, dst,    \
+                                  mac));                               \
+  }                                                                    \
+  static void BenchContextCbcEncrypt##n(void) {                        \
+    assert(!omemoDriverAesSetKey(cbcenc, prv, true));                  \
+    assert(!omemoDriverAesCbc(cbcenc, n, iv, buf, dst));               \
+  }                                                                    \
+  static void BenchContextCbcDecrypt##n(void) {                        \
+    assert(!omemoDriverAesSetKey(cbcdec, prv, false));                 \
+    assert(!omemoDriverAesCbc(cbcdec, n, iv, buf, dst));               \
+  }                                                                    \
+  static void BenchContextGcmEncrypt##n(void) {                        \
+    assert(!omemoDriverAesSetGcmKey(gcm, gcmkey));                     \
+    assert(!omemoDriverAesGcmEncrypt(gcm, dst, n, gcmiv, tag, buf));   \
+  }                                                                    \
+  static void BenchContextGcmDecrypt##n(void) {                        \
+    assert(!omemoDriverAesSetGcmKey(gcm, gcmkey));                     \
+    assert(!omemoDriverAesGcmDecrypt(gcm, dst, n, gcmiv, gcmtags[i],   \
+                                     16, ct));                         \
+  }                                                                    \
+  static void BenchContextGcmStream##n(void) {                         \
+    assert(!omemoDriverAesSetGcmKey(gcm, gcmkey));                     \
+    assert(!omemoDriverAesGcmStart(gcm, gcmiv, true));                 \
+    assert(!omemoDriverAesGcmUpdate(gcm, dst, n, buf));                \
+    assert(!omemoDriverAesGcmFinish(gcm, tag, 16));                    \
+  }
+AES(0, 16)
+AES(1, 256)
+AES(2, 4096)
+AES(3, 65536)
+AES(4, 1048576)
+
+#define AESBENCHES(n, name)                                            \
+  {"AesCbcEncrypt" name, BenchCbcEncrypt##n, n},                       \
+  {"AesCbcDecrypt" name, BenchCbcDecrypt##n, n},                       \
+  {"AesGcmEncrypt" name, BenchGcmEncrypt##n, n},                       \
+  {"AesGcmDecrypt" name, BenchGcmDecrypt##n, n},                       \
+  {"AesCbcEncryptFreshKey" name, BenchCbcEncryptFresh##n, n},          \
+  {"AesGcmEncryptFreshKey" name, BenchGcmEncryptFresh##n, n},          \
+  {"AesCbcHmacEncrypt" name, BenchCbcHmacEncrypt##n, n},               \
+  {"AesCbcHmacDecrypt" name, BenchCbcHmacDecrypt##n, n},               \
+  {"AesContextCbcEncrypt" name, BenchContextCbcEncrypt##n, n},         \
+  {"AesContextCbcDecrypt" name, BenchContextCbcDecrypt##n, n},         \
+  {"AesContextGcmEncrypt" name, BenchContextGcmEncrypt##n, n},         \
+  {"AesContextGcmDecrypt" name, BenchContextGcmDecrypt##n, n},         \
+  {"AesContextGcmStream" name, BenchContextGcmStream##n, n}
+
+static const struct Bench benches[] = {
+    {"X25519", BenchX25519},
+    {"CvPrvToPub", BenchCvPrvToPub},
+    {"CvPrvToEdPub", BenchCvPrvToEdPub},
+    {"EdSeedToPubPrv", BenchEdSeedToPubPrv},
+    {"EdSignMod", BenchEdSignMod},
+    {"EdVerify", BenchEdVerify},
+    {"EdVerifyBatch32", BenchEdVerifyBatch},
+    {"EdPubToCvPub", BenchEdPubToCvPub},
+    {"CvPubToEdPub", BenchCvPubToEdPub},
+    {"EdPubToCvPubBatch32", BenchEdPubToCvPubBatch},
+    {"CvPubToEdPubBatch32", BenchCvPubToEdPubBatch},
+    {"Hmac1", BenchHmac1, 1},
+    {"Hmac32", BenchHmac32, 32},
+    {"Hmac100", BenchHmac100, 100},
+    {"Hmac4K", BenchHmac4096, 4096},
+    {"HmacContext1", BenchHmacContext1, 1},
+    {"HmacContext32", BenchHmacContext32, 32},
+    {"HmacContext100", BenchHmacContext100, 100},
+    {"HmacContext4K", BenchHmacContext4096, 4096},
+    {"Hkdf80", BenchHkdf},
+    AESBENCHES(16, "16"),
+    AESBENCHES(256, "256"),
+    AESBENCHES(4096, "4K"),
+    AESBENCHES(65536, "64K"),
+    AESBENCHES(1048576, "1M"),
+};
+
+int main(int argc, char **argv) {
+  Setup();
+  char drivers[128];
+  snprintf(drivers, sizeof(drivers), "%s/%s/%s", omemoDriverCurveImpl(),
+           omemoDriverAesImpl(), omemoDriverHashImpl());
+  return RunBenches(argc, argv, "driver", drivers, benches,
+                    sizeof(benches) / sizeof(*benches));
+}
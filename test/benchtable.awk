@@ -0,0 +1,36 @@
+# Prints the ns/op of each benchmark in a CSV from bench.h with one
+# column per driver set, and how many times more than the first one.
+# Another column of the CSV can be chosen with -v col=name.
+#
+# $ awk -f test/benchtable.awk o/benchdriver.csv
+
+BEGIN { FS = ","; if (col == "") col = "ns_per_op" }
+NR == 1 {
+  for (i = 1; i <= NF; i++)
+    if ($i == col) field = i
+  next
+}
+{
+  # The API benchmarks of both versions get their own columns.
+  c = $1 == "driver" ? $2 : $1 " " $2
+  if (!(c in column)) { column[c] = ++ncols; names[ncols] = c }
+  if (!($3 in row)) { row[$3] = ++nrows; benches[nrows] = $3 }
+  ns[$3, c] = $field
+}
+END {
+  printf "%-24s", col == "ns_per_op" ? "ns/op" : col
+  for (c = 1; c <= ncols; c++) printf " %26s", names[c]
+  printf "\n"
+  for (r = 1; r <= nrows; r++) {
+    b = benches[r]
+    printf "%-24s", b
+    base = ns[b, names[1]]
+    for (c = 1; c <= ncols; c++) {
+      v = ns[b, names[c]]
+      if (v == "") printf " %26s", "-"
+      else if (c == 1 || base == "") printf " %26.1f", v
+      else printf " %17.1f (x%5.2f)", v, v / base
+    }
+    printf "\n"
+  }
+}
@@ -2,25 +2,143 @@ TESTCFLAGS=$(CFLAGS) -g
 
 all: test-omemo test-omemo2
 
-o/test-xmpp: test/xmpp.c example/yxml.c example/xmpp.c test/cacert.inc
+o/test-xmpp: test/xmpp.c test/xmppserver.h example/yxml.c example/xmpp.c test/cacert.inc
 	$(CC) -o $@ test/xmpp.c example/yxml.c $(TESTCFLAGS) -Iexample -lmbedtls -lmbedcrypto -lmbedx509
 
-TESTOMEMO_DEPS=test/omemo.c omemo.c $(DRIVEROBJS)
+TESTOMEMO_DEPS=test/omemo.c omemo.c core.c core.h $(DRIVEROBJS)
 TESTOMEMO_BUILD=$(CC) -o $@ test/omemo.c $(DRIVEROBJS) \
 				$(TESTCFLAGS) $(OMEMOCFLAGS) $(LIBS)
 
-o/test-omemo: test/omemo.c omemo.c $(DRIVEROBJS) o/store.inc o/msg.bin
+o/test-omemo: test/omemo.c test/stack.h omemo.c core.c core.h $(DRIVEROBJS) o/store.inc o/msg.bin
 	$(TESTOMEMO_BUILD)
 
-o/test-omemo2: test/omemo.c omemo.c $(DRIVEROBJS) o/store2.inc o/msg2.bin
+o/test-omemo2: test/omemo.c test/stack.h omemo.c core.c core.h $(DRIVEROBJS) o/store2.inc o/msg2.bin
 	$(TESTOMEMO_BUILD) -DOMEMO2
 
-o/generate: test/generate.c omemo.c $(DRIVEROBJS)
+# dual.c needs both versions, so it is tested against the library.
+o/test-dual: test/dual.c o/libpicomemo.a
+	$(CC) -o $@ test/dual.c o/libpicomemo.a $(TESTCFLAGS) $(OMEMOCFLAGS) $(LIBS)
+
+o/generate: test/generate.c test/corpus.h omemo.c core.c core.h $(DRIVEROBJS)
 	$(CC) -o $@ test/generate.c omemo.c $(DRIVEROBJS) $(TESTCFLAGS) $(LIBS)
 
-o/generate2: test/generate.c omemo.c $(DRIVEROBJS)
+o/generate2: test/generate.c test/corpus.h omemo.c core.c core.h $(DRIVEROBJS)
 	$(CC) -o $@ test/generate.c omemo.c $(DRIVEROBJS) $(TESTCFLAGS) $(LIBS) -DOMEMO2
 
+# `make bench` builds test/bench.c for every driver combination in
+# BENCHDRIVERS (drivers joined with +) and both OMEMO versions, runs
+# them with BENCHFLAGS and collects the results in o/bench.csv.
+# `make bench-driver` does the same for test/benchdriver.c and prints a
+# table comparing the combinations. `make bench-replay` decrypts the
+# conversations recorded in o/corpus.bin and o/corpus2.bin, generated
+# with CORPUSFLAGS (see test/generate.c), with every combination.
+# The results are only meaningful on the machine that ran them, they
+# stay in o/ with the rest of the build.
+BENCHDRIVERS?=hacl.c+openssl.c c25519.c+openssl.c \
+              hacl.c+mbedtls.c c25519.c+mbedtls.c
+BENCHFLAGS?=
+BENCHCFLAGS=$(CFLAGS)
+
+BENCH_openssl.c=-lssl -lcrypto
+ifdef MBED_VENDOR
+BENCH_mbedtls.c=-I $(MBED_VENDOR)/include $(MBED_VENDOR)/library/libmbedcrypto.a
+else
+BENCH_mbedtls.c=-lmbedcrypto
+endif
+BENCH_aes.c=-DOMEMO_INTREE_AES -pthread
+
+BenchDrivers=$(subst +, ,$(1))
+BenchName=$(subst .c,,$(subst +,-,$(1)))
+
+define BENCH_RULES
+o/bench-$(call BenchName,$(1)): test/bench.c test/bench.h test/stack.h omemo.c core.c core.h $(call BenchDrivers,$(1)) cpu.c | o
+	$$(CC) -o $$@ test/bench.c omemo.c $(call BenchDrivers,$(1)) cpu.c $(CORESRCS) \
+	  $$(BENCHCFLAGS) $(foreach d,$(call BenchDrivers,$(1)),$$(BENCH_$(d)))
+
+o/bench2-$(call BenchName,$(1)): test/bench.c test/bench.h test/stack.h omemo.c core.c core.h $(call BenchDrivers,$(1)) cpu.c | o
+	$$(CC) -o $$@ test/bench.c omemo.c $(call BenchDrivers,$(1)) cpu.c $(CORESRCS) \
+	  $$(BENCHCFLAGS) $(foreach d,$(call BenchDrivers,$(1)),$$(BENCH_$(d))) -DOMEMO2
+
+o/benchdriver-$(call BenchName,$(1)): test/benchdriver.c test/bench.h $(call BenchDrivers,$(1)) cpu.c | o
+	$$(CC) -o $$@ test/benchdriver.c $(call BenchDrivers,$(1)) cpu.c \
+	  $$(BENCHCFLAGS) $(foreach d,$(call BenchDrivers,$(1)),$$(BENCH_$(d)))
+
+o/replay-$(call BenchName,$(1)): test/replay.c test/bench.h test/corpus.h omemo.c core.c core.h $(call BenchDrivers,$(1)) cpu.c | o
+	$$(CC) -o $$@ test/replay.c omemo.c $(call BenchDrivers,$(1)) cpu.c $(CORESRCS) \
+	  $$(BENCHCFLAGS) $(foreach d,$(call BenchDrivers,$(1)),$$(BENCH_$(d)))
+
+o/replay2-$(call BenchName,$(1)): test/replay.c test/bench.h test/corpus.h omemo.c core.c core.h $(call BenchDrivers,$(1)) cpu.c | o
+	$$(CC) -o $$@ test/replay.c omemo.c $(call BenchDrivers,$(1)) cpu.c $(CORESRCS) \
+	  $$(BENCHCFLAGS) $(foreach d,$(call BenchDrivers,$(1)),$$(BENCH_$(d))) -DOMEMO2
+endef
+
+$(foreach c,$(BENCHDRIVERS),$(eval $(call BENCH_RULES,$(c))))
+
+BENCHBINS=$(foreach c,$(BENCHDRIVERS),o/bench-$(call BenchName,$(c)) \
+                                      o/bench2-$(call BenchName,$(c)))
+
+.PHONY: bench
+bench: $(BENCHBINS)
+	rm -f o/bench.csv
+	for b in $(BENCHBINS); do ./$$b -o o/bench.csv $(BENCHFLAGS) || exit 1; done
+
+BENCHDRIVERBINS=$(foreach c,$(BENCHDRIVERS),o/benchdriver-$(call BenchName,$(c)))
+
+.PHONY: bench-driver
+bench-driver: $(BENCHDRIVERBINS)
+	rm -f o/benchdriver.csv
+	for b in $(BENCHDRIVERBINS); do ./$$b -o o/benchdriver.csv $(BENCHFLAGS) || exit 1; done
+	awk -f test/benchtable.awk o/benchdriver.csv
+
+# `make bench-stack` runs the same programs with -s, which reports the
+# peak stack use of each benchmark instead of the time.
+.PHONY: bench-stack
+bench-stack: $(BENCHBINS)
+	rm -f o/stack.csv
+	for b in $(BENCHBINS); do ./$$b -s -o o/stack.csv || exit 1; done
+	awk -v col=stack_bytes -f test/benchtable.awk o/stack.csv
+
+REPLAYBINS=$(foreach c,$(BENCHDRIVERS),o/replay-$(call BenchName,$(c)))
+REPLAY2BINS=$(foreach c,$(BENCHDRIVERS),o/replay2-$(call BenchName,$(c)))
+
+.PHONY: bench-replay
+bench-replay: $(REPLAYBINS) $(REPLAY2BINS) o/corpus.bin o/corpus2.bin
+	rm -f o/replay.csv
+	for b in $(REPLAYBINS); do ./$$b o/corpus.bin -o o/replay.csv $(BENCHFLAGS) || exit 1; done
+	for b in $(REPLAY2BINS); do ./$$b o/corpus2.bin -o o/replay.csv $(BENCHFLAGS) || exit 1; done
+
+CORPUSFLAGS?=
+
+o/corpus.bin: o/generate
+	o/generate -c $@ $(CORPUSFLAGS)
+
+o/corpus2.bin: o/generate2
+	o/generate2 -c $@ $(CORPUSFLAGS)
+
+# `make bench-xmpp` runs test/xmppload.c, K example/xmpp.c clients
+# talking OMEMO through the stand-in server of test/xmppserver.h, with
+# XMPPLOADFLAGS for both versions.
+XMPPLOADFLAGS?=
+XMPPLOAD_DEPS=test/xmppload.c test/xmppserver.h test/corpus.h $(XMPPSRCS) \
+              omemo.c core.c core.h $(DRIVEROBJS)
+XMPPLOAD_BUILD=$(CC) -o $@ test/xmppload.c example/yxml.c omemo.c \
+               $(DRIVEROBJS) $(TESTCFLAGS) -Iexample $(LIBS) -lmbedcrypto
+
+o/xmppload: $(XMPPLOAD_DEPS)
+	$(XMPPLOAD_BUILD)
+
+o/xmppload2: $(XMPPLOAD_DEPS)
+	$(XMPPLOAD_BUILD) -DOMEMO2
+
+.PHONY: bench-xmpp
+bench-xmpp: o/xmppload o/xmppload2
+	./o/xmppload $(XMPPLOADFLAGS)
+	./o/xmppload2 $(XMPPLOADFLAGS)
+
+# The driver benchmarks for the current DRIVERS
+o/bench-driver: test/benchdriver.c test/bench.h $(DRIVEROBJS)
+	$(CC) -o $@ test/benchdriver.c $(DRIVEROBJS) $(TESTCFLAGS) $(OMEMOCFLAGS) $(LIBS)
+
 o/msg.bin: test/initsession.py o/bundle.py | test/bot-venv
 	PYTHONPATH=o ./test/bot-venv/bin/python test/initsession.py bundle
 
@@ -51,6 +169,10 @@ test-omemo: o/test-omemo
 test-omemo2: o/test-omemo2
 	$(TESTRUNTOOL) ./o/test-omemo2
 
+.PHONY: test-dual
+test-dual: o/test-dual
+	$(TESTRUNTOOL) ./o/test-dual
+
 .PHONY: start-prosody
 start-prosody: test/localhost.crt
 	docker-compose -f test/docker-compose.yml up -d --build
@@ -0,0 +1,185 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Recorded conversations, written by `o/generate -c` and replayed by
+// test/replay.c. Everything the library draws from omemoRandom comes
+// from a seeded generator that is reseeded with a stream number before
+// each call, so a reader can rebuild the devices and sessions of the
+// writer from (seed, devices) alone and decrypt the recorded messages
+// in the same order with the same results.
+//
+// The file is little-endian:
+//
+//   "PMCORPUS" u8 version u8 unused[3] u32 devices u64 seed u32 events
+//   events times:
+//     u32 stream u16 to u16 from u8 isprekey u16 keyn u8 key[keyn]
+//     u16 payloadn u8 iv[12] u8 payload[payloadn]
+//
+// payloadn is 0 for heartbeats, iv is only used by OMEMO 0.3.
+
+#ifndef OMEMO_CORPUS_H_
+#define OMEMO_CORPUS_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "omemo.h"
+
+#ifdef OMEMO2
+#define CORPUSVERSION 2
+#else
+#define CORPUSVERSION 0
+#endif
+
+#define CORPUSMAGIC      "PMCORPUS"
+#define CORPUSMAXDEVICES 64
+#define CORPUSMAXPAYLOAD 4096
+
+static uint64_t rngstate;
+
+static uint64_t SplitMix64(uint64_t *s) {
+  uint64_t z = (*s += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static void Reseed(uint64_t seed, uint64_t stream) {
+  rngstate = seed ^ (stream * 0xd1342543de82ef95ull);
+}
+
+// Not random at all, the corpus must be reproducible.
+static int SeededRandom(void *p, size_t n) {
+  uint8_t *b = p;
+  while (n) {
+    uint64_t x = SplitMix64(&rngstate);
+    size_t m = n < 8 ? n : 8;
+    memcpy(b, &x, m);
+    b += m, n -= m;
+  }
+  return 0;
+}
+
+// Skipped message keys of all sessions, chained in a small hash table.
+struct SkippedKey {
+  struct SkippedKey *next;
+  const struct omemoSession *session;
+  struct omemoMessageKey k;
+};
+
+#define SKIPBUCKETS 1024
+
+static struct SkippedKey *skipped[SKIPBUCKETS];
+static size_t numskipped;
+
+static struct SkippedKey **SkipBucket(const struct omemoMessageKey *k) {
+  uint32_t h;
+  memcpy(&h, k->dh, 4);
+  return skipped + ((h ^ (k->nr * 2654435761u)) % SKIPBUCKETS);
+}
+
+static int LoadSkippedKey(struct omemoSession *s,
+                          struct omemoMessageKey *k) {
+  for (struct SkippedKey **p = SkipBucket(k); *p; p = &(*p)->next) {
+    struct SkippedKey *e = *p;
+    if (e->session == s && e->k.nr == k->nr &&
+        !memcmp(e->k.dh, k->dh, 32)) {
+      memcpy(k->mk, e->k.mk, 32);
+      *p = e->next;
+      free(e);
+      numskipped--;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int StoreSkippedKey(struct omemoSession *s,
+                           const struct omemoMessageKey *k, uint64_t n) {
+  struct SkippedKey *e, **p = SkipBucket(k);
+  if (!(e = malloc(sizeof(*e))))
+    return OMEMO_EUSER;
+  e->session = s;
+  e->k = *k;
+  e->next = *p;
+  *p = e;
+  numskipped++;
+  return 0;
+}
+
+static void ClearSkippedKeys(void) {
+  for (int i = 0; i < SKIPBUCKETS; i++) {
+    while (skipped[i]) {
+      struct SkippedKey *e = skipped[i];
+      skipped[i] = e->next;
+      free(e);
+    }
+  }
+  numskipped = 0;
+}
+
+// sessions[i * n + j] is the session of device i with device j. Device
+// i initiates the sessions with the devices after it using prekey i of
+// the other device, the others come from prekey messages.
+struct World {
+  int n;
+  uint64_t seed;
+  struct omemoStore *stores;
+  struct omemoSession *sessions;
+};
+
+#define SESSION(w, i, j) ((w)->sessions + (i) * (w)->n + (j))
+
+// First stream number that is free for the conversation.
+#define FIRSTSTREAM(n) ((uint64_t)(n) * (n) + (n))
+
+static void SetupWorld(struct World *w, int n, uint64_t seed) {
+  assert(n >= 2 && n <= CORPUSMAXDEVICES);
+  w->n = n;
+  w->seed = seed;
+  assert((w->stores = calloc(n, sizeof(*w->stores))));
+  assert((w->sessions = calloc(n * n, sizeof(*w->sessions))));
+  omemoSetCallbacks(LoadSkippedKey, StoreSkippedKey, SeededRandom);
+  for (int i = 0; i < n; i++) {
+    Reseed(seed, i);
+    assert(!omemoSetupStore(w->stores + i));
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = i + 1; j < n; j++) {
+      const struct omemoStore *b = w->stores + j;
+      omemoSerializedKey spk, ik, pk;
+      omemoSerializeKey(spk, b->cursignedprekey.kp.pub);
+      omemoSerializeKey(ik, b->identity.pub);
+      omemoSerializeKey(pk, b->prekeys[i].kp.pub);
+      Reseed(seed, n + i * n + j);
+      assert(!omemoInitiateSession(SESSION(w, i, j), w->stores + i,
+                                   b->cursignedprekey.sig, spk, ik, pk,
+                                   b->cursignedprekey.id,
+                                   b->prekeys[i].id));
+    }
+  }
+}
+
+static void FreeWorld(struct World *w) {
+  free(w->stores);
+  free(w->sessions);
+}
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Tests of dual.c, linked against libpicomemo.a as it uses both
+// versions.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/random.h>
+
+#include "dual.h"
+
+static int Random(void *d, size_t n) {
+  return getrandom(d, n, 0) != n;
+}
+
+// The messages are decrypted in order, no keys are skipped.
+static int LoadMessageKey0(struct omemo0Session *s,
+                           struct omemo0MessageKey *k) {
+  return 1;
+}
+
+static int StoreMessageKey0(struct omemo0Session *s,
+                            const struct omemo0MessageKey *k,
+                            uint64_t n) {
+  return OMEMO0_EUSER;
+}
+
+static int LoadMessageKey2(struct omemo2Session *s,
+                           struct omemo2MessageKey *k) {
+  return 1;
+}
+
+static int StoreMessageKey2(struct omemo2Session *s,
+                            const struct omemo2MessageKey *k,
+                            uint64_t n) {
+  return OMEMO2_EUSER;
+}
+
+#define NDEVICES 2
+
+// The sender and NDEVICES recipients for each version.
+static struct omemo0Store sender0, stores0[NDEVICES];
+static struct omemo2Store sender2, stores2[NDEVICES];
+static struct omemo0Session out0[NDEVICES], in0[NDEVICES];
+static struct omemo2Session out2[NDEVICES], in2[NDEVICES];
+
+static void Setup(void) {
+  memset(out0, 0, sizeof(out0));
+  memset(in0, 0, sizeof(in0));
+  memset(out2, 0, sizeof(out2));
+  memset(in2, 0, sizeof(in2));
+  assert(!omemo0SetupStore(&sender0));
+  assert(!omemo2SetupStore(&sender2));
+  for (int i = 0; i < NDEVICES; i++) {
+    omemo0SerializedKey spk0, ik0, pk0;
+    struct omemo0Store *b0 = stores0 + i;
+    assert(!omemo0SetupStore(b0));
+    omemo0SerializeKey(spk0, b0->cursignedprekey.kp.pub);
+    omemo0SerializeKey(ik0, b0->identity.pub);
+    omemo0SerializeKey(pk0, b0->prekeys[0].kp.pub);
+    assert(!omemo0InitiateSession(out0 + i, &sender0,
+                                  b0->cursignedprekey.sig, spk0, ik0,
+                                  pk0, b0->cursignedprekey.id,
+                                  b0->prekeys[0].id));
+    omemo2SerializedKey spk2, ik2, pk2;
+    struct omemo2Store *b2 = stores2 + i;
+    assert(!omemo2SetupStore(b2));
+    omemo2SerializeKey(spk2, b2->cursignedprekey.kp.pub);
+    omemo2SerializeKey(ik2, b2->identity.pub);
+    omemo2SerializeKey(pk2, b2->prekeys[0].kp.pub);
+    assert(!omemo2InitiateSession(out2 + i, &sender2,
+                                  b2->cursignedprekey.sig, spk2, ik2,
+                                  pk2, b2->cursignedprekey.id,
+                                  b2->prekeys[0].id));
+  }
+}
+
+// Recipients alternate between the versions, rcpts[2 * i] is device i
+// of OMEMO 0.3 and rcpts[2 * i + 1] device i of OMEMO 2.
+static void SetRecipients(struct omemoDualRecipient *rcpts) {
+  memset(rcpts, 0, 2 * NDEVICES * sizeof(*rcpts));
+  for (int i = 0; i < NDEVICES; i++) {
+    rcpts[2 * i].session0 = out0 + i;
+    rcpts[2 * i + 1].session2 = out2 + i;
+  }
+}
+
+static void CheckReceived(const struct omemoDualMessage *msg,
+                          const struct omemoDualRecipient *rcpts,
+                          const uint8_t *s, size_t n, bool isprekey) {
+  uint8_t *dec = malloc(n + 16);
+  assert(dec);
+  for (int i = 0; i < NDEVICES; i++) {
+    const struct omemoDualRecipient *r0 = rcpts + 2 * i, *r2 = r0 + 1;
+    uint8_t key[OMEMO2_KEYSIZE];
+    size_t keyn = sizeof(key), decn;
+    assert(!r0->r && r0->msg && r0->isprekey == isprekey);
+    assert(!omemo0DecryptKey(in0 + i, stores0 + i, key, &keyn,
+                             r0->isprekey, r0->msg, r0->msgn));
+    assert(keyn == OMEMO0_KEYSIZE);
+    assert(!omemo0DecryptMessage(dec, key, keyn, msg->iv0,
+                                 msg->payload0, msg->payload0n));
+    assert(!memcmp(dec, s, n));
+    keyn = sizeof(key);
+    assert(!r2->r && r2->msg && r2->isprekey == isprekey);
+    assert(!omemo2DecryptKey(in2 + i, stores2 + i, key, &keyn,
+                             r2->isprekey, r2->msg, r2->msgn));
+    assert(keyn == OMEMO2_KEYSIZE);
+    assert(!omemo2DecryptMessage(dec, &decn, key, keyn, msg->payload2,
+                                 msg->payload2n));
+    assert(decn == n && !memcmp(dec, s, n));
+  }
+  free(dec);
+}
+
+static void TestDualEncrypt() {
+  Setup();
+  struct omemoDualRecipient rcpts[2 * NDEVICES];
+  struct omemoDualMessage msg;
+  // Spans a few pieces and does not end on a block.
+  size_t sizes[] = {10000, 0, 31};
+  for (int k = 0; k < 3; k++) {
+    size_t n = sizes[k];
+    uint8_t *s = malloc(n + 1);
+    assert(s && !Random(s, n));
+    SetRecipients(rcpts);
+    size_t dn = omemoDualGetSize(rcpts, 2 * NDEVICES, n);
+    uint8_t *d = malloc(dn);
+    assert(d);
+    assert(!omemoDualEncrypt(&msg, rcpts, 2 * NDEVICES, d, dn, s, n));
+    assert(msg.payload0n == n);
+    assert(msg.payload2n == n + omemo2GetMessagePadSize(n));
+    // The first message initiates the sessions.
+    CheckReceived(&msg, rcpts, s, n, true);
+    free(d);
+    free(s);
+  }
+  // After the reply the prekey header is gone.
+  for (int i = 0; i < NDEVICES; i++) {
+    struct omemo0KeyMessage m0;
+    struct omemo2KeyMessage m2;
+    uint8_t key[OMEMO2_KEYSIZE] = {0};
+    size_t keyn = sizeof(key);
+    assert(!omemo0EncryptKey(in0 + i, &m0, key, OMEMO0_KEYSIZE));
+    assert(!omemo0DecryptKey(out0 + i, &sender0, key, &keyn, m0.isprekey,
+                             m0.p, m0.n));
+    keyn = sizeof(key);
+    assert(!omemo2EncryptKey(in2 + i, &m2, key, OMEMO2_KEYSIZE));
+    assert(!omemo2DecryptKey(out2 + i, &sender2, key, &keyn, m2.isprekey,
+                             m2.p, m2.n));
+  }
+  uint8_t s[100], d[4096];
+  assert(!Random(s, sizeof(s)));
+  SetRecipients(rcpts);
+  assert(omemoDualGetSize(rcpts, 2 * NDEVICES, sizeof(s)) <= sizeof(d));
+  assert(!omemoDualEncrypt(&msg, rcpts, 2 * NDEVICES, d, sizeof(d), s,
+                           sizeof(s)));
+  CheckReceived(&msg, rcpts, s, sizeof(s), false);
+}
+
+// A broken session only fails its own recipient.
+static void TestDualFailure() {
+  Setup();
+  struct omemoDualRecipient rcpts[2 * NDEVICES + 1];
+  struct omemo0Session uninit;
+  struct omemoDualMessage msg;
+  uint8_t s[100], d[4096];
+  memset(&uninit, 0, sizeof(uninit));
+  assert(!Random(s, sizeof(s)));
+  SetRecipients(rcpts);
+  memset(rcpts + 2 * NDEVICES, 0, sizeof(*rcpts));
+  assert(omemoDualEncrypt(&msg, rcpts, 2 * NDEVICES + 1, d, sizeof(d), s,
+                          sizeof(s)) == OMEMO0_EPARAM);
+  rcpts[2 * NDEVICES].session0 = &uninit;
+  rcpts[2 * NDEVICES].session2 = out2;
+  assert(omemoDualEncrypt(&msg, rcpts, 2 * NDEVICES + 1, d, sizeof(d), s,
+                          sizeof(s)) == OMEMO0_EPARAM);
+  rcpts[2 * NDEVICES].session2 = NULL;
+  size_t dn = omemoDualGetSize(rcpts, 2 * NDEVICES + 1, sizeof(s));
+  assert(omemoDualEncrypt(&msg, rcpts, 2 * NDEVICES + 1, d, dn - 1, s,
+                          sizeof(s)) == OMEMO0_EPARAM);
+  assert(!omemoDualEncrypt(&msg, rcpts, 2 * NDEVICES + 1, d, dn, s,
+                           sizeof(s)));
+  assert(rcpts[2 * NDEVICES].r == OMEMO0_ESTATE);
+  assert(!rcpts[2 * NDEVICES].msg && !rcpts[2 * NDEVICES].msgn);
+  CheckReceived(&msg, rcpts, s, sizeof(s), true);
+}
+
+#define RunTest(t)                                                     \
+  do {                                                                 \
+    puts("\e[34mRunning test " #t "\e[0m");                            \
+    t();                                                               \
+    puts("\e[32mFinished test " #t "\e[0m");                           \
+  } while (0)
+
+int main() {
+  omemo0SetCallbacks(LoadMessageKey0, StoreMessageKey0, Random);
+  omemo2SetCallbacks(LoadMessageKey2, StoreMessageKey2, Random);
+#ifdef OMEMO0_SMALLSTACK
+  static struct omemo0Context context0;
+  assert(!omemo0SetupContext(&context0));
+  omemo0SetContext(&context0);
+#endif
+#ifdef OMEMO2_SMALLSTACK
+  static struct omemo2Context context2;
+  assert(!omemo2SetupContext(&context2));
+  omemo2SetContext(&context2);
+#endif
+  RunTest(TestDualEncrypt);
+  RunTest(TestDualFailure);
+  puts("All tests succeeded");
+}
@@ -17,9 +17,12 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/random.h>
+#include <unistd.h>
 
 #include "omemo.h"
+#include "corpus.h"
 
 FILE *f;
 
@@ -35,8 +38,236 @@ void PrintSer(omemoKey k) {
   PrintHex(ser, sizeof(ser));
 }
 
+// A key message on its way to a device, heartbeats have no payload.
+struct Pending {
+  int to, from;
+  uint64_t release;
+  struct omemoKeyMessage msg;
+  size_t payloadn, plainn;
+  uint8_t iv[12], key[OMEMO_KEYSIZE];
+  uint8_t *payload, *plain;
+};
 
+#define WINDOW 8
+
+static struct World world;
+static uint64_t choices, stream;
+static struct Pending *pending, *held;
+static size_t npending, nheld;
+static uint32_t nevents, nprekey, nheartbeat, ndropped, nheld_total;
+// Remaining messages of an outage between two devices, negative when
+// they are held back instead of dropped.
+static int outage[CORPUSMAXDEVICES][CORPUSMAXDEVICES];
+
+static uint64_t Rand(uint64_t n) {
+  return SplitMix64(&choices) % n;
+}
+
+static void Put(const void *p, size_t n) {
+  assert(fwrite(p, 1, n, f) == n);
+}
+
+static void PutInt(uint64_t v, int n) {
+  for (int i = 0; i < n; i++)
+    fputc(v >> (8 * i), f);
+}
+
+static void Push(struct Pending **a, size_t *n, const struct Pending *p) {
+  assert((*a = realloc(*a, (*n + 1) * sizeof(**a))));
+  (*a)[(*n)++] = *p;
+}
+
+static void FreePending(struct Pending *p) {
+  free(p->payload);
+  free(p->plain);
+}
+
+// Queues p for delivery, unless the two devices are in an outage.
+static void Route(struct Pending *p, uint64_t sent) {
+  int *o = &outage[p->from][p->to];
+  if (!*o && !Rand(300))
+    *o = (20 + Rand(280)) * (Rand(2) ? 1 : -1);
+  if (*o > 0) {
+    (*o)--;
+    ndropped++;
+    FreePending(p);
+  } else if (*o < 0) {
+    p->release = sent - *o + Rand(50);
+    (*o)++;
+    nheld_total++;
+    Push(&held, &nheld, p);
+  } else {
+    Push(&pending, &npending, p);
+  }
+}
+
+static void Release(uint64_t sent, bool all) {
+  for (size_t i = 0; i < nheld;) {
+    if (all || held[i].release <= sent) {
+      Push(&pending, &npending, held + i);
+      held[i] = held[--nheld];
+    } else {
+      i++;
+    }
+  }
+}
+
+// One message from a random device to all devices it has a session
+// with, it is not sent when there is none.
+static bool SendMessage(uint64_t sent) {
+  int from = Rand(world.n);
+  size_t plainn;
+  switch (Rand(20)) {
+  case 0: plainn = 1024 + Rand(CORPUSMAXPAYLOAD - 1024 + 1); break;
+  case 1: case 2: case 3: case 4: plainn = 200 + Rand(824); break;
+  default: plainn = 1 + Rand(199); break;
+  }
+  uint8_t plain[CORPUSMAXPAYLOAD + 16], payload[CORPUSMAXPAYLOAD + 16];
+  uint8_t key[OMEMO_KEYSIZE], iv[12] = {0};
+  for (size_t i = 0; i < plainn; i++)
+    plain[i] = 'a' + Rand(26);
+  int tos[CORPUSMAXDEVICES], ntos = 0;
+  for (int to = 0; to < world.n; to++) {
+    if (to != from && (from < to || SESSION(&world, from, to)->init))
+      tos[ntos++] = to;
+  }
+  if (!ntos)
+    return false;
+  Reseed(world.seed, stream++);
+#ifdef OMEMO2
+  size_t payloadn = plainn + omemoGetMessagePadSize(plainn);
+  uint8_t tmp[CORPUSMAXPAYLOAD + 16];
+  memcpy(tmp, plain, plainn);
+  assert(!omemoEncryptMessage(payload, key, tmp, plainn));
+#else
+  size_t payloadn = plainn;
+  assert(!omemoEncryptMessage(payload, key, iv, plain, plainn));
+#endif
+  for (int i = 0; i < ntos; i++) {
+    struct Pending p = {.to = tos[i], .from = from};
+    Reseed(world.seed, stream++);
+    assert(!omemoEncryptKey(SESSION(&world, from, p.to), &p.msg, key,
+                            sizeof(key)));
+    memcpy(p.key, key, sizeof(key));
+    memcpy(p.iv, iv, 12);
+    p.payloadn = payloadn;
+    p.plainn = plainn;
+    assert((p.payload = malloc(payloadn)) && (p.plain = malloc(plainn)));
+    memcpy(p.payload, payload, payloadn);
+    memcpy(p.plain, plain, plainn);
+    Route(&p, sent);
+  }
+  return true;
+}
+
+// Delivers one of the first WINDOW pending messages and records it.
+static void Deliver(void) {
+  size_t i = Rand(npending < WINDOW ? npending : WINDOW);
+  struct Pending p = pending[i];
+  npending--;
+  memmove(pending + i, pending + i + 1, (npending - i) * sizeof(*pending));
+
+  uint8_t key[OMEMO_KEYSIZE];
+  size_t keyn = sizeof(key);
+  Reseed(world.seed, stream);
+  assert(!omemoDecryptKey(SESSION(&world, p.to, p.from),
+                          world.stores + p.to, key, &keyn,
+                          p.msg.isprekey, p.msg.p, p.msg.n));
+  if (p.payload) {
+    assert(keyn == sizeof(key) && !memcmp(key, p.key, keyn));
+    uint8_t dec[CORPUSMAXPAYLOAD + 16];
+#ifdef OMEMO2
+    size_t decn;
+    assert(!omemoDecryptMessage(dec, &decn, key, keyn, p.payload,
+                                p.payloadn));
+    assert(decn == p.plainn);
+#else
+    assert(!omemoDecryptMessage(dec, key, keyn, p.iv, p.payload,
+                                p.payloadn));
+#endif
+    assert(!memcmp(dec, p.plain, p.plainn));
+  } else {
+    nheartbeat++;
+  }
+  nprekey += p.msg.isprekey;
+
+  PutInt(stream, 4);
+  PutInt(p.to, 2);
+  PutInt(p.from, 2);
+  PutInt(p.msg.isprekey, 1);
+  PutInt(p.msg.n, 2);
+  Put(p.msg.p, p.msg.n);
+  PutInt(p.payloadn, 2);
+  Put(p.iv, 12);
+  Put(p.payload, p.payloadn);
+  nevents++;
+  stream++;
+  FreePending(&p);
+
+  struct Pending hb = {.to = p.from, .from = p.to};
+  Reseed(world.seed, stream++);
+  assert(!omemoHeartbeat(SESSION(&world, p.to, p.from),
+                         world.stores + p.to, &hb.msg));
+  if (hb.msg.n)
+    Push(&pending, &npending, &hb);
+}
+
+// Records a conversation of messages between n devices. A new message
+// is only sent when fewer than WINDOW messages are in flight, so they
+// are delivered a little late and out of order. Now and then the messages between two devices are dropped
+// or held back for a while, which makes the receiver skip many keys.
+static int GenerateCorpus(const char *path, int n, uint32_t messages,
+                          uint64_t seed) {
+  SetupWorld(&world, n, seed);
+  choices = seed;
+  stream = FIRSTSTREAM(n);
+  assert((f = fopen(path, "w")));
+  Put(CORPUSMAGIC, 8);
+  PutInt(CORPUSVERSION, 4);
+  PutInt(n, 4);
+  PutInt(seed, 8);
+  PutInt(0, 4);
+  uint64_t sent = 0;
+  while (sent < messages || npending || nheld) {
+    if (sent < messages && npending < WINDOW) {
+      sent += SendMessage(sent);
+      Release(sent, sent == messages);
+    } else if (npending) {
+      Deliver();
+    } else {
+      Release(sent, true);
+    }
+  }
+  fseek(f, 24, SEEK_SET);
+  PutInt(nevents, 4);
+  fclose(f);
+  printf("%d devices, %u messages, %u events: %u prekey, %u heartbeats, "
+         "%u dropped, %u held, %zu skipped keys left\n",
+         n, messages, nevents, nprekey, nheartbeat, ndropped,
+         nheld_total, numskipped);
+  ClearSkippedKeys();
+  FreeWorld(&world);
+  return 0;
+}
+
+// $ o/generate store.inc bundle.py
+// $ o/generate -c corpus.bin [-n devices] [-m messages] [-s seed]
 int main(int argc, char **argv) {
+  const char *corpus = NULL;
+  int devices = 4, c;
+  uint32_t messages = 2000;
+  uint64_t seed = 1;
+  while ((c = getopt(argc, argv, "c:n:m:s:")) != -1) {
+    switch (c) {
+    case 'c': corpus = optarg; break;
+    case 'n': devices = atoi(optarg); break;
+    case 'm': messages = strtoul(optarg, NULL, 10); break;
+    case 's': seed = strtoull(optarg, NULL, 10); break;
+    default: return 1;
+    }
+  }
+  if (corpus)
+    return GenerateCorpus(corpus, devices, messages, seed);
   assert(argc == 3);
   struct omemoStore store;
   assert(!omemoSetupStore(&store));
@@ -21,6 +21,8 @@
 
 #include <sys/random.h>
 
+#include "stack.h"
+
 #ifdef OMEMO2
 #include "o/store2.inc"
 #else
@@ -52,6 +54,14 @@ static void CopyHex(uint8_t *d, const char *hex) {
   }
 }
 
+static bool IsZero(const void *p, size_t n) {
+  const uint8_t *b = p;
+  while (n--)
+    if (*b++)
+      return false;
+  return true;
+}
+
 static void ClearFieldValues(struct ProtobufField *fields, int nfields) {
   for (int i = 0; i < nfields; i++) {
     fields[i].v = 0;
@@ -126,6 +136,24 @@ static void TestFormattings() {
   omemoKey k = {0};
   assert(FormatPreKeyMessage(buf, UINT32_MAX, UINT32_MAX, k, k, OMEMO_INTERNAL_ENCRYPTED_MAXSIZE) == OMEMO_INTERNAL_PREKEYHEADER_MAXSIZE);
   assert(FormatMessageHeader(buf, UINT32_MAX, UINT32_MAX, k, OMEMO_INTERNAL_PAYLOAD_MAXPADDEDSIZE) == OMEMO_INTERNAL_HEADER_MAXSIZE);
+
+  // core.c parses back what it formats.
+  struct omemoCoreMessage m, m2;
+  struct omemoCoreKeyExchange kx;
+  omemoKey dh;
+  memset(dh, 0x42, 32);
+  size_t n = omemoCoreFormatMessage(&Protocol, &m, buf, 300, 7, dh, 32);
+  assert(n == GetMessageSize(300, 7, 32));
+  assert(!omemoCoreParseMessage(&Protocol, &m2, buf, n));
+  assert(m2.n == 300 && m2.pn == 7 && !memcmp(buf + m2.dh, dh, 32));
+  assert(m2.ciphertext == m.ciphertext && m2.ciphertextn == 32);
+  assert(m2.mac == m.mac && m2.macced == m.macced && m2.maccedn == m.maccedn);
+  size_t h = FormatPreKeyMessage(buf, 5, 6, k, dh, n);
+  assert(!omemoCoreParseKeyExchange(&Protocol, &kx, buf, h + n));
+  assert(kx.pk_id == 5 && kx.spk_id == 6);
+  assert(!memcmp(buf + kx.ik, k, 32) && !memcmp(buf + kx.ek, dh, 32));
+  assert(kx.message == h && kx.messagen == n);
+  assert(omemoCoreParseKeyExchange(&Protocol, &kx, buf, h + n - 1));
 }
 
 static void TestEncryptSize() {
@@ -140,8 +168,10 @@ static void TestEncryptSize() {
   session.usedspk_id = UINT32_MAX;
   struct omemoKeyMessage msg;
   uint8_t payload[OMEMO_KEYSIZE];
-  assert(!EncryptKeyImpl(&session, &msg, payload, sizeof(payload)));
+  size_t n = omemoGetKeyMessageSize(&session, sizeof(payload));
+  assert(!omemoEncryptKey(&session, &msg, payload, sizeof(payload)));
   assert(msg.n == sizeof(msg.p));
+  assert(n == msg.n);
 }
 
 static void TestKeyPair(struct omemoKeyPair *kp, const char *rnd, const char *prv, const char *pub) {
@@ -178,6 +208,21 @@ static void TestRotate() {
   assert(!omemoRotateSignedPreKey(&store));
   assert(!memcmp(&spk, &store.prevsignedprekey, sizeof(spk)));
   assert(memcmp(&spk, &store.cursignedprekey, sizeof(spk)));
+  // store_inc has no identityalt, it must be derived on deserialization.
+  struct omemoStore tmp = store;
+  DeriveIdentityAlt(&tmp);
+  assert(!memcmp(tmp.identityalt, store.identityalt, 32));
+  omemoSerializedKey ser;
+  omemoSerializeKey(ser, store.cursignedprekey.kp.pub);
+  assert(VerifySignature(store.cursignedprekey.sig, store.identity.pub, NULL,
+                         ser, SerLen));
+}
+
+static void GetEd(omemoKey ed, const struct omemoKeyPair *ik) {
+  static struct omemoStore store;
+  store.identity = *ik;
+  memset(store.identityalt, 0, 32);
+  GetIdentityEd(ed, &store);
 }
 
 static void TestSignature() {
@@ -202,12 +247,14 @@ static void TestSignature() {
   CopyHex(msg, "af82");
   CopyHex(expsig, "6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a");
 #endif
-  assert(VerifySignature(expsig, ik.pub, msg, MSGLEN));
+  assert(VerifySignature(expsig, ik.pub, NULL, msg, MSGLEN));
 
   uint8_t rnd[64];
+  omemoKey ed;
+  GetEd(ed, &ik);
   assert(!omemoRandom(rnd, 64));
-  assert(!CalculateCurveSignature(sig, &ik, rnd, msg, MSGLEN));
-  assert(VerifySignature(sig, ik.pub, msg, MSGLEN));
+  assert(!CalculateCurveSignature(sig, &ik, ed, rnd, msg, MSGLEN));
+  assert(VerifySignature(sig, ik.pub, NULL, msg, MSGLEN));
 
 #ifndef OMEMO2
   uint8_t msg2[33];
@@ -215,7 +262,8 @@ static void TestSignature() {
   PrepareKey(ik.prv);
   memset(msg2, 0xaa, 33);
   memset(rnd, 0x55, 64);
-  CalculateCurveSignature(sig, &ik, rnd, msg2, 33);
+  GetEd(ed, &ik);
+  CalculateCurveSignature(sig, &ik, ed, rnd, msg2, 33);
   CopyHex(expsig, "f233b4ff4a5ba228980348fc07a49bdb26d4c88499015b29c604995cbe8c98351934e773569453d17ee000011e3662783d695f830b6a4bb49fb774c9b0599604");
   assert(!memcmp(expsig, sig, 64));
 #endif
@@ -245,7 +293,163 @@ static void TestEncryption() {
   assert(!omemoDecryptMessage(decrypted, &n, payload, sizeof(payload), encrypted, 16));
   assert(n == 9);
   assert(!memcmp("plaintext", decrypted, 9));
+
+  // Padding of 0 or more than a block is rejected, also by the stream.
+  for (int pad = 0; pad <= 17; pad += 17) {
+    struct omemoInternalDerivedKeys kdfout;
+    struct omemoPayloadStream st;
+    uint8_t block[16] = {0}, mac[32];
+    assert(!Random(payload, 32));
+    assert(!DeriveKey(payload, info_payload, &kdfout));
+    block[15] = pad;
+    assert(!omemoDriverAesCbcHmac(kdfout.cipher, kdfout.mac, true, 16,
+                                  kdfout.iv, block, encrypted, mac));
+    memcpy(payload + 32, mac, 16);
+    memset(decrypted, 0xff, 16);
+    assert(omemoDecryptMessage(decrypted, &n, payload, sizeof(payload),
+                               encrypted, 16) == OMEMO_ECORRUPT);
+    assert(IsZero(decrypted, 16));
+    assert(!omemoDecryptMessageInit(&st, payload, sizeof(payload)));
+    assert(!omemoDecryptMessageUpdate(&st, decrypted, &n, encrypted, 16));
+    assert(omemoDecryptMessageFinal(&st, decrypted, &n) == OMEMO_ECORRUPT);
+  }
+#endif
+}
+
+static void TestEncryptionInPlace() {
+  static uint8_t msg[1000], buf[1008], copy[1008], out[1008];
+  uint8_t payload[OMEMO_KEYSIZE];
+  size_t n = sizeof(msg);
+  assert(!Random(msg, n));
+  memcpy(buf, msg, n);
+#ifdef OMEMO2
+  size_t outn;
+  assert(!omemoEncryptMessage(buf, payload, buf, n));
+  n += omemoGetMessagePadSize(n);
+  memcpy(copy, buf, n);
+  assert(!omemoDecryptMessage(out, &outn, payload, sizeof(payload), copy, n));
+  assert(outn == sizeof(msg));
+  assert(!omemoDecryptMessage(buf, &outn, payload, sizeof(payload), buf, n));
+  assert(outn == sizeof(msg));
+#else
+  uint8_t iv[12];
+  assert(!omemoEncryptMessage(buf, payload, iv, buf, n));
+  memcpy(copy, buf, n);
+  assert(!omemoDecryptMessage(out, payload, sizeof(payload), iv, copy, n));
+  assert(!omemoDecryptMessage(buf, payload, sizeof(payload), iv, buf, n));
+#endif
+  assert(!memcmp(msg, out, sizeof(msg)));
+  assert(!memcmp(msg, buf, sizeof(msg)));
+}
+
+static void TestCbcHmac() {
+  static uint8_t msg[10000], enc[10000], dec[10000];
+  omemoKey k, mk;
+  uint8_t iv[16], iv2[16], mac[32], mac2[32];
+  assert(!Random(msg, sizeof(msg)));
+  assert(!Random(k, 32));
+  assert(!Random(mk, 32));
+  assert(!Random(iv, 16));
+  memcpy(iv2, iv, 16);
+  assert(!omemoDriverAesCbcHmac(k, mk, true, sizeof(msg), iv2, msg, enc, mac));
+  memcpy(iv2, iv, 16);
+  assert(!omemoDriverAesEncrypt(k, sizeof(msg), iv2, msg, dec));
+  assert(!memcmp(enc, dec, sizeof(enc)));
+  assert(!omemoDriverHmac(mk, enc, sizeof(enc), mac2));
+  assert(!memcmp(mac, mac2, 32));
+  memcpy(iv2, iv, 16);
+  assert(!omemoDriverAesCbcHmac(k, mk, false, sizeof(enc), iv2, enc, dec, mac2));
+  assert(!memcmp(mac, mac2, 32));
+  assert(!memcmp(msg, dec, sizeof(msg)));
+  assert(omemoDriverAesCbcHmac(k, mk, true, 15, iv2, msg, enc, mac));
+}
+
+static void TestGcmThreads() {
+  static uint8_t msg[5000], enc[5000], par[5000], dec[5000];
+  uint8_t key[16], iv[12], tag[16], tag2[16];
+  assert(!Random(msg, sizeof(msg)));
+  assert(!Random(key, 16));
+  assert(!Random(iv, 12));
+  for (size_t n = 0; n <= sizeof(msg); n += 457) {
+    omemoDriverSetGcmThreads(1, 0);
+    assert(!omemoDriverGcmEncrypt(enc, key, n, iv, tag, msg));
+    for (int t = 2; t <= 5; t++) {
+      omemoDriverSetGcmThreads(t, 16);
+      assert(!omemoDriverGcmEncrypt(par, key, n, iv, tag2, msg));
+      assert(!memcmp(enc, par, n) && !memcmp(tag, tag2, 16));
+      memcpy(dec, par, n);
+      assert(!omemoDriverGcmDecrypt(dec, key, n, iv, tag, 16, dec));
+      assert(!memcmp(dec, msg, n));
+      tag2[3] ^= 1;
+      assert(omemoDriverGcmDecrypt(dec, key, n, iv, tag2, 16, par));
+    }
+  }
+  omemoDriverSetGcmThreads(1, SIZE_MAX);
+}
+
+// Feeds s to the stream in pieces of 0 to 40 bytes.
+static size_t StreamPieces(struct omemoPayloadStream *st, bool enc,
+                           uint8_t *d, const uint8_t *s, size_t n) {
+  size_t i = 0, o = 0, outn;
+  uint8_t r;
+  while (i < n) {
+    assert(!Random(&r, 1));
+    size_t m = r % 41 < n - i ? r % 41 : n - i;
+    if (enc)
+      assert(!omemoEncryptMessageUpdate(st, d + o, &outn, s + i, m));
+    else
+      assert(!omemoDecryptMessageUpdate(st, d + o, &outn, s + i, m));
+    assert(outn <= m + 15);
+    i += m, o += outn;
+  }
+  return o;
+}
+
+static void TestEncryptionStream() {
+  static uint8_t msg[1000], enc[1016], dec[1016];
+  uint8_t key[OMEMO_KEYSIZE];
+  struct omemoPayloadStream st;
+  size_t n, outn;
+  assert(!Random(msg, sizeof(msg)));
+  for (size_t len = 0; len <= sizeof(msg); len += 111) {
+#ifdef OMEMO2
+    assert(!omemoEncryptMessageInit(&st));
+    n = StreamPieces(&st, true, enc, msg, len);
+    assert(!omemoEncryptMessageFinal(&st, enc + n, &outn, key));
+    n += outn;
+    assert(n == len + omemoGetMessagePadSize(len));
+    assert(!omemoDecryptMessage(dec, &outn, key, sizeof(key), enc, n));
+    assert(outn == len && !memcmp(dec, msg, len));
+
+    assert(!omemoDecryptMessageInit(&st, key, sizeof(key)));
+    outn = StreamPieces(&st, false, dec, enc, n);
+    assert(!omemoDecryptMessageFinal(&st, dec + outn, &n));
+    assert(outn + n == len && !memcmp(dec, msg, len));
+
+    enc[0] ^= 1;
+    assert(!omemoDecryptMessageInit(&st, key, sizeof(key)));
+    StreamPieces(&st, false, dec, enc, len + omemoGetMessagePadSize(len));
+    assert(omemoDecryptMessageFinal(&st, dec, &n) == OMEMO_ECORRUPT);
+#else
+    uint8_t iv[12];
+    assert(!omemoEncryptMessageInit(&st, iv));
+    n = StreamPieces(&st, true, enc, msg, len);
+    assert(!omemoEncryptMessageFinal(&st, NULL, &outn, key));
+    assert(n == len && !outn);
+    assert(!omemoDecryptMessage(dec, key, sizeof(key), iv, enc, n));
+    assert(!memcmp(dec, msg, len));
+
+    assert(!omemoDecryptMessageInit(&st, key, sizeof(key), iv));
+    outn = StreamPieces(&st, false, dec, enc, n);
+    assert(!omemoDecryptMessageFinal(&st, NULL, &n));
+    assert(outn == len && !memcmp(dec, msg, len));
+
+    key[20] ^= 1;
+    assert(!omemoDecryptMessageInit(&st, key, sizeof(key), iv));
+    StreamPieces(&st, false, dec, enc, len);
+    assert(omemoDecryptMessageFinal(&st, NULL, &n));
 #endif
+  }
 }
 
 // user is either a or b
@@ -339,6 +543,294 @@ static void TestSession() {
   mkskippedi = 0;
 }
 
+static void TestEncryptKeyTo() {
+  struct omemoStore storea, storeb;
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  struct omemoSession sessiona, sessionb, copy;
+  memset(&sessiona, 0, sizeof(sessiona));
+  memset(&sessionb, 0, sizeof(sessionb));
+  Init(&sessiona, &storea, &storeb);
+
+  uint8_t buf[3 * OMEMO_KEYMESSAGE_MAXSIZE], payload[OMEMO_KEYSIZE],
+      dec[OMEMO_KEYSIZE];
+  size_t off = 0, sizes[3], n;
+  bool isprekey[3];
+  assert(!Random(payload, sizeof(payload)));
+  memcpy(&copy, &sessiona, sizeof(copy));
+  assert(!omemoGetKeyMessageSize(NULL, sizeof(payload)));
+  n = omemoGetKeyMessageSize(&sessiona, sizeof(payload)) - 1;
+  assert(omemoEncryptKeyTo(&sessiona, buf, &n, isprekey, payload,
+                           sizeof(payload)) == OMEMO_EPARAM);
+  assert(!memcmp(&copy, &sessiona, sizeof(copy)));
+  for (int i = 0; i < 3; i++) {
+    size_t want = omemoGetKeyMessageSize(&sessiona, sizeof(payload));
+    n = sizeof(buf) - off;
+    assert(!omemoEncryptKeyTo(&sessiona, buf + off, &n, isprekey + i,
+                              payload, sizeof(payload)));
+    assert(isprekey[i] && n == want);
+    sizes[i] = n;
+    off += n;
+  }
+  off = 0;
+  for (int i = 0; i < 3; i++) {
+    n = sizeof(dec);
+    assert(!omemoDecryptKey(&sessionb, &storeb, dec, &n, isprekey[i],
+                            buf + off, sizes[i]));
+    assert(n == sizeof(payload) && !memcmp(dec, payload, n));
+    off += sizes[i];
+  }
+
+  struct omemoKeyMessage msg;
+  assert(!omemoEncryptKey(&sessionb, &msg, payload, sizeof(payload)));
+  assert(!msg.isprekey);
+  n = sizeof(dec);
+  assert(!omemoDecryptKey(&sessiona, &storea, dec, &n, false, msg.p,
+                          msg.n));
+  size_t want = omemoGetKeyMessageSize(&sessiona, sizeof(payload));
+  n = sizeof(buf);
+  assert(!omemoEncryptKeyTo(&sessiona, buf, &n, isprekey, payload,
+                            sizeof(payload)));
+  assert(!isprekey[0] && n == want);
+}
+
+// A message that fails to decrypt must leave the session as it was.
+static void TestDecryptFailure() {
+  struct {
+    uint8_t payload[OMEMO_KEYSIZE];
+    struct omemoKeyMessage msg;
+  } messages[3];
+
+  struct omemoStore storea, storeb;
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+
+  struct omemoSession sessiona, sessionb, copy;
+  memset(&sessiona, 0, sizeof(sessiona));
+  memset(&sessionb, 0, sizeof(sessionb));
+  Init(&sessiona, &storea, &storeb);
+
+  Send(a, 0);
+  memcpy(&copy, &sessionb, sizeof(copy));
+  messages[0].msg.p[messages[0].msg.n - 1] ^= 1;
+  uint8_t dec[OMEMO_KEYSIZE];
+  size_t decn = sizeof(dec);
+  assert(omemoDecryptKey(&sessionb, &storeb, dec, &decn, true,
+                         messages[0].msg.p, messages[0].msg.n));
+  assert(!memcmp(&copy, &sessionb, sizeof(copy)));
+  messages[0].msg.p[messages[0].msg.n - 1] ^= 1;
+  Recv(b, 0, true);
+
+  Send(b, 1);
+  Send(b, 2);
+  memcpy(&copy, &sessiona, sizeof(copy));
+  messages[2].msg.p[messages[2].msg.n - 1] ^= 1;
+  assert(omemoDecryptKey(&sessiona, &storea, dec, &decn, false,
+                         messages[2].msg.p, messages[2].msg.n) ==
+         OMEMO_ECORRUPT);
+  assert(!memcmp(&copy, &sessiona, sizeof(copy)));
+  messages[2].msg.p[messages[2].msg.n - 1] ^= 1;
+  Recv(a, 2, false);
+  Recv(a, 1, false);
+
+  memset(mkskipped, 0, sizeof(mkskipped));
+  mkskippedi = 0;
+}
+
+static void TestStats() {
+  struct omemoStats st;
+#ifdef OMEMO_STATS
+  struct {
+    uint8_t payload[OMEMO_KEYSIZE];
+    struct omemoKeyMessage msg;
+  } messages[3];
+  assert(!omemoGetStats(&st, true));
+
+  struct omemoStore storea, storeb;
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  struct omemoSession sessiona, sessionb;
+  memset(&sessiona, 0, sizeof(sessiona));
+  memset(&sessionb, 0, sizeof(sessionb));
+  Init(&sessiona, &storea, &storeb);
+  Send(a, 0);
+  Recv(b, 0, true);
+  Send(b, 1);
+  Send(b, 2);
+  Recv(a, 2, false);
+  Recv(a, 1, false);
+
+  assert(!omemoGetStats(&st, true));
+  assert(st.x25519 && st.hmac && st.hkdf && st.aes);
+  assert(st.prekeysused == 1);
+  assert(st.ratchetsteps == 2);
+  assert(st.skippedstored == 1 && st.skippedloaded == 1);
+  uint64_t calls[OMEMO_STAT_NUMAPIS] = {0};
+  for (int i = 0; i < OMEMO_STAT_NUMAPIS; i++)
+    for (int j = 0; j < OMEMO_STAT_NUMBUCKETS; j++)
+      calls[i] += st.latency[i][j];
+  assert(calls[OMEMO_STAT_SETUPSTORE] == 2);
+  assert(calls[OMEMO_STAT_REFILLPREKEYS] == 2);
+  assert(calls[OMEMO_STAT_INITIATESESSION] == 1);
+  assert(calls[OMEMO_STAT_ENCRYPTKEY] == 3);
+  assert(calls[OMEMO_STAT_DECRYPTKEY] == 3);
+  assert(!calls[OMEMO_STAT_ENCRYPTMESSAGE]);
+
+  assert(!omemoGetStats(&st, false));
+  assert(!st.x25519 && !st.latency[OMEMO_STAT_DECRYPTKEY][0]);
+  memset(mkskipped, 0, sizeof(mkskipped));
+  mkskippedi = 0;
+#else
+  assert(omemoGetStats(&st, false) == OMEMO_ESTATE);
+  assert(!st.x25519);
+#endif
+}
+
+static int tracecalls[OMEMO_TRACE_RANDOM + 1], tracedepth;
+static struct omemoSession *tracesessions[OMEMO_TRACE_RANDOM + 1];
+
+static void TraceBeginHook(int op, struct omemoSession *session) {
+  assert(op >= 0 && op <= OMEMO_TRACE_RANDOM);
+  assert(!tracedepth++);
+  tracecalls[op]++;
+  tracesessions[op] = session;
+}
+
+static void TraceEndHook(int op, struct omemoSession *session) {
+  assert(tracedepth-- == 1);
+  assert(tracesessions[op] == session);
+}
+
+static void TestTraceHooks() {
+  struct {
+    uint8_t payload[OMEMO_KEYSIZE];
+    struct omemoKeyMessage msg;
+  } messages[3];
+  struct omemoStore storea, storeb;
+  struct omemoSession sessiona, sessionb;
+  memset(&sessiona, 0, sizeof(sessiona));
+  memset(&sessionb, 0, sizeof(sessionb));
+  omemoSetTraceHooks(TraceBeginHook, TraceEndHook);
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  assert(tracecalls[OMEMO_TRACE_RANDOM] && !tracesessions[OMEMO_TRACE_RANDOM]);
+  Init(&sessiona, &storea, &storeb);
+  assert(tracesessions[OMEMO_TRACE_X25519] == &sessiona);
+  Send(a, 0);
+  Recv(b, 0, true);
+  assert(tracesessions[OMEMO_TRACE_AESDECRYPT] == &sessionb);
+  Send(b, 1);
+  Send(b, 2);
+  Recv(a, 2, false);
+  assert(tracecalls[OMEMO_TRACE_STOREMESSAGEKEY] == 1);
+  assert(tracesessions[OMEMO_TRACE_STOREMESSAGEKEY] == &sessiona);
+  Recv(a, 1, false);
+  assert(tracecalls[OMEMO_TRACE_LOADMESSAGEKEY] == 3);
+  assert(tracecalls[OMEMO_TRACE_HKDF] && tracecalls[OMEMO_TRACE_HMAC] &&
+         tracecalls[OMEMO_TRACE_AESENCRYPT]);
+  omemoSetTraceHooks(NULL, NULL);
+  int n = tracecalls[OMEMO_TRACE_AESENCRYPT];
+  Send(a, 0);
+  assert(tracecalls[OMEMO_TRACE_AESENCRYPT] == n && !tracedepth);
+  memset(mkskipped, 0, sizeof(mkskipped));
+  mkskippedi = 0;
+}
+
+static void TestVerifyBundles() {
+  struct omemoStore storea, storeb;
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  struct omemoBundle bundles[21];
+  bool ok[21];
+  for (int i = 0; i < 21; i++) {
+    struct omemoStore *store = i % 3 ? &storea : &storeb;
+    assert(!omemoRotateSignedPreKey(store));
+    memcpy(bundles[i].spks, store->cursignedprekey.sig, 64);
+    omemoSerializeKey(bundles[i].spk, store->cursignedprekey.kp.pub);
+    omemoSerializeKey(bundles[i].ik, store->identity.pub);
+  }
+  assert(!omemoVerifyBundles(bundles, ok, 0));
+  assert(!omemoVerifyBundles(bundles, ok, 21));
+  for (int i = 0; i < 21; i++)
+    assert(ok[i]);
+  bundles[3].spks[5] ^= 1;
+  bundles[17].spk[9] ^= 1;
+  memcpy(bundles[20].ik, bundles[18].ik, sizeof(omemoSerializedKey));
+  assert(omemoVerifyBundles(bundles, ok, 21) == OMEMO_ECORRUPT);
+  for (int i = 0; i < 21; i++)
+    assert(ok[i] == (i != 3 && i != 17 && i != 20));
+
+  // With A the identity, R of order 2 and S = 0 only the cofactored
+  // equation holds, a single and a batch verification must agree on it.
+  omemoCurveSignature lowsig = {0};
+  omemoKey lowpub = {1}, seed = {0};
+  uint8_t lowmsg[SerLen] = {0}, *lowmsgp = lowmsg;
+  size_t lowmsgn = SerLen;
+  memset(lowsig, 0xff, 32), lowsig[0] = 0xec, lowsig[31] = 0x7f;
+  assert(omemoDriverEdVerifyBatch(1, &lowsig, &lowpub, &lowmsgp, &lowmsgn,
+                                  seed));
+  assert(omemoDriverEdVerify(lowsig, lowpub, lowmsg, lowmsgn));
+
+  struct omemoSession session;
+  omemoSerializedKey pk;
+  omemoSerializeKey(pk, storeb.prekeys[0].kp.pub);
+  assert(!omemoInitiateVerifiedSession(&session, &storea, bundles[0].spk,
+                                       bundles[0].ik, pk,
+                                       storeb.cursignedprekey.id,
+                                       storeb.prekeys[0].id));
+}
+
+static void TestSignatureCache() {
+  struct omemoStore storea, storeb;
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  struct omemoSignatureCache cache, saved;
+  assert(!omemoSetupSignatureCache(&cache));
+  omemoSetSignatureCache(&cache);
+
+  struct omemoBundle b;
+  memcpy(b.spks, storeb.cursignedprekey.sig, 64);
+  omemoSerializeKey(b.spk, storeb.cursignedprekey.kp.pub);
+  omemoSerializeKey(b.ik, storeb.identity.pub);
+  omemoSerializedKey pk;
+  omemoSerializeKey(pk, storeb.prekeys[0].kp.pub);
+  uint8_t h[16];
+  assert(HashBundle(h, b.spks, b.spk, b.ik));
+  assert(!IsBundleCached(h));
+  struct omemoSession session;
+  assert(!omemoInitiateSession(&session, &storea, b.spks, b.spk, b.ik, pk, 1, 1));
+  assert(IsBundleCached(h));
+  memcpy(&saved, &cache, sizeof(cache));
+
+  // A cached entry skips verification, so make sure a forged one is
+  // different.
+  b.spks[0] ^= 1;
+  assert(omemoInitiateSession(&session, &storea, b.spks, b.spk, b.ik, pk, 1, 1) == OMEMO_ECORRUPT);
+  bool ok;
+  assert(omemoVerifyBundles(&b, &ok, 1) == OMEMO_ECORRUPT && !ok);
+  assert(HashBundle(h, b.spks, b.spk, b.ik));
+  CacheBundle(h);
+  assert(!omemoInitiateSession(&session, &storea, b.spks, b.spk, b.ik, pk, 1, 1));
+  assert(!omemoVerifyBundles(&b, &ok, 1) && ok);
+
+  // Restoring the saved cache forgets it again.
+  memcpy(&cache, &saved, sizeof(cache));
+  assert(omemoVerifyBundles(&b, &ok, 1) == OMEMO_ECORRUPT && !ok);
+  b.spks[0] ^= 1;
+  assert(!omemoVerifyBundles(&b, &ok, 1) && ok);
+
+  // Entries are replaced in order once the cache is full.
+  uint8_t other[16];
+  for (int i = 0; i < OMEMO_SIGCACHE_SIZE; i++) {
+    memset(other, i + 1, 16);
+    CacheBundle(other);
+  }
+  assert(HashBundle(h, b.spks, b.spk, b.ik));
+  assert(!IsBundleCached(h));
+  omemoSetSignatureCache(NULL);
+  assert(!HashBundle(h, b.spks, b.spk, b.ik));
+}
+
 // Test session built by Gajim
 static void TestReceive() {
 #ifndef OMEMO2
@@ -393,8 +885,8 @@ static void TestDeriveChainKey() {
   omemoKey myck, mymk;
   GetBaseMaterials(myck, mymk, seed);
   assert(!memcmp(ck, myck, 32));
-  struct DeriveChainKeyOutput kdfout[1];
-  assert(!DeriveKey(Zero32, mymk, HkdfInfoMessageKeys, kdfout));
+  struct omemoInternalDerivedKeys kdfout[1];
+  assert(!DeriveKey(mymk, info_messagekeys, kdfout));
   assert(!memcmp(mk, kdfout->cipher, 32));
   assert(!memcmp(mac, kdfout->mac, 32));
 #endif
@@ -423,6 +915,263 @@ static void TestHkdf() {
   assert(!memcmp(okm, out, sizeof(okm)));
 }
 
+static void TestAes() {
+  // NIST SP 800-38A F.2.5 CBC-AES256
+  omemoKey key;
+  uint8_t iv[16], tmp[16], pt[64], ct[64], out[64];
+  CopyHex(key, "603deb1015ca71be2b73aef0857d7781"
+               "1f352c073b6108d72d9810a30914dff4");
+  CopyHex(pt, "6bc1bee22e409f96e93d7e117393172a"
+              "ae2d8a571e03ac9c9eb76fac45af8e51"
+              "30c81c46a35ce411e5fbc1191a0a52ef"
+              "f69f2445df4f9b17ad2b417be66c3710");
+  CopyHex(ct, "f58c4c04d6e5f1ba779eabfb5f7bfbd6"
+              "9cfc4e967edb808d679f777bc6702c7d"
+              "39f23369a9d9bacfa530e26304231461"
+              "b2eb05e2c39be9fcda6c19078c6a9d1b");
+  CopyHex(iv, "000102030405060708090a0b0c0d0e0f");
+  memcpy(tmp, iv, 16);
+  assert(!omemoDriverAesEncrypt(key, 64, tmp, pt, out));
+  assert(!memcmp(out, ct, 64));
+  memcpy(tmp, iv, 16);
+  assert(!omemoDriverAesDecrypt(key, 64, tmp, out, out));
+  assert(!memcmp(out, pt, 64));
+
+  // GCM Test Case 3
+  uint8_t gkey[16], giv[12], gpt[64], gct[64], tag[16], gtag[16];
+  CopyHex(gkey, "feffe9928665731c6d6a8f9467308308");
+  CopyHex(giv, "cafebabefacedbaddecaf888");
+  CopyHex(gpt, "d9313225f88406e5a55909c5aff5269a"
+               "86a7a9531534f7da2e4c303d8a318a72"
+               "1c3c0c95956809532fcf0e2449a6b525"
+               "b16aedf5aa0de657ba637b391aafd255");
+  CopyHex(gct, "42831ec2217774244b7221b784d0d49c"
+               "e3aa212f2c02a4e035c17e2329aca12e"
+               "21d514b25466931c7d8f6a5aac84aa05"
+               "1ba30b396a0aac973d58e091473f5985");
+  CopyHex(gtag, "4d5c2af327cd64a62cf35abd2ba6fab4");
+  assert(!omemoDriverGcmEncrypt(out, gkey, 64, giv, tag, gpt));
+  assert(!memcmp(out, gct, 64));
+  assert(!memcmp(tag, gtag, 16));
+  assert(!omemoDriverGcmDecrypt(out, gkey, 64, giv, tag, 16, gct));
+  assert(!memcmp(out, gpt, 64));
+  // Partial block, tag computed with OpenSSL
+  CopyHex(gtag, "cc15abcc191161501aabab46b8fbac85");
+  assert(!omemoDriverGcmDecrypt(out, gkey, 60, giv, gtag, 16, gct));
+  assert(!memcmp(out, gpt, 60));
+  tag[0] ^= 1;
+  assert(omemoDriverGcmDecrypt(out, gkey, 64, giv, tag, 16, gct));
+
+  // Reused context, CBC calls can be chained
+  struct omemoDriverAes *aes = omemoDriverAesCreate();
+  assert(aes);
+  memcpy(tmp, iv, 16);
+  assert(!omemoDriverAesSetKey(aes, key, true));
+  assert(!omemoDriverAesCbc(aes, 16, tmp, pt, out));
+  assert(!omemoDriverAesCbc(aes, 48, tmp, pt + 16, out + 16));
+  assert(!memcmp(out, ct, 64));
+  assert(!omemoDriverAesSetGcmKey(aes, gkey));
+  for (int i = 0; i < 2; i++) {
+    assert(!omemoDriverAesGcmEncrypt(aes, out, 64, giv, tag, gpt));
+    assert(!memcmp(out, gct, 64));
+    assert(!omemoDriverAesGcmDecrypt(aes, out, 64, giv, tag, 16, out));
+    assert(!memcmp(out, gpt, 64));
+  }
+  memcpy(tmp, iv, 16);
+  assert(!omemoDriverAesSetKey(aes, key, false));
+  assert(!omemoDriverAesCbc(aes, 64, tmp, ct, out));
+  assert(!memcmp(out, pt, 64));
+  omemoDriverAesDestroy(aes);
+}
+
+static void TestCpuFeatures() {
+  uint32_t features = omemoGetCpuFeatures();
+  assert(omemoGetDriverImpl(OMEMO_DRIVER_CURVE));
+  assert(omemoGetDriverImpl(OMEMO_DRIVER_AES));
+  assert(omemoGetDriverImpl(OMEMO_DRIVER_HASH));
+  assert(!omemoGetDriverImpl(-1));
+  // Everything must also work with the portable implementations
+  omemoSetCpuFeatures(0);
+  assert(omemoGetCpuFeatures() == 0);
+#ifdef OMEMO_INTREE_AES
+  assert(!strcmp(omemoGetDriverImpl(OMEMO_DRIVER_AES), "ct"));
+#endif
+  TestAes();
+  TestCurve25519();
+  omemoSetCpuFeatures(~0);
+  assert(omemoGetCpuFeatures() == features);
+
+  // Compare the optimized and portable AES, AES-NI does GCM in one pass
+  // over eight blocks at a time.
+  static uint8_t msg[700], enc[2][700], dec[700];
+  uint8_t key[32], iv[16], iv2[16], tag[2][16];
+  assert(!Random(msg, sizeof(msg)) && !Random(key, 32) && !Random(iv, 16));
+  for (size_t n = 0; n <= sizeof(msg); n += 47) {
+    size_t m = n - n % 16;
+    for (int f = 0; f < 2; f++) {
+      omemoSetCpuFeatures(f ? ~0 : 0);
+      assert(!omemoDriverGcmEncrypt(enc[f], key, n, iv, tag[f], msg));
+      assert(!omemoDriverGcmDecrypt(dec, key, n, iv, tag[f], 16, enc[f]));
+      assert(!memcmp(dec, msg, n));
+      struct omemoDriverAes *aes = omemoDriverAesCreate();
+      assert(aes && !omemoDriverAesSetGcmKey(aes, key));
+      assert(!omemoDriverAesGcmStart(aes, iv, false));
+      assert(!omemoDriverAesGcmUpdate(aes, dec, n / 3, enc[f]));
+      assert(!omemoDriverAesGcmUpdate(aes, dec + n / 3, n - n / 3,
+                                      enc[f] + n / 3));
+      assert(!omemoDriverAesGcmFinish(aes, tag[f], 16));
+      assert(!memcmp(dec, msg, n));
+      omemoDriverAesDestroy(aes);
+    }
+    assert(!memcmp(enc[0], enc[1], n) && !memcmp(tag[0], tag[1], 16));
+    for (int f = 0; f < 2; f++) {
+      omemoSetCpuFeatures(f ? ~0 : 0);
+      memcpy(iv2, iv, 16);
+      assert(!omemoDriverAesEncrypt(key, m, iv2, msg, enc[f]));
+      memcpy(iv2, iv, 16);
+      assert(!omemoDriverAesDecrypt(key, m, iv2, enc[f], dec));
+      assert(!memcmp(dec, msg, m));
+    }
+    assert(!memcmp(enc[0], enc[1], m));
+  }
+  omemoSetCpuFeatures(~0);
+
+  // Compare the optimized and portable X25519
+  omemoKey prv, pub, a, b;
+  for (int i = 0; i < 32; i++)
+    prv[i] = i * 7, pub[i] = 0xff - i;
+  for (int i = 0; i < 16; i++) {
+    assert(!omemoDriverX25519(a, prv, pub));
+    omemoSetCpuFeatures(0);
+    assert(!omemoDriverX25519(b, prv, pub));
+    omemoSetCpuFeatures(~0);
+    assert(!memcmp(a, b, 32));
+    memcpy(pub, a, 32);
+    prv[i] ^= a[i];
+  }
+  // Non-canonical u (p + k for k < 19) is reduced
+  for (int k = 0; k < 19; k++) {
+    omemoKey u, c;
+    memset(u, 0xff, 32), u[0] = 0xed + k, u[31] = 0x7f;
+    memset(c, 0, 32), c[0] = k;
+    for (int f = 0; f < 2; f++) {
+      omemoSetCpuFeatures(f ? ~0 : 0);
+      int r = omemoDriverX25519(a, prv, u);
+      assert(r == omemoDriverX25519(b, prv, c));
+      assert(r || !memcmp(a, b, 32));
+      // 0 and 1 have small order and give an all-zero result
+      assert(!r == (k > 1));
+    }
+  }
+  omemoSetCpuFeatures(~0);
+  // c25519.c expects clamped scalars and u below 2^255, hacl.c takes
+  // anything as RFC 7748 says.
+  if (strncmp(omemoGetDriverImpl(OMEMO_DRIVER_CURVE), "hacl", 4))
+    return;
+  // The top bit of u is ignored
+  for (int f = 0; f < 2; f++) {
+    omemoSetCpuFeatures(f ? ~0 : 0);
+    omemoKey u;
+    memcpy(u, pub, 32), u[31] |= 0x80;
+    assert(!omemoDriverX25519(a, prv, u));
+    u[31] &= 0x7f;
+    assert(!omemoDriverX25519(b, prv, u) && !memcmp(a, b, 32));
+  }
+  // Iterated vectors from RFC 7748 section 5.2
+  static const omemoKey once = {
+      0x42, 0x2c, 0x8e, 0x7a, 0x62, 0x27, 0xd7, 0xbc, 0xa1, 0x35, 0x0b,
+      0x3e, 0x2b, 0xb7, 0x27, 0x9f, 0x78, 0x97, 0xb8, 0x7b, 0xb6, 0x85,
+      0x4b, 0x78, 0x3c, 0x60, 0xe8, 0x03, 0x11, 0xae, 0x30, 0x79};
+  static const omemoKey thousand = {
+      0x68, 0x4c, 0xf5, 0x9b, 0xa8, 0x33, 0x09, 0x55, 0x28, 0x00, 0xef,
+      0x56, 0x6f, 0x2f, 0x4d, 0x3c, 0x1c, 0x38, 0x87, 0xc4, 0x93, 0x60,
+      0xe3, 0x87, 0x5f, 0x2e, 0xb9, 0x4d, 0x99, 0x53, 0x2c, 0x51};
+  for (int f = 0; f < 2; f++) {
+    omemoSetCpuFeatures(f ? ~0 : 0);
+    omemoKey k = {9}, u = {9};
+    for (int i = 1; i <= 1000; i++) {
+      assert(!omemoDriverX25519(a, k, u));
+      memcpy(u, k, 32);
+      memcpy(k, a, 32);
+      if (i == 1)
+        assert(!memcmp(k, once, 32));
+    }
+    assert(!memcmp(k, thousand, 32));
+  }
+  omemoSetCpuFeatures(~0);
+}
+
+// Only defined by c25519.c built with OMEMO_C25519_LIMBS.
+void f25519_mul__distinct(uint8_t *r, const uint8_t *a, const uint8_t *b) __attribute__((weak));
+void f25519_mul_bytes(uint8_t *r, const uint8_t *a, const uint8_t *b) __attribute__((weak));
+void f25519_normalize(uint8_t *x) __attribute__((weak));
+
+static void TestFieldLimbs() {
+  if (!f25519_mul_bytes)
+    return;
+  uint8_t a[32], b[32], x[32], y[32];
+  for (int i = 0; i < 1000; i++) {
+    assert(!Random(a, 32));
+    assert(!Random(b, 32));
+    // Elements may be anything below 2p.
+    if (i % 3 == 0)
+      memset(a, 0xff, 31), a[31] = 0xff, a[0] = 0xd9;
+    if (i % 5 == 0)
+      memset(b, 0xff, 31), b[31] = 0x7f;
+    f25519_mul__distinct(x, a, b);
+    f25519_mul_bytes(y, a, b);
+    f25519_normalize(x);
+    f25519_normalize(y);
+    assert(!memcmp(x, y, 32));
+  }
+}
+
+static void TestConvertBatch() {
+#define N 40
+  omemoKey in[N], out[N], exp[N];
+  for (int i = 0; i < N; i++) {
+    assert(!Random(in[i], 32));
+    in[i][31] &= 0x7f;
+  }
+  // Keys where the denominator is zero.
+  memset(in[5], 0, 32), in[5][0] = 1;
+  memset(in[33], 0xff, 31), in[33][0] = 0xec, in[33][31] = 0x7f;
+  for (int i = 0; i < N; i++)
+    omemoDriverEdPubToCvPub(exp[i], in[i]);
+  omemoDriverEdPubToCvPubBatch(N, out, in);
+  assert(!memcmp(out, exp, sizeof(exp)));
+  for (int i = 0; i < N; i++)
+    omemoDriverCvPubToEdPub(exp[i], in[i]);
+  omemoDriverCvPubToEdPubBatch(N, out, in);
+  assert(!memcmp(out, exp, sizeof(exp)));
+  omemoDriverCvPubToEdPubBatch(N, in, in);
+  assert(!memcmp(in, exp, sizeof(exp)));
+#undef N
+}
+
+static void TestImportIdentities() {
+  struct omemoStore storea, storeb;
+  struct omemoSession sessions[3], *p[3] = {sessions, sessions + 1,
+                                            sessions + 2};
+  omemoSerializedKey iks[3];
+  omemoKey alt;
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  memset(sessions, 0, sizeof(sessions));
+  omemoSerializeKey(iks[0], storea.identity.pub);
+  omemoSerializeKey(iks[1], storeb.identity.pub);
+  omemoSerializeKey(iks[2], storea.identity.pub);
+  assert(!omemoImportRemoteIdentities(p, iks, 3));
+  for (int i = 0; i < 3; i++) {
+    assert(!memcmp(sessions[i].remoteidentity, GetRawKey(iks[i]), 32));
+    GetRemoteIdentityAlt(alt, NULL, GetRawKey(iks[i]));
+    assert(!memcmp(sessions[i].remoteidentityalt, alt, 32));
+  }
+  sessions[1].init = SESSION_READY;
+  assert(omemoImportRemoteIdentities(p, iks + 1, 2) == OMEMO_ESTATE);
+  assert(!omemoImportRemoteIdentities(p + 1, iks + 1, 2));
+}
+
 static int GetSharedSecretWithoutPreKey(omemoKey rk, omemoKey ck, bool isbob, const omemoKey ika, const omemoKey ska, const omemoKey ikb, const omemoKey spkb) {
   uint8_t secret[32*4] = {0}, salt[32];
   memset(secret, 0xff, 32);
@@ -512,6 +1261,11 @@ static void TestSerialization() {
   memset(&storeb, 0, sizeof(storeb));
   assert(!omemoDeserializeStore(buf, n, &storeb));
   assert(!memcmp(&storea, &storeb, sizeof(struct omemoStore)));
+  DeriveIdentityAlt(&storeb);
+  assert(!memcmp(storea.identityalt, storeb.identityalt, 32));
+  omemoKey alt;
+  GetRemoteIdentityAlt(alt, NULL, sessiona.remoteidentity);
+  assert(!memcmp(alt, sessiona.remoteidentityalt, 32));
 
   struct omemoSession tmpsession;
   memset(&tmpsession, 0, sizeof(tmpsession));
@@ -568,6 +1322,170 @@ static void TestSessionIntegration() {
 #endif
 }
 
+#ifdef OMEMO_SMALLSTACK
+static struct omemoContext context;
+#define MAINCONTEXT (&context)
+#else
+#define MAINCONTEXT NULL
+#endif
+
+// Everything works the same with a context, also when only one side of
+// a session uses it, and freeing it wipes the scratch.
+static void TestContext() {
+  struct omemoContext ctx;
+  struct omemoStore storea, storeb;
+  struct omemoSession sessiona, sessionb;
+  struct omemoKeyMessage msg;
+  omemoKey salt, ikm;
+  uint8_t info[] = "info", a[100], b[100];
+  uint8_t key[OMEMO_KEYSIZE], dec[OMEMO_KEYSIZE];
+  size_t decn;
+  assert(omemoSetupContext(NULL) == OMEMO_EPARAM);
+  assert(!omemoSetupContext(&ctx));
+  assert(!omemoRandom(salt, 32));
+  assert(!omemoRandom(ikm, 32));
+  omemoSetContext(NULL);
+  assert(!omemoDriverHkdf(salt, 32, ikm, 32, info, 4, a, sizeof(a)));
+  omemoSetContext(&ctx);
+  assert(!omemoDriverHkdf(salt, 32, ikm, 32, info, 4, b, sizeof(b)));
+  assert(!memcmp(a, b, sizeof(a)));
+
+  TestEncryption();
+  TestEncryptionInPlace();
+  TestCbcHmac();
+  TestAes();
+  TestSession();
+
+  assert(!omemoSetupStore(&storea));
+  assert(!omemoSetupStore(&storeb));
+  memset(&sessiona, 0, sizeof(sessiona));
+  memset(&sessionb, 0, sizeof(sessionb));
+  Init(&sessiona, &storea, &storeb);
+  for (int i = 0; i < 4; i++) {
+    assert(!omemoRandom(key, sizeof(key)));
+    omemoSetContext(i % 2 ? MAINCONTEXT : &ctx);
+    assert(!omemoEncryptKey(i % 2 ? &sessionb : &sessiona, &msg, key,
+                            sizeof(key)));
+    omemoSetContext(i % 2 ? &ctx : MAINCONTEXT);
+    decn = sizeof(dec);
+    assert(!omemoDecryptKey(i % 2 ? &sessiona : &sessionb,
+                            i % 2 ? &storea : &storeb, dec, &decn,
+                            msg.isprekey, msg.p, msg.n));
+    assert(decn == sizeof(key) && !memcmp(dec, key, sizeof(key)));
+  }
+  // The calls wipe their temporaries before they return.
+  assert(IsZero(&ctx.scratch, sizeof(ctx.scratch)));
+  omemoSetContext(&ctx);
+  omemoFreeContext(&ctx);
+  assert(IsZero(&ctx, sizeof(ctx)));
+  omemoSetContext(MAINCONTEXT);
+}
+
+// Peak stack use of the API calls, see test/stack.h. The budgets are
+// for gcc -O2 on x86-64 with the OpenSSL driver and leave about a
+// quarter of headroom, other builds only print the numbers. HACL*
+// verifies signatures with tables on the stack, so it has its own.
+static void CheckStackBudget(const char *name, size_t used,
+                             size_t hacl, size_t c25519) {
+  const char *curve = omemoGetDriverImpl(OMEMO_DRIVER_CURVE);
+  const char *hash = omemoGetDriverImpl(OMEMO_DRIVER_HASH);
+  size_t budget = strncmp(curve, "hacl", 4) ? c25519 : hacl;
+  printf("%-20s %6zu bytes, budget %zu\n", name, used, budget);
+#if defined(__OPTIMIZE__) && defined(__x86_64__) && !defined(__clang__)
+  if (!strcmp(hash, "openssl"))
+    assert(used <= budget);
+#endif
+}
+
+#ifdef OMEMO_SMALLSTACK
+#define StackBudget(name, used, hacl, c25519, smallhacl, smallc25519)  \
+  CheckStackBudget(name, used, smallhacl, smallc25519)
+#else
+#define StackBudget(name, used, hacl, c25519, smallhacl, smallc25519)  \
+  CheckStackBudget(name, used, hacl, c25519)
+#endif
+
+static void TestStackBudget() {
+  struct omemoStore storea, storeb;
+  struct omemoSession sessiona, sessionb;
+  struct omemoKeyMessage msg;
+  struct omemoBundle b = {0};
+  omemoSerializedKey pk;
+  uint8_t key[OMEMO_KEYSIZE], dec[OMEMO_KEYSIZE], buf[64], enc[64 + 16];
+  size_t decn = sizeof(dec), used;
+  bool ok;
+  int r;
+#ifdef OMEMO_SMALLSTACK
+  // Nothing that needs scratch memory works without a context.
+  omemoSetContext(NULL);
+  assert(omemoVerifyBundles(&b, &ok, 1) == OMEMO_ESTATE);
+  omemoSetContext(&context);
+#endif
+  if (!CanMeasureStack())
+    return;
+  memset(&sessiona, 0, sizeof(sessiona));
+  memset(&sessionb, 0, sizeof(sessionb));
+  memset(buf, 0x55, sizeof(buf));
+  assert(!omemoRandom(key, sizeof(key)));
+
+  used = MEASURESTACK(r = NOINLINE(omemoSetupStore)(&storea));
+  assert(!r);
+  StackBudget("SetupStore", used, 2560, 2560, 2560, 2560);
+  assert(!omemoSetupStore(&storeb));
+  used = MEASURESTACK(r = NOINLINE(omemoRotateSignedPreKey)(&storeb));
+  assert(!r);
+  StackBudget("RotateSignedPreKey", used, 2560, 2560, 2560, 2560);
+
+  memcpy(b.spks, storeb.cursignedprekey.sig, 64);
+  omemoSerializeKey(b.spk, storeb.cursignedprekey.kp.pub);
+  omemoSerializeKey(b.ik, storeb.identity.pub);
+  omemoSerializeKey(pk, storeb.prekeys[0].kp.pub);
+  used = MEASURESTACK(r = NOINLINE(omemoVerifyBundles)(&b, &ok, 1));
+  assert(!r && ok);
+  StackBudget("VerifyBundles", used, 36864, 10240, 10240, 5120);
+  used = MEASURESTACK(r = NOINLINE(omemoInitiateSession)(
+                          &sessiona, &storea, b.spks, b.spk, b.ik, pk,
+                          storeb.cursignedprekey.id, storeb.prekeys[0].id));
+  assert(!r);
+  StackBudget("InitiateSession", used, 10240, 3328, 10240, 3072);
+
+  used = MEASURESTACK(r = NOINLINE(omemoEncryptKey)(&sessiona, &msg, key,
+                                                    sizeof(key)));
+  assert(!r);
+  StackBudget("EncryptKey", used, 2816, 2816, 2560, 2560);
+  used = MEASURESTACK(r = NOINLINE(omemoDecryptKey)(
+                          &sessionb, &storeb, dec, &decn, msg.isprekey,
+                          msg.p, msg.n));
+  assert(!r && !memcmp(dec, key, sizeof(key)));
+  StackBudget("DecryptKey prekey", used, 3840, 3840, 3328, 3328);
+  assert(!omemoEncryptKey(&sessionb, &msg, key, sizeof(key)));
+  used = MEASURESTACK(r = NOINLINE(omemoDecryptKey)(
+                          &sessiona, &storea, dec, &decn, msg.isprekey,
+                          msg.p, msg.n));
+  assert(!r && !memcmp(dec, key, sizeof(key)));
+  StackBudget("DecryptKey", used, 3840, 3840, 3328, 3328);
+
+#ifdef OMEMO2
+  used = MEASURESTACK(r = NOINLINE(omemoEncryptMessage)(enc, key, buf, 32));
+  assert(!r);
+  StackBudget("EncryptMessage", used, 2560, 2560, 2560, 2560);
+  used = MEASURESTACK(r = NOINLINE(omemoDecryptMessage)(
+                          dec, &decn, key, sizeof(key), enc, 48));
+  assert(!r && decn == 32);
+  StackBudget("DecryptMessage", used, 2560, 2560, 2560, 2560);
+#else
+  uint8_t iv[12];
+  used = MEASURESTACK(r = NOINLINE(omemoEncryptMessage)(enc, key, iv, buf,
+                                                        32));
+  assert(!r);
+  StackBudget("EncryptMessage", used, 2560, 2560, 2560, 2560);
+  used = MEASURESTACK(r = NOINLINE(omemoDecryptMessage)(
+                          dec, key, sizeof(key), iv, enc, 32));
+  assert(!r && !memcmp(dec, buf, 32));
+  StackBudget("DecryptMessage", used, 2560, 2560, 2560, 2560);
+#endif
+}
+
 #define RunTest(t)                                                     \
   do {                                                                 \
     puts("\e[34mRunning test " #t "\e[0m");                            \
@@ -577,6 +1495,10 @@ static void TestSessionIntegration() {
 
 int main() {
   omemoSetCallbacks(LoadMessageKey, StoreMessageKey, Random);
+#ifdef OMEMO_SMALLSTACK
+  assert(!omemoSetupContext(&context));
+  omemoSetContext(&context);
+#endif
   // TODO: tests TestCurve25519, TestSignature, TestSession and
   // TestSerialization are slow because they use the slow
   // edsign_sign_modified and edsign_verify.
@@ -589,12 +1511,29 @@ int main() {
   RunTest(TestRotate);
   RunTest(TestSignature);
   RunTest(TestEncryption);
+  RunTest(TestEncryptionInPlace);
+  RunTest(TestCbcHmac);
+  RunTest(TestGcmThreads);
+  RunTest(TestEncryptionStream);
   RunTest(TestHkdf);
+  RunTest(TestAes);
+  RunTest(TestCpuFeatures);
+  RunTest(TestFieldLimbs);
+  RunTest(TestConvertBatch);
+  RunTest(TestImportIdentities);
   RunTest(TestRatchet);
   RunTest(TestDeriveChainKey);
   RunTest(TestSerialization);
   RunTest(TestSessionIntegration);
   RunTest(TestReceive);
   RunTest(TestSession);
+  RunTest(TestDecryptFailure);
+  RunTest(TestEncryptKeyTo);
+  RunTest(TestStats);
+  RunTest(TestTraceHooks);
+  RunTest(TestVerifyBundles);
+  RunTest(TestSignatureCache);
+  RunTest(TestStackBudget);
+  RunTest(TestContext);
   puts("All tests succeeded");
 }
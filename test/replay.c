@@ -0,0 +1,169 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Decrypts a corpus recorded by `o/generate -c`, see corpus.h. Every
+// run starts from the sessions right after initiation and goes through
+// all recorded messages in order, so one op is the whole corpus.
+// ReplayKeys only decrypts the key messages, Replay also the payloads.
+//
+// $ o/replay-hacl-openssl corpus.bin [-r repeats] [-t ms] [-o file.csv]
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "omemo.h"
+#include "bench.h"
+#include "corpus.h"
+
+#ifdef OMEMO2
+#define VERSION "2"
+#else
+#define VERSION "0.3"
+#endif
+
+struct Event {
+  uint32_t stream;
+  uint16_t to, from;
+  bool isprekey;
+  uint16_t keyn, payloadn;
+  const uint8_t *key, *iv, *payload;
+};
+
+static struct World world;
+static struct omemoSession *initial;
+static struct Event *events;
+static uint32_t nevents;
+static size_t payloadbytes;
+
+static uint64_t GetInt(const uint8_t **p, const uint8_t *end, int n) {
+  uint64_t v = 0;
+  assert(*p + n <= end);
+  for (int i = 0; i < n; i++)
+    v |= (uint64_t)(*p)[i] << (8 * i);
+  *p += n;
+  return v;
+}
+
+static const uint8_t *GetBytes(const uint8_t **p, const uint8_t *end,
+                               size_t n) {
+  const uint8_t *b = *p;
+  assert(*p + n <= end);
+  *p += n;
+  return b;
+}
+
+static void LoadCorpus(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  assert(!fseek(f, 0, SEEK_END));
+  long n = ftell(f);
+  rewind(f);
+  uint8_t *buf = malloc(n);
+  assert(buf && fread(buf, 1, n, f) == n);
+  fclose(f);
+  const uint8_t *p = buf, *end = buf + n;
+  assert(!memcmp(GetBytes(&p, end, 8), CORPUSMAGIC, 8));
+  if (GetInt(&p, end, 4) != CORPUSVERSION) {
+    fprintf(stderr, "%s is not an OMEMO %s corpus\n", path, VERSION);
+    exit(1);
+  }
+  int devices = GetInt(&p, end, 4);
+  uint64_t seed = GetInt(&p, end, 8);
+  nevents = GetInt(&p, end, 4);
+  assert((events = calloc(nevents, sizeof(*events))));
+  for (uint32_t i = 0; i < nevents; i++) {
+    struct Event *e = events + i;
+    e->stream = GetInt(&p, end, 4);
+    e->to = GetInt(&p, end, 2);
+    e->from = GetInt(&p, end, 2);
+    e->isprekey = GetInt(&p, end, 1);
+    e->keyn = GetInt(&p, end, 2);
+    e->key = GetBytes(&p, end, e->keyn);
+    e->payloadn = GetInt(&p, end, 2);
+    e->iv = GetBytes(&p, end, 12);
+    e->payload = GetBytes(&p, end, e->payloadn);
+    assert(e->to < devices && e->from < devices);
+    payloadbytes += e->payloadn;
+  }
+  SetupWorld(&world, devices, seed);
+  size_t sz = devices * devices * sizeof(*initial);
+  assert((initial = malloc(sz)));
+  memcpy(initial, world.sessions, sz);
+  printf("%s: %d devices, %u key messages, %zu payload bytes\n", path,
+         devices, nevents, payloadbytes);
+}
+
+static void Replay(bool payloads) {
+  memcpy(world.sessions, initial,
+         world.n * world.n * sizeof(*initial));
+  ClearSkippedKeys();
+  for (uint32_t i = 0; i < nevents; i++) {
+    const struct Event *e = events + i;
+    uint8_t key[OMEMO_KEYSIZE];
+    size_t keyn = sizeof(key);
+    Reseed(world.seed, e->stream);
+    assert(!omemoDecryptKey(SESSION(&world, e->to, e->from),
+                            world.stores + e->to, key, &keyn,
+                            e->isprekey, e->key, e->keyn));
+    if (payloads && e->payloadn) {
+      uint8_t dec[CORPUSMAXPAYLOAD + 16];
+#ifdef OMEMO2
+      size_t decn;
+      assert(!omemoDecryptMessage(dec, &decn, key, keyn, e->payload,
+                                  e->payloadn));
+#else
+      assert(!omemoDecryptMessage(dec, key, keyn, e->iv, e->payload,
+                                  e->payloadn));
+#endif
+    }
+  }
+}
+
+static void BenchReplayKeys(void) {
+  Replay(false);
+}
+
+static void BenchReplay(void) {
+  Replay(true);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || *argv[1] == '-') {
+    fprintf(stderr, "usage: %s corpus.bin [-r repeats] [-t ms] "
+                    "[-o file.csv] [filter]\n", argv[0]);
+    return 1;
+  }
+  LoadCorpus(argv[1]);
+  struct Bench benches[] = {
+      {"ReplayKeys", BenchReplayKeys},
+      {"Replay", BenchReplay, payloadbytes},
+  };
+  char drivers[128];
+  snprintf(drivers, sizeof(drivers), "%s/%s/%s",
+           omemoGetDriverImpl(OMEMO_DRIVER_CURVE),
+           omemoGetDriverImpl(OMEMO_DRIVER_AES),
+           omemoGetDriverImpl(OMEMO_DRIVER_HASH));
+  argv[1] = argv[0];
+  return RunBenches(argc - 1, argv + 1, VERSION, drivers, benches,
+                    sizeof(benches) / sizeof(*benches));
+}
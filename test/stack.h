@@ -0,0 +1,70 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Peak stack use by painting. StackProbe(true) fills STACKPAINTSIZE
+// bytes below the caller with a pattern and StackProbe(false) returns
+// how many of them were overwritten since. Both are called from the
+// same function as the measured call, so the painted area starts right
+// below its frame and the result is off by at most a few words.
+
+#ifndef OMEMO_STACK_H_
+#define OMEMO_STACK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STACKPAINTSIZE (64 * 1024)
+#define STACKPAINT     0xa5
+
+static __attribute__((noinline)) size_t StackProbe(bool paint) {
+  volatile uint8_t buf[STACKPAINTSIZE];
+  // The compiler may pop the arguments of the measured call late, then
+  // the second probe is a bit lower, so it checks the area of the first.
+  static uintptr_t lo;
+  size_t i;
+  if (paint) {
+    for (i = 0; i < STACKPAINTSIZE; i++)
+      buf[i] = STACKPAINT;
+    lo = (uintptr_t)buf;
+    return 0;
+  }
+  // The stack grows down, the first byte is the deepest.
+  volatile uint8_t *p = (volatile uint8_t *)lo;
+  for (i = 0; i < STACKPAINTSIZE && p[i] == STACKPAINT; i++)
+    ;
+  return STACKPAINTSIZE - i;
+}
+
+// Memcheck marks the stack of returned frames as undefined, so the
+// paint can't be read back under valgrind.
+static bool CanMeasureStack(void) {
+  const char *p = getenv("LD_PRELOAD");
+  return !p || !strstr(p, "vgpreload");
+}
+
+// Bytes of stack used by the expression call. The measured function
+// must not be inlined, or its locals end up in the frame of the caller.
+#define MEASURESTACK(call) (StackProbe(true), (call), StackProbe(false))
+
+// f called through a volatile pointer, which can't be inlined.
+#define NOINLINE(f) (*(__typeof__(&(f)) volatile[]){&(f)})
+
+#endif
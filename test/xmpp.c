@@ -19,6 +19,7 @@
 #include <sys/poll.h>
 
 #include "test/cacert.inc"
+#include "test/xmppserver.h"
 
 #define Log(fmt, ...) fprintf(stdout, fmt "\n" __VA_OPT__(,) __VA_ARGS__)
 #define LogWarn(fmt, ...) fprintf(stdout, "\e[33m" fmt "\e[0m\n" __VA_OPT__(,) __VA_ARGS__)
@@ -329,6 +330,82 @@ static void TestBuilder() {
   assert(!strcmp(buf, "test&lt;&gt; 100"));
 }
 
+// Runs c until it would block.
+// returns the number of messages received
+static int StepLoopbackClient(struct xmppClient *c, int fd) {
+  char *buf;
+  size_t n;
+  ssize_t r;
+  int msgs = 0;
+  for (;;) {
+    switch ((r = xmppIterate(c))) {
+    case XMPP_ITER_SEND:
+      xmppGetSendBuffer(c, &buf, &n, NULL);
+      if ((r = write(fd, buf, n)) < 0)
+        return msgs;
+      xmppAddAmountSent(c, r);
+      break;
+    case XMPP_ITER_READY:
+    case XMPP_ITER_RECV:
+      xmppGetReceiveBuffer(c, &buf, &n, NULL);
+      if ((r = read(fd, buf, n)) <= 0)
+        return msgs;
+      xmppAddAmountReceived(c, r);
+      break;
+    case XMPP_ITER_GIVEPWD:
+      assert(!xmppSupplyPassword(c, "userpass"));
+      break;
+    case XMPP_ITER_STANZA:
+      msgs += c->stanza.type == XMPP_STANZA_MESSAGE;
+      break;
+    default:
+      assert(r > 0);
+    }
+  }
+}
+
+static int ConnectLoopback(struct Server *s) {
+  int fds[2];
+  assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  SetNonBlocking(fds[0]);
+  assert(AddConnection(s, fds[1]));
+  return fds[0];
+}
+
+// One client logs in with SCRAM-SHA-1, the other with PLAIN, then they
+// message each other through the stand-in server.
+static void TestServer() {
+  static struct Server server;
+  static struct xmppClient a, b;
+  static struct StaticData sda, sdb;
+  int msgs = 0;
+  SetupServer(&server, "localhost", "userpass");
+  int fda = ConnectLoopback(&server), fdb = ConnectLoopback(&server);
+  xmppInitClient(&a, &sda, "admin@localhost/a", XMPP_OPT_FORCEUNENCRYPTED);
+  xmppInitClient(&b, &sdb, "user@localhost",
+                 XMPP_OPT_FORCEUNENCRYPTED | XMPP_OPT_FORCEPLAIN |
+                     XMPP_OPT_ALLOWUNENCRYPTEDPLAIN);
+  for (int i = 0; i < 100 && !(a.isnegotiationdone && b.isnegotiationdone); i++) {
+    PollServer(&server, 10);
+    StepLoopbackClient(&a, fda);
+    StepLoopbackClient(&b, fdb);
+  }
+  assert(a.isnegotiationdone && b.isnegotiationdone);
+  assert(!xmppFormatStanza(&a, "<message to='%s' id='m1'><body>%s</body></message>", "user@localhost", "Hi"));
+  assert(!xmppFormatStanza(&b, "<message to='%s' id='m2'><body>%s</body></message>", "admin@localhost/a", "Hello"));
+  assert(!xmppFormatStanza(&b, "<message to='%s' id='m3'/>", "nobody@localhost"));
+  for (int i = 0; i < 100 && msgs < 2; i++) {
+    PollServer(&server, 10);
+    msgs += StepLoopbackClient(&a, fda);
+    msgs += StepLoopbackClient(&b, fdb);
+  }
+  assert(msgs == 2);
+  assert(server.routed == 2 && server.dropped == 1);
+  close(fda);
+  close(fdb);
+  FreeServer(&server);
+}
+
 int main() {
   puts("Starting tests");
   TestXmlSlice();
@@ -338,6 +415,7 @@ int main() {
   TestParseJid();
   TestBuilder();
   TestBuilderInClient();
+  TestServer();
   puts("All tests passed");
   return 0;
 }
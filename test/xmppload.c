@@ -0,0 +1,393 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Load generator for the whole client path: K example/xmpp.c clients
+// log in to the stand-in server of xmppserver.h and send each other
+// OMEMO encrypted messages in the format of example/im.c. Every message
+// is timed from encrypting it at the sender, through the builder, the
+// server and the receiver's parser until it is decrypted. Clients,
+// server and sessions (see corpus.h) all run in one thread.
+//
+// $ o/xmppload [-k clients] [-m messages] [-w window] [-b bytes] [-p] [-t]
+//
+// -m is the number of messages per client, each client has at most -w
+// of them on their way. -b is the payload size. -p logs in with PLAIN
+// instead of SCRAM-SHA-1, -t connects over TCP on 127.0.0.1 instead of
+// socketpairs.
+
+#include "example/xmpp.c"
+#include "test/xmppserver.h"
+#include "test/corpus.h"
+
+#include <getopt.h>
+#include <time.h>
+
+#ifdef OMEMO2
+#define VERSION "2"
+#else
+#define VERSION "0.3"
+#endif
+
+#define DOMAIN   "localhost"
+#define PASSWORD "loadpass"
+
+struct LoadClient {
+  int i, fd;
+  struct xmppClient c;
+  struct StaticData *sd;
+  bool online;
+  int sent, inflight, next;
+};
+
+static struct Server server;
+static struct World world;
+static struct LoadClient *clients;
+// canencrypt[i * k + j]: client i has a session with j it can send on
+static bool *canencrypt;
+static int64_t *senttime, *latencies;
+static int k = 4, messages = 1000, window = 8, payloadn = 100;
+static long received, total;
+static bool running;
+
+int xmppRandom(void *p, size_t n) { return getrandom(p, n, 0) != n; }
+
+static int64_t Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void MakePayload(uint8_t *p, int id) {
+  for (int i = 0; i < payloadn; i++)
+    p[i] = 'a' + (id + i) % 26;
+}
+
+static bool SendMessage(struct LoadClient *lc) {
+  uint8_t payload[CORPUSMAXPAYLOAD + 16], key[OMEMO_KEYSIZE];
+  struct omemoKeyMessage msg;
+  char to[64];
+  int j = 0, n;
+  if (lc->sent == messages || lc->inflight == window)
+    return false;
+  for (n = 0; n < k; n++) {
+    j = (lc->next + n) % k;
+    if (canencrypt[lc->i * k + j])
+      break;
+  }
+  if (n == k)
+    return false;
+  lc->next = j + 1;
+  int id = lc->i * messages + lc->sent;
+  senttime[id] = Now();
+  MakePayload(payload, id);
+#ifdef OMEMO2
+  assert(!omemoEncryptMessage(payload, key, payload, payloadn));
+  n = payloadn + omemoGetMessagePadSize(payloadn);
+#else
+  uint8_t iv[12];
+  assert(!omemoEncryptMessage(payload, key, iv, payload, payloadn));
+  n = payloadn;
+#endif
+  assert(!omemoEncryptKey(SESSION(&world, lc->i, j), &msg, key,
+                          sizeof(key)));
+  snprintf(to, sizeof(to), "user%d@" DOMAIN, j);
+#ifdef OMEMO2
+  assert(!xmppFormatStanza(
+      &lc->c,
+      "<message to='%s' id='%d' type='chat'><encrypted "
+      "xmlns='urn:xmpp:omemo:2'><header sid='%d'><keys jid='%s'><key "
+      "rid='%d'[ kex='true']>%b</key></keys></header><payload>%b</payload>"
+      "</encrypted><store xmlns='urn:xmpp:hints'/></message>",
+      to, id, lc->i + 1, to, j + 1, msg.isprekey, (int)msg.n, msg.p, n,
+      payload));
+#else
+  assert(!xmppFormatStanza(
+      &lc->c,
+      "<message to='%s' id='%d' type='chat'><encrypted "
+      "xmlns='eu.siacs.conversations.axolotl'><header sid='%d'><key "
+      "[prekey='true' ]rid='%d'>%b</key><iv>%b</iv></header><payload>%b"
+      "</payload></encrypted><store xmlns='urn:xmpp:hints'/></message>",
+      to, id, lc->i + 1, msg.isprekey, j + 1, (int)msg.n, msg.p,
+      (int)sizeof(iv), iv, n, payload));
+#endif
+  lc->sent++;
+  lc->inflight++;
+  return true;
+}
+
+static void DecodeContent(struct xmppParser *p, uint8_t *d, size_t *n) {
+  struct xmppXmlSlice slc;
+  xmppParseContent(p, &slc);
+  if (!slc.p || xmppDecodeBase64XmlSlice(d, n, &slc))
+    longjmp(p->jb, XMPP_ESPEC);
+}
+
+static void ParseKey(struct xmppParser *p, int me, uint8_t *d, size_t *n,
+                     bool *isprekey) {
+  struct xmppXmlSlice attr;
+  int rid = 0;
+  while (xmppParseAttribute(p, &attr)) {
+    if (!strcmp(p->x.attr, "rid"))
+      xmppDecodeIntXmlSlice(&rid, &attr);
+    else if (!strcmp(p->x.attr, "prekey") || !strcmp(p->x.attr, "kex"))
+      *isprekey = true;
+  }
+  if (rid == me + 1)
+    DecodeContent(p, d, n);
+  else
+    xmppParseUnknown(p);
+}
+
+static void HandleMessage(struct LoadClient *lc, struct xmppStanza *st) {
+  uint8_t xbuf[200], keymsg[OMEMO_KEYMESSAGE_MAXSIZE],
+      payload[CORPUSMAXPAYLOAD + 16], expected[CORPUSMAXPAYLOAD],
+      key[OMEMO_KEYSIZE], iv[12];
+  size_t keymsgn = 0, payloadsz = sizeof(payload), ivn = sizeof(iv),
+         keyn = sizeof(key);
+  struct xmppXmlSlice attr;
+  bool isprekey = false;
+  int from = -1, id, r;
+  struct xmppParser parser = {.p = st->raw.p, .n = st->raw.n,
+                              .c = st->raw.n};
+  struct xmppParser *p = &parser;
+  yxml_init(&p->x, xbuf, sizeof(xbuf));
+  if ((r = setjmp(p->jb))) {
+    fprintf(stderr, "client %d: bad message (%d)\n", lc->i, r);
+    exit(1);
+  }
+  assert(xmppParseElement(p));
+  while (xmppParseElement(p)) {
+    if (strcmp(p->x.elem, "encrypted")) {
+      xmppParseUnknown(p);
+      continue;
+    }
+    while (xmppParseElement(p)) {
+      if (!strcmp(p->x.elem, "header")) {
+        while (xmppParseAttribute(p, &attr)) {
+          if (!strcmp(p->x.attr, "sid") && xmppDecodeIntXmlSlice(&from, &attr))
+            from--;
+        }
+        while (xmppParseElement(p)) {
+          if (!strcmp(p->x.elem, "keys")) {
+            while (xmppParseElement(p)) {
+              keymsgn = sizeof(keymsg);
+              ParseKey(p, lc->i, keymsg, &keymsgn, &isprekey);
+            }
+          } else if (!strcmp(p->x.elem, "key")) {
+            keymsgn = sizeof(keymsg);
+            ParseKey(p, lc->i, keymsg, &keymsgn, &isprekey);
+          } else if (!strcmp(p->x.elem, "iv")) {
+            DecodeContent(p, iv, &ivn);
+          } else {
+            xmppParseUnknown(p);
+          }
+        }
+      } else if (!strcmp(p->x.elem, "payload")) {
+        DecodeContent(p, payload, &payloadsz);
+      } else {
+        xmppParseUnknown(p);
+      }
+    }
+  }
+  assert(from >= 0 && from < k && keymsgn);
+  assert(xmppDecodeIntXmlSlice(&id, &st->id));
+  assert(!omemoDecryptKey(SESSION(&world, lc->i, from), world.stores + lc->i,
+                          key, &keyn, isprekey, keymsg, keymsgn));
+#ifdef OMEMO2
+  size_t n;
+  assert(!omemoDecryptMessage(payload, &n, key, keyn, payload, payloadsz));
+  assert(n == payloadn);
+#else
+  assert(ivn == 12 && payloadsz == payloadn);
+  assert(!omemoDecryptMessage(payload, key, keyn, iv, payload, payloadsz));
+#endif
+  latencies[received++] = Now() - senttime[id];
+  MakePayload(expected, id);
+  assert(!memcmp(payload, expected, payloadn));
+  canencrypt[lc->i * k + from] = true;
+  clients[from].inflight--;
+}
+
+// Does everything the client can do without blocking.
+static void StepClient(struct LoadClient *lc) {
+  char *buf;
+  size_t n;
+  ssize_t r;
+  for (;;) {
+    switch ((r = xmppIterate(&lc->c))) {
+    case XMPP_ITER_SEND:
+      xmppGetSendBuffer(&lc->c, &buf, &n, NULL);
+      if ((r = write(lc->fd, buf, n)) < 0) {
+        if (errno == EAGAIN)
+          return;
+        perror("write");
+        exit(1);
+      }
+      xmppAddAmountSent(&lc->c, r);
+      break;
+    case XMPP_ITER_READY:
+      lc->online = true;
+      if (running && SendMessage(lc))
+        break;
+      // fallthrough
+    case XMPP_ITER_RECV:
+      xmppGetReceiveBuffer(&lc->c, &buf, &n, NULL);
+      if ((r = read(lc->fd, buf, n)) <= 0) {
+        if (r < 0 && errno == EAGAIN)
+          return;
+        fprintf(stderr, "client %d: connection closed\n", lc->i);
+        exit(1);
+      }
+      xmppAddAmountReceived(&lc->c, r);
+      break;
+    case XMPP_ITER_GIVEPWD:
+      assert(!xmppSupplyPassword(&lc->c, PASSWORD));
+      break;
+    case XMPP_ITER_STANZA:
+      if (lc->c.stanza.type == XMPP_STANZA_MESSAGE)
+        HandleMessage(lc, &lc->c.stanza);
+      break;
+    case XMPP_ITER_OK:
+    case XMPP_ITER_ACK:
+      break;
+    default:
+      fprintf(stderr, "client %d: xmppIterate returned %d\n", lc->i, (int)r);
+      exit(1);
+    }
+  }
+}
+
+static int Connect(int port) {
+  int fds[2];
+  if (port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert((fds[0] = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    assert(!connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)));
+  } else {
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    AddConnection(&server, fds[1]);
+  }
+  SetNonBlocking(fds[0]);
+  return fds[0];
+}
+
+static int CompareInt64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double Percentile(double q) {
+  return latencies[(long)(q * (total - 1))] / 1e3;
+}
+
+int main(int argc, char **argv) {
+  int opt, opts = XMPP_OPT_FORCEUNENCRYPTED, port = 0;
+  bool tcp = false;
+  while ((opt = getopt(argc, argv, "k:m:w:b:pt")) != -1) {
+    switch (opt) {
+    break; case 'k': k = atoi(optarg);
+    break; case 'm': messages = atoi(optarg);
+    break; case 'w': window = atoi(optarg);
+    break; case 'b': payloadn = atoi(optarg);
+    break; case 'p': opts |= XMPP_OPT_FORCEPLAIN | XMPP_OPT_ALLOWUNENCRYPTEDPLAIN;
+    break; case 't': tcp = true;
+    break; default:
+      fprintf(stderr, "usage: %s [-k clients] [-m messages] [-w window] "
+                      "[-b bytes] [-p] [-t]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (k < 2 || k > CORPUSMAXDEVICES || messages < 1 || window < 1 ||
+      payloadn < 1 || payloadn > CORPUSMAXPAYLOAD) {
+    fprintf(stderr, "%s: bad arguments\n", argv[0]);
+    return 1;
+  }
+  total = (long)k * messages;
+  assert((clients = calloc(k, sizeof(*clients))));
+  assert((canencrypt = calloc(k * k, sizeof(*canencrypt))));
+  assert((senttime = calloc(total, sizeof(*senttime))));
+  assert((latencies = calloc(total, sizeof(*latencies))));
+
+  int64_t start = Now();
+  SetupWorld(&world, k, 1);
+  SetupServer(&server, DOMAIN, PASSWORD);
+  if (tcp)
+    assert((port = ListenServer(&server, 0)) > 0);
+  for (int i = 0; i < k; i++) {
+    struct LoadClient *lc = clients + i;
+    char jid[64];
+    for (int j = i + 1; j < k; j++)
+      canencrypt[i * k + j] = true;
+    lc->i = i;
+    lc->next = i + 1;
+    lc->fd = Connect(port);
+    assert((lc->sd = calloc(1, sizeof(*lc->sd))));
+    snprintf(jid, sizeof(jid), "user%d@" DOMAIN "/load", i);
+    xmppInitClient(&lc->c, lc->sd, jid, opts);
+  }
+  for (int online = 0; online < k;) {
+    PollServer(&server, 0);
+    online = 0;
+    for (int i = 0; i < k; i++) {
+      StepClient(clients + i);
+      online += clients[i].online;
+    }
+  }
+  int64_t setup = Now() - start;
+
+  start = Now();
+  running = true;
+  while (received < total) {
+    PollServer(&server, 0);
+    for (int i = 0; i < k; i++)
+      StepClient(clients + i);
+  }
+  double secs = (Now() - start) / 1e9;
+
+  qsort(latencies, total, sizeof(*latencies), CompareInt64);
+  printf("OMEMO %s, %s/%s/%s, %d clients over %s, %s\n", VERSION,
+         omemoGetDriverImpl(OMEMO_DRIVER_CURVE),
+         omemoGetDriverImpl(OMEMO_DRIVER_AES),
+         omemoGetDriverImpl(OMEMO_DRIVER_HASH), k,
+         tcp ? "TCP" : "socketpairs",
+         opts & XMPP_OPT_FORCEPLAIN ? "PLAIN" : "SCRAM-SHA-1");
+  printf("login: %.1f ms\n", setup / 1e6);
+  printf("%ld messages of %d bytes in %.3f s: %.0f messages/s, "
+         "%.0f stanzas/s at the server (%.0f elements/s)\n",
+         total, payloadn, secs, total / secs, server.stanzas / secs,
+         server.elements / secs);
+  printf("latency us: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+         Percentile(.5), Percentile(.9), Percentile(.99),
+         latencies[total - 1] / 1e3);
+
+  for (int i = 0; i < k; i++) {
+    close(clients[i].fd);
+    free(clients[i].sd);
+  }
+  FreeServer(&server);
+  FreeWorld(&world);
+  ClearSkippedKeys();
+  free(clients);
+  free(canencrypt);
+  free(senttime);
+  free(latencies);
+  return 0;
+}
@@ -0,0 +1,639 @@
+/**
+ * Copyright 2026 mierenhoop
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// A stand-in XMPP server that serves example/xmpp.c clients without
+// Prosody. It must be included after example/xmpp.c, it reuses the
+// parser, builder and SCRAM primitives from there. There is no TLS, so
+// clients must use XMPP_OPT_FORCEUNENCRYPTED, and for PLAIN also
+// XMPP_OPT_ALLOWUNENCRYPTEDPLAIN.
+//
+// It speaks just enough for the client:
+// - the stream header and features
+// - SASL PLAIN and SCRAM-SHA-1, every account has the same password
+// - resource binding, a resource is made up when none is asked for
+// - XEP-0198 <enable/>, <r/> and <a/>, without resumption
+// - routing <message/> and <iq/> to a bound full or bare JID, stanzas
+//   to unknown JIDs and iqs to the server are dropped
+//
+// Everything runs in the caller's thread. Connections come from
+// AddConnection (e.g. one end of a socketpair) or from the socket made
+// by ListenServer, PollServer then does whatever can be done without
+// blocking.
+
+#ifndef XMPPSERVER_H_
+#define XMPPSERVER_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define SERVERMAXCONNS   256
+#define SERVERINBUF      (1 << 16)
+#define SERVEROUTBUF     (1 << 18)
+#define SERVERXBUF       512
+#define SERVERMAXJID     128
+#define SERVERMAXREPLY   512
+#define SERVERSCRAMITERS 4096
+// Ask a client for an ack after this many routed stanzas.
+#define SERVERACKEVERY   8
+
+enum {
+  SERVERSTATE_STREAM, // expecting <stream:stream>
+  SERVERSTATE_SASL,
+  SERVERSTATE_SCRAM, // sent the SCRAM challenge
+  SERVERSTATE_BIND,
+  SERVERSTATE_BOUND,
+  SERVERSTATE_CLOSED,
+};
+
+struct ServerConn {
+  int fd, state, id;
+  bool authed, smacks;
+  // h counts the stanzas received since <enable/>, sent the ones routed
+  // to the client and acked the last h the client answered with.
+  int h, sent, acked;
+  char user[64], jid[SERVERMAXJID], barejid[SERVERMAXJID];
+  // client-first-message-bare "," server-first-message, and the offset
+  // and size of the combined nonce in it
+  char scram[512];
+  size_t scramn, nonce, noncen;
+  // The parser takes the builder's place in xmppClient, written is how
+  // much of builder.p has been written to fd.
+  struct xmppParser parser;
+  struct xmppBuilder builder;
+  size_t written;
+  char in[SERVERINBUF], out[SERVEROUTBUF], xbuf[SERVERXBUF];
+};
+
+struct Server {
+  const char *domain, *password;
+  int listenfd, nconns, nextid;
+  struct ServerConn *conns[SERVERMAXCONNS];
+  char salt[16], storedkey[20], serverkey[20];
+  // elements counts every top-level element read from clients,
+  // stanzas only <message/>, <iq/> and <presence/>
+  uint64_t elements, stanzas, routed, dropped;
+};
+
+enum {
+  ELEM_OTHER,
+  ELEM_STREAM,
+  ELEM_STREAMEND,
+  ELEM_AUTH,
+  ELEM_RESPONSE,
+  ELEM_BIND,
+  ELEM_IQ,
+  ELEM_MESSAGE,
+  ELEM_PRESENCE,
+  ELEM_ENABLE,
+  ELEM_ACKREQUEST,
+  ELEM_ACKANSWER,
+};
+
+// Top-level element read from a client, the slices point into the
+// connection's input buffer.
+struct ClientElement {
+  int type, h;
+  bool hasfrom;
+  size_t namen;
+  struct xmppXmlSlice raw, id, to, mechanism, content;
+};
+
+static void SetupServer(struct Server *s, const char *domain,
+                        const char *password) {
+  char saltedpwd[20], clientkey[20];
+  memset(s, 0, sizeof(*s));
+  s->domain = domain;
+  s->password = password;
+  s->listenfd = -1;
+  // Every account has the same password, so the keys are the same too.
+  assert(!xmppRandom(s->salt, sizeof(s->salt)));
+  assert(H(saltedpwd, password, strlen(password), s->salt, sizeof(s->salt),
+           SERVERSCRAMITERS));
+  assert(HMAC(clientkey, "Client Key", 10, saltedpwd));
+  assert(Sha1(s->storedkey, clientkey));
+  assert(HMAC(s->serverkey, "Server Key", 10, saltedpwd));
+}
+
+static void SetNonBlocking(int fd) {
+  assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != -1);
+}
+
+// fd is owned by the server from now on.
+static struct ServerConn *AddConnection(struct Server *s, int fd) {
+  struct ServerConn *c;
+  if (s->nconns == SERVERMAXCONNS || !(c = calloc(1, sizeof(*c)))) {
+    close(fd);
+    return NULL;
+  }
+  SetNonBlocking(fd);
+  c->fd = fd;
+  c->id = s->nextid++;
+  c->parser.p = c->in;
+  c->parser.c = sizeof(c->in);
+  c->parser.xbuf = c->xbuf;
+  c->parser.xbufn = sizeof(c->xbuf);
+  c->builder.p = c->out;
+  c->builder.c = sizeof(c->out);
+  s->conns[s->nconns++] = c;
+  return c;
+}
+
+// Listen on 127.0.0.1:port, port 0 picks a free one.
+// returns the port or -1 on error
+static int ListenServer(struct Server *s, int port) {
+  struct sockaddr_in addr = {0};
+  socklen_t len = sizeof(addr);
+  int one = 1;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((s->listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return -1;
+  setsockopt(s->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(s->listenfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(s->listenfd, SERVERMAXCONNS) ||
+      getsockname(s->listenfd, (struct sockaddr *)&addr, &len)) {
+    close(s->listenfd);
+    s->listenfd = -1;
+    return -1;
+  }
+  SetNonBlocking(s->listenfd);
+  return ntohs(addr.sin_port);
+}
+
+static bool HasRoom(const struct ServerConn *c, size_t n) {
+  return c->builder.c - c->builder.n > n;
+}
+
+static void AppendRaw(struct xmppBuilder *b, const char *p, size_t n) {
+  memcpy(b->p + b->n, p, n);
+  b->n += n;
+}
+
+// Same as the client's xmppParseStanza, but for what clients send.
+static int ParseClientElement(struct ServerConn *c, struct ClientElement *el) {
+  struct xmppParser *p = &c->parser;
+  struct xmppXmlSlice attr;
+  size_t i = p->i;
+  int r;
+  memset(el, 0, sizeof(*el));
+  yxml_init(&p->x, p->xbuf, p->xbufn);
+  if (c->state != SERVERSTATE_STREAM) {
+    for (const char *pre = "<stream:stream>"; *pre; pre++)
+      yxml_parse(&p->x, *pre);
+  }
+  if ((r = setjmp(p->jb))) {
+    memset(el, 0, sizeof(*el));
+    p->i = i;
+    return r;
+  }
+  el->raw.p = p->p + p->i;
+  if (!xmppParseElement(p)) {
+    el->type = ELEM_STREAMEND;
+  } else if (c->state == SERVERSTATE_STREAM) {
+    if (strcmp(p->x.elem, "stream:stream"))
+      longjmp(p->jb, XMPP_ESPEC);
+    el->type = ELEM_STREAM;
+    while (xmppParseAttribute(p, &attr)) {}
+  } else if (!strcmp(p->x.elem, "auth")) {
+    el->type = ELEM_AUTH;
+    while (xmppParseAttribute(p, &attr)) {
+      if (!strcmp(p->x.attr, "mechanism"))
+        memcpy(&el->mechanism, &attr, sizeof(attr));
+    }
+    xmppParseContent(p, &el->content);
+  } else if (!strcmp(p->x.elem, "response")) {
+    el->type = ELEM_RESPONSE;
+    xmppParseContent(p, &el->content);
+  } else if (!strcmp(p->x.elem, "enable")) {
+    el->type = ELEM_ENABLE;
+    xmppParseUnknown(p);
+  } else if (!strcmp(p->x.elem, "r")) {
+    el->type = ELEM_ACKREQUEST;
+    xmppParseUnknown(p);
+  } else if (!strcmp(p->x.elem, "a")) {
+    el->type = ELEM_ACKANSWER;
+    while (xmppParseAttribute(p, &attr)) {
+      if (!strcmp(p->x.attr, "h") && !xmppDecodeIntXmlSlice(&el->h, &attr))
+        longjmp(p->jb, XMPP_ESPEC);
+    }
+    xmppParseUnknown(p);
+  } else if (!strcmp(p->x.elem, "iq")) {
+    el->type = ELEM_IQ;
+    el->namen = 2;
+    while (xmppParseAttribute(p, &attr)) {
+      if (!strcmp(p->x.attr, "id"))
+        memcpy(&el->id, &attr, sizeof(attr));
+      else if (!strcmp(p->x.attr, "to"))
+        memcpy(&el->to, &attr, sizeof(attr));
+      else if (!strcmp(p->x.attr, "from"))
+        el->hasfrom = true;
+    }
+    while (xmppParseElement(p)) {
+      if (!strcmp(p->x.elem, "bind")) {
+        el->type = ELEM_BIND;
+        while (xmppParseElement(p)) {
+          if (!strcmp(p->x.elem, "resource"))
+            xmppParseContent(p, &el->content);
+          else
+            xmppParseUnknown(p);
+        }
+      } else {
+        xmppParseUnknown(p);
+      }
+    }
+  } else if (!strcmp(p->x.elem, "message") ||
+             !strcmp(p->x.elem, "presence")) {
+    el->type = *p->x.elem == 'm' ? ELEM_MESSAGE : ELEM_PRESENCE;
+    el->namen = strlen(p->x.elem);
+    while (xmppParseAttribute(p, &attr)) {
+      if (!strcmp(p->x.attr, "to"))
+        memcpy(&el->to, &attr, sizeof(attr));
+      else if (!strcmp(p->x.attr, "from"))
+        el->hasfrom = true;
+    }
+    xmppParseUnknown(p);
+  } else {
+    xmppParseUnknown(p);
+  }
+  el->raw.rawn = el->raw.n = p->i - i;
+  return 0;
+}
+
+static void StartServerStream(struct Server *s, struct ServerConn *c) {
+  xmppAppendXml(&c->builder,
+                "<?xml version='1.0'?><stream:stream from='%s' id='%d'"
+                " version='1.0' xmlns='jabber:client'"
+                " xmlns:stream='http://etherx.jabber.org/streams'>"
+                "<stream:features>",
+                s->domain, c->id);
+  if (c->authed) {
+    xmppAppendXml(&c->builder,
+                  "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+                  "<required/></bind>"
+                  "<sm xmlns='urn:xmpp:sm:3'><optional/></sm>");
+    c->state = SERVERSTATE_BIND;
+  } else {
+    xmppAppendXml(&c->builder,
+                  "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+                  "<mechanism>SCRAM-SHA-1</mechanism>"
+                  "<mechanism>PLAIN</mechanism></mechanisms>");
+    c->state = SERVERSTATE_SASL;
+  }
+  xmppAppendXml(&c->builder, "</stream:features>");
+}
+
+static void SucceedSasl(struct ServerConn *c, const char *v, size_t n) {
+  xmppAppendXml(&c->builder,
+                "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'[/>][>%b"
+                "</success>]",
+                !n, !!n, (int)n, v);
+  c->authed = true;
+  c->state = SERVERSTATE_STREAM;
+}
+
+static void FailSasl(struct ServerConn *c) {
+  xmppAppendXml(&c->builder,
+                "<failure xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+                "<not-authorized/></failure>");
+  c->state = SERVERSTATE_SASL;
+}
+
+// [authzid] NUL authcid NUL passwd
+static void AuthPlain(struct Server *s, struct ServerConn *c,
+                      const struct xmppXmlSlice *content) {
+  char buf[256], *user, *pwd;
+  size_t n = sizeof(buf) - 1;
+  if (!content->p || xmppDecodeBase64XmlSlice(buf, &n, content))
+    return FailSasl(c);
+  buf[n] = 0;
+  if (!(user = memchr(buf, 0, n)))
+    return FailSasl(c);
+  user++;
+  if (!(pwd = memchr(user, 0, buf + n - user)))
+    return FailSasl(c);
+  pwd++;
+  if (strlen(user) >= sizeof(c->user) || buf + n - pwd != strlen(s->password) ||
+      memcmp(pwd, s->password, buf + n - pwd))
+    return FailSasl(c);
+  strcpy(c->user, user);
+  SucceedSasl(c, NULL, 0);
+}
+
+// client-first-message: gs2-header "n=" user ",r=" cnonce
+static void StartScram(struct Server *s, struct ServerConn *c,
+                       const struct xmppXmlSlice *content) {
+  char buf[256], *bare, *user, *nonce, *p, *e = c->scram + sizeof(c->scram);
+  size_t n = sizeof(buf) - 1;
+  if (!content->p || xmppDecodeBase64XmlSlice(buf, &n, content))
+    return FailSasl(c);
+  buf[n] = 0;
+  if (!(bare = strchr(buf, ',')) || !(bare = strchr(bare + 1, ',')) ||
+      strncmp(++bare, "n=", 2) || !(nonce = strstr(bare, ",r=")))
+    return FailSasl(c);
+  user = bare + 2;
+  if (nonce - user >= sizeof(c->user))
+    return FailSasl(c);
+  memcpy(c->user, user, nonce - user);
+  c->user[nonce - user] = 0;
+  nonce += 3;
+  p = SafeStpCpy(c->scram, e, bare);
+  p = SafeStpCpy(p, e, ",r=");
+  c->nonce = p - c->scram;
+  p = SafeStpCpy(p, e, nonce);
+  p = FillRandomHex(p, e, 16);
+  c->noncen = p - c->scram - c->nonce;
+  p = SafeStpCpy(p, e, ",s=");
+  p = EncodeBase64(p, e, s->salt, sizeof(s->salt));
+  p = SafeStpCpy(p, e, ",i=");
+  p = Itoa(p, e, SERVERSCRAMITERS);
+  if (HasOverflowed(p, e))
+    return FailSasl(c);
+  c->scramn = p - c->scram;
+  size_t first = strlen(bare) + 1;
+  xmppAppendXml(&c->builder,
+                "<challenge xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>%b"
+                "</challenge>",
+                (int)(c->scramn - first), c->scram + first);
+  c->state = SERVERSTATE_SCRAM;
+}
+
+// client-final-message: "c=biws,r=" nonce ",p=" proof
+static void FinishScram(struct Server *s, struct ServerConn *c,
+                        const struct xmppXmlSlice *content) {
+  char buf[256], *proofb64, *p, *e = c->scram + sizeof(c->scram);
+  char proof[20], clientsig[20], clientkey[20], storedkey[20];
+  char serversig[20], v[40];
+  size_t n = sizeof(buf) - 1;
+  if (!content->p || xmppDecodeBase64XmlSlice(buf, &n, content))
+    return FailSasl(c);
+  buf[n] = 0;
+  if (!(p = strstr(buf, ",r=")) || strncmp(p + 3, c->scram + c->nonce, c->noncen) ||
+      !(proofb64 = strstr(buf, ",p=")))
+    return FailSasl(c);
+  p = c->scram + c->scramn;
+  p = SafeStpCpy(p, e, ",");
+  p = SafeMempCpy(p, e, buf, proofb64 - buf);
+  if (HasOverflowed(p, e) ||
+      mbedtls_base64_decode(proof, 20, &n, proofb64 + 3, strlen(proofb64 + 3)) ||
+      n != 20)
+    return FailSasl(c);
+  n = p - c->scram;
+  if (!HMAC(clientsig, c->scram, n, s->storedkey))
+    return FailSasl(c);
+  XorSha1(clientkey, proof, clientsig);
+  if (!Sha1(storedkey, clientkey) || memcmp(storedkey, s->storedkey, 20) ||
+      !HMAC(serversig, c->scram, n, s->serverkey))
+    return FailSasl(c);
+  p = SafeStpCpy(v, v + sizeof(v), "v=");
+  p = EncodeBase64(p, v + sizeof(v), serversig, 20);
+  SucceedSasl(c, v, p - v);
+}
+
+static void Bind(struct Server *s, struct ServerConn *c,
+                 const struct xmppXmlSlice *id,
+                 const struct xmppXmlSlice *resource) {
+  char res[64];
+  int n = snprintf(c->barejid, sizeof(c->barejid), "%s@%s", c->user,
+                   s->domain);
+  if (resource->p && resource->n < sizeof(res)) {
+    xmppReadXmlSlice(res, resource);
+    res[resource->n] = 0;
+  } else {
+    snprintf(res, sizeof(res), "r%d", c->id);
+  }
+  snprintf(c->jid, sizeof(c->jid), "%.*s/%s", n, c->barejid, res);
+  xmppAppendXml(&c->builder, "<iq type='result' id='");
+  if (id->p)
+    AppendRaw(&c->builder, id->p + 1, id->rawn - 2);
+  xmppAppendXml(&c->builder,
+                "'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+                "<jid>%s</jid></bind></iq>",
+                c->jid);
+  c->state = SERVERSTATE_BOUND;
+}
+
+// A full JID goes to that resource, a bare JID to the first one bound.
+static struct ServerConn *FindConnection(struct Server *s,
+                                         const struct xmppXmlSlice *to) {
+  struct ServerConn *bare = NULL;
+  for (int i = 0; i < s->nconns; i++) {
+    struct ServerConn *c = s->conns[i];
+    if (c->state != SERVERSTATE_BOUND)
+      continue;
+    if (xmppCompareXmlSlice(c->jid, to))
+      return c;
+    if (!bare && xmppCompareXmlSlice(c->barejid, to))
+      bare = c;
+  }
+  return bare;
+}
+
+// Copies the stanza as is, only adding the sender's JID.
+// returns XMPP_EMEM when the receiver's buffer is full
+static int RouteStanza(struct Server *s, struct ServerConn *from,
+                       const struct ClientElement *el) {
+  struct ServerConn *to;
+  const char *p = el->raw.p;
+  size_t n = el->raw.rawn;
+  if (!el->to.p || !(to = FindConnection(s, &el->to))) {
+    s->dropped++;
+    return 0;
+  }
+  if (!HasRoom(to, n + strlen(from->jid) + SERVERMAXREPLY))
+    return XMPP_EMEM;
+  while (*p != '<')
+    p++, n--;
+  if (el->hasfrom) {
+    AppendRaw(&to->builder, p, n);
+  } else {
+    AppendRaw(&to->builder, p, el->namen + 1);
+    xmppAppendXml(&to->builder, " from='%s'", from->jid);
+    AppendRaw(&to->builder, p + el->namen + 1, n - el->namen - 1);
+  }
+  if (to->smacks && ++to->sent % SERVERACKEVERY == 0)
+    xmppAppendXml(&to->builder, "<r xmlns='urn:xmpp:sm:3'/>");
+  s->routed++;
+  return 0;
+}
+
+static int HandleClientElement(struct Server *s, struct ServerConn *c,
+                               const struct ClientElement *el) {
+  int r;
+  if (!HasRoom(c, SERVERMAXREPLY))
+    return XMPP_EMEM;
+  switch (el->type) {
+  case ELEM_STREAM:
+    StartServerStream(s, c);
+    break;
+  case ELEM_STREAMEND:
+    xmppAppendXml(&c->builder, "</stream:stream>");
+    c->state = SERVERSTATE_CLOSED;
+    break;
+  case ELEM_AUTH:
+    if (c->state != SERVERSTATE_SASL)
+      return XMPP_ESTATE;
+    if (xmppCompareXmlSlice("PLAIN", &el->mechanism))
+      AuthPlain(s, c, &el->content);
+    else if (xmppCompareXmlSlice("SCRAM-SHA-1", &el->mechanism))
+      StartScram(s, c, &el->content);
+    else
+      FailSasl(c);
+    break;
+  case ELEM_RESPONSE:
+    if (c->state != SERVERSTATE_SCRAM)
+      return XMPP_ESTATE;
+    FinishScram(s, c, &el->content);
+    break;
+  case ELEM_BIND:
+    if (c->state != SERVERSTATE_BIND)
+      return XMPP_ESTATE;
+    Bind(s, c, &el->id, &el->content);
+    break;
+  case ELEM_ENABLE:
+    if (c->state != SERVERSTATE_BOUND)
+      return XMPP_ESTATE;
+    c->smacks = true;
+    c->h = c->sent = c->acked = 0;
+    xmppAppendXml(&c->builder, "<enabled xmlns='urn:xmpp:sm:3' id='sm%d'/>",
+                  c->id);
+    break;
+  case ELEM_ACKREQUEST:
+    xmppAppendXml(&c->builder, "<a xmlns='urn:xmpp:sm:3' h='%d'/>", c->h);
+    break;
+  case ELEM_ACKANSWER:
+    // Not checked against sent, the client starts counting as soon as
+    // it sends <enable/>.
+    c->acked = el->h;
+    break;
+  case ELEM_IQ:
+  case ELEM_MESSAGE:
+  case ELEM_PRESENCE:
+    if (c->state != SERVERSTATE_BOUND)
+      return XMPP_ESTATE;
+    if (el->type != ELEM_PRESENCE && (r = RouteStanza(s, c, el)))
+      return r;
+    s->stanzas++;
+    if (c->smacks)
+      c->h++;
+    break;
+  }
+  s->elements++;
+  return 0;
+}
+
+// Handles every complete element in the input buffer.
+// returns 0, XMPP_EMEM when some receiver is full or another error
+static int HandleServerInput(struct Server *s, struct ServerConn *c) {
+  struct ClientElement el;
+  int r = 0;
+  while (c->state != SERVERSTATE_CLOSED && c->parser.i < c->parser.n) {
+    size_t i = c->parser.i;
+    if ((r = ParseClientElement(c, &el)))
+      break;
+    if ((r = HandleClientElement(s, c, &el))) {
+      c->parser.i = i;
+      break;
+    }
+  }
+  MoveStanza(&c->parser);
+  if (r == XMPP_EPARTIAL)
+    return c->parser.n == c->parser.c ? XMPP_EMEM : 0;
+  return r == XMPP_EMEM ? 0 : r;
+}
+
+static int ReadServerConn(struct ServerConn *c) {
+  ssize_t n = read(c->fd, c->parser.p + c->parser.n,
+                   c->parser.c - c->parser.n);
+  if (n > 0)
+    c->parser.n += n;
+  else if (!n || errno != EAGAIN)
+    return -1;
+  return 0;
+}
+
+static int WriteServerConn(struct ServerConn *c) {
+  struct xmppBuilder *b = &c->builder;
+  ssize_t n = write(c->fd, b->p + c->written, b->n - c->written);
+  if (n < 0)
+    return errno == EAGAIN ? 0 : -1;
+  if ((c->written += n) == b->n) {
+    b->n = c->written = 0;
+  } else if (c->written > b->c / 2) {
+    memmove(b->p, b->p + c->written, b->n - c->written);
+    b->n -= c->written;
+    c->written = 0;
+  }
+  return 0;
+}
+
+static void CloseServerConn(struct Server *s, int i) {
+  close(s->conns[i]->fd);
+  free(s->conns[i]);
+  s->conns[i] = s->conns[--s->nconns];
+}
+
+// Accepts, reads, routes and writes without blocking longer than
+// timeout ms.
+// returns the number of connections
+static int PollServer(struct Server *s, int timeout) {
+  struct pollfd fds[SERVERMAXCONNS + 1];
+  int i, n = s->nconns, fd;
+  for (i = 0; i < n; i++) {
+    fds[i].fd = s->conns[i]->fd;
+    fds[i].events = POLLIN | (s->conns[i]->builder.n ? POLLOUT : 0);
+    fds[i].revents = 0;
+  }
+  fds[n].fd = s->listenfd;
+  fds[n].events = POLLIN;
+  fds[n].revents = 0;
+  if (poll(fds, n + 1, timeout) < 0)
+    return s->nconns;
+  for (i = 0; i < n; i++) {
+    struct ServerConn *c = s->conns[i];
+    if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR) &&
+         c->state != SERVERSTATE_CLOSED && ReadServerConn(c)) ||
+        HandleServerInput(s, c))
+      c->state = SERVERSTATE_CLOSED, c->builder.n = 0;
+  }
+  for (i = s->nconns - 1; i >= 0; i--) {
+    struct ServerConn *c = s->conns[i];
+    if (c->builder.n && WriteServerConn(c))
+      c->builder.n = 0;
+    if (c->state == SERVERSTATE_CLOSED && !c->builder.n)
+      CloseServerConn(s, i);
+  }
+  if (fds[n].revents & POLLIN) {
+    while ((fd = accept(s->listenfd, NULL, NULL)) != -1)
+      AddConnection(s, fd);
+  }
+  return s->nconns;
+}
+
+static void FreeServer(struct Server *s) {
+  while (s->nconns)
+    CloseServerConn(s, 0);
+  if (s->listenfd != -1)
+    close(s->listenfd);
+}
+
+#endif